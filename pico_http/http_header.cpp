@@ -95,7 +95,7 @@ bool HTTPHeader::parse(char *data, int len)
                 return false;
             }
             
-            m_responseCode = m_responseCode * 10 + (m_second[0] - '0');
+            m_responseCode = m_responseCode * 10 + (data[i] - '0');
         }
     }
     
@@ -25,6 +25,8 @@ SOFTWARE.
 #include "pico_logger.h"
 #include "general_config.h"
 #include "http_request.h"
+#include "mbedtls_wrapper.h"
+#include "pico/rand.h"
 #include <cstdlib>
 
 HTTPRequest::HTTPRequest(const char *host, uint16_t port, bool tls, const char *command, const char *path)
@@ -194,15 +196,142 @@ bool HTTPRequest::send()
     return true;
 }
 
+bool HTTPRequest::upgradeWebSocket(const char *protocol)
+{
+    if (m_state == FAIL)
+    {
+        trace("HTTPRequest::upgradeWebSocket: this=%p, request already failed.", this);
+        return false;
+    }
+
+    // 16 random bytes, base64 encoded
+    uint8_t nonce[16];
+    for (int i=0;i<4;++i)
+    {
+        uint32_t value = get_rand_32();
+        memcpy(&nonce[i*4], &value, sizeof(value));
+    }
+
+    int err = base64_encode(nonce, sizeof(nonce), (u8_t*)m_websocketKey, sizeof(m_websocketKey));
+    if (err != 0)
+    {
+        trace("HTTPRequest::upgradeWebSocket: this=%p, base64 error[%d]", this, err);
+        return false;
+    }
+
+    if (!addHeader("Upgrade", "websocket") ||
+        !addHeader("Connection", "Upgrade") ||
+        !addHeader("Sec-WebSocket-Key", m_websocketKey) ||
+        !addHeader("Sec-WebSocket-Version", "13") ||
+        ((protocol != NULL) && !addHeader("Sec-WebSocket-Protocol", protocol)))
+    {
+        return false;
+    }
+
+    m_websocketHandler.setClientMode(get_rand_32);
+    m_websocket = true;
+    return true;
+}
+
+bool HTTPRequest::validateWebSocketReply(HTTPHeader& header)
+{
+    if (header.getResponseCode() != 101)
+    {
+        trace("HTTPRequest::validateWebSocketReply: this=%p, upgrade refused, code[%d]", this, header.getResponseCode());
+        return false;
+    }
+
+    const char *accept = header.getHeaderValue("Sec-WebSocket-Accept");
+    if (accept == NULL)
+    {
+        trace("HTTPRequest::validateWebSocketReply: this=%p, reply missing header 'Sec-WebSocket-Accept'", this);
+        return false;
+    }
+
+    char buffer[WEBSOCKET_ACCEPT_SIZE];
+    if (!computeWebSocketAccept(m_websocketKey, buffer, sizeof(buffer)))
+    {
+        return false;
+    }
+
+    if (strcmp(buffer, accept) != 0)
+    {
+        trace("HTTPRequest::validateWebSocketReply: this=%p, invalid 'Sec-WebSocket-Accept' got[%s] expected[%s]", this, accept, buffer);
+        return false;
+    }
+
+    return true;
+}
+
+bool HTTPRequest::sendWebSocketData(const uint8_t *data, size_t len, WebSocketOperation operation)
+{
+    if (m_state != WEBSOCKET_ESTABLISHED)
+    {
+        trace("HTTPRequest::sendWebSocketData: this=%p, websocket not established, state[%d]", this, m_state);
+        return false;
+    }
+
+    return m_websocketHandler.encodeData(data, len, this, operation);
+}
+
+bool HTTPRequest::onWebsocketEncodedData(const uint8_t *data, size_t len)
+{
+    err_t err = m_connection.send(data, len);
+    if (err != ERR_OK)
+    {
+        trace("HTTPRequest::onWebsocketEncodedData: this=%p, failed sending websocket data error[%d]", this, err);
+        return false;
+    }
+
+    m_bytesSent += len;
+    return true;
+}
+
+bool HTTPRequest::onWebSocketData(uint8_t *data, size_t len)
+{
+    return ((m_callback == NULL) || m_callback->onWebSocketData(data, len));
+}
+
+bool HTTPRequest::onWebSocketMessage(uint8_t *data, size_t len, WebSocketOperation operation)
+{
+    return ((m_callback == NULL) || m_callback->onWebSocketMessage(data, len, operation));
+}
+
+bool HTTPRequest::onWebSocketClose(uint16_t code)
+{
+    trace("HTTPRequest::onWebSocketClose: this=%p, code[%d]", this, code);
+
+    if (m_callback != NULL)
+    {
+        m_callback->onWebSocketClose(code);
+    }
+
+    // close handshake is done, drop the connection once the peer acknowledged our close frame
+    m_closeAfterSent = true;
+
+    // our close frame may be acknowledged already, no further on_sent would arrive then
+    return (int32_t)(m_bytesAcked - m_bytesSent) < 0;
+}
+
+bool HTTPRequest::on_sent(u16_t len)
+{
+    m_bytesAcked += len;
+
+    // returning false closes the connection
+    return !m_closeAfterSent || ((int32_t)(m_bytesAcked - m_bytesSent) < 0);
+}
+
 void HTTPRequest::on_connected()
 {
     trace("HTTPRequest::on_connected: this=%p, host=%s, header=%s, body=[%.*s] bodyLen=%d", this, m_header, &m_header[m_headerStart], m_bodyLen, m_body, m_bodyLen);
     
     m_connection.send((const u8_t*)&m_header[m_headerStart], m_headerIndex-m_headerStart-1);
+    m_bytesSent += m_headerIndex-m_headerStart-1;
 
     if (m_body != NULL && m_bodyLen > 0)
     {
         m_connection.send(m_body, m_bodyLen);
+        m_bytesSent += m_bodyLen;
     }
 }
 
@@ -226,6 +355,26 @@ bool HTTPRequest::on_recv(u8_t *data, size_t len)
 
             data += header.getHeaderSize();
             len -= header.getHeaderSize();
+
+            if (m_websocket)
+            {
+                if (!validateWebSocketReply(header))
+                {
+                    m_state = FAIL;
+                    return false;
+                }
+
+                m_state = WEBSOCKET_ESTABLISHED;
+                trace("HTTPRequest::on_recv: this=%p, websocket established", this);
+
+                if ((m_callback != NULL) && !m_callback->onWebSocketEstablished())
+                {
+                    return false;
+                }
+
+                // server may send frames right behind the reply
+                return (len == 0) || m_websocketHandler.decodeData(data, len, this);
+            }
             
             if ((len > 0) && (m_callback != NULL) && (!m_callback->onHttpData(data,len)))
             {
@@ -240,8 +389,7 @@ bool HTTPRequest::on_recv(u8_t *data, size_t len)
         }
         case WEBSOCKET_ESTABLISHED:
         {
-            // future functionality
-            return true;
+            return m_websocketHandler.decodeData(data, len, this);
         }
         case FAIL:
         {
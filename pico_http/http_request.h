@@ -32,15 +32,23 @@ public:
     
     virtual bool onHeaderReceived(HTTPHeader& header) { return true; };
     virtual bool onHttpData(u8_t *data, size_t len) { return true; }
+
+    // Only used after HTTPRequest::upgradeWebSocket, data is unmasked in place.
+    virtual bool onWebSocketEstablished() { return true; }
+    virtual bool onWebSocketData(u8_t *data, size_t len) { return true; }
+    virtual bool onWebSocketMessage(u8_t *data, size_t len, WebSocketOperation operation) { return true; }
+    virtual bool onWebSocketClose(uint16_t code) { return true; }
     
     virtual void onRequestDestroyed() {};
 };
 
 ///
-/// Basic example HTTP(S) request handler, future functionality pending.
-/// Right now it's fire and forget for some telegram notifications.
+/// Basic example HTTP(S) request handler.
+/// Fire and forget for some telegram notifications, or a long lived websocket client after upgradeWebSocket.
 ///
-class HTTPRequest : public ISessionCallback
+class HTTPRequest
+    : public ISessionCallback
+    , public WebSocketInterface
 {
     static const int MAX_HEADER_SIZE=1000;
     
@@ -57,18 +65,44 @@ public:
 
     bool send();
 
+    ///
+    /// Turn the request into a websocket handshake, call before send().
+    /// onWebSocketEstablished is called once the server reply is validated.
+    ///
+    /// @param protocol - optional Sec-WebSocket-Protocol value.
+    ///
+    bool upgradeWebSocket(const char *protocol = NULL);
+
+    // Deliver whole messages through onWebSocketMessage, see WebSocketHandler::setMessageBuffer.
+    void setWebSocketMessageBuffer(uint8_t *buffer, size_t size) { m_websocketHandler.setMessageBuffer(buffer, size); }
+
+    // Frames are masked with a new random key each, as required for clients.
+    bool sendWebSocketData(const uint8_t *data, size_t len, WebSocketOperation operation = WebSocketOperation::BINARY_FRAME);
+    bool sendWebSocketPing(const uint8_t *data, size_t len) { return m_websocketHandler.sendPing(data, len, this); }
+    bool closeWebSocket(uint16_t code = WebSocketCloseCode::NORMAL_CLOSURE) { return m_websocketHandler.sendClose(code, this); }
+    bool isWebSocketEstablished() { return m_state == WEBSOCKET_ESTABLISHED; }
+
+    void close() { m_connection.close(); }
+
     void setHttpCallback(IHttpCallback *callback) { m_callback = callback; }
 
 protected:
-    virtual bool on_sent(u16_t len) override { return true; };
+    virtual bool on_sent(u16_t len) override;
     virtual bool on_recv(u8_t *data, size_t len) override;
     virtual void on_closed() override;
     virtual void on_connected() override;
 
+    virtual bool onWebSocketData(uint8_t *data, size_t len) override;
+    virtual bool onWebsocketEncodedData(const uint8_t *data, size_t len) override;
+    virtual bool onWebSocketMessage(uint8_t *data, size_t len, WebSocketOperation operation) override;
+    virtual bool onWebSocketClose(uint16_t code) override;
+
 private:
     virtual ~HTTPRequest();
+
+    bool validateWebSocketReply(HTTPHeader& header);
     
-    HTTPSessionState m_state;
+    HTTPSessionState m_state = INIT;
 
     uint16_t m_port = 443;
     uint16_t m_headerStart = 0;
@@ -80,5 +114,12 @@ private:
     size_t m_bodyLen = 0;
 
     IHttpCallback *m_callback = NULL;
+
+    bool m_websocket = false;
+    char m_websocketKey[32];
+    WebSocketHandler m_websocketHandler;
+    bool m_closeAfterSent = false;
+    uint32_t m_bytesSent = 0;
+    uint32_t m_bytesAcked = 0;
     Session m_connection;
 };
@@ -25,9 +25,9 @@ SOFTWARE.
 #include <time.h>
 
 #include "pico/cyw43_arch.h"
+#include "pico/time.h"
 
 #include "http_session.h"
-#include "mbedtls_wrapper.h"
 #include "pico_logger.h"
 
 void HTTPSession::create(void *arg, bool tls) {
@@ -46,10 +46,17 @@ HTTPSession::HTTPSession(void *arg, bool tls)
 HTTPSession::~HTTPSession()
 {
     trace("HTTPSession::~HTTPSession: this=%p, session=%p, arg=%p\n", this, m_session, m_session != NULL ? m_session->get_pcb() : NULL);
+    leaveBroadcast();
+
     if (m_session != NULL)
     {
         delete m_session;
     }
+
+    if (m_deflate != NULL)
+    {
+        delete m_deflate;
+    }
 }
 
 bool HTTPSession::on_recv(u8_t *data, size_t len)
@@ -106,19 +113,173 @@ bool HTTPSession::onWebsocketEncodedData(const uint8_t *data, size_t len)
         return false;
     }
 
+    m_bytesSent += len;
+    return true;
+}
+
+bool HTTPSession::sendWebSocketPing()
+{
+    uint64_t now = time_us_64();
+    return m_websocketHandler.sendPing((const uint8_t *)&now, sizeof(now), this);
+}
+
+bool HTTPSession::onWebSocketPong(const uint8_t *data, size_t len)
+{
+    // unsolicited pongs or pongs for other payloads are ignored
+    if (len == sizeof(uint64_t))
+    {
+        uint64_t sent;
+        memcpy(&sent, data, sizeof(sent));
+        
+        uint64_t now = time_us_64();
+        if (sent <= now)
+        {
+            m_websocketRttUs = now - sent;
+            trace("HTTPSession::onWebSocketPong: this=%p, rtt[%llu]us\n", this, m_websocketRttUs);
+        }
+    }
     return true;
 }
 
-bool HTTPSession::sendWebSocketData(const uint8_t *body, int body_len)
+bool HTTPSession::closeWebSocket(uint16_t code)
+{
+    return m_websocketHandler.sendClose(code, this);
+}
+
+bool HTTPSession::onWebSocketClose(uint16_t code)
+{
+    trace("HTTPSession::onWebSocketClose: this=%p, code[%d]\n", this, code);
+
+    // close handshake is done, drop the connection once the peer acknowledged our close frame
+    m_closeAfterSent = true;
+
+    // our close frame may be acknowledged already, no further on_sent would arrive then
+    return (int32_t)(m_bytesAcked - m_bytesSent) < 0;
+}
+
+bool HTTPSession::sendWebSocketData(const uint8_t *body, int body_len, WebSocketOperation operation)
+{
+    // keep message order while older frames are still waiting, frames that do not fit wait in the queue too
+    if (!m_sendQueue.empty() || !fitsSendBuffer(body_len, operation))
+    {
+        return queueWebSocketData(body, body_len, operation);
+    }
+
+    if (!m_websocketHandler.encodeData(body, body_len, this, operation))
+    {
+        return false;
+    }
+
+    return true;
+}
+
+bool HTTPSession::sendWebSocketText(const char *text, int len)
+{
+    return sendWebSocketData((const uint8_t *)text, (len < 0) ? strlen(text) : len, WebSocketOperation::TEXT_FRAME);
+}
+
+bool HTTPSession::sendWebSocketFrame(uint8_t *buffer, int body_len, WebSocketOperation operation)
+{
+    if (!m_sendQueue.empty() || !fitsSendBuffer(body_len, operation))
+    {
+        return queueWebSocketData(&buffer[WEBSOCKET_FRAME_HEADROOM], body_len, operation);
+    }
+
+    return m_websocketHandler.encodeFrame(buffer, body_len, this, operation);
+}
+
+bool HTTPSession::fitsSendBuffer(int body_len, WebSocketOperation operation)
+{
+    uint8_t header[WEBSOCKET_FRAME_HEADROOM];
+    return send_buffer_size() >= WebSocketHandler::writeHeader(header, operation, body_len, NULL) + body_len;
+}
+
+
+bool HTTPSession::queueWebSocketData(const uint8_t *body, int body_len, WebSocketOperation operation)
+{
+    WebSocketFrameBuffer *frame = WebSocketFrameBuffer::create(body, body_len, operation);
+    if (frame == NULL)
+    {
+        return false;
+    }
+
+    bool result = queueWebSocketFrame(frame);
+    frame->release();
+    return result;
+}
+
+bool HTTPSession::queueWebSocketFrame(WebSocketFrameBuffer *frame)
+{
+    if (!m_sendQueue.push(frame))
+    {
+        trace("HTTPSession::queueWebSocketFrame: this=%p, queue full, frame dropped, queued[%d]\n", this, m_sendQueue.size());
+    }
+
+    return flushWebSocketQueue();
+}
+
+bool HTTPSession::flushWebSocketQueue()
 {
-    if (!m_websocketHandler.encodeData(body, body_len, this))
+    // sending can trigger on_sent which flushes again
+    if (m_flushing)
+    {
+        return true;
+    }
+
+    // with nothing waiting for acknowledgement the send buffer will not get any larger
+    bool drained = ((int32_t)(m_bytesAcked - m_bytesSent) >= 0);
+
+    m_flushing = true;
+    bool result = m_sendQueue.flush(this, send_buffer_size(), drained);
+    m_flushing = false;
+
+    return result;
+}
+
+bool HTTPSession::joinBroadcast(WebSocketBroadcastGroup *group)
+{
+    if (m_state != WEBSOCKET_ESTABLISHED)
+    {
+        trace("HTTPSession::joinBroadcast: this=%p, websocket not established, state[%d]\n", this, m_state);
+        return false;
+    }
+
+    leaveBroadcast();
+    if (!group->join(this))
     {
         return false;
     }
 
+    m_broadcastGroup = group;
     return true;
 }
 
+void HTTPSession::leaveBroadcast()
+{
+    if (m_broadcastGroup != NULL)
+    {
+        m_broadcastGroup->leave(this);
+        m_broadcastGroup = NULL;
+    }
+}
+
+bool HTTPSession::canSendFrame()
+{
+    // slow sessions are the ones with a full queue, the group policy decides what happens to them
+    return (m_state == WEBSOCKET_ESTABLISHED) && !m_websocketHandler.isClosed() && !m_sendQueue.full();
+}
+
+bool HTTPSession::sendFrame(WebSocketFrameBuffer *frame)
+{
+    return queueWebSocketFrame(frame);
+}
+
+void HTTPSession::onBroadcastDropped()
+{
+    trace("HTTPSession::onBroadcastDropped: this=%p, too slow for broadcast, closing\n", this);
+    m_broadcastGroup = NULL;
+    close();
+}
 
 bool HTTPSession::sendHttpReply(const char *extra_headers, const char *body, int body_len)
 {
@@ -135,11 +296,15 @@ bool HTTPSession::sendHttpReply(const char *extra_headers, const char *body, int
 
     trace("HTTPSession::sendReply: this=%p, replyHeader:\n%s\n", this, buffer);
 
+    // new response, start again with small records for a fast first byte
+    m_session->restart_record_sizing();
+
     err_t err = m_session->send((u8_t*)buffer, n);
     if (err != ERR_OK) {
         trace("HTTPSession::sendReply: this=%p, failed sending header error[%d]\n", this, err);
         return false;
     }
+    m_bytesSent += n;
 
     if (body != NULL)
     {
@@ -148,16 +313,25 @@ bool HTTPSession::sendHttpReply(const char *extra_headers, const char *body, int
             trace("HTTPSession::sendReply: this=%p, failed sending body[%p], error[%d] body_len[%d]\n", this, body, err, body_len);
             return false;
         }
+        m_bytesSent += body_len;
     }
 
     return true;
 }
 
+void HTTPSession::enableWebSocketDeflate(uint8_t *inflateBuffer, size_t inflateSize, uint8_t *deflateBuffer, size_t deflateSize, uint8_t windowBits)
+{
+    m_inflateBuffer = inflateBuffer;
+    m_inflateBufferSize = inflateSize;
+    m_deflateBuffer = deflateBuffer;
+    m_deflateBufferSize = deflateSize;
+    m_deflateWindowBits = windowBits;
+}
+
 bool HTTPSession::acceptWebSocket(HTTPHeader& header)
 {
-    const int BUFFER_SIZE = 128;
-    const int REPLY_SIZE = 256;
-    const int SHA1_SIZE = 20;
+    const int EXTENSION_SIZE = 160;
+    const int REPLY_SIZE = 384;
 
     const char *websocket_key = header.getHeaderValue("Sec-WebSocket-Key");
     if (websocket_key == NULL)
@@ -167,50 +341,41 @@ bool HTTPSession::acceptWebSocket(HTTPHeader& header)
         return false;
     }
 
-    const char *KEY_BUFFER = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
-    static const int KEY_BUFFER_SIZE = strlen(KEY_BUFFER);
-
-    int len = strlen(websocket_key);
-
-    if (len+1 >= BUFFER_SIZE - KEY_BUFFER_SIZE)
+    char buffer[WEBSOCKET_ACCEPT_SIZE];
+    if (!computeWebSocketAccept(websocket_key, buffer, sizeof(buffer)))
     {
-        trace("HTTPSession::acceptWebSocket: this=%p, request 'Sec-Websocket-Key' too long: len[%d] max[%d]:\n", this, len, (BUFFER_SIZE - KEY_BUFFER_SIZE));
+        trace("HTTPSession::acceptWebSocket: this=%p, no accept value for 'Sec-Websocket-Key'[%s]\n", this, websocket_key);
         return false;
     }
-    char buffer[BUFFER_SIZE];
-    memcpy(&buffer[0], websocket_key, len);
-    memcpy(&buffer[len], KEY_BUFFER, KEY_BUFFER_SIZE+1);
 
-    uint8_t sha1sum[SHA1_SIZE];
-    int err = sha1((u8_t*)buffer, len+KEY_BUFFER_SIZE, sha1sum );
-    if (err != 0)
+    char extension[EXTENSION_SIZE] = "";
+    uint8_t windowBits = m_deflateWindowBits;
+    // compressed messages are inflated whole, without a message buffer they could not be decoded
+    if ((m_inflateBuffer != NULL) && m_websocketHandler.hasMessageBuffer() && WebSocketDeflate::negotiate(header.getHeaderValue("Sec-WebSocket-Extensions"), &windowBits, extension, EXTENSION_SIZE))
     {
-        trace("HTTPSession::acceptWebSocket: sha1 error[%d]\n", this, err);
-        return false;
-    }
-    
-    trace("HTTPSession::acceptWebSocket: sha1[%s] len[%d]", buffer, len+KEY_BUFFER_SIZE);
-    err = base64_encode(sha1sum, 20, (u8_t*)buffer, 128);
-    if (err != 0)
-    {
-        trace("HTTPSession::acceptWebSocket: base64 error[%d]\n", this, err);
-        return false;
+        if (m_deflate == NULL)
+        {
+            m_deflate = new WebSocketDeflate();
+        }
+        m_websocketHandler.setDeflate(m_deflate, m_inflateBuffer, m_inflateBufferSize, m_deflateBuffer, m_deflateBufferSize, windowBits);
     }
 
     char reply[REPLY_SIZE];
-    int n = snprintf(&reply[0], REPLY_SIZE, "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n\r\n", buffer);
+    int n = snprintf(&reply[0], REPLY_SIZE, "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n%s%s%s\r\n", buffer,
+                     extension[0] ? "Sec-WebSocket-Extensions: " : "", extension, extension[0] ? "\r\n" : "");
     if ((n >= REPLY_SIZE) || (n <= 0))
     {
-        trace("HTTPSession::acceptWebSocket: reply buffer too small, expected[%d] had[%d]\n", this, n, BUFFER_SIZE);
+        trace("HTTPSession::acceptWebSocket: reply buffer too small, expected[%d] had[%d]\n", this, n, REPLY_SIZE);
         return false;
     }
     
-    err = m_session->send((u8_t*)reply, n);
+    err_t err = m_session->send((u8_t*)reply, n);
     if (err != ERR_OK)
     {
         printf("HTTPSession::acceptWebSocket: failed sending reply, error[%d]", err);
         return false;
     }
+    m_bytesSent += n;
 
     m_state = WEBSOCKET_ESTABLISHED;
     trace("HTTPSession::acceptWebSocket: this=%p, websocket accepted, reply:\n%s\n", this, reply);
@@ -219,6 +384,26 @@ bool HTTPSession::acceptWebSocket(HTTPHeader& header)
 
 
 bool HTTPSession::on_sent(u16_t len) {
+    m_bytesAcked += len;
+    
+    if (m_closeAfterSent && ((int32_t)(m_bytesAcked - m_bytesSent) >= 0))
+    {
+        return false;
+    }
+
+    if ((m_state == WEBSOCKET_ESTABLISHED) && !m_websocketHandler.isClosed() && !m_flushing)
+    {
+        if (!flushWebSocketQueue())
+        {
+            return false;
+        }
+
+        if (!m_sendQueue.full())
+        {
+            return onWebSocketWritable();
+        }
+    }
+    
     return true;
 }
 
@@ -33,6 +33,10 @@ SOFTWARE.
 #include "session.h"
 #include "http_header.h"
 #include "websocket_handler.h"
+#include "websocket_deflate.h"
+#include "websocket_broadcast.h"
+#include "websocket_send_queue.h"
+#include "websocket_rpc.h"
 
 enum HTTPSessionState
 {
@@ -45,6 +49,8 @@ enum HTTPSessionState
 class HTTPSession
     : public WebSocketInterface
     , public ISessionCallback
+    , public IWebSocketBroadcastMember
+    , public IWebSocketRpcTransport
 {
 public:
     static void create(void *arg, bool tls);
@@ -53,12 +59,52 @@ public:
     virtual bool onHttpData(u8_t *data, size_t len) { return false; }
 
     virtual bool onWebSocketData(u8_t *data, size_t len) override { return false; }
+    virtual bool onWebSocketMessage(u8_t *data, size_t len, WebSocketOperation operation) override { return false; }
     virtual bool onWebsocketEncodedData(const uint8_t *data, size_t len) override;
+    virtual bool onWebSocketPong(const uint8_t *data, size_t len) override;
+    virtual bool onWebSocketClose(uint16_t code) override;
     
     bool acceptWebSocket(HTTPHeader& header);
+
+    // Deliver whole websocket messages through onWebSocketMessage, see WebSocketHandler::setMessageBuffer.
+    void setWebSocketMessageBuffer(uint8_t *buffer, size_t size) { m_websocketHandler.setMessageBuffer(buffer, size); }
+
+    // Offer permessage-deflate in acceptWebSocket if the client asks for it and a message buffer is set. See WebSocketHandler::setDeflate.
+    void enableWebSocketDeflate(uint8_t *inflateBuffer, size_t inflateSize, uint8_t *deflateBuffer, size_t deflateSize, uint8_t windowBits = WEBSOCKET_DEFLATE_MAX_WINDOW_BITS);
     
     bool sendHttpReply(const char *extra_headers, const char *body, int body_len);
-    bool sendWebSocketData(const uint8_t *body, int body_len);
+    bool sendWebSocketData(const uint8_t *body, int body_len, WebSocketOperation operation = WebSocketOperation::BINARY_FRAME);
+
+    // TEXT frame, text must be valid UTF-8. Length is taken with strlen if negative.
+    bool sendWebSocketText(const char *text, int len = -1);
+
+    // Zero copy send, buffer starts with WEBSOCKET_FRAME_HEADROOM reserved bytes followed by body_len bytes of payload.
+    bool sendWebSocketFrame(uint8_t *buffer, int body_len, WebSocketOperation operation = WebSocketOperation::BINARY_FRAME);
+
+    // Replies of a WebSocketRpc created with this session as transport.
+    virtual bool sendRpcFrame(uint8_t *buffer, size_t len) override { return sendWebSocketFrame(buffer, len); }
+
+    // Queue a frame and send it as soon as the send buffer has room, full queues follow the queue policy.
+    // onWebSocketWritable is called once acknowledgements free up space in the queue.
+    bool queueWebSocketData(const uint8_t *body, int body_len, WebSocketOperation operation = WebSocketOperation::BINARY_FRAME);
+    bool queueWebSocketFrame(WebSocketFrameBuffer *frame);
+    void setWebSocketQueuePolicy(WebSocketQueuePolicy policy) { m_sendQueue.setPolicy(policy); }
+    const WebSocketQueueStats& getWebSocketQueueStats() { return m_sendQueue.get_stats(); }
+
+    // Server initiated PING carrying a timestamp, round trip time is available after the PONG.
+    bool sendWebSocketPing();
+    uint64_t getWebSocketRttUs() { return m_websocketRttUs; }
+
+    // Receive messages broadcast to group, only one group per session. Session leaves the group when closed.
+    bool joinBroadcast(WebSocketBroadcastGroup *group);
+    void leaveBroadcast();
+
+    virtual bool canSendFrame() override;
+    virtual bool sendFrame(WebSocketFrameBuffer *frame) override;
+    virtual void onBroadcastDropped() override;
+
+    // Start the CLOSE handshake, connection is closed once the peer replied and everything was acknowledged.
+    bool closeWebSocket(uint16_t code = WebSocketCloseCode::NORMAL_CLOSURE);
 
     virtual bool on_recv(u8_t *data, size_t len) override;
     virtual bool on_sent(u16_t len) override;
@@ -76,6 +122,24 @@ private:
     HTTPHeader m_header;
     WebSocketHandler m_websocketHandler;
     Session *m_session;
+
+    bool flushWebSocketQueue();
+    bool fitsSendBuffer(int body_len, WebSocketOperation operation);
+
+    uint64_t m_websocketRttUs = 0;
+    WebSocketBroadcastGroup *m_broadcastGroup = NULL;
+    WebSocketSendQueue m_sendQueue;
+    bool m_flushing = false;
+
+    uint8_t *m_inflateBuffer = NULL;
+    size_t m_inflateBufferSize = 0;
+    uint8_t *m_deflateBuffer = NULL;
+    size_t m_deflateBufferSize = 0;
+    uint8_t m_deflateWindowBits = WEBSOCKET_DEFLATE_MAX_WINDOW_BITS;
+    WebSocketDeflate *m_deflate = NULL;
+    bool m_closeAfterSent = false;
+    uint32_t m_bytesSent = 0;
+    uint32_t m_bytesAcked = 0;
 };
 
 #endif
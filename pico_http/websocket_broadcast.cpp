@@ -0,0 +1,153 @@
+/* MIT License
+
+Copyright (c) 2024 Adrian Cruceru - https://github.com/AdrianCX/pico_https
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include <new>
+#include <string.h>
+
+#include "websocket_broadcast.h"
+
+extern "C" void trace(const char *parameters, ...);
+
+WebSocketFrameBuffer *WebSocketFrameBuffer::create(const uint8_t *data, size_t len, WebSocketOperation operation)
+{
+    void *memory = malloc(sizeof(WebSocketFrameBuffer) + WEBSOCKET_FRAME_HEADROOM + len);
+    if (memory == NULL)
+    {
+        trace("WebSocketFrameBuffer::create: failed allocating frame, len[%d]\n", len);
+        return NULL;
+    }
+
+    WebSocketFrameBuffer *buffer = new (memory) WebSocketFrameBuffer();
+    buffer->m_payloadLen = len;
+    buffer->m_operation = operation;
+
+    // header is written right in front of the payload, same layout as WebSocketHandler::encodeFrame
+    uint8_t header[WEBSOCKET_FRAME_HEADROOM];
+    buffer->m_headerSize = WebSocketHandler::writeHeader(header, operation, len, NULL);
+    memcpy(buffer->storage() + WEBSOCKET_FRAME_HEADROOM - buffer->m_headerSize, header, buffer->m_headerSize);
+
+    if (len > 0)
+    {
+        memcpy(buffer->storage() + WEBSOCKET_FRAME_HEADROOM, data, len);
+    }
+
+    return buffer;
+}
+
+void WebSocketFrameBuffer::release()
+{
+    if (--m_refCount == 0)
+    {
+        this->~WebSocketFrameBuffer();
+        free(this);
+    }
+}
+
+bool WebSocketBroadcastGroup::join(IWebSocketBroadcastMember *member)
+{
+    for (uint16_t i=0;i<m_memberCount;++i)
+    {
+        if (m_members[i] == member)
+        {
+            return true;
+        }
+    }
+
+    if (m_memberCount >= WEBSOCKET_BROADCAST_MAX_MEMBERS)
+    {
+        trace("WebSocketBroadcastGroup::join: this=%p, group full, member=%p max[%d]\n", this, member, WEBSOCKET_BROADCAST_MAX_MEMBERS);
+        return false;
+    }
+
+    m_members[m_memberCount++] = member;
+    return true;
+}
+
+void WebSocketBroadcastGroup::leave(IWebSocketBroadcastMember *member)
+{
+    for (uint16_t i=0;i<m_memberCount;++i)
+    {
+        if (m_members[i] == member)
+        {
+            // order is not kept, last member takes the free slot
+            m_members[i] = m_members[--m_memberCount];
+            return;
+        }
+    }
+}
+
+int WebSocketBroadcastGroup::broadcast(const uint8_t *data, size_t len, WebSocketOperation operation)
+{
+    if (m_memberCount == 0)
+    {
+        return 0;
+    }
+
+    WebSocketFrameBuffer *frame = WebSocketFrameBuffer::create(data, len, operation);
+    if (frame == NULL)
+    {
+        return -1;
+    }
+
+    int sent = broadcast(frame);
+    frame->release();
+    return sent;
+}
+
+int WebSocketBroadcastGroup::broadcast(WebSocketFrameBuffer *frame)
+{
+    int sent = 0;
+    m_stats.messages++;
+
+    // hold a reference so members releasing theirs can not free the frame mid-loop
+    frame->acquire();
+
+    for (uint16_t i=0;i<m_memberCount;)
+    {
+        IWebSocketBroadcastMember *member = m_members[i];
+
+        if (member->canSendFrame() && member->sendFrame(frame))
+        {
+            ++sent;
+            ++i;
+            m_stats.frames_sent++;
+            continue;
+        }
+
+        if (m_policy == WebSocketSlowMemberPolicy::SKIP_SLOW_MEMBER)
+        {
+            ++i;
+            m_stats.frames_skipped++;
+            continue;
+        }
+
+        trace("WebSocketBroadcastGroup::broadcast: this=%p, dropping slow member=%p\n", this, member);
+
+        // slot i now holds the former last member, do not advance
+        m_members[i] = m_members[--m_memberCount];
+        m_stats.members_dropped++;
+        member->onBroadcastDropped();
+    }
+
+    frame->release();
+    return sent;
+}
@@ -0,0 +1,146 @@
+/* MIT License
+
+Copyright (c) 2024 Adrian Cruceru - https://github.com/AdrianCX/pico_https
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef WEBSOCKET_BROADCAST_H
+#define WEBSOCKET_BROADCAST_H
+
+#ifdef __TARGET_CPU_CORTEX_M0PLUS
+#include "pico/stdlib.h"
+#else
+#include "stdlib.h"
+#include <cstdint>
+#endif
+
+#include "websocket_handler.h"
+
+#ifndef WEBSOCKET_BROADCAST_MAX_MEMBERS
+#define WEBSOCKET_BROADCAST_MAX_MEMBERS 8
+#endif
+
+///
+/// A complete server frame (header + payload) encoded once and shared between sessions.
+/// Reference counted, all users run in the lwip context so no locking is done.
+///
+class WebSocketFrameBuffer
+{
+public:
+    ///
+    /// Allocate and encode a frame, returned with one reference held by the caller.
+    ///
+    /// @returns - NULL on allocation failure.
+    ///
+    static WebSocketFrameBuffer *create(const uint8_t *data, size_t len, WebSocketOperation operation);
+
+    void acquire() { ++m_refCount; }
+    void release();
+
+    const uint8_t *frame() const { return storage() + WEBSOCKET_FRAME_HEADROOM - m_headerSize; }
+    size_t frameSize() const { return m_headerSize + m_payloadLen; }
+
+    const uint8_t *payload() const { return storage() + WEBSOCKET_FRAME_HEADROOM; }
+    size_t payloadSize() const { return m_payloadLen; }
+    WebSocketOperation operation() const { return m_operation; }
+
+private:
+    WebSocketFrameBuffer() {}
+    ~WebSocketFrameBuffer() {}
+
+    // header and payload are allocated right after the object
+    uint8_t *storage() const { return (uint8_t *)(this + 1); }
+
+    uint32_t m_refCount = 1;
+    uint16_t m_headerSize = 0;
+    WebSocketOperation m_operation = WebSocketOperation::BINARY_FRAME;
+    size_t m_payloadLen = 0;
+};
+
+class IWebSocketBroadcastMember
+{
+public:
+    ///
+    /// @returns - true - member can take another frame right now without blocking other members.
+    ///
+    virtual bool canSendFrame() = 0;
+
+    ///
+    /// Send a shared frame, members keeping it past this call must acquire a reference.
+    ///
+    virtual bool sendFrame(WebSocketFrameBuffer *frame) = 0;
+
+    ///
+    /// Member was removed from the group by the DROP_SLOW_MEMBER policy.
+    ///
+    virtual void onBroadcastDropped() {}
+};
+
+enum WebSocketSlowMemberPolicy
+{
+    SKIP_SLOW_MEMBER,   // member misses this message and stays in the group
+    DROP_SLOW_MEMBER,   // member is removed from the group and notified
+};
+
+struct WebSocketBroadcastStats
+{
+    uint32_t messages;
+    uint32_t frames_sent;
+    uint32_t frames_skipped;
+    uint32_t members_dropped;
+};
+
+///
+/// Set of websocket sessions receiving the same messages.
+/// Each message is framed once, every member sends the same bytes.
+///
+class WebSocketBroadcastGroup
+{
+public:
+    WebSocketBroadcastGroup(WebSocketSlowMemberPolicy policy = WebSocketSlowMemberPolicy::SKIP_SLOW_MEMBER) : m_policy(policy) {}
+
+    ///
+    /// @returns - false - group is full.
+    ///
+    bool join(IWebSocketBroadcastMember *member);
+    void leave(IWebSocketBroadcastMember *member);
+
+    ///
+    /// Frame the message once and hand it to every member that can take it.
+    ///
+    /// @returns - number of members that sent the message, -1 on allocation failure.
+    ///
+    int broadcast(const uint8_t *data, size_t len, WebSocketOperation operation = WebSocketOperation::BINARY_FRAME);
+
+    ///
+    /// Same as above for an already encoded frame.
+    ///
+    int broadcast(WebSocketFrameBuffer *frame);
+
+    uint16_t size() { return m_memberCount; }
+    const WebSocketBroadcastStats& get_stats() { return m_stats; }
+
+private:
+    WebSocketSlowMemberPolicy m_policy;
+    uint16_t m_memberCount = 0;
+    IWebSocketBroadcastMember *m_members[WEBSOCKET_BROADCAST_MAX_MEMBERS];
+    WebSocketBroadcastStats m_stats = {};
+};
+
+#endif
@@ -0,0 +1,581 @@
+/* MIT License
+
+Copyright (c) 2024 Adrian Cruceru - https://github.com/AdrianCX/pico_https
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include <algorithm>
+#include <string.h>
+#include <stdio.h>
+
+#include "websocket_deflate.h"
+
+extern "C" void trace(const char *parameters, ...);
+
+namespace
+{
+
+const uint16_t LENGTH_BASE[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+const uint8_t LENGTH_EXTRA[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+const uint16_t DIST_BASE[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+const uint8_t DIST_EXTRA[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+const uint8_t CODE_LENGTH_ORDER[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+// tail stripped by the sender, see RFC 7692 section 7.2.2
+const uint8_t DEFLATE_TAIL[4] = { 0x00, 0x00, 0xff, 0xff };
+
+const uint8_t MAX_CODE_BITS = 15;
+
+typedef WebSocketDeflate::Huffman Huffman;
+
+struct BitReader
+{
+    const uint8_t *in;
+    size_t inLen;
+    size_t pos;
+    uint32_t bits;
+    uint8_t bitCount;
+    bool error;
+
+    size_t totalLen() { return inLen + sizeof(DEFLATE_TAIL); }
+
+    uint32_t get(uint8_t count)
+    {
+        while (bitCount < count)
+        {
+            if (pos >= totalLen())
+            {
+                error = true;
+                return 0;
+            }
+
+            uint8_t value = (pos < inLen) ? in[pos] : DEFLATE_TAIL[pos - inLen];
+            ++pos;
+
+            bits |= ((uint32_t)value) << bitCount;
+            bitCount += 8;
+        }
+
+        uint32_t result = bits & ((1u << count) - 1);
+        bits >>= count;
+        bitCount -= count;
+        return result;
+    }
+
+    void alignToByte()
+    {
+        bits >>= (bitCount & 0x7);
+        bitCount -= (bitCount & 0x7);
+    }
+
+    bool finished() { return (pos >= totalLen()) && (bitCount < 8); }
+};
+
+bool buildHuffman(Huffman& huffman, const uint8_t *lengths, uint16_t num)
+{
+    memset(huffman.counts, 0, sizeof(huffman.counts));
+    for (uint16_t i=0;i<num;++i)
+    {
+        huffman.counts[lengths[i]]++;
+    }
+    huffman.counts[0] = 0;
+
+    // reject over-subscribed code sets
+    int32_t left = 1;
+    for (uint8_t len=1;len<=MAX_CODE_BITS;++len)
+    {
+        left = (left << 1) - huffman.counts[len];
+        if (left < 0)
+        {
+            return false;
+        }
+    }
+
+    uint16_t offsets[MAX_CODE_BITS + 1];
+    uint16_t sum = 0;
+    for (uint8_t len=0;len<=MAX_CODE_BITS;++len)
+    {
+        offsets[len] = sum;
+        sum += huffman.counts[len];
+    }
+
+    for (uint16_t i=0;i<num;++i)
+    {
+        if (lengths[i] != 0)
+        {
+            huffman.symbols[offsets[lengths[i]]++] = i;
+        }
+    }
+
+    return true;
+}
+
+int decodeSymbol(BitReader& reader, const Huffman& huffman)
+{
+    int32_t code = 0;
+    int32_t first = 0;
+    int32_t index = 0;
+
+    for (uint8_t len=1;len<=MAX_CODE_BITS;++len)
+    {
+        code |= reader.get(1);
+        int32_t count = huffman.counts[len];
+        if (code - first < count)
+        {
+            return huffman.symbols[index + (code - first)];
+        }
+
+        index += count;
+        first = (first + count) << 1;
+        code <<= 1;
+    }
+
+    reader.error = true;
+    return -1;
+}
+
+bool inflateBlock(BitReader& reader, const Huffman& literals, const Huffman& distances, uint8_t *out, size_t outSize, size_t& outPos)
+{
+    while (!reader.error)
+    {
+        int symbol = decodeSymbol(reader, literals);
+        if (symbol < 0)
+        {
+            return false;
+        }
+        
+        if (symbol < 256)
+        {
+            if (outPos >= outSize)
+            {
+                return false;
+            }
+            out[outPos++] = symbol;
+            continue;
+        }
+
+        if (symbol == 256)
+        {
+            return true;
+        }
+
+        symbol -= 257;
+        if (symbol >= 29)
+        {
+            return false;
+        }
+
+        uint32_t length = LENGTH_BASE[symbol] + reader.get(LENGTH_EXTRA[symbol]);
+
+        int distSymbol = decodeSymbol(reader, distances);
+        if ((distSymbol < 0) || (distSymbol >= 30))
+        {
+            return false;
+        }
+
+        uint32_t distance = DIST_BASE[distSymbol] + reader.get(DIST_EXTRA[distSymbol]);
+        if ((distance > outPos) || (length > outSize - outPos))
+        {
+            return false;
+        }
+
+        // byte by byte, source and destination can overlap
+        for (uint32_t i=0;i<length;++i,++outPos)
+        {
+            out[outPos] = out[outPos - distance];
+        }
+    }
+
+    return false;
+}
+
+// lengths holds 286 + 30 entries
+bool readDynamicTables(BitReader& reader, Huffman& literals, Huffman& distances, Huffman& codeLengths, uint8_t *lengths)
+{
+    uint16_t hlit = reader.get(5) + 257;
+    uint8_t hdist = reader.get(5) + 1;
+    uint8_t hclen = reader.get(4) + 4;
+
+    if ((hlit > 286) || (hdist > 30))
+    {
+        return false;
+    }
+
+    memset(lengths, 0, 19);
+    for (uint8_t i=0;i<hclen;++i)
+    {
+        lengths[CODE_LENGTH_ORDER[i]] = reader.get(3);
+    }
+
+    if (!buildHuffman(codeLengths, lengths, 19))
+    {
+        return false;
+    }
+
+    memset(lengths, 0, hlit + hdist);
+    for (uint16_t i=0;i<hlit+hdist;)
+    {
+        int symbol = decodeSymbol(reader, codeLengths);
+        if (symbol < 0)
+        {
+            return false;
+        }
+
+        if (symbol < 16)
+        {
+            lengths[i++] = symbol;
+            continue;
+        }
+
+        uint8_t value = 0;
+        uint8_t repeat = 0;
+        if (symbol == 16)
+        {
+            if (i == 0)
+            {
+                return false;
+            }
+            value = lengths[i-1];
+            repeat = 3 + reader.get(2);
+        }
+        else if (symbol == 17)
+        {
+            repeat = 3 + reader.get(3);
+        }
+        else
+        {
+            repeat = 11 + reader.get(7);
+        }
+
+        if (i + repeat > hlit + hdist)
+        {
+            return false;
+        }
+
+        while (repeat-- > 0)
+        {
+            lengths[i++] = value;
+        }
+    }
+
+    return !reader.error && buildHuffman(literals, lengths, hlit) && buildHuffman(distances, &lengths[hlit], hdist);
+}
+
+// lengths holds at least 288 entries
+void buildFixedTables(Huffman& literals, Huffman& distances, uint8_t *lengths)
+{
+    memset(&lengths[0], 8, 144);
+    memset(&lengths[144], 9, 112);
+    memset(&lengths[256], 7, 24);
+    memset(&lengths[280], 8, 8);
+    buildHuffman(literals, lengths, 288);
+
+    memset(lengths, 5, 30);
+    buildHuffman(distances, lengths, 30);
+}
+
+struct BitWriter
+{
+    uint8_t *out;
+    size_t outSize;
+    size_t pos;
+    uint32_t bits;
+    uint8_t bitCount;
+    bool overflow;
+
+    void put(uint32_t value, uint8_t count)
+    {
+        bits |= value << bitCount;
+        bitCount += count;
+
+        while (bitCount >= 8)
+        {
+            if (pos >= outSize)
+            {
+                overflow = true;
+                return;
+            }
+            out[pos++] = bits & 0xff;
+            bits >>= 8;
+            bitCount -= 8;
+        }
+    }
+
+    // huffman codes are packed starting with the most significant bit
+    void putCode(uint32_t code, uint8_t count)
+    {
+        uint32_t reversed = 0;
+        for (uint8_t i=0;i<count;++i)
+        {
+            reversed = (reversed << 1) | ((code >> i) & 0x1);
+        }
+        put(reversed, count);
+    }
+
+    void flush()
+    {
+        if (bitCount > 0)
+        {
+            put(0, 8 - bitCount);
+        }
+    }
+};
+
+void putFixedLiteral(BitWriter& writer, uint16_t symbol)
+{
+    if (symbol < 144)
+    {
+        writer.putCode(0x30 + symbol, 8);
+    }
+    else if (symbol < 256)
+    {
+        writer.putCode(0x190 + (symbol - 144), 9);
+    }
+    else if (symbol < 280)
+    {
+        writer.putCode(symbol - 256, 7);
+    }
+    else
+    {
+        writer.putCode(0xc0 + (symbol - 280), 8);
+    }
+}
+
+void putMatch(BitWriter& writer, uint32_t length, uint32_t distance)
+{
+    uint8_t lengthCode = 28;
+    while (LENGTH_BASE[lengthCode] > length)
+    {
+        --lengthCode;
+    }
+    putFixedLiteral(writer, 257 + lengthCode);
+    writer.put(length - LENGTH_BASE[lengthCode], LENGTH_EXTRA[lengthCode]);
+
+    uint8_t distCode = 29;
+    while (DIST_BASE[distCode] > distance)
+    {
+        --distCode;
+    }
+    writer.putCode(distCode, 5);
+    writer.put(distance - DIST_BASE[distCode], DIST_EXTRA[distCode]);
+}
+
+const uint8_t HASH_BITS = WEBSOCKET_DEFLATE_HASH_BITS;
+const uint32_t MIN_MATCH = 3;
+const uint32_t MAX_MATCH = 258;
+
+inline uint32_t hash3(const uint8_t *data)
+{
+    uint32_t value = ((uint32_t)data[0] << 16) | ((uint32_t)data[1] << 8) | data[2];
+    return (value * 2654435761u) >> (32 - HASH_BITS);
+}
+
+}
+
+bool WebSocketDeflate::inflate(const uint8_t *in, size_t inLen, uint8_t *out, size_t outSize, size_t *outLen)
+{
+    BitReader reader = { in, inLen, 0, 0, 0, false };
+    size_t outPos = 0;
+
+    bool final = false;
+    while (!final && !reader.finished())
+    {
+        final = reader.get(1);
+        uint8_t type = reader.get(2);
+
+        if (type == 0)
+        {
+            reader.alignToByte();
+            uint16_t len = reader.get(16);
+            uint16_t nlen = reader.get(16);
+            if ((uint16_t)~nlen != len)
+            {
+                trace("WebSocketDeflate::inflate: stored block length mismatch len[%d] nlen[%d]\n", len, nlen);
+                return false;
+            }
+
+            if (len > outSize - outPos)
+            {
+                trace("WebSocketDeflate::inflate: output buffer too small[%d]\n", outSize);
+                return false;
+            }
+
+            for (uint16_t i=0;i<len;++i)
+            {
+                out[outPos++] = reader.get(8);
+            }
+        }
+        else if (type == 1)
+        {
+            buildFixedTables(m_literals, m_distances, m_lengths);
+            if (!inflateBlock(reader, m_literals, m_distances, out, outSize, outPos))
+            {
+                trace("WebSocketDeflate::inflate: failed decoding fixed block, out[%d] max[%d]\n", outPos, outSize);
+                return false;
+            }
+        }
+        else if (type == 2)
+        {
+            if (!readDynamicTables(reader, m_literals, m_distances, m_codeLengths, m_lengths) || !inflateBlock(reader, m_literals, m_distances, out, outSize, outPos))
+            {
+                trace("WebSocketDeflate::inflate: failed decoding dynamic block, out[%d] max[%d]\n", outPos, outSize);
+                return false;
+            }
+        }
+        else
+        {
+            trace("WebSocketDeflate::inflate: invalid block type\n");
+            return false;
+        }
+
+        if (reader.error)
+        {
+            trace("WebSocketDeflate::inflate: truncated input[%d]\n", inLen);
+            return false;
+        }
+    }
+
+    *outLen = outPos;
+    return true;
+}
+
+bool WebSocketDeflate::deflate(const uint8_t *in, size_t inLen, uint8_t *out, size_t outSize, size_t *outLen, uint8_t windowBits)
+{
+    windowBits = std::min(std::max(windowBits, (uint8_t)WEBSOCKET_DEFLATE_MIN_WINDOW_BITS), (uint8_t)WEBSOCKET_DEFLATE_MAX_WINDOW_BITS);
+    const uint32_t window = (1u << windowBits);
+
+    // positions are stored truncated, candidates are always verified against the data so stale entries are harmless
+    memset(m_head, 0, sizeof(m_head));
+
+    BitWriter writer = { out, outSize, 0, 0, 0, false };
+
+    // single final block with fixed huffman codes
+    writer.put(1, 1);
+    writer.put(1, 2);
+
+    size_t pos = 0;
+    while ((pos < inLen) && !writer.overflow)
+    {
+        uint32_t bestLength = 0;
+        uint32_t bestDistance = 0;
+
+        if (pos + MIN_MATCH <= inLen)
+        {
+            uint32_t h = hash3(&in[pos]);
+            uint32_t distance = (uint16_t)(pos - m_head[h]);
+            m_head[h] = (uint16_t)pos;
+
+            if ((distance > 0) && (distance <= window) && (distance <= pos))
+            {
+                const uint8_t *candidate = &in[pos - distance];
+                uint32_t maxLength = std::min((size_t)MAX_MATCH, inLen - pos);
+                uint32_t length = 0;
+                while ((length < maxLength) && (candidate[length] == in[pos + length]))
+                {
+                    ++length;
+                }
+
+                if (length >= MIN_MATCH)
+                {
+                    bestLength = length;
+                    bestDistance = distance;
+                }
+            }
+        }
+
+        if (bestLength > 0)
+        {
+            putMatch(writer, bestLength, bestDistance);
+
+            // keep the hash table warm inside the match
+            size_t end = pos + bestLength;
+            for (++pos; (pos < end) && (pos + MIN_MATCH <= inLen); ++pos)
+            {
+                m_head[hash3(&in[pos])] = (uint16_t)pos;
+            }
+            pos = end;
+        }
+        else
+        {
+            putFixedLiteral(writer, in[pos]);
+            ++pos;
+        }
+    }
+
+    putFixedLiteral(writer, 256);
+    writer.flush();
+
+    if (writer.overflow)
+    {
+        return false;
+    }
+
+    *outLen = writer.pos;
+    return true;
+}
+
+bool WebSocketDeflate::negotiate(const char *offer, uint8_t *windowBits, char *response, size_t responseSize)
+{
+    if (offer == NULL)
+    {
+        return false;
+    }
+
+    // offers are comma separated, use the first permessage-deflate one
+    const char *start = strstr(offer, "permessage-deflate");
+    if (start == NULL)
+    {
+        return false;
+    }
+
+    const char *end = strchr(start, ',');
+    size_t offerLen = (end != NULL) ? (size_t)(end - start) : strlen(start);
+
+    uint8_t bits = std::min(std::max(*windowBits, (uint8_t)WEBSOCKET_DEFLATE_MIN_WINDOW_BITS), (uint8_t)WEBSOCKET_DEFLATE_MAX_WINDOW_BITS);
+
+    // client may limit the window we use to compress
+    const char *PARAM = "server_max_window_bits";
+    const char *param = strstr(start, PARAM);
+    if ((param != NULL) && ((size_t)(param - start) < offerLen))
+    {
+        param += strlen(PARAM);
+        while ((*param == ' ') || (*param == '=') || (*param == '"'))
+        {
+            ++param;
+        }
+
+        int requested = atoi(param);
+        if ((requested < WEBSOCKET_DEFLATE_MIN_WINDOW_BITS) || (requested > WEBSOCKET_DEFLATE_MAX_WINDOW_BITS))
+        {
+            trace("WebSocketDeflate::negotiate: invalid server_max_window_bits[%d]\n", requested);
+            return false;
+        }
+
+        bits = std::min(bits, (uint8_t)requested);
+    }
+
+    int n = snprintf(response, responseSize, "permessage-deflate; server_no_context_takeover; client_no_context_takeover; server_max_window_bits=%d", bits);
+    if ((n <= 0) || ((size_t)n >= responseSize))
+    {
+        return false;
+    }
+
+    *windowBits = bits;
+    return true;
+}
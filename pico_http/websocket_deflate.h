@@ -0,0 +1,96 @@
+/* MIT License
+
+Copyright (c) 2024 Adrian Cruceru - https://github.com/AdrianCX/pico_https
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef WEBSOCKET_DEFLATE_H
+#define WEBSOCKET_DEFLATE_H
+
+#ifdef __TARGET_CPU_CORTEX_M0PLUS
+#include "pico/stdlib.h"
+#else
+#include "stdlib.h"
+#include <cstdint>
+#endif
+
+// Messages smaller then this are sent uncompressed.
+#ifndef WEBSOCKET_DEFLATE_MIN_SIZE
+#define WEBSOCKET_DEFLATE_MIN_SIZE 64
+#endif
+
+#define WEBSOCKET_DEFLATE_MIN_WINDOW_BITS 8
+#define WEBSOCKET_DEFLATE_MAX_WINDOW_BITS 15
+
+// Match finder hash table size used by deflate.
+#define WEBSOCKET_DEFLATE_HASH_BITS 9
+
+///
+/// Minimal permessage-deflate (RFC 7692) support with no context takeover in both directions.
+///
+/// Every message is compressed/decompressed on its own so nothing is kept between messages.
+/// Huffman tables and the match finder hash live in the object (~3.1KB) rather than on the stack,
+/// inflate runs from the lwIP receive callback. Calls themselves only keep a few small locals on the stack.
+/// Keep one object per connection, it is not safe to share between concurrent calls.
+///
+class WebSocketDeflate
+{
+public:
+    struct Huffman
+    {
+        uint16_t counts[16];
+        uint16_t symbols[288];
+    };
+
+    ///
+    /// Decompress one message, the 0x00 0x00 0xff 0xff tail removed by the sender is implied.
+    ///
+    /// @returns - true - message fully decompressed in out, outLen set.
+    ///          - false - corrupt data or out is too small.
+    ///
+    bool inflate(const uint8_t *in, size_t inLen, uint8_t *out, size_t outSize, size_t *outLen);
+
+    ///
+    /// Compress one message as a single final fixed huffman block, matches are limited to 2^windowBits bytes back.
+    ///
+    /// @returns - true - message compressed in out, outLen set.
+    ///          - false - out is too small, send message uncompressed instead.
+    ///
+    bool deflate(const uint8_t *in, size_t inLen, uint8_t *out, size_t outSize, size_t *outLen, uint8_t windowBits = WEBSOCKET_DEFLATE_MAX_WINDOW_BITS);
+
+    ///
+    /// Build the Sec-WebSocket-Extensions response for a client offer.
+    ///
+    /// @param offer - Sec-WebSocket-Extensions request header value.
+    /// @param windowBits - in: largest window we want to use, out: window agreed with client.
+    ///
+    /// @returns - true - permessage-deflate was offered, response written.
+    ///          - false - not offered or response does not fit, continue without compression.
+    ///
+    static bool negotiate(const char *offer, uint8_t *windowBits, char *response, size_t responseSize);
+
+private:
+    Huffman m_literals;
+    Huffman m_distances;
+    Huffman m_codeLengths;
+    uint8_t m_lengths[286 + 30];
+    uint16_t m_head[1 << WEBSOCKET_DEFLATE_HASH_BITS];
+};
+
+#endif
@@ -21,19 +21,35 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 */
 #include <algorithm>
+#include <stdio.h>
 #include <string.h>
 #include <time.h>
 
 #include "websocket_handler.h"
+#include "websocket_deflate.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 extern "C" void trace(const char *parameters, ...);
 extern "C" const char *safestr(const char *value);
 
+// mbedtls_wrapper
+extern "C" int sha1(const unsigned char *input, size_t ilen, unsigned char output[20]);
+extern "C" int base64_encode(const unsigned char *src, size_t slen, unsigned char *dst, size_t dlen);
+
 bool WebSocketHandler::decodeData(uint8_t* data, size_t len, WebSocketInterface *callback)
 {
-    while (len > 0)
+    // keep going with no data left only to finish an empty frame
+    while ((len > 0) || ((m_state == WebSocketState::WAIT_DATA) && (m_webSocketDataIndex == m_webSocketDataLen)))
     {
-        if (m_state == WebSocketState::WAIT_PACKET)
+        if (m_state == WebSocketState::WEBSOCKET_CLOSED)
+        {
+            // nothing is processed after the CLOSE handshake
+            return true;
+        }
+        else if (m_state == WebSocketState::WAIT_PACKET)
         {
             uint16_t bytesToCopy = std::min(len, (size_t)(MAX_WEBSOCKET_HEADER - m_bufferIndex));
             memcpy(&m_buffer[m_bufferIndex], data, bytesToCopy);
@@ -45,6 +61,7 @@ bool WebSocketHandler::decodeData(uint8_t* data, size_t len, WebSocketInterface
             }
             
             m_fin = m_buffer[0] & 0x80;
+            m_rsv1 = m_buffer[0] & 0x40;
             m_webSocketOperation = (WebSocketOperation) (m_buffer[0] & 0x0f);
             m_mask = m_buffer[1] & 0x80;
             uint16_t payload_len = (m_buffer[1] & 0x7f);
@@ -95,23 +112,82 @@ bool WebSocketHandler::decodeData(uint8_t* data, size_t len, WebSocketInterface
             m_webSocketDataIndex = 0;
             m_state = WebSocketState::WAIT_DATA;
             m_bufferIndex = 0;
+
+            if ((m_webSocketOperation & 0x08) && (!m_fin || (m_webSocketDataLen > MAX_WEBSOCKET_CONTROL_PAYLOAD)))
+            {
+                trace("WebSocketHandler::decodeData: this=%p, invalid control frame[%d] fin[%d] len[%llu]\n", this, m_webSocketOperation, m_fin, m_webSocketDataLen);
+                return false;
+            }
+
+            // RSV1 is only valid on the first frame of a message and only with permessage-deflate negotiated
+            if (m_rsv1 && ((m_inflateBuffer == NULL) || (m_messageBuffer == NULL) || (m_webSocketOperation == WebSocketOperation::CONTINUATION_FRAME) || (m_webSocketOperation & 0x08)))
+            {
+                trace("WebSocketHandler::decodeData: this=%p, unexpected RSV1 on operation[%d]\n", this, m_webSocketOperation);
+                return false;
+            }
+
+            if ((m_webSocketOperation == WebSocketOperation::TEXT_FRAME) || (m_webSocketOperation == WebSocketOperation::BINARY_FRAME))
+            {
+                // compressed text is validated once inflated
+                m_validateText = m_utf8Validation && (m_webSocketOperation == WebSocketOperation::TEXT_FRAME) && !m_rsv1;
+                m_utf8Validator.reset();
+            }
+
+            if ((m_messageBuffer != NULL) && !startMessageFrame())
+            {
+                return false;
+            }
         }
         else if (m_state == WebSocketState::WAIT_DATA)
         {
             if ((m_webSocketOperation == WebSocketOperation::TEXT_FRAME) || (m_webSocketOperation == WebSocketOperation::BINARY_FRAME) || (m_webSocketOperation == WebSocketOperation::CONTINUATION_FRAME))
             {
-                uint32_t i=0;
-                for (; (i<len) && (m_webSocketDataIndex < m_webSocketDataLen);++i,++m_webSocketDataIndex)
+                uint32_t i = (uint32_t)std::min((uint64_t)len, m_webSocketDataLen - m_webSocketDataIndex);
+                if (m_mask)
+                {
+                    applyMask(data, i, m_maskingKey, (uint32_t)(m_webSocketDataIndex & 0x3));
+                }
+                bool frameStart = (m_webSocketDataIndex == 0);
+                m_webSocketDataIndex += i;
+
+                if (m_validateText && (!m_utf8Validator.feed(data, i) || (m_fin && (m_webSocketDataIndex == m_webSocketDataLen) && !m_utf8Validator.complete())))
                 {
-                    if (m_mask)
+                    trace("WebSocketHandler::decodeData: this=%p, invalid UTF-8 in text message\n", this);
+                    return failInvalidPayload(callback);
+                }
+
+                if (m_messageBuffer == NULL)
+                {
+                    if (!callback->onWebSocketData(data, i))
                     {
-                        data[i] ^= m_maskingKey[m_webSocketDataIndex&0x3];
+                        return false;
                     }
                 }
-
-                if (!callback->onWebSocketData(data, i))
+                else if (frameStart && m_fin && (m_messageLen == 0) && (m_webSocketDataIndex == m_webSocketDataLen))
                 {
-                    return false;
+                    // whole message is already contiguous in received data, no copy needed
+                    m_inMessage = false;
+                    if (!deliverMessage(data, i, callback))
+                    {
+                        return false;
+                    }
+                }
+                else
+                {
+                    memcpy(&m_messageBuffer[m_messageLen], data, i);
+                    m_messageLen += i;
+
+                    if (m_fin && (m_webSocketDataIndex == m_webSocketDataLen))
+                    {
+                        size_t messageLen = m_messageLen;
+                        m_messageLen = 0;
+                        m_inMessage = false;
+                        
+                        if (!deliverMessage(m_messageBuffer, messageLen, callback))
+                        {
+                            return false;
+                        }
+                    }
                 }
 
                 len-=i;
@@ -126,8 +202,32 @@ bool WebSocketHandler::decodeData(uint8_t* data, size_t len, WebSocketInterface
                     }
                 }
             }
+            else if ((m_webSocketOperation == WebSocketOperation::PING) || (m_webSocketOperation == WebSocketOperation::PONG) || (m_webSocketOperation == WebSocketOperation::CONNECTION_CLOSE))
+            {
+                // control frames can arrive between fragments of a message, keep them apart from message state
+                uint32_t i = (uint32_t)std::min((uint64_t)len, m_webSocketDataLen - m_webSocketDataIndex);
+                memcpy(&m_controlBuffer[m_webSocketDataIndex], data, i);
+                if (m_mask)
+                {
+                    applyMask(&m_controlBuffer[m_webSocketDataIndex], i, m_maskingKey, (uint32_t)(m_webSocketDataIndex & 0x3));
+                }
+                m_webSocketDataIndex += i;
+
+                len-=i;
+                data+=i;
+
+                if (m_webSocketDataIndex == m_webSocketDataLen)
+                {
+                    m_state = WebSocketState::WAIT_PACKET;
+                    if (!handleControlFrame(callback))
+                    {
+                        return false;
+                    }
+                }
+            }
             else
             {
+                trace("WebSocketHandler::decodeData: this=%p, unsupported operation[%d]\n", this, m_webSocketOperation);
                 return false;
             }
         }
@@ -142,13 +242,235 @@ bool WebSocketHandler::decodeData(uint8_t* data, size_t len, WebSocketInterface
 }
 
 
-bool WebSocketHandler::encodeData(const uint8_t* data, size_t len, WebSocketInterface *callback)
+bool WebSocketHandler::handleControlFrame(WebSocketInterface *callback)
+{
+    switch (m_webSocketOperation)
+    {
+        case WebSocketOperation::PING:
+        {
+            return encodeControl(WebSocketOperation::PONG, m_controlBuffer, m_webSocketDataLen, callback);
+        }
+        case WebSocketOperation::PONG:
+        {
+            return callback->onWebSocketPong(m_controlBuffer, m_webSocketDataLen);
+        }
+        case WebSocketOperation::CONNECTION_CLOSE:
+        {
+            if (m_webSocketDataLen == 1)
+            {
+                trace("WebSocketHandler::handleControlFrame: this=%p, close frame with 1 byte payload\n", this);
+                return false;
+            }
+
+            uint16_t code = (m_webSocketDataLen >= 2) ? ((m_controlBuffer[0] << 8) | m_controlBuffer[1]) : WebSocketCloseCode::NO_STATUS_RECEIVED;
+            trace("WebSocketHandler::handleControlFrame: this=%p, close received, code[%d] closeSent[%d]\n", this, code, m_closeSent);
+
+            m_state = WebSocketState::WEBSOCKET_CLOSED;
+
+            // complete the handshake echoing the status code
+            if (!m_closeSent)
+            {
+                m_closeSent = true;
+                if (!encodeControl(WebSocketOperation::CONNECTION_CLOSE, m_controlBuffer, (m_webSocketDataLen >= 2) ? 2 : 0, callback))
+                {
+                    return false;
+                }
+            }
+
+            return callback->onWebSocketClose(code);
+        }
+        default:
+        {
+            return false;
+        }
+    }
+}
+
+bool WebSocketHandler::sendPing(const uint8_t* data, size_t len, WebSocketInterface *callback)
+{
+    return encodeControl(WebSocketOperation::PING, data, len, callback);
+}
+
+bool WebSocketHandler::sendClose(uint16_t code, WebSocketInterface *callback)
+{
+    if (m_closeSent)
+    {
+        return true;
+    }
+
+    m_closeSent = true;
+    uint8_t payload[2] = { (uint8_t)(code >> 8), (uint8_t)(code & 0xff) };
+    return encodeControl(WebSocketOperation::CONNECTION_CLOSE, payload, sizeof(payload), callback);
+}
+
+bool WebSocketHandler::encodeControl(WebSocketOperation operation, const uint8_t* data, size_t len, WebSocketInterface *callback)
+{
+    if (len > MAX_WEBSOCKET_CONTROL_PAYLOAD)
+    {
+        trace("WebSocketHandler::encodeControl: this=%p, control payload too large[%d] max[%d]\n", this, len, MAX_WEBSOCKET_CONTROL_PAYLOAD);
+        return false;
+    }
+
+    // control frames are small, header and payload go out in a single write
+    uint8_t buffer[6 + MAX_WEBSOCKET_CONTROL_PAYLOAD];
+    const uint8_t *maskingKey = nextMaskingKey(NULL);
+    uint16_t headerSize = writeHeader(buffer, operation, len, maskingKey);
+    if (len > 0)
+    {
+        memcpy(&buffer[headerSize], data, len);
+        if (maskingKey != NULL)
+        {
+            applyMask(&buffer[headerSize], len, maskingKey, 0);
+        }
+    }
+
+    return callback->onWebsocketEncodedData(buffer, headerSize + len);
+}
+
+const uint8_t *WebSocketHandler::nextMaskingKey(const uint8_t *maskingKey)
+{
+    if ((maskingKey != NULL) || (m_maskGenerator == NULL))
+    {
+        return maskingKey;
+    }
+
+    uint32_t key = m_maskGenerator();
+    memcpy(m_sendMaskingKey, &key, sizeof(m_sendMaskingKey));
+    return m_sendMaskingKey;
+}
+
+bool WebSocketHandler::startMessageFrame()
+{
+    if (m_webSocketOperation == WebSocketOperation::CONTINUATION_FRAME)
+    {
+        if (!m_inMessage)
+        {
+            trace("WebSocketHandler::startMessageFrame: this=%p, continuation frame without a started message\n", this);
+            return false;
+        }
+    }
+    else if ((m_webSocketOperation == WebSocketOperation::TEXT_FRAME) || (m_webSocketOperation == WebSocketOperation::BINARY_FRAME))
+    {
+        if (m_inMessage)
+        {
+            trace("WebSocketHandler::startMessageFrame: this=%p, new message[%d] while previous fragmented message is not finished\n", this, m_webSocketOperation);
+            return false;
+        }
+
+        m_inMessage = true;
+        m_messageOperation = m_webSocketOperation;
+        m_messageCompressed = m_rsv1;
+        m_messageLen = 0;
+    }
+    else
+    {
+        return true;
+    }
+
+    if (m_messageLen + m_webSocketDataLen > m_messageBufferSize)
+    {
+        trace("WebSocketHandler::startMessageFrame: this=%p, message too large, received[%d] frame[%llu] max[%d]\n", this, m_messageLen, m_webSocketDataLen, m_messageBufferSize);
+        return false;
+    }
+
+    return true;
+}
+
+bool WebSocketHandler::deliverMessage(uint8_t *data, size_t len, WebSocketInterface *callback)
+{
+    if (!m_messageCompressed)
+    {
+        return callback->onWebSocketMessage(data, len, m_messageOperation);
+    }
+
+    size_t inflatedLen = 0;
+    if (!m_deflate->inflate(data, len, m_inflateBuffer, m_inflateBufferSize, &inflatedLen))
+    {
+        trace("WebSocketHandler::deliverMessage: this=%p, failed inflating message len[%d] max[%d]\n", this, len, m_inflateBufferSize);
+        return false;
+    }
+
+    if (m_utf8Validation && (m_messageOperation == WebSocketOperation::TEXT_FRAME) && !WebSocketUtf8Validator::validate(m_inflateBuffer, inflatedLen))
+    {
+        trace("WebSocketHandler::deliverMessage: this=%p, invalid UTF-8 in compressed text message\n", this);
+        return failInvalidPayload(callback);
+    }
+
+    return callback->onWebSocketMessage(m_inflateBuffer, inflatedLen, m_messageOperation);
+}
+
+bool WebSocketHandler::failInvalidPayload(WebSocketInterface *callback)
+{
+    // let the peer know why, nothing is processed after this so the connection can close once the CLOSE frame is out
+    m_state = WebSocketState::WEBSOCKET_CLOSED;
+    if (!sendClose(WebSocketCloseCode::INVALID_PAYLOAD, callback))
+    {
+        return false;
+    }
+
+    return callback->onWebSocketClose(WebSocketCloseCode::INVALID_PAYLOAD);
+}
+
+void WebSocketHandler::setDeflate(WebSocketDeflate *deflate, uint8_t *inflateBuffer, size_t inflateSize, uint8_t *deflateBuffer, size_t deflateSize, uint8_t windowBits)
+{
+    bool enabled = (deflate != NULL) && (inflateBuffer != NULL) && (deflateBuffer != NULL) && (deflateSize > WEBSOCKET_FRAME_HEADROOM);
+
+    m_deflate = enabled ? deflate : NULL;
+    m_inflateBuffer = enabled ? inflateBuffer : NULL;
+    m_inflateBufferSize = enabled ? inflateSize : 0;
+    m_deflateBuffer = enabled ? deflateBuffer : NULL;
+    m_deflateBufferSize = enabled ? deflateSize : 0;
+    m_deflateWindowBits = windowBits;
+}
+
+void WebSocketHandler::applyMask(uint8_t* data, size_t len, const uint8_t maskingKey[4], uint32_t phase)
+{
+    typedef uintptr_t __attribute__((__may_alias__)) word_t;
+
+    // unaligned head, byte at a time until data is word aligned
+    while ((len > 0) && (((uintptr_t)data & (sizeof(word_t)-1)) != 0))
+    {
+        *data++ ^= maskingKey[phase++ & 0x3];
+        --len;
+    }
+
+    // key rotated to the current phase and repeated over a full word, memcpy keeps it endian independent
+    uint8_t rotated[16];
+    for (uint32_t i=0;i<sizeof(rotated);++i)
+    {
+        rotated[i] = maskingKey[(phase + i) & 0x3];
+    }
+
+#if defined(__SSE2__)
+    __m128i wideKey = _mm_loadu_si128((const __m128i *)rotated);
+    for (; len >= sizeof(__m128i); len -= sizeof(__m128i), data += sizeof(__m128i))
+    {
+        __m128i value = _mm_loadu_si128((const __m128i *)data);
+        _mm_storeu_si128((__m128i *)data, _mm_xor_si128(value, wideKey));
+    }
+#endif
+
+    word_t key;
+    memcpy(&key, rotated, sizeof(key));
+    for (; len >= sizeof(word_t); len -= sizeof(word_t), data += sizeof(word_t))
+    {
+        *(word_t *)data ^= key;
+    }
+
+    // tail, phase is unchanged by whole words since word size is a multiple of 4
+    for (uint32_t i=0;i<len;++i)
+    {
+        data[i] ^= rotated[i];
+    }
+}
+
+uint16_t WebSocketHandler::writeHeader(uint8_t *buffer, WebSocketOperation operation, uint64_t len, const uint8_t *maskingKey, bool compressed)
 {
-    uint8_t buffer[MAX_WEBSOCKET_HEADER] = {0};
     uint16_t headerSize = 0;
 
-    // FIN + operation
-    buffer[0] = 0x80 | WebSocketOperation::BINARY_FRAME;
+    // FIN + RSV1 + operation
+    buffer[0] = 0x80 | (compressed ? 0x40 : 0x00) | operation;
+    buffer[1] = (maskingKey != NULL) ? 0x80 : 0x00;
 
     if (len < 126)
     {
@@ -165,22 +487,121 @@ bool WebSocketHandler::encodeData(const uint8_t* data, size_t len, WebSocketInte
     else
     {
         buffer[1] |= 127;
-        buffer[2] = 0;
-        buffer[3] = 0;
-        buffer[4] = 0;
-        buffer[5] = 0;
-        buffer[6] = (len >> 24) & 0xff;
-        buffer[7] = (len >> 16) & 0xff;
-        buffer[8] = (len >> 8) & 0xff;
-        buffer[9] = (len) & 0xff;
+        for (int i=0;i<8;++i)
+        {
+            buffer[2+i] = (len >> (56 - i*8)) & 0xff;
+        }
         headerSize += 10;
     }
 
-    if (!callback->onWebsocketEncodedData(&buffer[0], headerSize))
+    if (maskingKey != NULL)
     {
-        return false;
+        memcpy(&buffer[headerSize], maskingKey, 4);
+        headerSize += 4;
+    }
+
+    return headerSize;
+}
+
+bool WebSocketHandler::encodeData(const uint8_t* data, size_t len, WebSocketInterface *callback, WebSocketOperation operation, const uint8_t *maskingKey)
+{
+    maskingKey = nextMaskingKey(maskingKey);
+
+    if ((m_deflateBuffer != NULL) && (len >= WEBSOCKET_DEFLATE_MIN_SIZE) && ((operation == WebSocketOperation::TEXT_FRAME) || (operation == WebSocketOperation::BINARY_FRAME)))
+    {
+        // incompressible or too large messages fall through and go out as they are
+        size_t compressedLen = 0;
+        if (m_deflate->deflate(data, len, &m_deflateBuffer[WEBSOCKET_FRAME_HEADROOM], m_deflateBufferSize - WEBSOCKET_FRAME_HEADROOM, &compressedLen, m_deflateWindowBits) && (compressedLen < len))
+        {
+            return encodeFrame(m_deflateBuffer, compressedLen, callback, operation, maskingKey, true);
+        }
+    }
+
+    uint8_t buffer[WEBSOCKET_FRAME_HEADROOM + WEBSOCKET_COALESCE_SIZE];
+    uint16_t headerSize = writeHeader(buffer, operation, len, maskingKey);
+
+    if ((maskingKey == NULL) && (headerSize + len > sizeof(buffer)))
+    {
+        // large payload, send straight from caller memory
+        if (!callback->onWebsocketEncodedData(&buffer[0], headerSize))
+        {
+            return false;
+        }
+
+        return callback->onWebsocketEncodedData(data, len);
+    }
+
+    // header and payload in one write, masked payloads are masked while copying in chunks
+    size_t pos = headerSize;
+    size_t offset = 0;
+    do
+    {
+        size_t count = std::min(len - offset, sizeof(buffer) - pos);
+        memcpy(&buffer[pos], &data[offset], count);
+
+        if (maskingKey != NULL)
+        {
+            applyMask(&buffer[pos], count, maskingKey, offset & 0x3);
+        }
+
+        if (!callback->onWebsocketEncodedData(&buffer[0], pos + count))
+        {
+            return false;
+        }
+
+        offset += count;
+        pos = 0;
+    } while (offset < len);
+
+    return true;
+}
+
+bool WebSocketHandler::encodeFrame(uint8_t* buffer, size_t len, WebSocketInterface *callback, WebSocketOperation operation, const uint8_t *maskingKey, bool compressed)
+{
+    maskingKey = nextMaskingKey(maskingKey);
+
+    uint8_t header[WEBSOCKET_FRAME_HEADROOM];
+    uint16_t headerSize = writeHeader(header, operation, len, maskingKey, compressed);
+
+    // header goes right in front of the payload
+    uint8_t *frame = &buffer[WEBSOCKET_FRAME_HEADROOM - headerSize];
+    memcpy(frame, header, headerSize);
+
+    if (maskingKey != NULL)
+    {
+        applyMask(&buffer[WEBSOCKET_FRAME_HEADROOM], len, maskingKey, 0);
     }
 
-    return callback->onWebsocketEncodedData(data, len);
+    return callback->onWebsocketEncodedData(frame, headerSize + len);
 }
 
+bool computeWebSocketAccept(const char *key, char *accept, size_t accept_size)
+{
+    const int BUFFER_SIZE = 128;
+    const int SHA1_SIZE = 20;
+    const char *KEY_GUID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+    char buffer[BUFFER_SIZE];
+    int len = snprintf(buffer, BUFFER_SIZE, "%s%s", key, KEY_GUID);
+    if ((len <= 0) || (len >= BUFFER_SIZE))
+    {
+        trace("computeWebSocketAccept: key too long, len[%d] max[%d]", (int)strlen(key), BUFFER_SIZE - (int)strlen(KEY_GUID) - 1);
+        return false;
+    }
+
+    uint8_t sha1sum[SHA1_SIZE];
+    int err = sha1((const uint8_t*)buffer, len, sha1sum);
+    if (err != 0)
+    {
+        trace("computeWebSocketAccept: sha1 error[%d]", err);
+        return false;
+    }
+
+    err = base64_encode(sha1sum, SHA1_SIZE, (uint8_t*)accept, accept_size);
+    if (err != 0)
+    {
+        trace("computeWebSocketAccept: base64 error[%d]", err);
+        return false;
+    }
+    return true;
+}
@@ -30,12 +30,26 @@ SOFTWARE.
 #include <cstdint>
 #endif
 
+#include "websocket_utf8.h"
+
+class WebSocketDeflate;
+
 #define MAX_WEBSOCKET_HEADER 16
+#define MAX_WEBSOCKET_CONTROL_PAYLOAD 125
+
+// Largest frame header: 2 bytes + 8 bytes extended length + 4 bytes masking key, reserve this in front of payload for encodeFrame.
+#define WEBSOCKET_FRAME_HEADROOM 14
+
+// Frames up to this payload size are copied next to their header and sent in a single write by encodeData.
+#ifndef WEBSOCKET_COALESCE_SIZE
+#define WEBSOCKET_COALESCE_SIZE 512
+#endif
 
 enum WebSocketState
 {
     WAIT_PACKET,
     WAIT_DATA,
+    WEBSOCKET_CLOSED,
 };
 
 enum WebSocketOperation
@@ -48,19 +62,69 @@ enum WebSocketOperation
     PONG               = 0x0A,
 };
 
+enum WebSocketCloseCode
+{
+    NORMAL_CLOSURE     = 1000,
+    GOING_AWAY         = 1001,
+    PROTOCOL_ERROR     = 1002,
+    UNSUPPORTED_DATA   = 1003,
+    NO_STATUS_RECEIVED = 1005,
+    INVALID_PAYLOAD    = 1007,
+    POLICY_VIOLATION   = 1008,
+    MESSAGE_TOO_BIG    = 1009,
+};
+
 class WebSocketInterface
 {
 public:
     virtual bool onWebSocketData(uint8_t *data, size_t len) = 0;
     virtual bool onWebsocketEncodedData(const uint8_t *data, size_t len) = 0;
     virtual bool onFinishedPacket() { return true; }
+
+    // Only called when a message buffer is set on the WebSocketHandler, replaces onWebSocketData with whole messages.
+    virtual bool onWebSocketMessage(uint8_t *data, size_t len, WebSocketOperation operation) { return true; }
+
+    // PING frames are answered by the WebSocketHandler, only PONG payloads and the CLOSE handshake are reported.
+    virtual bool onWebSocketPong(const uint8_t *data, size_t len) { return true; }
+
+    // CLOSE handshake is done, or a CLOSE with INVALID_PAYLOAD was sent for bad text. Nothing is decoded afterwards.
+    // Returning false aborts the connection, close it once the CLOSE frame is acknowledged so the peer gets it.
+    virtual bool onWebSocketClose(uint16_t code) { return true; }
+
+    // Called as sent data is acknowledged and the outbound queue has room again, a good time to produce more data.
+    virtual bool onWebSocketWritable() { return true; }
 };
 
+// Source of masking keys for client mode, should not be predictable by the peer.
+typedef uint32_t (*WebSocketMaskGenerator)();
+
+// Sec-WebSocket-Accept value is 28 base64 characters.
+#define WEBSOCKET_ACCEPT_SIZE 29
+
+///
+/// Sec-WebSocket-Accept for a Sec-WebSocket-Key: base64 of the SHA-1 of the key followed by the RFC 6455 GUID.
+/// Servers send it in the 101 reply, clients compare it with the one received.
+///
+bool computeWebSocketAccept(const char *key, char *accept, size_t accept_size);
+
+
 class WebSocketHandler
 {
 public:
     WebSocketHandler() {};
 
+    ///
+    /// Client side handler, every frame sent (including PONG and CLOSE replies) is masked with a new key from generator.
+    ///
+    void setClientMode(WebSocketMaskGenerator generator) { m_maskGenerator = generator; }
+
+    ///
+    /// TEXT messages are checked to be valid UTF-8 as they arrive, across frames and segments.
+    /// Invalid messages are answered with CLOSE INVALID_PAYLOAD, then onWebSocketClose(INVALID_PAYLOAD) is called and
+    /// decodeData returns its result, nothing after the bad message is decoded. Enabled by default.
+    ///
+    void setUtf8Validation(bool enabled) { m_utf8Validation = enabled; }
+
     ///
     /// This will decode messages in-place in provided data and trigger callback with them.
     /// It will cache any remaining bytes that are part of a next message header.
@@ -70,16 +134,82 @@ public:
     ///
     bool decodeData(uint8_t* data, size_t len, WebSocketInterface *callback);
 
+    ///
+    /// Enable message reassembly, whole messages (including fragmented CONTINUATION sequences) are delivered
+    /// in one onWebSocketMessage call instead of onWebSocketData slices.
+    /// Messages that are contiguous in received data are handed through in place, others are copied in buffer.
+    /// Messages larger then size are rejected and decodeData fails.
+    ///
+    /// @param buffer - storage for reassembly, must outlive the handler, NULL disables reassembly.
+    ///
+    void setMessageBuffer(uint8_t *buffer, size_t size) { m_messageBuffer = buffer; m_messageBufferSize = buffer ? size : 0; m_messageLen = 0; m_inMessage = false; }
+    bool hasMessageBuffer() const { return m_messageBuffer != NULL; }
+
+    ///
+    /// Enable permessage-deflate once negotiated (see WebSocketDeflate::negotiate), requires a message buffer.
+    /// Compressed messages are inflated whole into inflateBuffer before onWebSocketMessage.
+    /// encodeData compresses messages of WEBSOCKET_DEFLATE_MIN_SIZE bytes or more into deflateBuffer,
+    /// first WEBSOCKET_FRAME_HEADROOM bytes of it are reserved for the frame header.
+    /// Buffers are separate so messages can be sent from within onWebSocketMessage.
+    ///
+    /// @param deflate - per connection compression state, must outlive the handler.
+    /// @param inflateBuffer - NULL disables compression.
+    ///
+    void setDeflate(WebSocketDeflate *deflate, uint8_t *inflateBuffer, size_t inflateSize, uint8_t *deflateBuffer, size_t deflateSize, uint8_t windowBits);
+
     ///
     /// This will encode data in a message and call back with bytes to send.
+    /// Small frames are sent with a single callback, larger unmasked frames call back with header and then payload.
+    ///
+    /// @param maskingKey - 4 byte key for client side frames, NULL for server frames or a generated key in client mode.
     ///
     /// @returns - true - if all data processed succesfully.
     ///          - false - on failure, connection must be closed.
     ///
-    bool encodeData(const uint8_t* data, size_t len, WebSocketInterface *callback);
+    bool encodeData(const uint8_t* data, size_t len, WebSocketInterface *callback, WebSocketOperation operation = WebSocketOperation::BINARY_FRAME, const uint8_t *maskingKey = NULL);
+
+    ///
+    /// Encode a frame in place with a single callback, no copies.
+    /// The first WEBSOCKET_FRAME_HEADROOM bytes of buffer are reserved for the header, payload of len bytes follows.
+    /// Payload is masked in place if maskingKey is provided.
+    ///
+    bool encodeFrame(uint8_t* buffer, size_t len, WebSocketInterface *callback, WebSocketOperation operation = WebSocketOperation::BINARY_FRAME, const uint8_t *maskingKey = NULL, bool compressed = false);
+
+    ///
+    /// Write a frame header with FIN set, returns header size.
+    ///
+    /// @param compressed - sets RSV1, marks a permessage-deflate message.
+    ///
+    static uint16_t writeHeader(uint8_t *buffer, WebSocketOperation operation, uint64_t len, const uint8_t *maskingKey, bool compressed = false);
+
+    ///
+    /// XOR data in place with the 4 byte masking key, starting at mask byte 'phase'.
+    /// Works a word at a time (16 bytes with SSE2 on host), unaligned head/tail bytes are handled separately.
+    ///
+    static void applyMask(uint8_t* data, size_t len, const uint8_t maskingKey[4], uint32_t phase);
+
+    ///
+    /// Send a PING, the PONG payload is reported through onWebSocketPong. Payload is limited to 125 bytes.
+    ///
+    bool sendPing(const uint8_t* data, size_t len, WebSocketInterface *callback);
+
+    ///
+    /// Start the CLOSE handshake, onWebSocketClose is called once the peer replies.
+    ///
+    bool sendClose(uint16_t code, WebSocketInterface *callback);
+
+    bool isClosed() { return m_state == WebSocketState::WEBSOCKET_CLOSED; }
 
 private:
+    bool startMessageFrame();
+    bool deliverMessage(uint8_t *data, size_t len, WebSocketInterface *callback);
+    bool failInvalidPayload(WebSocketInterface *callback);
+    bool handleControlFrame(WebSocketInterface *callback);
+    bool encodeControl(WebSocketOperation operation, const uint8_t* data, size_t len, WebSocketInterface *callback);
+    const uint8_t *nextMaskingKey(const uint8_t *maskingKey);
+
     bool m_fin = false;
+    bool m_rsv1 = false;
     bool m_mask = false;
     WebSocketOperation m_webSocketOperation;
     uint64_t m_webSocketDataLen = 0;
@@ -89,6 +219,30 @@ private:
     WebSocketState m_state = WebSocketState::WAIT_PACKET;
     uint16_t m_bufferIndex = 0;
     uint8_t m_buffer[MAX_WEBSOCKET_HEADER];
+
+    bool m_inMessage = false;
+    WebSocketOperation m_messageOperation = WebSocketOperation::BINARY_FRAME;
+    size_t m_messageLen = 0;
+    size_t m_messageBufferSize = 0;
+    uint8_t *m_messageBuffer = NULL;
+
+    bool m_messageCompressed = false;
+    WebSocketDeflate *m_deflate = NULL;
+    uint8_t m_deflateWindowBits = 15;
+    size_t m_inflateBufferSize = 0;
+    uint8_t *m_inflateBuffer = NULL;
+    size_t m_deflateBufferSize = 0;
+    uint8_t *m_deflateBuffer = NULL;
+
+    bool m_utf8Validation = true;
+    bool m_validateText = false;
+    WebSocketUtf8Validator m_utf8Validator;
+
+    WebSocketMaskGenerator m_maskGenerator = NULL;
+    uint8_t m_sendMaskingKey[4];
+
+    bool m_closeSent = false;
+    uint8_t m_controlBuffer[MAX_WEBSOCKET_CONTROL_PAYLOAD];
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,204 @@
+/* MIT License
+
+Copyright (c) 2024 Adrian Cruceru - https://github.com/AdrianCX/pico_https
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include <string.h>
+
+#include "websocket_rpc.h"
+
+extern "C" void trace(const char *parameters, ...);
+
+bool WebSocketRpcArgs::next(const uint8_t **data, uint16_t *len)
+{
+    if (m_len - m_pos < 2)
+    {
+        return false;
+    }
+
+    uint16_t argLen = (m_data[m_pos] << 8) | m_data[m_pos+1];
+    if (m_len - m_pos - 2 < argLen)
+    {
+        return false;
+    }
+
+    *data = &m_data[m_pos + 2];
+    *len = argLen;
+    m_pos += 2 + argLen;
+    return true;
+}
+
+bool WebSocketRpcArgs::readU32(uint32_t *value)
+{
+    const uint8_t *data = NULL;
+    uint16_t len = 0;
+    if (!next(&data, &len) || (len != 4))
+    {
+        return false;
+    }
+
+    *value = ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | (uint32_t)data[3];
+    return true;
+}
+
+bool WebSocketRpcWriter::add(const void *data, uint16_t len)
+{
+    if (m_overflow || (m_size - m_pos < (size_t)len + 2))
+    {
+        m_overflow = true;
+        return false;
+    }
+
+    m_buffer[m_pos++] = len >> 8;
+    m_buffer[m_pos++] = len & 0xff;
+    if (len > 0)
+    {
+        memcpy(&m_buffer[m_pos], data, len);
+    }
+    m_pos += len;
+    return true;
+}
+
+bool WebSocketRpcWriter::addU32(uint32_t value)
+{
+    uint8_t data[4] = { (uint8_t)(value >> 24), (uint8_t)(value >> 16), (uint8_t)(value >> 8), (uint8_t)value };
+    return add(data, sizeof(data));
+}
+
+bool WebSocketRpcWriter::addString(const char *value)
+{
+    return add(value, strlen(value));
+}
+
+bool WebSocketRpc::addMethod(uint32_t methodId, WebSocketRpcHandler handler, void *context)
+{
+    if (m_methodCount >= WEBSOCKET_RPC_MAX_METHODS)
+    {
+        trace("WebSocketRpc::addMethod: this=%p, too many methods, max[%d]\n", this, WEBSOCKET_RPC_MAX_METHODS);
+        return false;
+    }
+
+    m_methods[m_methodCount++] = { methodId, handler, context };
+    return true;
+}
+
+bool WebSocketRpc::onMessage(const uint8_t *data, size_t len)
+{
+    if ((len < WEBSOCKET_RPC_REQUEST_HEADER) || (data[0] != WEBSOCKET_RPC_REQUEST))
+    {
+        trace("WebSocketRpc::onMessage: this=%p, malformed request, len[%d]\n", this, len);
+        return false;
+    }
+
+    uint16_t requestId = (data[1] << 8) | data[2];
+    uint32_t methodId = ((uint32_t)data[3] << 24) | ((uint32_t)data[4] << 16) | ((uint32_t)data[5] << 8) | (uint32_t)data[6];
+
+    uint8_t buffer[WEBSOCKET_FRAME_HEADROOM + WEBSOCKET_RPC_RESPONSE_HEADER + WEBSOCKET_RPC_REPLY_SIZE];
+    WebSocketRpcWriter reply(buffer, sizeof(buffer));
+
+    const Method *method = NULL;
+    for (uint16_t i=0;i<m_methodCount;++i)
+    {
+        if (m_methods[i].id == methodId)
+        {
+            method = &m_methods[i];
+            break;
+        }
+    }
+
+    if (method == NULL)
+    {
+        trace("WebSocketRpc::onMessage: this=%p, unknown method[%08x] request[%d]\n", this, methodId, requestId);
+        return send(requestId, WebSocketRpcStatus::RPC_METHOD_NOT_FOUND, reply);
+    }
+
+    // reserve the slot up front, the handler may answer asynchronously
+    if (m_pendingCount >= WEBSOCKET_RPC_MAX_PENDING)
+    {
+        return send(requestId, WebSocketRpcStatus::RPC_BUSY, reply);
+    }
+
+    WebSocketRpcArgs args(&data[WEBSOCKET_RPC_REQUEST_HEADER], len - WEBSOCKET_RPC_REQUEST_HEADER);
+    WebSocketRpcStatus status = method->handler(method->context, requestId, args, reply);
+
+    if (status == WebSocketRpcStatus::RPC_PENDING)
+    {
+        m_pending[m_pendingCount++] = requestId;
+        return true;
+    }
+
+    return send(requestId, status, reply);
+}
+
+bool WebSocketRpc::respond(uint16_t requestId, WebSocketRpcStatus status, WebSocketRpcWriter& reply)
+{
+    // local marker only, the request stays pending for a real answer
+    if (status == WebSocketRpcStatus::RPC_PENDING)
+    {
+        trace("WebSocketRpc::respond: this=%p, RPC_PENDING is not a response, request[%d]\n", this, requestId);
+        return false;
+    }
+
+    if (!removePending(requestId))
+    {
+        trace("WebSocketRpc::respond: this=%p, request[%d] is not pending\n", this, requestId);
+        return false;
+    }
+
+    return send(requestId, status, reply);
+}
+
+bool WebSocketRpc::send(uint16_t requestId, WebSocketRpcStatus status, WebSocketRpcWriter& reply)
+{
+    // the peer always gets an answer, a reply that did not fit turns into RPC_FAILED
+    if ((status == WebSocketRpcStatus::RPC_OK) && reply.overflow())
+    {
+        trace("WebSocketRpc::send: this=%p, reply too large for request[%d]\n", this, requestId);
+        status = WebSocketRpcStatus::RPC_FAILED;
+    }
+
+    if (status != WebSocketRpcStatus::RPC_OK)
+    {
+        // error replies carry no arguments
+        reply.m_pos = WEBSOCKET_FRAME_HEADROOM + WEBSOCKET_RPC_RESPONSE_HEADER;
+    }
+
+    uint8_t *header = &reply.m_buffer[WEBSOCKET_FRAME_HEADROOM];
+    header[0] = WEBSOCKET_RPC_RESPONSE;
+    header[1] = requestId >> 8;
+    header[2] = requestId & 0xff;
+    header[3] = status;
+
+    return m_transport->sendRpcFrame(reply.m_buffer, reply.m_pos - WEBSOCKET_FRAME_HEADROOM);
+}
+
+bool WebSocketRpc::removePending(uint16_t requestId)
+{
+    for (uint16_t i=0;i<m_pendingCount;++i)
+    {
+        if (m_pending[i] == requestId)
+        {
+            m_pending[i] = m_pending[--m_pendingCount];
+            return true;
+        }
+    }
+
+    return false;
+}
@@ -0,0 +1,187 @@
+/* MIT License
+
+Copyright (c) 2024 Adrian Cruceru - https://github.com/AdrianCX/pico_https
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef WEBSOCKET_RPC_H
+#define WEBSOCKET_RPC_H
+
+#ifdef __TARGET_CPU_CORTEX_M0PLUS
+#include "pico/stdlib.h"
+#else
+#include "stdlib.h"
+#include <cstdint>
+#endif
+
+#include "websocket_handler.h"
+
+#ifndef WEBSOCKET_RPC_MAX_METHODS
+#define WEBSOCKET_RPC_MAX_METHODS 16
+#endif
+
+// Requests accepted but not answered yet, more are refused with RPC_BUSY.
+#ifndef WEBSOCKET_RPC_MAX_PENDING
+#define WEBSOCKET_RPC_MAX_PENDING 8
+#endif
+
+// Room for arguments of synchronous replies, taken from the stack.
+#ifndef WEBSOCKET_RPC_REPLY_SIZE
+#define WEBSOCKET_RPC_REPLY_SIZE 256
+#endif
+
+///
+/// Binary frames, all integers big endian:
+///   request:  0x01 | request id (2) | method id (4) | arguments
+///   response: 0x02 | request id (2) | status (1)    | arguments
+/// Arguments are a sequence of length (2) | bytes.
+///
+#define WEBSOCKET_RPC_REQUEST 0x01
+#define WEBSOCKET_RPC_RESPONSE 0x02
+#define WEBSOCKET_RPC_REQUEST_HEADER 7
+#define WEBSOCKET_RPC_RESPONSE_HEADER 4
+
+enum WebSocketRpcStatus
+{
+    RPC_OK                = 0x00,
+    RPC_METHOD_NOT_FOUND  = 0x01,
+    RPC_INVALID_ARGUMENTS = 0x02,
+    RPC_BUSY              = 0x03,
+    RPC_FAILED            = 0x04,
+
+    // returned by handlers that answer later with WebSocketRpc::respond, never sent
+    RPC_PENDING           = 0xFF,
+};
+
+///
+/// FNV-1a of the method name, evaluated at compile time for constant names.
+///
+constexpr uint32_t websocketRpcMethodId(const char *name, uint32_t hash = 2166136261u)
+{
+    return (*name == 0) ? hash : websocketRpcMethodId(name + 1, (hash ^ (uint8_t)*name) * 16777619u);
+}
+
+///
+/// Reads arguments in place from a decoded frame, pointers live as long as the frame data.
+///
+class WebSocketRpcArgs
+{
+public:
+    WebSocketRpcArgs(const uint8_t *data, size_t len) : m_data(data), m_len(len) {}
+
+    bool next(const uint8_t **data, uint16_t *len);
+    bool readU32(uint32_t *value);
+    bool readString(const char **value, uint16_t *len) { return next((const uint8_t **)value, len); }
+
+    size_t remaining() { return m_len - m_pos; }
+
+private:
+    const uint8_t *m_data;
+    size_t m_len;
+    size_t m_pos = 0;
+};
+
+///
+/// Builds a response in a caller buffer, leaving room for the frame and response headers so it is sent without copies.
+///
+class WebSocketRpcWriter
+{
+public:
+    WebSocketRpcWriter(uint8_t *buffer, size_t size) : m_buffer(buffer), m_size(size), m_pos(WEBSOCKET_FRAME_HEADROOM + WEBSOCKET_RPC_RESPONSE_HEADER), m_overflow(size < m_pos) {}
+
+    bool add(const void *data, uint16_t len);
+    bool addU32(uint32_t value);
+    bool addString(const char *value);
+
+    bool overflow() { return m_overflow; }
+
+private:
+    friend class WebSocketRpc;
+
+    uint8_t *m_buffer;
+    size_t m_size;
+    size_t m_pos;
+    bool m_overflow;
+};
+
+class IWebSocketRpcTransport
+{
+public:
+    ///
+    /// Send a frame in place, see WebSocketHandler::encodeFrame for the buffer layout.
+    ///
+    virtual bool sendRpcFrame(uint8_t *buffer, size_t len) = 0;
+};
+
+///
+/// Handler for one method. Either fills reply and returns RPC_OK, returns an error status,
+/// or keeps requestId and returns RPC_PENDING to answer later through WebSocketRpc::respond.
+///
+typedef WebSocketRpcStatus (*WebSocketRpcHandler)(void *context, uint16_t requestId, WebSocketRpcArgs& args, WebSocketRpcWriter& reply);
+
+///
+/// Dispatches RPC requests received in websocket messages, several requests can be in flight at once.
+///
+class WebSocketRpc
+{
+public:
+    WebSocketRpc(IWebSocketRpcTransport *transport) : m_transport(transport) {}
+
+    bool addMethod(uint32_t methodId, WebSocketRpcHandler handler, void *context);
+
+    ///
+    /// Handle one whole message, typically from onWebSocketMessage.
+    ///
+    /// @returns - false - malformed message or sending failed, connection must be closed.
+    ///
+    bool onMessage(const uint8_t *data, size_t len);
+
+    ///
+    /// Answer a request that returned RPC_PENDING. A reply that overflowed is sent as RPC_FAILED.
+    ///
+    /// @returns - false - unknown request id, status RPC_PENDING or sending failed.
+    ///
+    bool respond(uint16_t requestId, WebSocketRpcStatus status, WebSocketRpcWriter& reply);
+
+    uint16_t pending() { return m_pendingCount; }
+
+    // Forget pending requests, for example when the connection is closed.
+    void reset() { m_pendingCount = 0; }
+
+private:
+    bool send(uint16_t requestId, WebSocketRpcStatus status, WebSocketRpcWriter& reply);
+    bool removePending(uint16_t requestId);
+
+    struct Method
+    {
+        uint32_t id;
+        WebSocketRpcHandler handler;
+        void *context;
+    };
+
+    IWebSocketRpcTransport *m_transport;
+
+    uint16_t m_methodCount = 0;
+    Method m_methods[WEBSOCKET_RPC_MAX_METHODS];
+
+    uint16_t m_pendingCount = 0;
+    uint16_t m_pending[WEBSOCKET_RPC_MAX_PENDING];
+};
+
+#endif
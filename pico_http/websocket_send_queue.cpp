@@ -0,0 +1,203 @@
+/* MIT License
+
+Copyright (c) 2024 Adrian Cruceru - https://github.com/AdrianCX/pico_https
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include <algorithm>
+
+#include "websocket_send_queue.h"
+
+extern "C" void trace(const char *parameters, ...);
+
+bool WebSocketSendQueue::push(WebSocketFrameBuffer *frame)
+{
+    if (full())
+    {
+        // a partly sent frame has to be finished, it is never dropped or replaced
+        if ((m_headSent > 0) && (m_count == 1))
+        {
+            m_stats.dropped++;
+            return false;
+        }
+
+        switch (m_policy)
+        {
+            case WebSocketQueuePolicy::DROP_NEWEST:
+            {
+                m_stats.dropped++;
+                return false;
+            }
+            case WebSocketQueuePolicy::DROP_OLDEST:
+            {
+                if (m_headSent > 0)
+                {
+                    removeSecond();
+                }
+                else
+                {
+                    popFront();
+                }
+                m_stats.dropped++;
+                break;
+            }
+            case WebSocketQueuePolicy::COALESCE_LATEST:
+            {
+                WebSocketFrameBuffer *& newest = at(m_count - 1);
+                m_bytes -= newest->frameSize();
+                newest->release();
+
+                frame->acquire();
+                newest = frame;
+                m_bytes += frame->frameSize();
+                m_stats.coalesced++;
+                return true;
+            }
+        }
+    }
+
+    frame->acquire();
+    at(m_count) = frame;
+    ++m_count;
+    m_bytes += frame->frameSize();
+
+    m_stats.queued++;
+    if (m_count > m_stats.high_water)
+    {
+        m_stats.high_water = m_count;
+    }
+    return true;
+}
+
+bool WebSocketSendQueue::flush(WebSocketInterface *callback, size_t available, bool drained)
+{
+    while (!empty())
+    {
+        WebSocketFrameBuffer *frame = at(0);
+        if ((m_headSent > 0) || ((frame->frameSize() > available) && drained))
+        {
+            // frame does not fit even an empty send buffer, it goes out as fragments
+            uint32_t sent = m_stats.sent;
+            if (!sendFragment(callback, available))
+            {
+                return false;
+            }
+
+            // wait for more room unless the last fragment went out
+            if (m_stats.sent == sent)
+            {
+                return true;
+            }
+            continue;
+        }
+
+        if (frame->frameSize() > available)
+        {
+            return true;
+        }
+
+        // frame leaves the queue before the callback so a nested flush can not send it twice
+        frame->acquire();
+        popFront();
+
+        bool result = callback->onWebsocketEncodedData(frame->frame(), frame->frameSize());
+        available -= frame->frameSize();
+        frame->release();
+
+        if (!result)
+        {
+            trace("WebSocketSendQueue::flush: this=%p, failed sending frame, queued[%d]\n", this, m_count);
+            return false;
+        }
+        m_stats.sent++;
+    }
+
+    return true;
+}
+
+bool WebSocketSendQueue::sendFragment(WebSocketInterface *callback, size_t& available)
+{
+    // largest header of a fragment with up to 0xffff payload bytes
+    const size_t FRAGMENT_HEADER_SIZE = 4;
+
+    WebSocketFrameBuffer *frame = at(0);
+    size_t left = frame->payloadSize() - m_headSent;
+    if (available <= FRAGMENT_HEADER_SIZE)
+    {
+        return true;
+    }
+
+    size_t len = std::min(std::min(left, available - FRAGMENT_HEADER_SIZE), (size_t)0xffff);
+    bool last = (len == left);
+
+    // first fragment carries the operation, the rest are continuation frames, FIN only on the last one
+    uint8_t header[WEBSOCKET_FRAME_HEADROOM];
+    uint16_t headerSize = WebSocketHandler::writeHeader(header, (m_headSent == 0) ? frame->operation() : WebSocketOperation::CONTINUATION_FRAME, len, NULL);
+    if (!last)
+    {
+        header[0] &= 0x7f;
+    }
+
+    if (!callback->onWebsocketEncodedData(header, headerSize) || !callback->onWebsocketEncodedData(frame->payload() + m_headSent, len))
+    {
+        trace("WebSocketSendQueue::sendFragment: this=%p, failed sending fragment, sent[%d] len[%d]\n", this, m_headSent, len);
+        return false;
+    }
+
+    available -= headerSize + len;
+    m_headSent += len;
+    m_stats.fragments++;
+
+    if (last)
+    {
+        popFront();
+        m_stats.sent++;
+    }
+    return true;
+}
+
+void WebSocketSendQueue::clear()
+{
+    while (!empty())
+    {
+        popFront();
+    }
+}
+
+void WebSocketSendQueue::popFront()
+{
+    WebSocketFrameBuffer *frame = at(0);
+    m_head = (m_head + 1) % WEBSOCKET_SEND_QUEUE_SIZE;
+    --m_count;
+    m_bytes -= frame->frameSize();
+    m_headSent = 0;
+    frame->release();
+}
+
+void WebSocketSendQueue::removeSecond()
+{
+    WebSocketFrameBuffer *frame = at(1);
+    for (uint16_t i=1;i+1<m_count;++i)
+    {
+        at(i) = at(i+1);
+    }
+    --m_count;
+    m_bytes -= frame->frameSize();
+    frame->release();
+}
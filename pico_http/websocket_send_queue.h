@@ -0,0 +1,111 @@
+/* MIT License
+
+Copyright (c) 2024 Adrian Cruceru - https://github.com/AdrianCX/pico_https
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef WEBSOCKET_SEND_QUEUE_H
+#define WEBSOCKET_SEND_QUEUE_H
+
+#ifdef __TARGET_CPU_CORTEX_M0PLUS
+#include "pico/stdlib.h"
+#else
+#include "stdlib.h"
+#include <cstdint>
+#endif
+
+#include "websocket_handler.h"
+#include "websocket_broadcast.h"
+
+#ifndef WEBSOCKET_SEND_QUEUE_SIZE
+#define WEBSOCKET_SEND_QUEUE_SIZE 8
+#endif
+
+enum WebSocketQueuePolicy
+{
+    DROP_OLDEST,      // full queue discards the oldest frame that was not sent yet
+    DROP_NEWEST,      // full queue rejects the new frame
+    COALESCE_LATEST,  // full queue replaces the newest frame, only the latest state matters
+};
+
+struct WebSocketQueueStats
+{
+    uint32_t queued;
+    uint32_t sent;
+    uint32_t dropped;
+    uint32_t coalesced;
+    uint32_t fragments;
+    uint16_t high_water;
+};
+
+///
+/// Bounded queue of encoded frames waiting for room in the send buffer.
+/// Frames are sent whole, a frame larger then the available space waits for acknowledgements.
+/// A frame that does not fit even the drained send buffer is sent as a fragmented message,
+/// fragments are whole frames so control frames may still go out between them.
+///
+class WebSocketSendQueue
+{
+public:
+    WebSocketSendQueue(WebSocketQueuePolicy policy = WebSocketQueuePolicy::DROP_OLDEST) : m_policy(policy) {}
+    ~WebSocketSendQueue() { clear(); }
+
+    void setPolicy(WebSocketQueuePolicy policy) { m_policy = policy; }
+
+    ///
+    /// Queue a frame, a reference is held until it is sent or dropped.
+    ///
+    /// @returns - false - frame was dropped by the DROP_NEWEST policy.
+    ///
+    bool push(WebSocketFrameBuffer *frame);
+
+    ///
+    /// Send queued frames in order while they fit in available bytes.
+    ///
+    /// @param drained - nothing is waiting for acknowledgement, available is all the send buffer will ever have.
+    ///
+    /// @returns - false - callback failed, connection must be closed.
+    ///
+    bool flush(WebSocketInterface *callback, size_t available, bool drained = false);
+
+    void clear();
+
+    bool empty() { return m_count == 0; }
+    bool full() { return m_count == WEBSOCKET_SEND_QUEUE_SIZE; }
+    uint16_t size() { return m_count; }
+    size_t queuedBytes() { return m_bytes; }
+
+    const WebSocketQueueStats& get_stats() { return m_stats; }
+
+private:
+    WebSocketFrameBuffer *& at(uint16_t index) { return m_frames[(m_head + index) % WEBSOCKET_SEND_QUEUE_SIZE]; }
+    void popFront();
+    void removeSecond();
+    bool sendFragment(WebSocketInterface *callback, size_t& available);
+
+    WebSocketQueuePolicy m_policy;
+    uint16_t m_head = 0;
+    uint16_t m_count = 0;
+    size_t m_bytes = 0;
+    size_t m_headSent = 0;
+    WebSocketFrameBuffer *m_frames[WEBSOCKET_SEND_QUEUE_SIZE];
+    WebSocketQueueStats m_stats = {};
+};
+
+#endif
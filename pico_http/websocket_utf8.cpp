@@ -0,0 +1,120 @@
+/* MIT License
+
+Copyright (c) 2024 Adrian Cruceru - https://github.com/AdrianCX/pico_https
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include <string.h>
+
+#include "websocket_utf8.h"
+
+bool WebSocketUtf8Validator::feed(const uint8_t *data, size_t len)
+{
+    typedef uintptr_t __attribute__((__may_alias__)) word_t;
+
+    // 0x8080...80 for any word size
+    const word_t HIGH_BITS = ((word_t)-1 / 0xff) * 0x80;
+
+    const uint8_t *end = data + len;
+    while (data < end)
+    {
+        if (m_remaining == 0)
+        {
+            // ASCII fast path, a word at a time once aligned
+            while ((data < end) && (*data < 0x80) && (((uintptr_t)data & (sizeof(word_t)-1)) != 0))
+            {
+                ++data;
+            }
+
+            while (((size_t)(end - data) >= sizeof(word_t)) && ((*(const word_t *)data & HIGH_BITS) == 0))
+            {
+                data += sizeof(word_t);
+            }
+
+            while ((data < end) && (*data < 0x80))
+            {
+                ++data;
+            }
+
+            if (data == end)
+            {
+                return true;
+            }
+
+            // lead byte, ranges from Unicode table 3-7
+            uint8_t lead = *data++;
+            m_lower = 0x80;
+            m_upper = 0xBF;
+
+            if ((lead >= 0xC2) && (lead <= 0xDF))
+            {
+                m_remaining = 1;
+            }
+            else if ((lead >= 0xE0) && (lead <= 0xEF))
+            {
+                m_remaining = 2;
+                if (lead == 0xE0)
+                {
+                    m_lower = 0xA0;
+                }
+                else if (lead == 0xED)
+                {
+                    m_upper = 0x9F;
+                }
+            }
+            else if ((lead >= 0xF0) && (lead <= 0xF4))
+            {
+                m_remaining = 3;
+                if (lead == 0xF0)
+                {
+                    m_lower = 0x90;
+                }
+                else if (lead == 0xF4)
+                {
+                    m_upper = 0x8F;
+                }
+            }
+            else
+            {
+                return false;
+            }
+        }
+        else
+        {
+            uint8_t value = *data++;
+            if ((value < m_lower) || (value > m_upper))
+            {
+                return false;
+            }
+
+            // only the first continuation byte has a narrowed range
+            m_lower = 0x80;
+            m_upper = 0xBF;
+            --m_remaining;
+        }
+    }
+
+    return true;
+}
+
+bool WebSocketUtf8Validator::validate(const uint8_t *data, size_t len)
+{
+    WebSocketUtf8Validator validator;
+    return validator.feed(data, len) && validator.complete();
+}
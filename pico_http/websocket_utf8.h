@@ -0,0 +1,61 @@
+/* MIT License
+
+Copyright (c) 2024 Adrian Cruceru - https://github.com/AdrianCX/pico_https
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef WEBSOCKET_UTF8_H
+#define WEBSOCKET_UTF8_H
+
+#ifdef __TARGET_CPU_CORTEX_M0PLUS
+#include "pico/stdlib.h"
+#else
+#include "stdlib.h"
+#include <cstdint>
+#endif
+
+///
+/// Incremental UTF-8 validator (RFC 3629), input can be split at any byte, including inside a sequence.
+/// Rejects overlong encodings, surrogates and code points above U+10FFFF.
+///
+class WebSocketUtf8Validator
+{
+public:
+    void reset() { m_remaining = 0; m_lower = 0x80; m_upper = 0xBF; }
+
+    ///
+    /// @returns - false - data is not valid UTF-8, validator must be reset before reuse.
+    ///
+    bool feed(const uint8_t *data, size_t len);
+
+    ///
+    /// @returns - true - no multi-byte sequence is left unfinished.
+    ///
+    bool complete() { return m_remaining == 0; }
+
+    static bool validate(const uint8_t *data, size_t len);
+
+private:
+    // continuation bytes still expected and the valid range for the next one
+    uint8_t m_remaining = 0;
+    uint8_t m_lower = 0x80;
+    uint8_t m_upper = 0xBF;
+};
+
+#endif
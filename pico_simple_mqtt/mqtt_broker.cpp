@@ -0,0 +1,744 @@
+/* MIT License
+
+Copyright (c) 2024 Adrian Cruceru - https://github.com/AdrianCX/pico_https
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include <algorithm>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include "stdlib.h"
+#include <cstdint>
+#else
+#include "pico/stdlib.h"
+#include "session.h"
+#include "listener.h"
+#include "tls_listener.h"
+#endif
+
+#include "mqtt_broker.h"
+
+extern "C" void trace(const char *parameters, ...);
+extern "C" const char *safestr(const char *value);
+
+#if !(defined(__x86_64__) || defined(_M_X64))
+MQTTBroker *MQTTBroker::s_instance = NULL;
+#endif
+
+MQTTBroker::MQTTBroker()
+{
+    for (uint8_t i=0;i<MQTT_BROKER_MAX_CLIENTS;++i)
+    {
+        m_clients[i].broker = this;
+        m_clients[i].index = i;
+    }
+}
+
+MQTTBroker::~MQTTBroker()
+{
+    for (uint8_t i=0;i<MQTT_BROKER_MAX_CLIENTS;++i)
+    {
+        if (m_clients[i].used && m_clients[i].owns_session)
+        {
+            delete m_clients[i].session;
+        }
+    }
+}
+
+#if !(defined(__x86_64__) || defined(_M_X64))
+bool MQTTBroker::listen(uint16_t port, bool tls)
+{
+    s_instance = this;
+
+    // listeners live for the whole runtime
+    int err = tls ? (new TLSListener())->listen(port, &MQTTBroker::session_factory) : (new Listener())->listen(port, &MQTTBroker::session_factory);
+    if (err != 0)
+    {
+        trace("MQTTBroker::listen: port[%d] tls[%d] failed, err[%d].", port, tls, err);
+        return false;
+    }
+    return true;
+}
+
+void MQTTBroker::session_factory(void *arg, bool tls)
+{
+    Session *session = new Session(arg, tls);
+
+    Client *client = (s_instance != NULL) ? s_instance->take(session) : NULL;
+    if (client == NULL)
+    {
+        delete session;
+        return;
+    }
+
+    client->owns_session = true;
+    session->set_callback(&client->handler);
+}
+#endif
+
+ISessionCallback *MQTTBroker::accept(ISessionSender *session)
+{
+    Client *client = take(session);
+    return (client != NULL) ? &client->handler : NULL;
+}
+
+MQTTBroker::Client *MQTTBroker::take(ISessionSender *session)
+{
+    for (uint8_t i=0;i<MQTT_BROKER_MAX_CLIENTS;++i)
+    {
+        Client& client = m_clients[i];
+        if (client.used)
+        {
+            continue;
+        }
+
+        client.used = true;
+        client.connected = false;
+        client.disconnecting = false;
+        client.owns_session = false;
+        client.session = session;
+        client.accept_us = m_nowUs;
+        client.keepalive_seconds = 0;
+        client.client_id_length = 0;
+        client.new_filters = 0;
+        client.dropping = false;
+        client.has_will = false;
+
+        client.handler.set_server_mode(true);
+        client.handler.set_upstream(&client);
+        client.handler.set_downstream(session);
+        client.handler.set_debug(m_debug);
+
+        // only clean sessions, nothing of the previous client in this slot carries over
+        client.handler.clear_session();
+
+        if (m_debug)
+        {
+            trace("MQTTBroker::take: this=%p, client[%d] session=%p", this, i, session);
+        }
+        return &client;
+    }
+
+    trace("MQTTBroker::take: all client slots[%d] taken, refusing connection.", MQTT_BROKER_MAX_CLIENTS);
+    m_stats.refused++;
+    return NULL;
+}
+
+void MQTTBroker::close(Client& client)
+{
+    // released from on_closed
+    client.session->close();
+}
+
+void MQTTBroker::release(Client& client)
+{
+    if (!client.used)
+    {
+        return;
+    }
+
+    bool was_connected = client.connected;
+    client.connected = false;
+
+    trace("MQTTBroker::release: client[%d] id[%s] connected[%d] disconnecting[%d]", client.index, client.client_id_length ? client.client_id : "", was_connected, client.disconnecting);
+
+    uint32_t bit = 1u << client.index;
+    for (uint8_t i=0;i<MQTT_BROKER_MAX_FILTERS;++i)
+    {
+        if (m_filters[i].used && (m_filters[i].clients & bit))
+        {
+            m_filters[i].clients &= ~bit;
+            release_filter(m_filters[i]);
+        }
+    }
+
+    if (was_connected)
+    {
+        m_stats.disconnects++;
+
+        // a DISCONNECT discards the will
+        if (client.has_will && !client.disconnecting)
+        {
+            m_stats.wills_sent++;
+            route(client.will_topic, strlen(client.will_topic), client.will_message, client.will_length, (client.will_flags & (MQTTQOS1 | MQTTQOS2)) >> 1, (client.will_flags & MQTTRETAIN) != 0);
+        }
+    }
+
+    client.handler.clear_session();
+
+    if (client.owns_session)
+    {
+        delete client.session;
+    }
+
+    client.session = NULL;
+    client.used = false;
+}
+
+void MQTTBroker::update(uint64_t now_us)
+{
+    m_nowUs = now_us;
+
+    for (uint8_t i=0;i<MQTT_BROKER_MAX_CLIENTS;++i)
+    {
+        Client& client = m_clients[i];
+        if (!client.used)
+        {
+            continue;
+        }
+
+        // sends batched publishes
+        if (!client.handler.update(now_us))
+        {
+            close(client);
+            continue;
+        }
+
+        if (!client.connected)
+        {
+            if (now_us - client.accept_us > (uint64_t)MQTT_BROKER_CONNECT_TIMEOUT_MS * 1000)
+            {
+                trace("MQTTBroker::update: client[%d] sent no CONNECT, closing.", i);
+                close(client);
+            }
+            continue;
+        }
+
+        // a client must send something within one and a half keepalive periods
+        uint64_t last_us = std::max(client.handler.get_last_recv_us(), client.accept_us);
+        if ((client.keepalive_seconds > 0) && (now_us > last_us) && (now_us - last_us > (uint64_t)client.keepalive_seconds * 1500000))
+        {
+            trace("MQTTBroker::update: client[%d] id[%s] keepalive[%d] expired, closing.", i, client.client_id, client.keepalive_seconds);
+            m_stats.keepalive_timeouts++;
+            close(client);
+        }
+    }
+}
+
+uint8_t MQTTBroker::get_client_count()
+{
+    uint8_t count = 0;
+    for (uint8_t i=0;i<MQTT_BROKER_MAX_CLIENTS;++i)
+    {
+        count += m_clients[i].connected ? 1 : 0;
+    }
+    return count;
+}
+
+uint8_t MQTTBroker::get_retained_count()
+{
+    return m_retainedCount;
+}
+
+bool MQTTBroker::subscribe(const char *filter, MQTTSubscriptionInterface *handler)
+{
+    int index = add_filter(filter);
+    if (index < 0)
+    {
+        return false;
+    }
+
+    m_filters[index].local = handler;
+    send_retained(m_filters[index]);
+    return true;
+}
+
+bool MQTTBroker::unsubscribe(const char *filter)
+{
+    int index = find_filter(filter);
+    if ((index < 0) || (m_filters[index].local == NULL))
+    {
+        trace("MQTTBroker::unsubscribe: filter[%s] not found", safestr(filter));
+        return false;
+    }
+
+    m_filters[index].local = NULL;
+    release_filter(m_filters[index]);
+    return true;
+}
+
+bool MQTTBroker::publish(const char *topic, const uint8_t *data, uint16_t len, uint8_t qos, bool retain)
+{
+    uint16_t topic_length = (topic != NULL) ? strlen(topic) : 0;
+
+    if ((topic_length == 0) || (topic_length > MQTT_BROKER_TOPIC_SIZE) || (len > MQTT_BROKER_MESSAGE_SIZE) || (strpbrk(topic, "+#") != NULL))
+    {
+        trace("MQTTBroker::publish: invalid topic[%s] or message too large, len[%d] max[%d].", safestr(topic), len, MQTT_BROKER_MESSAGE_SIZE);
+        return false;
+    }
+
+    route(topic, topic_length, data, len, qos, retain);
+    return true;
+}
+
+void MQTTBroker::route(const char *topic, uint16_t topic_length, const uint8_t *data, uint16_t len, uint8_t qos, bool retain)
+{
+    if (m_debug)
+    {
+        trace("MQTTBroker::route: this=%p, topic[%s] len[%d] qos[%d] retain[%d]", this, topic, len, qos, retain);
+    }
+
+    if (retain)
+    {
+        store_retained(topic, topic_length, data, len, qos);
+    }
+
+    // every filter may match the topic
+    MQTTSubscriptionInterface *matches[MQTT_BROKER_MAX_FILTERS];
+    uint8_t count = m_subscriptions.match((const uint8_t *)topic, topic_length, matches, MQTT_BROKER_MAX_FILTERS);
+
+    // overlapping filters of a client deliver once, at the highest QoS granted
+    int8_t client_qos[MQTT_BROKER_MAX_CLIENTS];
+    memset(client_qos, -1, sizeof(client_qos));
+
+    MQTTSubscriptionInterface *delivered[MQTT_BROKER_MAX_FILTERS];
+    uint8_t delivered_count = 0;
+
+    for (uint8_t i=0;i<count;++i)
+    {
+        Filter *entry = static_cast<Filter*>(matches[i]);
+
+        for (uint8_t c=0;c<MQTT_BROKER_MAX_CLIENTS;++c)
+        {
+            if (entry->clients & (1u << c))
+            {
+                client_qos[c] = std::max<int8_t>(client_qos[c], entry->qos[c]);
+            }
+        }
+
+        if ((entry->local != NULL) && (std::find(delivered, delivered + delivered_count, entry->local) == delivered + delivered_count))
+        {
+            delivered[delivered_count++] = entry->local;
+            entry->local->on_publish_header((uint8_t *)topic, topic_length, 0, len);
+            entry->local->on_publish_data((uint8_t *)data, len, true);
+        }
+    }
+
+    for (uint8_t c=0;c<MQTT_BROKER_MAX_CLIENTS;++c)
+    {
+        if ((client_qos[c] >= 0) && m_clients[c].connected)
+        {
+            send_publish(m_clients[c], topic, data, len, std::min<uint8_t>(qos, client_qos[c]), false);
+        }
+    }
+}
+
+bool MQTTBroker::send_publish(Client& client, const char *topic, const uint8_t *data, uint16_t len, uint8_t qos, bool retain)
+{
+    // batched, sent by update() or once the batch is full
+    if (!client.handler.queue_publish(topic, data, len, qos, retain))
+    {
+        trace("MQTTBroker::send_publish: client[%d] topic[%s] dropped, in-flight window full.", client.index, topic);
+        m_stats.publishes_dropped++;
+        return false;
+    }
+
+    m_stats.publishes_sent++;
+    return true;
+}
+
+void MQTTBroker::store_retained(const char *topic, uint16_t topic_length, const uint8_t *data, uint16_t len, uint8_t qos)
+{
+    int index = -1;
+    for (uint8_t i=0;i<m_retainedCount;++i)
+    {
+        if ((m_retained[i].topic_length == topic_length) && (memcmp(m_retained[i].topic, topic, topic_length) == 0))
+        {
+            index = i;
+            break;
+        }
+    }
+
+    // an empty retained message clears the topic
+    bool fits = (topic_length <= MQTT_BROKER_RETAINED_TOPIC_SIZE) && (len <= MQTT_BROKER_RETAINED_DATA_SIZE) && ((index >= 0) || (m_retainedCount < MQTT_BROKER_RETAINED));
+    if ((len == 0) || !fits)
+    {
+        if (len > 0)
+        {
+            trace("MQTTBroker::store_retained: topic[%s] len[%d] does not fit the retained table, count[%d].", topic, len, m_retainedCount);
+            m_stats.retained_dropped++;
+        }
+
+        // new subscribers would get an outdated value otherwise
+        if (index >= 0)
+        {
+            m_retained[index] = m_retained[--m_retainedCount];
+        }
+        return;
+    }
+
+    Retained& entry = m_retained[(index >= 0) ? index : m_retainedCount++];
+    entry.qos = qos;
+    entry.topic_length = topic_length;
+    entry.length = len;
+    memcpy(entry.topic, topic, topic_length);
+    entry.topic[topic_length] = '\0';
+    memcpy(entry.data, data, len);
+}
+
+void MQTTBroker::send_retained(Client& client)
+{
+    for (uint8_t r=0;r<m_retainedCount;++r)
+    {
+        Retained& entry = m_retained[r];
+
+        // once per message even if several new filters match it
+        int qos = -1;
+        for (uint8_t i=0;i<MQTT_BROKER_MAX_FILTERS;++i)
+        {
+            if ((client.new_filters & (1u << i)) && m_filters[i].used && topic_matches(m_filters[i].filter, entry.topic, entry.topic_length))
+            {
+                qos = std::max<int>(qos, m_filters[i].qos[client.index]);
+            }
+        }
+
+        if (qos >= 0)
+        {
+            send_publish(client, entry.topic, entry.data, entry.length, std::min<int>(qos, entry.qos), true);
+        }
+    }
+}
+
+void MQTTBroker::send_retained(Filter& entry)
+{
+    for (uint8_t r=0;r<m_retainedCount;++r)
+    {
+        Retained& retained = m_retained[r];
+        if (topic_matches(entry.filter, retained.topic, retained.topic_length))
+        {
+            entry.local->on_publish_header((uint8_t *)retained.topic, retained.topic_length, 0, retained.length);
+            entry.local->on_publish_data(retained.data, retained.length, true);
+        }
+    }
+}
+
+int MQTTBroker::find_filter(const char *filter)
+{
+    for (uint8_t i=0;i<MQTT_BROKER_MAX_FILTERS;++i)
+    {
+        if (m_filters[i].used && (strcmp(m_filters[i].filter, filter) == 0))
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int MQTTBroker::add_filter(const char *filter)
+{
+    int index = find_filter(filter);
+    if (index >= 0)
+    {
+        return index;
+    }
+
+    if (strlen(filter) > MQTT_BROKER_FILTER_SIZE)
+    {
+        trace("MQTTBroker::add_filter: filter[%s] longer then max[%d].", filter, MQTT_BROKER_FILTER_SIZE);
+        return -1;
+    }
+
+    for (uint8_t i=0;i<MQTT_BROKER_MAX_FILTERS;++i)
+    {
+        Filter& entry = m_filters[i];
+        if (entry.used)
+        {
+            continue;
+        }
+
+        // validates the filter as well
+        if (!m_subscriptions.add(filter, &entry))
+        {
+            return -1;
+        }
+
+        entry.used = true;
+        entry.clients = 0;
+        entry.local = NULL;
+        strcpy(entry.filter, filter);
+        return i;
+    }
+
+    trace("MQTTBroker::add_filter: filter table full, max[%d], filter[%s] refused.", MQTT_BROKER_MAX_FILTERS, filter);
+    return -1;
+}
+
+bool MQTTBroker::remove_filter(const char *filter, uint8_t client)
+{
+    int index = find_filter(filter);
+    if ((index < 0) || !(m_filters[index].clients & (1u << client)))
+    {
+        return false;
+    }
+
+    m_filters[index].clients &= ~(1u << client);
+    release_filter(m_filters[index]);
+    return true;
+}
+
+void MQTTBroker::release_filter(Filter& entry)
+{
+    if ((entry.clients != 0) || (entry.local != NULL))
+    {
+        return;
+    }
+
+    m_subscriptions.remove(entry.filter);
+    entry.used = false;
+}
+
+bool MQTTBroker::topic_matches(const char *filter, const char *topic, uint16_t topic_length)
+{
+    if ((topic_length > 0) && (topic[0] == '$') && ((filter[0] == '+') || (filter[0] == '#')))
+    {
+        return false;
+    }
+
+    uint16_t pos = 0;
+    for (const char *f = filter; *f != '\0';)
+    {
+        // "a/#" matches "a" as well
+        if ((*f == '#') || ((pos == topic_length) && (f[0] == '/') && (f[1] == '#')))
+        {
+            return true;
+        }
+
+        if (*f == '+')
+        {
+            while ((pos < topic_length) && (topic[pos] != '/'))
+            {
+                ++pos;
+            }
+        }
+        else if ((pos >= topic_length) || (topic[pos++] != *f))
+        {
+            return false;
+        }
+        ++f;
+    }
+
+    return pos == topic_length;
+}
+
+bool MQTTBroker::Client::on_connect(const MQTTConnectInfo& info)
+{
+    if (connected)
+    {
+        trace("MQTTBroker::Client::on_connect: client[%d] sent a second CONNECT, closing.", index);
+        return false;
+    }
+
+    conn_ack_code_t code = CONNECTION_ACCEPTED;
+    if (info.protocol_level != MQTT_PROTOCOL_V311)
+    {
+        code = UNACCEPTABLE_PROTOCOL;
+    }
+    else if ((info.client_id_length > MQTT_BROKER_CLIENT_ID_SIZE) || ((info.client_id_length == 0) && !(info.flags & MQTT_CONNECT_CLEAN_SESSION)))
+    {
+        code = IDENTIFIER_REJECTED;
+    }
+    else if ((info.flags & MQTT_CONNECT_WILL) && ((info.will_topic_length == 0) || (info.will_topic_length > MQTT_BROKER_WILL_SIZE) || (info.will_message_length > MQTT_BROKER_WILL_SIZE)))
+    {
+        code = SERVER_UNAVAILABLE;
+    }
+
+    if (code != CONNECTION_ACCEPTED)
+    {
+        trace("MQTTBroker::Client::on_connect: client[%d] refused, protocol_level[%d] client_id_length[%d] code[%d].", index, info.protocol_level, info.client_id_length, code);
+        broker->m_stats.refused++;
+        handler.send_conn_ack(false, code);
+        return false;
+    }
+
+    memcpy(client_id, info.client_id, info.client_id_length);
+    client_id[info.client_id_length] = '\0';
+    client_id_length = info.client_id_length;
+
+    // a new connection with the same client id takes over
+    for (uint8_t i=0;i<MQTT_BROKER_MAX_CLIENTS;++i)
+    {
+        Client& other = broker->m_clients[i];
+        if ((i != index) && other.connected && (client_id_length > 0) && (other.client_id_length == client_id_length) && (memcmp(other.client_id, client_id, client_id_length) == 0))
+        {
+            trace("MQTTBroker::Client::on_connect: client id[%s] connected again, closing client[%d].", client_id, i);
+            broker->close(other);
+        }
+    }
+
+    keepalive_seconds = info.keepalive_seconds;
+
+    has_will = (info.flags & MQTT_CONNECT_WILL) != 0;
+    if (has_will)
+    {
+        memcpy(will_topic, info.will_topic, info.will_topic_length);
+        will_topic[info.will_topic_length] = '\0';
+        memcpy(will_message, info.will_message, info.will_message_length);
+        will_length = info.will_message_length;
+        will_flags = (MQTT_CONNECT_WILL_QOS(info.flags) << 1) | ((info.flags & MQTT_CONNECT_WILL_RETAIN) ? MQTTRETAIN : 0);
+    }
+
+    trace("MQTTBroker::Client::on_connect: client[%d] id[%s] keepalive[%d] will[%d]", index, client_id, keepalive_seconds, has_will);
+
+    connected = true;
+    broker->m_stats.connections++;
+
+    // sessions are never kept
+    return handler.send_conn_ack(false, CONNECTION_ACCEPTED);
+}
+
+uint8_t MQTTBroker::Client::on_subscribe(uint16_t message_id, const uint8_t *filter, uint16_t filter_length, uint8_t qos)
+{
+    if (!connected || (filter_length > MQTT_BROKER_FILTER_SIZE) || (memchr(filter, '\0', filter_length) != NULL))
+    {
+        return MQTT_RC_UNSPECIFIED_ERROR;
+    }
+
+    char buffer[MQTT_BROKER_FILTER_SIZE + 1];
+    memcpy(buffer, filter, filter_length);
+    buffer[filter_length] = '\0';
+
+    int filter_index = broker->add_filter(buffer);
+    if (filter_index < 0)
+    {
+        return MQTT_RC_UNSPECIFIED_ERROR;
+    }
+
+    // QoS 2 is not implemented for delivery, granted as QoS 1
+    uint8_t granted = std::min<uint8_t>(qos, 1);
+
+    Filter& entry = broker->m_filters[filter_index];
+    entry.clients |= 1u << index;
+    entry.qos[index] = granted;
+    new_filters |= 1u << filter_index;
+
+    if (broker->m_debug)
+    {
+        trace("MQTTBroker::Client::on_subscribe: client[%d] filter[%s] granted[%d]", index, buffer, granted);
+    }
+    return granted;
+}
+
+bool MQTTBroker::Client::on_subscribed(uint16_t message_id)
+{
+    if (!connected)
+    {
+        trace("MQTTBroker::Client::on_subscribed: client[%d] subscribed before CONNECT, closing.", index);
+        return false;
+    }
+
+    broker->send_retained(*this);
+    new_filters = 0;
+    return true;
+}
+
+bool MQTTBroker::Client::on_unsubscribe(uint16_t message_id, const uint8_t *filter, uint16_t filter_length)
+{
+    if (!connected)
+    {
+        trace("MQTTBroker::Client::on_unsubscribe: client[%d] unsubscribed before CONNECT, closing.", index);
+        return false;
+    }
+
+    // longer filters were never subscribed, UNSUBACK is sent regardless
+    if (filter_length <= MQTT_BROKER_FILTER_SIZE)
+    {
+        char buffer[MQTT_BROKER_FILTER_SIZE + 1];
+        memcpy(buffer, filter, filter_length);
+        buffer[filter_length] = '\0';
+        broker->remove_filter(buffer, index);
+    }
+    return true;
+}
+
+bool MQTTBroker::Client::on_reason_code(uint8_t message_type, uint16_t message_id, mqtt_reason_code_t reason_code)
+{
+    if (message_type == MQTTDISCONNECT)
+    {
+        disconnecting = true;
+    }
+    return true;
+}
+
+bool MQTTBroker::Client::on_publish_header(uint8_t *topic, uint16_t topic_length, uint16_t message_id, uint32_t message_length)
+{
+    flags = handler.get_publish_flags();
+    received = 0;
+
+    // nothing of a refused publish is routed, even if more data arrives before the close
+    if (!connected)
+    {
+        trace("MQTTBroker::Client::on_publish_header: client[%d] published before CONNECT, closing.", index);
+        dropping = true;
+        return false;
+    }
+
+    // topics too long for the receive buffer arrive with topic NULL
+    dropping = (topic == NULL) || (topic_length > MQTT_BROKER_TOPIC_SIZE) || (message_length > MQTT_BROKER_MESSAGE_SIZE);
+    if (dropping)
+    {
+        trace("MQTTBroker::Client::on_publish_header: client[%d] topic_length[%d] message_length[%d] too large, dropped.", index, topic_length, message_length);
+        broker->m_stats.publishes_dropped++;
+        return true;
+    }
+
+    if ((topic_length == 0) || (memchr(topic, '+', topic_length) != NULL) || (memchr(topic, '#', topic_length) != NULL) || (memchr(topic, '\0', topic_length) != NULL))
+    {
+        trace("MQTTBroker::Client::on_publish_header: client[%d] invalid topic name, closing.", index);
+        dropping = true;
+        return false;
+    }
+
+    memcpy(this->topic, topic, topic_length);
+    this->topic[topic_length] = '\0';
+    this->topic_length = topic_length;
+    return true;
+}
+
+bool MQTTBroker::Client::on_publish_data(uint8_t *data, uint32_t len, bool last_chunk)
+{
+    if (dropping)
+    {
+        dropping = !last_chunk;
+        return true;
+    }
+
+    if (received + len > MQTT_BROKER_MESSAGE_SIZE)
+    {
+        return false;
+    }
+
+    if (len > 0)
+    {
+        memcpy(&message[received], data, len);
+        received += len;
+    }
+
+    if (last_chunk)
+    {
+        broker->m_stats.publishes_received++;
+        broker->route(topic, topic_length, message, received, (flags & (MQTTQOS1 | MQTTQOS2)) >> 1, (flags & MQTTRETAIN) != 0);
+    }
+    return true;
+}
+
+void MQTTBroker::Client::on_closed()
+{
+    broker->release(*this);
+}
@@ -0,0 +1,261 @@
+/* MIT License
+
+Copyright (c) 2024 Adrian Cruceru - https://github.com/AdrianCX/pico_https
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#ifdef __TARGET_CPU_CORTEX_M0PLUS
+#include "pico/stdlib.h"
+#else
+#include "stdlib.h"
+#include <cstdint>
+#endif
+
+#include "mqtt_handler.h"
+#include "mqtt_subscriptions.h"
+
+// Connected clients at once, further connections are closed right away.
+#ifndef MQTT_BROKER_MAX_CLIENTS
+#define MQTT_BROKER_MAX_CLIENTS 4
+#endif
+
+// Distinct filters over all clients and local handlers, a filter subscribed by several clients takes one entry.
+#ifndef MQTT_BROKER_MAX_FILTERS
+#define MQTT_BROKER_MAX_FILTERS 32
+#endif
+
+#ifndef MQTT_BROKER_FILTER_SIZE
+#define MQTT_BROKER_FILTER_SIZE 64
+#endif
+
+// Publishes are received whole before fan-out, larger topics or messages are dropped.
+#ifndef MQTT_BROKER_TOPIC_SIZE
+#define MQTT_BROKER_TOPIC_SIZE 128
+#endif
+
+#ifndef MQTT_BROKER_MESSAGE_SIZE
+#define MQTT_BROKER_MESSAGE_SIZE 256
+#endif
+
+// Retained messages table, an entry per topic. Messages that do not fit an entry are forwarded but not retained.
+#ifndef MQTT_BROKER_RETAINED
+#define MQTT_BROKER_RETAINED 16
+#endif
+
+#ifndef MQTT_BROKER_RETAINED_TOPIC_SIZE
+#define MQTT_BROKER_RETAINED_TOPIC_SIZE 64
+#endif
+
+#ifndef MQTT_BROKER_RETAINED_DATA_SIZE
+#define MQTT_BROKER_RETAINED_DATA_SIZE 64
+#endif
+
+// Will topic and message of each client, connections with larger wills are refused.
+#ifndef MQTT_BROKER_WILL_SIZE
+#define MQTT_BROKER_WILL_SIZE 64
+#endif
+
+#ifndef MQTT_BROKER_CLIENT_ID_SIZE
+#define MQTT_BROKER_CLIENT_ID_SIZE 32
+#endif
+
+// Connections without CONNECT after this long are closed.
+#ifndef MQTT_BROKER_CONNECT_TIMEOUT_MS
+#define MQTT_BROKER_CONNECT_TIMEOUT_MS 10000
+#endif
+
+static_assert(MQTT_BROKER_MAX_CLIENTS <= 32, "MQTT_BROKER_MAX_CLIENTS must fit the client mask of a filter");
+static_assert(MQTT_BROKER_MAX_FILTERS <= 32, "MQTT_BROKER_MAX_FILTERS must fit the new filter mask of a client");
+static_assert(MQTT_BROKER_TOPIC_SIZE + MQTT_BROKER_MESSAGE_SIZE + MQTT_MAX_HEADER_SIZE + 4 <= MQTT_BATCH_BUFFER_SIZE, "broker publishes must fit the batch buffer of MQTTSocketHandler");
+static_assert(MQTT_BROKER_TOPIC_SIZE < MQTT_BUFFER_SIZE, "broker topics must fit the receive buffer of MQTTSocketHandler");
+
+struct MQTTBrokerStats
+{
+    uint32_t connections;
+    uint32_t refused;
+    uint32_t disconnects;
+    uint32_t keepalive_timeouts;
+    uint32_t publishes_received;
+    uint32_t publishes_sent;
+
+    // too large to receive whole, or the subscriber in-flight window was full
+    uint32_t publishes_dropped;
+    uint32_t retained_dropped;
+    uint32_t wills_sent;
+};
+
+///
+/// Minimal MQTT 3.1.1 broker for a handful of local clients (sensors) and local handlers on the device itself.
+///
+/// Every client connection is an MQTTSocketHandler in server mode. Filters of all clients share one MQTTSubscriptions trie,
+/// each filter entry records which clients subscribed it and with what QoS. Publishes are received whole into the client slot
+/// and fanned out to subscribers with queue_publish at the lower of the publish and granted QoS (QoS 2 is granted as QoS 1),
+/// so a burst of small publishes reaches each subscriber in one write.
+///
+/// Retained messages are kept in a fixed table and sent on SUBSCRIBE. Wills are published when a client is lost without DISCONNECT.
+/// Sessions are always clean: CONNACK never reports a session present and nothing is kept for a client once it disconnects.
+///
+/// Time is taken from update(now_us), call it from the main loop.
+///
+class MQTTBroker
+{
+public:
+    MQTTBroker();
+    ~MQTTBroker();
+
+#if !(defined(__x86_64__) || defined(_M_X64))
+    ///
+    /// Accept connections on port with a Listener (or TLSListener), one broker per device.
+    ///
+    bool listen(uint16_t port, bool tls);
+
+    ///
+    /// session_factory_t for Listener/TLSListener, sessions are handed to the broker set with listen.
+    ///
+    static void session_factory(void *arg, bool tls);
+#endif
+
+    ///
+    /// Take a connected session, its callback must be set to the result. Not owned.
+    ///
+    /// @returns - NULL if all client slots are taken, the session should be closed.
+    ///
+    ISessionCallback *accept(ISessionSender *session);
+
+    ///
+    /// Local handler for publishes of clients and of publish, with the same filter syntax as MQTTSubscriptions.
+    ///
+    bool subscribe(const char *filter, MQTTSubscriptionInterface *handler);
+    bool unsubscribe(const char *filter);
+
+    ///
+    /// Publish from the device itself, to subscribed clients and local handlers.
+    ///
+    bool publish(const char *topic, const uint8_t *data, uint16_t len, uint8_t qos = 0, bool retain = false);
+
+    void update(uint64_t now_us);
+    void set_debug(bool debug) { m_debug = debug; }
+
+    uint8_t get_client_count();
+    uint8_t get_retained_count();
+    const MQTTBrokerStats& get_stats() { return m_stats; }
+
+    ///
+    /// Single filter match with '+' and '#' wildcards, first level wildcards do not match topics starting with '$'.
+    ///
+    static bool topic_matches(const char *filter, const char *topic, uint16_t topic_length);
+
+private:
+    class Client
+        : public MQTTSocketInterface
+    {
+    public:
+        virtual bool on_connect(const MQTTConnectInfo& info) override;
+        virtual uint8_t on_subscribe(uint16_t message_id, const uint8_t *filter, uint16_t filter_length, uint8_t qos) override;
+        virtual bool on_subscribed(uint16_t message_id) override;
+        virtual bool on_unsubscribe(uint16_t message_id, const uint8_t *filter, uint16_t filter_length) override;
+        virtual bool on_reason_code(uint8_t message_type, uint16_t message_id, mqtt_reason_code_t reason_code) override;
+        virtual bool on_publish_header(uint8_t *topic, uint16_t topic_length, uint16_t message_id, uint32_t message_length) override;
+        virtual bool on_publish_data(uint8_t *data, uint32_t len, bool last_chunk) override;
+        virtual void on_closed() override;
+
+        MQTTBroker *broker = NULL;
+        uint8_t index = 0;
+        bool used = false;
+        bool connected = false;
+        bool disconnecting = false;
+        bool owns_session = false;
+        ISessionSender *session = NULL;
+        MQTTSocketHandler handler;
+
+        uint64_t accept_us = 0;
+        uint16_t keepalive_seconds = 0;
+        uint8_t client_id_length = 0;
+        char client_id[MQTT_BROKER_CLIENT_ID_SIZE + 1];
+
+        // filters of the SUBSCRIBE being answered, for retained messages once SUBACK went out
+        uint32_t new_filters = 0;
+
+        // publish being received, dropped when it does not fit
+        bool dropping = false;
+        uint8_t flags = 0;
+        uint16_t topic_length = 0;
+        uint16_t received = 0;
+        char topic[MQTT_BROKER_TOPIC_SIZE + 1];
+        uint8_t message[MQTT_BROKER_MESSAGE_SIZE];
+
+        bool has_will = false;
+        uint8_t will_flags = 0;
+        uint16_t will_length = 0;
+        char will_topic[MQTT_BROKER_WILL_SIZE + 1];
+        uint8_t will_message[MQTT_BROKER_WILL_SIZE];
+    };
+
+    class Filter
+        : public MQTTSubscriptionInterface
+    {
+    public:
+        bool used = false;
+        uint32_t clients = 0;
+        uint8_t qos[MQTT_BROKER_MAX_CLIENTS];
+        MQTTSubscriptionInterface *local = NULL;
+        char filter[MQTT_BROKER_FILTER_SIZE + 1];
+    };
+
+    struct Retained
+    {
+        uint8_t qos;
+        uint16_t topic_length;
+        uint16_t length;
+        char topic[MQTT_BROKER_RETAINED_TOPIC_SIZE + 1];
+        uint8_t data[MQTT_BROKER_RETAINED_DATA_SIZE];
+    };
+
+    Client *take(ISessionSender *session);
+
+    int add_filter(const char *filter);
+    bool remove_filter(const char *filter, uint8_t client);
+    void release_filter(Filter& entry);
+    int find_filter(const char *filter);
+
+    void route(const char *topic, uint16_t topic_length, const uint8_t *data, uint16_t len, uint8_t qos, bool retain);
+    void store_retained(const char *topic, uint16_t topic_length, const uint8_t *data, uint16_t len, uint8_t qos);
+    void send_retained(Client& client);
+    void send_retained(Filter& entry);
+    bool send_publish(Client& client, const char *topic, const uint8_t *data, uint16_t len, uint8_t qos, bool retain);
+
+    void close(Client& client);
+    void release(Client& client);
+
+    bool m_debug = false;
+    uint64_t m_nowUs = 0;
+
+    MQTTSubscriptions m_subscriptions;
+    Filter m_filters[MQTT_BROKER_MAX_FILTERS];
+    Client m_clients[MQTT_BROKER_MAX_CLIENTS];
+
+    uint8_t m_retainedCount = 0;
+    Retained m_retained[MQTT_BROKER_RETAINED];
+
+    MQTTBrokerStats m_stats = {};
+
+    static MQTTBroker *s_instance;
+};
@@ -39,45 +39,109 @@ uint64_t to_us_since_boot (uint64_t t) { return 0; }
 extern "C" void trace(const char *parameters, ...);
 extern "C" const char *safestr(const char *value);
 
-bool MQTTSocketHandler::on_recv(uint8_t *data, size_t len)
+bool MQTTSocketHandlerBase::on_recv(uint8_t *data, size_t len)
 {
-    return decode_data(data, len);
+    m_lastRecvUs = to_us_since_boot(get_absolute_time());
+
+    // acknowledgements for everything decoded go out together
+    return decode_data(data, len) && flush_acks();
 }
 
-bool MQTTSocketHandler::on_sent(uint16_t len)
+bool MQTTSocketHandlerBase::on_sent(uint16_t len)
 {
     return m_upstream->on_sent(len);
 }
 
-void MQTTSocketHandler::on_closed()
+void MQTTSocketHandlerBase::on_closed()
 {
     m_upstream->on_closed();
 }
 
-void MQTTSocketHandler::on_connected()
+void MQTTSocketHandlerBase::on_connected()
 {
     reset();
     m_upstream->on_connected();
 }
 
-void MQTTSocketHandler::reset()
+void MQTTSocketHandlerBase::reset()
 {
+    // a publish cut short by the disconnect can not be resent
+    if ((m_pendingSendDataLen > 0) && (m_inflightCount > 0))
+    {
+        release_publish(m_inflightCount - 1);
+    }
+
+    for (uint8_t i=0;i<m_inflightCount;)
+    {
+        if (!m_inflight[i].retained)
+        {
+            trace("MQTTSocketHandler::reset: message_id[%d] was too large to keep for retransmission, dropped.", m_inflight[i].message_id);
+            release_publish(i);
+            continue;
+        }
+        ++i;
+    }
+
+    // ids of publishes still waiting for PUBACK must stay unique
+    if (m_inflightCount == 0)
+    {
+        m_messageId = 1;
+    }
+
+    // all of the window is resent after the next CONNACK
+    m_inflightHeld = 0;
+
     m_pendingPing = false;
-    m_messageId = 1;
     m_recvBufferIdx = 0;
     m_state = SocketState::WAIT_PACKET;
     m_lastKeepaliveUs = to_us_since_boot(get_absolute_time());
     m_pendingDataLen = 0;
     m_pendingSendDataLen = 0;
+    m_streamTopicLength = 0;
+    m_streamTopicOffset = 0;
+    m_skipDataLen = 0;
+
+    // QoS 2 ids stay until PUBREL, the broker resends it on the new connection
+    m_receiveQos = 0;
+    m_receiveDuplicate = false;
+    m_ackBufferIdx = 0;
+
+    // QoS 1 publishes of a dropped batch are still in the in-flight window and resent after CONNACK
+    m_batchUsed = 0;
+
+    // topic aliases only live as long as the connection, the broker allows them again in CONNACK
+    m_outAliasMax = 0;
+    m_outAliasCount = 0;
+    m_outAliasNext = 0;
+    for (uint8_t i=0;i<MQTT_TOPIC_ALIASES;++i)
+    {
+        m_inAliases[i].length = 0;
+    }
+}
+
+void MQTTSocketHandlerBase::clear_session()
+{
+    m_inflightCount = 0;
+    m_inflightUsed = 0;
+    m_qos2Count = 0;
+
+    // message ids start over with the in-flight window empty
+    reset();
 }
 
-bool MQTTSocketHandler::update(uint64_t now_us)
+bool MQTTSocketHandlerBase::update(uint64_t now_us)
 {
     if (m_downstream && m_downstream->is_connected())
     {
+        if ((m_batchUsed > 0) && (now_us - m_batchStartUs >= m_batchDelayUs) && !flush_publishes())
+        {
+            return false;
+        }
+
         uint32_t seconds = (uint32_t)((now_us - m_lastKeepaliveUs)/1000000LL);
 
-        if (seconds > m_keepaliveSeconds)
+        // clients ping, the server only answers
+        if (!m_serverMode && (seconds > m_keepaliveSeconds))
         {
             m_lastKeepaliveUs = to_us_since_boot(get_absolute_time());
             send_ping();
@@ -88,7 +152,7 @@ bool MQTTSocketHandler::update(uint64_t now_us)
 }
 
 
-bool MQTTSocketHandler::decode_data(uint8_t* data, size_t len)
+bool MQTTSocketHandlerBase::decode_data(uint8_t* data, size_t len)
 {
     while (len > 0)
     {
@@ -105,13 +169,58 @@ bool MQTTSocketHandler::decode_data(uint8_t* data, size_t len)
             case SocketState::WAIT_DATA:
             {
                 uint32_t bytesReceived = len < m_pendingDataLen ? len : m_pendingDataLen;
-                m_upstream->on_publish_data(data, bytesReceived, (bytesReceived == m_pendingDataLen));
+
+                // QoS 2 redelivery of a message already handed upstream
+                if (!m_receiveDuplicate && !m_upstream->on_publish_data(data, bytesReceived, (bytesReceived == m_pendingDataLen)))
+                {
+                    trace("MQTTSocketHandler::decode_data: publish refused upstream, closing.");
+                    return false;
+                }
 
                 data += bytesReceived;
                 len -= bytesReceived;
                 m_pendingDataLen -= bytesReceived;
 
                 if (m_pendingDataLen == 0)
+                {
+                    m_state = SocketState::WAIT_PACKET;
+
+                    if (!finish_publish())
+                    {
+                        return false;
+                    }
+                }
+                break;
+            }
+            case SocketState::WAIT_TOPIC:
+            {
+                uint32_t bytesReceived = std::min((size_t)(m_streamTopicLength - m_streamTopicOffset), len);
+                uint8_t *piece = data;
+
+                data += bytesReceived;
+                len -= bytesReceived;
+
+                if (!stream_topic(piece, bytesReceived))
+                {
+                    return false;
+                }
+
+                // rest of the header, decoded right away in case nothing else follows (empty QoS 0 message)
+                if ((m_state == SocketState::WAIT_PACKET) && !decode_header(data, len))
+                {
+                    return false;
+                }
+                break;
+            }
+            case SocketState::SKIP_DATA:
+            {
+                uint32_t bytesSkipped = len < m_skipDataLen ? len : m_skipDataLen;
+
+                data += bytesSkipped;
+                len -= bytesSkipped;
+                m_skipDataLen -= bytesSkipped;
+
+                if (m_skipDataLen == 0)
                 {
                     m_state = SocketState::WAIT_PACKET;
                 }
@@ -135,11 +244,11 @@ bool MQTTSocketHandler::decode_data(uint8_t* data, size_t len)
 ///
 /// @returns - false if failure.
 ///
-bool MQTTSocketHandler::decode_header(uint8_t*& data, size_t& len)
+bool MQTTSocketHandlerBase::decode_header(uint8_t*& data, size_t& len)
 {
     uint16_t startPosition = m_recvBufferIdx;
     
-    uint16_t bytesToCopy = std::min(len, (size_t)(MQTT_BUFFER_SIZE - m_recvBufferIdx));
+    uint16_t bytesToCopy = std::min(len, (size_t)(m_recvBufferSize - m_recvBufferIdx));
     memcpy(&m_recvBuffer[m_recvBufferIdx], data, bytesToCopy);
     m_recvBufferIdx += bytesToCopy;
 
@@ -181,15 +290,35 @@ bool MQTTSocketHandler::decode_header(uint8_t*& data, size_t& len)
         trace("MQTTSocketHandler::decode_header: this=%p, message_type=%d, msg_size=%d", this, message_type, msg_size);
     }
 
+    // other packets larger then the buffer are decoded from the part that fits, the rest is skipped
+    if ((message_type != MQTTPUBLISH) && (msg_size > m_recvBufferSize))
+    {
+        if (m_recvBufferIdx < m_recvBufferSize)
+        {
+            return consume(data, len, len);
+        }
+
+        trace("MQTTSocketHandler::decode_header: message_type[%d] msg_size[%d] larger then receive buffer[%d], skipping the rest.", message_type, msg_size, m_recvBufferSize);
+
+        m_skipDataLen = msg_size - m_recvBufferSize;
+        m_state = SocketState::SKIP_DATA;
+        msg_size = m_recvBufferSize;
+    }
+
     switch (message_type)
     {
         case MQTTPUBLISH: return decode_publish_header(data, len, msg_size, pos, startPosition);
         case MQTTCONNACK: return decode_conn_ack(data, len, msg_size, pos, startPosition);
+        case MQTTUNSUBACK: // fall through
         case MQTTSUBACK:  // fall through
+        case MQTTPUBREL:  // fall through
         case MQTTPUBACK:  return decode_pubsub_ack(data, len, msg_size, pos, startPosition, message_type);
         case MQTTPINGRESP: // fall through
         case MQTTPINGREQ: return decode_ping(data, len, msg_size, pos, startPosition, message_type);
-        case MQTTPUBREL:   // fall through - ignored
+        case MQTTDISCONNECT: return decode_disconnect(data, len, msg_size, pos, startPosition);
+        case MQTTCONNECT: return m_serverMode ? decode_connect(data, len, msg_size, pos, startPosition) : decode_unhandled(data, len, msg_size, pos, startPosition, message_type);
+        case MQTTUNSUBSCRIBE: // fall through
+        case MQTTSUBSCRIBE: return m_serverMode ? decode_subscribe(data, len, msg_size, pos, startPosition, message_type) : decode_unhandled(data, len, msg_size, pos, startPosition, message_type);
         case MQTTPUBCOMP:  // fall through - ignored
         case MQTTRESERVED: // fall through - ignored
         default:
@@ -199,7 +328,7 @@ bool MQTTSocketHandler::decode_header(uint8_t*& data, size_t& len)
     }
 }
 
-bool MQTTSocketHandler::consume(uint8_t*& data, size_t& len, size_t bytes)
+bool MQTTSocketHandlerBase::consume(uint8_t*& data, size_t& len, size_t bytes)
 {
     if (bytes > len)
     {
@@ -212,8 +341,14 @@ bool MQTTSocketHandler::consume(uint8_t*& data, size_t& len, size_t bytes)
     return true;
 }
 
-bool MQTTSocketHandler::decode_publish_header(uint8_t*& data, size_t& len, uint32_t msg_size, uint32_t pos, uint32_t startPosition)
+bool MQTTSocketHandlerBase::decode_publish_header(uint8_t*& data, size_t& len, uint32_t msg_size, uint32_t pos, uint32_t startPosition)
 {
+    if (!m_startup.first_publish && !m_serverMode)
+    {
+        m_startup.first_publish = true;
+        m_startup.first_publish_us = to_us_since_boot(get_absolute_time()) - m_startup.start_us;
+    }
+
     if (pos + 2 > m_recvBufferIdx)
     {
         return consume(data, len, len);
@@ -222,10 +357,31 @@ bool MQTTSocketHandler::decode_publish_header(uint8_t*& data, size_t& len, uint3
     uint16_t topic_length = (m_recvBuffer[pos] << 8) + m_recvBuffer[pos+1];
     pos+=2;
 
-    if (pos + topic_length >= MQTT_BUFFER_SIZE)
+    // topics not leaving room for the packet id (and properties length) in the buffer are handed upstream in pieces
+    const int MQTT_MESSAGE_ID_SIZE = 2;
+    if (pos + topic_length + MQTT_MESSAGE_ID_SIZE + ((m_protocolVersion >= MQTT_PROTOCOL_V5) ? 1 : 0) > m_recvBufferSize)
     {
-        trace("MQTTSocketHandler::decode_publish_header: received message with header larger then local buffer, pos[%d] topic_length[%d] received header[%d], max header[%d]", pos, topic_length, pos + topic_length, MQTT_BUFFER_SIZE);
-        return false;
+        uint32_t available = std::min<uint32_t>(m_recvBufferIdx - pos, topic_length);
+        if (startPosition > pos + available)
+        {
+            trace("MQTTSocketHandler::decode_publish_header: logic failure: startPosition[%d] pos[%d] msg_size[%d].", startPosition, pos, msg_size);
+            return false;
+        }
+
+        m_streamFlags = m_recvBuffer[0];
+        m_streamTopicLength = topic_length;
+        m_streamTopicOffset = 0;
+        m_streamRemaining = msg_size - pos;
+        m_state = SocketState::WAIT_TOPIC;
+        m_recvBufferIdx = 0;
+
+        if (!stream_topic(&m_recvBuffer[pos], available) || !consume(data, len, pos + available - startPosition))
+        {
+            return false;
+        }
+
+        // whole topic was already here
+        return (m_state == SocketState::WAIT_PACKET) ? decode_header(data, len) : true;
     }
                 
     if (pos + topic_length > m_recvBufferIdx)
@@ -235,6 +391,14 @@ bool MQTTSocketHandler::decode_publish_header(uint8_t*& data, size_t& len, uint3
     
     uint8_t *topic = &m_recvBuffer[pos];
     pos += topic_length;
+
+    // rest of the header of a streamed topic, behind an empty topic
+    bool streamed = (m_streamTopicLength > 0);
+    if (streamed)
+    {
+        topic = NULL;
+        topic_length = m_streamTopicLength;
+    }
                 
     if ((m_recvBuffer[0] & (MQTTQOS1 | MQTTQOS2)) && (pos + 2 > m_recvBufferIdx))
     {
@@ -244,12 +408,121 @@ bool MQTTSocketHandler::decode_publish_header(uint8_t*& data, size_t& len, uint3
     uint16_t message_id = (m_recvBuffer[0] & (MQTTQOS1 | MQTTQOS2)) ? (m_recvBuffer[pos] << 8) + m_recvBuffer[pos+1] : 0;
     pos += (m_recvBuffer[0] & (MQTTQOS1 | MQTTQOS2)) ? 2 : 0;
 
+    if (m_protocolVersion >= MQTT_PROTOCOL_V5)
+    {
+        uint32_t properties_length = 0;
+        uint32_t properties_pos = pos;
+        if (!read_varint(m_recvBuffer, m_recvBufferIdx, properties_pos, properties_length))
+        {
+            if (pos + 4 <= m_recvBufferIdx)
+            {
+                trace("MQTTSocketHandler::decode_publish_header: malformed properties length, pos[%d].", pos);
+                return false;
+            }
+            return consume(data, len, len);
+        }
+
+        if ((properties_pos + properties_length > m_recvBufferSize) || (properties_pos + properties_length > msg_size))
+        {
+            trace("MQTTSocketHandler::decode_publish_header: properties do not fit local buffer or message, properties_length[%d] msg_size[%d] max header[%d]", properties_length, msg_size, m_recvBufferSize);
+            return false;
+        }
+
+        if (properties_pos + properties_length > m_recvBufferIdx)
+        {
+            return consume(data, len, len);
+        }
+
+        ReceivedProperties properties = {0, 0, 0, 0};
+        if (!decode_properties(m_recvBuffer, properties_pos, properties_pos + properties_length, properties) || (properties.topic_alias > MQTT_TOPIC_ALIASES))
+        {
+            trace("MQTTSocketHandler::decode_publish_header: invalid properties, topic_alias[%d] max[%d].", properties.topic_alias, MQTT_TOPIC_ALIASES);
+            return false;
+        }
+        pos = properties_pos + properties_length;
+
+        // a topic with an alias sets it, an empty topic uses it
+        if ((properties.topic_alias > 0) && streamed)
+        {
+            trace("MQTTSocketHandler::decode_publish_header: topic_alias[%d] for a topic longer then the receive buffer.", properties.topic_alias);
+            return false;
+        }
+
+        if (properties.topic_alias > 0)
+        {
+            TopicAlias& entry = m_inAliases[properties.topic_alias - 1];
+            if (topic_length > 0)
+            {
+                // the publish still carries the topic, only the mapping is not kept
+                if (topic_length > MQTT_TOPIC_ALIAS_SIZE)
+                {
+                    trace("MQTTSocketHandler::decode_publish_header: topic_length[%d] too long for alias, max[%d], alias dropped.", topic_length, MQTT_TOPIC_ALIAS_SIZE);
+                    entry.length = 0;
+                }
+                else
+                {
+                    memcpy(entry.topic, topic, topic_length);
+                    entry.length = topic_length;
+                }
+            }
+            else if (entry.length == 0)
+            {
+                trace("MQTTSocketHandler::decode_publish_header: unknown topic_alias[%d].", properties.topic_alias);
+                return false;
+            }
+            else
+            {
+                topic = (uint8_t*)entry.topic;
+                topic_length = entry.length;
+            }
+        }
+    }
+
     uint32_t message_length = msg_size - pos;
 
-    m_upstream->on_publish_header(topic, topic_length, message_id, message_length);
+    m_receiveFlags = m_recvBuffer[0] & (MQTTQOS1 | MQTTQOS2 | MQTTRETAIN);
+    m_receiveQos = (m_recvBuffer[0] & (MQTTQOS1 | MQTTQOS2)) >> 1;
+    m_receiveMessageId = message_id;
+    m_receiveDuplicate = (m_receiveQos == 2) && (find_qos2(message_id) >= 0);
+
+    if ((m_receiveQos == 2) && !m_receiveDuplicate && (m_qos2Count >= MQTT_QOS2_RECEIVE_MAX))
+    {
+        trace("MQTTSocketHandler::decode_publish_header: too many QoS 2 messages waiting for PUBREL, message_id[%d] max[%d].", message_id, MQTT_QOS2_RECEIVE_MAX);
+        return false;
+    }
+
+    if (m_receiveDuplicate)
+    {
+        trace("MQTTSocketHandler::decode_publish_header: QoS 2 message_id[%d] already received, skipping.", message_id);
+    }
+    else if (!m_upstream->on_publish_header(topic, topic_length, message_id, message_length))
+    {
+        trace("MQTTSocketHandler::decode_publish_header: publish refused upstream, message_id[%d], closing.", message_id);
+        return false;
+    }
+
+    m_streamTopicLength = 0;
+    m_streamTopicOffset = 0;
 
     m_pendingDataLen = message_length;
     m_state = SocketState::WAIT_DATA;
+
+    // empty messages are complete with the header
+    if (message_length == 0)
+    {
+        if (!m_receiveDuplicate && !m_upstream->on_publish_data(NULL, 0, true))
+        {
+            trace("MQTTSocketHandler::decode_publish_header: publish refused upstream, message_id[%d], closing.", message_id);
+            return false;
+        }
+
+        m_state = SocketState::WAIT_PACKET;
+
+        if (!finish_publish())
+        {
+            return false;
+        }
+    }
                 
     m_recvBufferIdx = 0;
 
@@ -263,12 +536,12 @@ bool MQTTSocketHandler::decode_publish_header(uint8_t*& data, size_t& len, uint3
     return consume(data, len, pos - startPosition);
 }
 
-bool MQTTSocketHandler::decode_conn_ack(uint8_t*& data, size_t& len, uint32_t msg_size, uint32_t pos, uint32_t startPosition)
+bool MQTTSocketHandlerBase::decode_conn_ack(uint8_t*& data, size_t& len, uint32_t msg_size, uint32_t pos, uint32_t startPosition)
 {
     // Smaller messages should fit in the defined buffer.
-    if (msg_size >= MQTT_BUFFER_SIZE)
+    if (msg_size > m_recvBufferSize)
     {
-        trace("MQTTSocketHandler::decode_conn_ack: received message with header larger then local buffer, msg_size[%d], max_header[%d]", msg_size, MQTT_BUFFER_SIZE);
+        trace("MQTTSocketHandler::decode_conn_ack: received message with header larger then local buffer, msg_size[%d], max_header[%d]", msg_size, m_recvBufferSize);
         return false;
     }
 
@@ -286,6 +559,31 @@ bool MQTTSocketHandler::decode_conn_ack(uint8_t*& data, size_t& len, uint32_t ms
     uint8_t conn_ack_flags = m_recvBuffer[pos];
     conn_ack_code_t code = (conn_ack_code_t)m_recvBuffer[pos+1];
     pos += 2;
+
+    if (m_protocolVersion >= MQTT_PROTOCOL_V5)
+    {
+        uint32_t properties_length = 0;
+        ReceivedProperties properties = {0, 0, 0, 0};
+        if (!read_varint(m_recvBuffer, msg_size, pos, properties_length) || (pos + properties_length > msg_size) || !decode_properties(m_recvBuffer, pos, pos + properties_length, properties))
+        {
+            trace("MQTTSocketHandler::decode_conn_ack: malformed properties, msg_size[%d].", msg_size);
+            return false;
+        }
+
+        // no Receive Maximum means 65535, the local window is the limit then
+        m_inflightWindow = (properties.receive_maximum > 0) ? std::min<uint32_t>(properties.receive_maximum, MQTT_INFLIGHT_WINDOW) : MQTT_INFLIGHT_WINDOW;
+        m_outAliasMax = std::min<uint32_t>(properties.topic_alias_maximum, MQTT_TOPIC_ALIASES);
+
+        if (properties.server_keep_alive > 0)
+        {
+            m_keepaliveSeconds = std::min<uint32_t>(properties.server_keep_alive, 0xFF);
+        }
+
+        if (m_debug)
+        {
+            trace("MQTTSocketHandler::decode_conn_ack: this=%p, receive_maximum[%d] topic_alias_maximum[%d] window[%d] aliases[%d]", this, properties.receive_maximum, properties.topic_alias_maximum, m_inflightWindow, m_outAliasMax);
+        }
+    }
     
     if (startPosition > msg_size)
     {
@@ -293,18 +591,29 @@ bool MQTTSocketHandler::decode_conn_ack(uint8_t*& data, size_t& len, uint32_t ms
         return false;
     }
     
-    m_upstream->on_conn_ack(code, conn_ack_flags);
+    // unacknowledged publishes go out again before anything new
+    if ((code == CONNECTION_ACCEPTED) && !resend_inflight())
+    {
+        return false;
+    }
+
+    m_startup.conn_ack_us = to_us_since_boot(get_absolute_time()) - m_startup.start_us;
+
+    if (!m_upstream->on_conn_ack(code, conn_ack_flags))
+    {
+        return false;
+    }
 
     m_recvBufferIdx = 0;
     return consume(data, len, msg_size - startPosition);
 }
 
-bool MQTTSocketHandler::decode_pubsub_ack(uint8_t*& data, size_t& len, uint32_t msg_size, uint32_t pos, uint32_t startPosition, uint8_t message_type)
+bool MQTTSocketHandlerBase::decode_pubsub_ack(uint8_t*& data, size_t& len, uint32_t msg_size, uint32_t pos, uint32_t startPosition, uint8_t message_type)
 {
     // Smaller messages should fit in the defined buffer.
-    if (msg_size >= MQTT_BUFFER_SIZE)
+    if (msg_size > m_recvBufferSize)
     {
-        trace("MQTTSocketHandler::decode_pubsub_ack: received message with header larger then local buffer, msg_size[%d], max_header[%d], msg_type[%d]", msg_size, MQTT_BUFFER_SIZE, message_type);
+        trace("MQTTSocketHandler::decode_pubsub_ack: received message with header larger then local buffer, msg_size[%d], max_header[%d], msg_type[%d]", msg_size, m_recvBufferSize, message_type);
         return false;
     }
 
@@ -327,26 +636,113 @@ bool MQTTSocketHandler::decode_pubsub_ack(uint8_t*& data, size_t& len, uint32_t
         trace("MQTTSocketHandler::decode_pubsub_ack: logic failure: startPosition[%d] pos[%d] msg_size[%d].", startPosition, pos, msg_size);
         return false;
     }
-    
+
+    // MQTT 5.0 SUBACK/UNSUBACK have properties before the reason codes
+    if ((m_protocolVersion >= MQTT_PROTOCOL_V5) && ((message_type == MQTTSUBACK) || (message_type == MQTTUNSUBACK)))
+    {
+        uint32_t properties_length = 0;
+        bool valid = read_varint(m_recvBuffer, msg_size, pos, properties_length) && (pos + properties_length <= msg_size);
+
+        // properties of an oversized packet may run past the part in buffer, its reason codes are not seen then
+        if (!valid && (m_skipDataLen == 0))
+        {
+            trace("MQTTSocketHandler::decode_pubsub_ack: malformed properties, msg_type[%d] msg_size[%d].", message_type, msg_size);
+            return false;
+        }
+        pos = valid ? (pos + properties_length) : msg_size;
+    }
+
+    // one reason code per filter for SUBACK (and MQTT 5.0 UNSUBACK), an optional one for MQTT 5.0 PUBACK/PUBREL
+    bool refused = false;
+    if ((m_protocolVersion >= MQTT_PROTOCOL_V5) || (message_type == MQTTSUBACK))
+    {
+        uint32_t end = ((message_type == MQTTPUBACK) || (message_type == MQTTPUBREL)) ? std::min(pos + 1, msg_size) : msg_size;
+        for (;pos<end;++pos)
+        {
+            refused = refused || (m_recvBuffer[pos] >= MQTT_RC_UNSPECIFIED_ERROR);
+            if ((m_recvBuffer[pos] >= MQTT_RC_UNSPECIFIED_ERROR) && !m_upstream->on_reason_code(message_type, message_id, (mqtt_reason_code_t)m_recvBuffer[pos]))
+            {
+                return false;
+            }
+        }
+    }
+
     if (message_type == MQTTPUBACK)
     {
-        m_upstream->on_pub_ack(message_id);
+        ack_publish(message_id);
+        if (!resend_held() || !m_upstream->on_pub_ack(message_id))
+        {
+            return false;
+        }
+    }
+    else if (message_type == MQTTPUBREL)
+    {
+        // released ids may be reused by the broker, PUBCOMP is sent even for unknown ids
+        int index = find_qos2(message_id);
+        if (index >= 0)
+        {
+            m_qos2Ids[index] = m_qos2Ids[--m_qos2Count];
+        }
+
+        if (!queue_ack(MQTTPUBCOMP, message_id))
+        {
+            return false;
+        }
+    }
+    else if (message_type == MQTTUNSUBACK)
+    {
+        if (!m_upstream->on_unsub_ack(message_id))
+        {
+            return false;
+        }
     }
     else
     {
-        m_upstream->on_sub_ack(message_id);
+        track_startup_sub_ack(message_id, refused);
+        if (!m_upstream->on_sub_ack(message_id))
+        {
+            return false;
+        }
     }
 
     m_recvBufferIdx = 0;
     return consume(data, len, msg_size - startPosition);
 }
 
-bool MQTTSocketHandler::decode_ping(uint8_t*& data, size_t& len, uint32_t msg_size, uint32_t pos, uint32_t startPosition, uint8_t message_type)
+void MQTTSocketHandlerBase::track_startup_sub_ack(uint16_t message_id, bool refused)
+{
+    for (uint8_t i=0;i<m_startupPending;++i)
+    {
+        if (m_startupIds[i] != message_id)
+        {
+            continue;
+        }
+
+        m_startupIds[i] = m_startupIds[--m_startupPending];
+        if (refused)
+        {
+            m_startup.refused++;
+        }
+        else
+        {
+            m_startup.granted++;
+        }
+
+        if (m_startupPending == 0)
+        {
+            m_startup.subscribed_us = to_us_since_boot(get_absolute_time()) - m_startup.start_us;
+            trace("MQTTSocketHandler::track_startup_sub_ack: this=%p, startup subscriptions done granted[%d] refused[%d] writes[%d]", this, m_startup.granted, m_startup.refused, m_startup.writes);
+        }
+        return;
+    }
+}
+
+bool MQTTSocketHandlerBase::decode_ping(uint8_t*& data, size_t& len, uint32_t msg_size, uint32_t pos, uint32_t startPosition, uint8_t message_type)
 {
     // Smaller messages should fit in the defined buffer.
-    if (msg_size >= MQTT_BUFFER_SIZE)
+    if (msg_size > m_recvBufferSize)
     {
-        trace("MQTTSocketHandler::decode_ping: received message with header larger then local buffer, msg_size[%d], max_header[%d], msg_type[%d]", msg_size, MQTT_BUFFER_SIZE, message_type);
+        trace("MQTTSocketHandler::decode_ping: received message with header larger then local buffer, msg_size[%d], max_header[%d], msg_type[%d]", msg_size, m_recvBufferSize, message_type);
         return false;
     }
 
@@ -368,6 +764,14 @@ bool MQTTSocketHandler::decode_ping(uint8_t*& data, size_t& len, uint32_t msg_si
     }
     else if (message_type == MQTTPINGREQ)
     {
+        if (m_serverMode)
+        {
+            uint8_t sendBuffer[2] = { MQTTPINGRESP, 0 };
+            if (!send_downstream(sendBuffer, sizeof(sendBuffer)))
+            {
+                return false;
+            }
+        }
         m_upstream->on_ping_req();
     }
 
@@ -375,12 +779,40 @@ bool MQTTSocketHandler::decode_ping(uint8_t*& data, size_t& len, uint32_t msg_si
     return consume(data, len, msg_size - startPosition);
 }
 
-bool MQTTSocketHandler::decode_unhandled(uint8_t*& data, size_t& len, uint32_t msg_size, uint32_t pos, uint32_t startPosition, uint8_t message_type)
+bool MQTTSocketHandlerBase::stream_topic(uint8_t* data, uint32_t len)
+{
+    if ((len > 0) && !m_upstream->on_publish_topic(data, len, m_streamTopicOffset, m_streamTopicLength))
+    {
+        return false;
+    }
+
+    m_streamTopicOffset += len;
+    if (m_streamTopicOffset < m_streamTopicLength)
+    {
+        return true;
+    }
+
+    // packet id, properties and message follow, decoded as a publish with an empty topic
+    uint32_t message_size = 2 + m_streamRemaining - m_streamTopicLength;
+    uint32_t pos = write_header(m_streamFlags, message_size, m_recvBuffer, m_recvBufferSize, message_size);
+    if (pos == 0)
+    {
+        return false;
+    }
+
+    m_recvBuffer[pos++] = 0;
+    m_recvBuffer[pos++] = 0;
+    m_recvBufferIdx = pos;
+    m_state = SocketState::WAIT_PACKET;
+    return true;
+}
+
+bool MQTTSocketHandlerBase::decode_disconnect(uint8_t*& data, size_t& len, uint32_t msg_size, uint32_t pos, uint32_t startPosition)
 {
     // Smaller messages should fit in the defined buffer.
-    if (msg_size >= MQTT_BUFFER_SIZE)
+    if (msg_size > m_recvBufferSize)
     {
-        trace("MQTTSocketHandler::decode_unhandled: received message with header larger then local buffer, msg_size[%d], max_header[%d], msg_type[%d]", msg_size, MQTT_BUFFER_SIZE, message_type);
+        trace("MQTTSocketHandler::decode_disconnect: received message with header larger then local buffer, msg_size[%d], max_header[%d]", msg_size, m_recvBufferSize);
         return false;
     }
 
@@ -389,65 +821,335 @@ bool MQTTSocketHandler::decode_unhandled(uint8_t*& data, size_t& len, uint32_t m
     {
         return consume(data, len, len);
     }
-    
-    if (startPosition > msg_size)
-    {
-        trace("MQTTSocketHandler::decode_unhandled: logic failure: startPosition[%d] pos[%d] msg_size[%d].", startPosition, pos, msg_size);
-        return false;
-    }
-    
-    trace("MQTTSocketHandler::decode_unhandled: received unhandled message_type[%d] msg_size[%d] ignoring.", message_type, msg_size);
+
+    // only MQTT 5.0 brokers send DISCONNECT, without a reason code (always for 3.1.1 clients) it is a normal disconnection
+    mqtt_reason_code_t reason_code = (pos < msg_size) ? (mqtt_reason_code_t)m_recvBuffer[pos] : MQTT_RC_SUCCESS;
+    trace("MQTTSocketHandler::decode_disconnect: %s disconnected, reason_code[0x%x].", m_serverMode ? "client" : "broker", reason_code);
+
+    m_upstream->on_reason_code(MQTTDISCONNECT, 0, reason_code);
 
     m_recvBufferIdx = 0;
-    return consume(data, len, msg_size - startPosition);
+    return false;
 }
 
-bool MQTTSocketHandler::send_connect(bool clean_session, uint8_t keepalive_seconds, const char *id, const char *will_topic, const char *will_message, const char *user, const char *pass)
+bool MQTTSocketHandlerBase::decode_connect(uint8_t*& data, size_t& len, uint32_t msg_size, uint32_t pos, uint32_t startPosition)
 {
-    if (m_pendingSendDataLen > 0)
+    // CONNECT is only decoded whole, a larger one was cut to the buffer size by decode_header
+    if ((msg_size > m_recvBufferSize) || (m_skipDataLen > 0))
     {
-        trace("MQTTSocketHandler::send_connect: attempting to send another message while previous was not fully sent, disconnecting.");
+        trace("MQTTSocketHandler::decode_connect: received message with header larger then local buffer, msg_size[%d], max_header[%d]", msg_size, m_recvBufferSize);
         return false;
     }
-    
-    trace("MQTTSocketHandler::send_connect: clean_session[%d], keepalive_seconds[%d], id[%s] will_topic[%s], will_message[%s], user[%s].", clean_session, keepalive_seconds, safestr(id), safestr(will_topic), safestr(will_message), safestr(user));
-    
-    uint16_t id_len = (id != NULL) ? strlen(id) : 0;
-    uint16_t will_topic_len = (will_topic != NULL) ? strlen(will_topic) : 0;
-    uint16_t will_message_len = ((will_topic != NULL) && (will_message != NULL)) ? strlen(will_message) : 0;
-    uint16_t user_len = (user != NULL) ? strlen(user) : 0;
-    uint16_t pass_len = ((user != NULL) && (pass != NULL)) ? strlen(pass) : 0;
-    
-    uint32_t message_size = 7 + 1 + 2;
 
-    message_size += (id_len > 0) ? (id_len + 2) : 0;
-    message_size += (will_topic_len > 0) ? (2 + will_topic_len) : 0;
-    message_size += (will_message_len > 0) ? (2 + will_message_len) : 0;
-    message_size += (user_len > 0) ? (2 + user_len) : 0;
-    message_size += (pass_len > 0) ? (2 + pass_len) : 0;
+    // Wait until the message is fully in buffer to process
+    if (msg_size > m_recvBufferIdx)
+    {
+        return consume(data, len, len);
+    }
 
-    if (message_size + MQTT_MAX_HEADER_SIZE > MQTT_BUFFER_SIZE)
+    if (startPosition > msg_size)
     {
-        trace("MQTTSocketHandler::send_connect: attempting to send a connect with message size larger then max local buffer, message size[%d], max header[%d]", message_size + MQTT_MAX_HEADER_SIZE, MQTT_BUFFER_SIZE);
+        trace("MQTTSocketHandler::decode_connect: logic failure: startPosition[%d] pos[%d] msg_size[%d].", startPosition, pos, msg_size);
         return false;
     }
 
-    uint8_t sendBuffer[message_size + MQTT_MAX_HEADER_SIZE] = {0};
-    
-    uint32_t pos = write_header(MQTTCONNECT, message_size, sendBuffer, sizeof(sendBuffer));
-    if (pos == 0)
+    MQTTConnectInfo info = {};
+    const uint8_t *protocol = NULL;
+    uint16_t protocol_length = 0;
+
+    if (!read_string(m_recvBuffer, msg_size, pos, protocol, protocol_length) || (pos + 4 > msg_size) || (protocol_length != 4) || (memcmp(protocol, "MQTT", 4) != 0))
     {
-        trace("MQTTSocketHandler::send_connect: failed writing header");
+        trace("MQTTSocketHandler::decode_connect: malformed CONNECT or unknown protocol name, msg_size[%d].", msg_size);
         return false;
     }
-    
-    sendBuffer[pos++] = 0x00;
-    sendBuffer[pos++] = 0x04;
-    sendBuffer[pos++] = 'M';
+
+    info.protocol_level = m_recvBuffer[pos++];
+    info.flags = m_recvBuffer[pos++];
+    info.keepalive_seconds = (m_recvBuffer[pos] << 8) + m_recvBuffer[pos+1];
+    pos += 2;
+
+    // other protocol levels have properties next, upstream refuses them from level and flags alone
+    if (info.protocol_level == MQTT_PROTOCOL_V311)
+    {
+        bool valid = read_string(m_recvBuffer, msg_size, pos, info.client_id, info.client_id_length);
+
+        if (valid && (info.flags & MQTT_CONNECT_WILL))
+        {
+            valid = read_string(m_recvBuffer, msg_size, pos, info.will_topic, info.will_topic_length) &&
+                    read_string(m_recvBuffer, msg_size, pos, info.will_message, info.will_message_length);
+        }
+
+        if (valid && (info.flags & MQTT_CONNECT_USER))
+        {
+            valid = read_string(m_recvBuffer, msg_size, pos, info.user, info.user_length);
+        }
+
+        if (valid && (info.flags & MQTT_CONNECT_PASS))
+        {
+            valid = read_string(m_recvBuffer, msg_size, pos, info.pass, info.pass_length);
+        }
+
+        if (!valid)
+        {
+            trace("MQTTSocketHandler::decode_connect: malformed payload, flags[0x%x] msg_size[%d].", info.flags, msg_size);
+            return false;
+        }
+    }
+
+    if (m_debug)
+    {
+        trace("MQTTSocketHandler::decode_connect: this=%p, protocol_level[%d] flags[0x%x] keepalive[%d]", this, info.protocol_level, info.flags, info.keepalive_seconds);
+    }
+
+    if (!m_upstream->on_connect(info))
+    {
+        return false;
+    }
+
+    m_recvBufferIdx = 0;
+    return consume(data, len, msg_size - startPosition);
+}
+
+bool MQTTSocketHandlerBase::decode_subscribe(uint8_t*& data, size_t& len, uint32_t msg_size, uint32_t pos, uint32_t startPosition, uint8_t message_type)
+{
+    // filters are only decoded whole, a larger packet was cut to the buffer size by decode_header
+    if ((msg_size > m_recvBufferSize) || (m_skipDataLen > 0))
+    {
+        trace("MQTTSocketHandler::decode_subscribe: received message with header larger then local buffer, msg_size[%d], max_header[%d], msg_type[%d]", msg_size, m_recvBufferSize, message_type);
+        return false;
+    }
+
+    // Wait until the message is fully in buffer to process
+    if (msg_size > m_recvBufferIdx)
+    {
+        return consume(data, len, len);
+    }
+
+    if ((startPosition > msg_size) || (pos + 2 > msg_size))
+    {
+        trace("MQTTSocketHandler::decode_subscribe: malformed message: startPosition[%d] pos[%d] msg_size[%d].", startPosition, pos, msg_size);
+        return false;
+    }
+
+    uint16_t message_id = (m_recvBuffer[pos] << 8) + m_recvBuffer[pos+1];
+    pos += 2;
+
+    // one SUBACK return code per filter, there are fewer filters then bytes
+    uint8_t codes[msg_size];
+    uint16_t count = 0;
+
+    while (pos < msg_size)
+    {
+        const uint8_t *filter = NULL;
+        uint16_t filter_length = 0;
+        if (!read_string(m_recvBuffer, msg_size, pos, filter, filter_length) || (filter_length == 0) ||
+            ((message_type == MQTTSUBSCRIBE) && ((pos + 1 > msg_size) || (m_recvBuffer[pos] > 2))))
+        {
+            trace("MQTTSocketHandler::decode_subscribe: malformed filter, msg_type[%d] pos[%d] msg_size[%d].", message_type, pos, msg_size);
+            return false;
+        }
+
+        if (message_type == MQTTSUBSCRIBE)
+        {
+            codes[count++] = m_upstream->on_subscribe(message_id, filter, filter_length, m_recvBuffer[pos++]);
+        }
+        else
+        {
+            if (!m_upstream->on_unsubscribe(message_id, filter, filter_length))
+            {
+                return false;
+            }
+            ++count;
+        }
+    }
+
+    if (count == 0)
+    {
+        trace("MQTTSocketHandler::decode_subscribe: no filters, msg_type[%d] message_id[%d].", message_type, message_id);
+        return false;
+    }
+
+    m_recvBufferIdx = 0;
+    if (!consume(data, len, msg_size - startPosition))
+    {
+        return false;
+    }
+
+    if (message_type == MQTTUNSUBSCRIBE)
+    {
+        return queue_ack(MQTTUNSUBACK, message_id);
+    }
+
+    // publishes queued for the client go first
+    if ((m_batchUsed > 0) && !flush_publishes())
+    {
+        return false;
+    }
+
+    uint8_t sendBuffer[MQTT_MAX_HEADER_SIZE + 2 + count];
+    uint32_t sendPos = write_header(MQTTSUBACK, 2 + count, sendBuffer, sizeof(sendBuffer));
+    if (sendPos == 0)
+    {
+        return false;
+    }
+
+    sendBuffer[sendPos++] = message_id >> 8;
+    sendBuffer[sendPos++] = message_id & 0xFF;
+    memcpy(&sendBuffer[sendPos], codes, count);
+    sendPos += count;
+
+    return send_downstream(sendBuffer, sendPos) && m_upstream->on_subscribed(message_id);
+}
+
+bool MQTTSocketHandlerBase::decode_unhandled(uint8_t*& data, size_t& len, uint32_t msg_size, uint32_t pos, uint32_t startPosition, uint8_t message_type)
+{
+    // Smaller messages should fit in the defined buffer.
+    if (msg_size > m_recvBufferSize)
+    {
+        trace("MQTTSocketHandler::decode_unhandled: received message with header larger then local buffer, msg_size[%d], max_header[%d], msg_type[%d]", msg_size, m_recvBufferSize, message_type);
+        return false;
+    }
+
+    // Wait until the message is fully in buffer to process
+    if (msg_size > m_recvBufferIdx)
+    {
+        return consume(data, len, len);
+    }
+    
+    if (startPosition > msg_size)
+    {
+        trace("MQTTSocketHandler::decode_unhandled: logic failure: startPosition[%d] pos[%d] msg_size[%d].", startPosition, pos, msg_size);
+        return false;
+    }
+    
+    trace("MQTTSocketHandler::decode_unhandled: received unhandled message_type[%d] msg_size[%d] ignoring.", message_type, msg_size);
+
+    m_recvBufferIdx = 0;
+    return consume(data, len, msg_size - startPosition);
+}
+
+bool MQTTSocketHandlerBase::send_connect(bool clean_session, uint8_t keepalive_seconds, const char *id, const char *will_topic, const char *will_message, const char *user, const char *pass)
+{
+    if (m_pendingSendDataLen > 0)
+    {
+        trace("MQTTSocketHandler::send_connect: attempting to send another message while previous was not fully sent, disconnecting.");
+        return false;
+    }
+
+    m_startup = {};
+    m_startup.start_us = to_us_since_boot(get_absolute_time());
+    m_startupPending = 0;
+
+    uint8_t sendBuffer[MQTT_BUFFER_SIZE];
+    uint32_t size = write_connect(clean_session, keepalive_seconds, id, will_topic, will_message, user, pass, sendBuffer, sizeof(sendBuffer));
+    return (size > 0) && send_downstream(sendBuffer, size);
+}
+
+bool MQTTSocketHandlerBase::send_connect_subscribe(const char **topics, uint8_t count, uint8_t qos, bool clean_session, uint8_t keepalive_seconds, const char *id, const char *will_topic, const char *will_message, const char *user, const char *pass)
+{
+    if (m_pendingSendDataLen > 0)
+    {
+        trace("MQTTSocketHandler::send_connect_subscribe: attempting to send another message while previous was not fully sent, disconnecting.");
+        return false;
+    }
+
+    if (count > MQTT_STARTUP_TOPICS)
+    {
+        trace("MQTTSocketHandler::send_connect_subscribe: too many topics, count[%d] max[%d]", count, MQTT_STARTUP_TOPICS);
+        return false;
+    }
+
+    // CONNECT is the first packet of a connection, a batch left over belongs to the previous one (its QoS 1 publishes are still in the window)
+    if (m_batchUsed > 0)
+    {
+        trace("MQTTSocketHandler::send_connect_subscribe: dropping batch of previous connection, bytes[%d]", m_batchUsed);
+        m_batchUsed = 0;
+    }
+
+    m_startup = {};
+    m_startup.start_us = to_us_since_boot(get_absolute_time());
+    m_startup.subscriptions = count;
+    m_startupPending = 0;
+
+    uint32_t used = write_connect(clean_session, keepalive_seconds, id, will_topic, will_message, user, pass, m_batchBuffer, sizeof(m_batchBuffer));
+    if (used == 0)
+    {
+        return false;
+    }
+
+    // a SUBSCRIBE per topic so each SUBACK is about a single filter, packets share a write as long as they fit the batch buffer
+    for (uint8_t i=0;i<count;++i)
+    {
+        uint32_t size = write_subscribe(&topics[i], 1, qos, &m_batchBuffer[used], sizeof(m_batchBuffer) - used, &m_startupIds[i]);
+        if (size == 0)
+        {
+            m_startup.writes++;
+            if (!send_downstream(m_batchBuffer, used))
+            {
+                return false;
+            }
+
+            used = 0;
+            size = write_subscribe(&topics[i], 1, qos, m_batchBuffer, sizeof(m_batchBuffer), &m_startupIds[i]);
+            if (size == 0)
+            {
+                return false;
+            }
+        }
+
+        used += size;
+        m_startupPending = i + 1;
+    }
+
+    m_startup.writes++;
+    return send_downstream(m_batchBuffer, used);
+}
+
+uint32_t MQTTSocketHandlerBase::write_connect(bool clean_session, uint8_t keepalive_seconds, const char *id, const char *will_topic, const char *will_message, const char *user, const char *pass, uint8_t *sendBuffer, size_t buffer_size)
+{
+    trace("MQTTSocketHandler::send_connect: clean_session[%d], keepalive_seconds[%d], id[%s] will_topic[%s], will_message[%s], user[%s].", clean_session, keepalive_seconds, safestr(id), safestr(will_topic), safestr(will_message), safestr(user));
+    
+    uint16_t id_len = (id != NULL) ? strlen(id) : 0;
+    uint16_t will_topic_len = (will_topic != NULL) ? strlen(will_topic) : 0;
+    uint16_t will_message_len = ((will_topic != NULL) && (will_message != NULL)) ? strlen(will_message) : 0;
+    uint16_t user_len = (user != NULL) ? strlen(user) : 0;
+    uint16_t pass_len = ((user != NULL) && (pass != NULL)) ? strlen(pass) : 0;
+    
+    bool v5 = (m_protocolVersion >= MQTT_PROTOCOL_V5);
+
+    // Receive Maximum, Topic Alias Maximum and Session Expiry Interval when the session is kept
+    uint8_t properties_length = v5 ? (3 + 3 + (clean_session ? 0 : 5)) : 0;
+
+    uint32_t message_size = 7 + 1 + 2;
+    message_size += v5 ? (1 + properties_length) : 0;
+    message_size += (v5 && will_topic && will_message) ? 1 : 0;
+
+    message_size += (id_len > 0) ? (id_len + 2) : 0;
+    message_size += (will_topic_len > 0) ? (2 + will_topic_len) : 0;
+    message_size += (will_message_len > 0) ? (2 + will_message_len) : 0;
+    message_size += (user_len > 0) ? (2 + user_len) : 0;
+    message_size += (pass_len > 0) ? (2 + pass_len) : 0;
+
+    if (message_size + MQTT_MAX_HEADER_SIZE > buffer_size)
+    {
+        trace("MQTTSocketHandler::send_connect: attempting to send a connect with message size larger then max local buffer, message size[%d], max header[%d]", message_size + MQTT_MAX_HEADER_SIZE, buffer_size);
+        return 0;
+    }
+
+    uint32_t pos = write_header(MQTTCONNECT, message_size, sendBuffer, buffer_size);
+    if (pos == 0)
+    {
+        trace("MQTTSocketHandler::send_connect: failed writing header");
+        return 0;
+    }
+    
+    sendBuffer[pos++] = 0x00;
+    sendBuffer[pos++] = 0x04;
+    sendBuffer[pos++] = 'M';
     sendBuffer[pos++] = 'Q';
     sendBuffer[pos++] = 'T';
     sendBuffer[pos++] = 'T';
-    sendBuffer[pos++] = 4;
+    sendBuffer[pos++] = m_protocolVersion;
         
     uint8_t v = 0;
 
@@ -475,17 +1177,45 @@ bool MQTTSocketHandler::send_connect(bool clean_session, uint8_t keepalive_secon
     sendBuffer[pos++] = v;
     sendBuffer[pos++] = (keepalive_seconds >> 8);
     sendBuffer[pos++] = (keepalive_seconds & 0xFF);
+
+    if (v5)
+    {
+        sendBuffer[pos++] = properties_length;
+
+        if (!clean_session)
+        {
+            sendBuffer[pos++] = MQTT_PROP_SESSION_EXPIRY_INTERVAL;
+            sendBuffer[pos++] = ((uint32_t)MQTT_SESSION_EXPIRY_SECONDS >> 24) & 0xFF;
+            sendBuffer[pos++] = ((uint32_t)MQTT_SESSION_EXPIRY_SECONDS >> 16) & 0xFF;
+            sendBuffer[pos++] = ((uint32_t)MQTT_SESSION_EXPIRY_SECONDS >> 8) & 0xFF;
+            sendBuffer[pos++] = (uint32_t)MQTT_SESSION_EXPIRY_SECONDS & 0xFF;
+        }
+
+        sendBuffer[pos++] = MQTT_PROP_RECEIVE_MAXIMUM;
+        sendBuffer[pos++] = MQTT_QOS2_RECEIVE_MAX >> 8;
+        sendBuffer[pos++] = MQTT_QOS2_RECEIVE_MAX & 0xFF;
+
+        sendBuffer[pos++] = MQTT_PROP_TOPIC_ALIAS_MAXIMUM;
+        sendBuffer[pos++] = MQTT_TOPIC_ALIASES >> 8;
+        sendBuffer[pos++] = MQTT_TOPIC_ALIASES & 0xFF;
+    }
     
     if (id == NULL)
     {
         trace("MQTTSocketHandler::send_connect: missing id for connect");
-        return false;
+        return 0;
     }
 
     pos = write_string(id, id_len, sendBuffer, pos);
     
     if (will_topic && will_message)
     {
+        // no will properties
+        if (v5)
+        {
+            sendBuffer[pos++] = 0;
+        }
+
         pos = write_string(will_topic, will_topic_len, sendBuffer, pos);
         pos = write_string(will_message, will_message_len, sendBuffer, pos);
     }
@@ -499,96 +1229,223 @@ bool MQTTSocketHandler::send_connect(bool clean_session, uint8_t keepalive_secon
         }
     }
 
-    m_messageId = 1;
+    if (m_inflightCount == 0)
+    {
+        m_messageId = 1;
+    }
+
+    // a clean session drops QoS 2 state on the broker as well
+    if (clean_session)
+    {
+        m_qos2Count = 0;
+    }
     m_lastKeepaliveUs = to_us_since_boot(get_absolute_time());
     m_keepaliveSeconds = keepalive_seconds;
-    return m_downstream->send(sendBuffer, pos);
+    return pos;
+}
+
+bool MQTTSocketHandlerBase::send_subscribe(const char *topic)
+{
+    return send_subscribe(&topic, 1);
 }
 
-bool MQTTSocketHandler::send_subscribe(const char *topic)
+bool MQTTSocketHandlerBase::send_subscribe(const char **topics, uint8_t count, uint8_t qos, uint16_t *out_message_id)
 {
     if (m_pendingSendDataLen > 0)
     {
         trace("MQTTSocketHandler::send_subscribe: attempting to send another message while previous was not fully sent, disconnecting.");
         return false;
     }
-    
-    trace("MQTTSocketHandler::send_subscribe: topic[%s]", safestr(topic));
 
+    // queued publishes go first
+    if ((m_batchUsed > 0) && !flush_publishes())
+    {
+        return false;
+    }
+
+    uint8_t sendBuffer[MQTT_BUFFER_SIZE];
+    uint32_t size = write_subscribe(topics, count, qos, sendBuffer, sizeof(sendBuffer), out_message_id);
+    return (size > 0) && send_downstream(sendBuffer, size);
+}
+
+uint32_t MQTTSocketHandlerBase::write_subscribe(const char **topics, uint8_t count, uint8_t qos, uint8_t *sendBuffer, size_t buffer_size, uint16_t *out_message_id)
+{
     const int MQTT_MESSAGE_ID_SIZE = 2;
     const int MQTT_TOPIC_LENGTH_SIZE = 2;
+    const int MQTT_QOS_SIZE = 1;
 
-    uint16_t topic_length = strlen(topic);
-    
-    uint32_t message_size = MQTT_TOPIC_LENGTH_SIZE + topic_length + MQTT_MESSAGE_ID_SIZE + 1;
-    if (message_size + MQTT_MAX_HEADER_SIZE > MQTT_BUFFER_SIZE)
+    uint32_t message_size = MQTT_MESSAGE_ID_SIZE;
+    for (uint8_t i=0;i<count;++i)
     {
-        trace("MQTTSocketHandler::send_subscribe: attempting to send a connect with message size larger then local buffer, message size[%d], max header[%d]", message_size + MQTT_MAX_HEADER_SIZE, MQTT_BUFFER_SIZE);
-        return false;
+        trace("MQTTSocketHandler::send_subscribe: topic[%s] qos[%d]", safestr(topics[i]), qos);
+        message_size += MQTT_TOPIC_LENGTH_SIZE + strlen(topics[i]) + MQTT_QOS_SIZE;
     }
 
-    uint8_t sendBuffer[message_size + MQTT_MAX_HEADER_SIZE];
-    uint32_t pos = write_header(MQTTSUBSCRIBE|MQTTQOS1, message_size, sendBuffer, sizeof(sendBuffer));
+    // no properties
+    message_size += (m_protocolVersion >= MQTT_PROTOCOL_V5) ? 1 : 0;
+
+    if ((count == 0) || (message_size + MQTT_MAX_HEADER_SIZE > buffer_size))
+    {
+        trace("MQTTSocketHandler::send_subscribe: attempting to send a subscribe with message size larger then local buffer, count[%d] message size[%d], max header[%d]", count, message_size + MQTT_MAX_HEADER_SIZE, buffer_size);
+        return 0;
+    }
+
+    uint32_t pos = write_header(MQTTSUBSCRIBE|MQTTQOS1, message_size, sendBuffer, buffer_size);
     if (pos == 0)
     {
         trace("MQTTSocketHandler::send_subscribe: failed writing header");
-        return false;
+        return 0;
+    }
+
+    if (out_message_id != NULL)
+    {
+        *out_message_id = m_messageId;
     }
 
     sendBuffer[pos++] = m_messageId >> 8;
     sendBuffer[pos++] = m_messageId & 0xFF;
 
-    pos = write_string(topic, topic_length, sendBuffer, pos);
-
-    const int qos = 1;
-    sendBuffer[pos++] = qos;
+    if (m_protocolVersion >= MQTT_PROTOCOL_V5)
+    {
+        sendBuffer[pos++] = 0;
+    }
 
+    for (uint8_t i=0;i<count;++i)
+    {
+        pos = write_string(topics[i], strlen(topics[i]), sendBuffer, pos);
+        sendBuffer[pos++] = qos;
+    }
     
     m_messageId = (m_messageId == 0xFFFF) ? 1 : (m_messageId + 1);
     
     m_lastKeepaliveUs = to_us_since_boot(get_absolute_time());
-    
-    return m_downstream->send(sendBuffer, pos);
+    return pos;
 }
 
-bool MQTTSocketHandler::send_publish_header(const char *topic, uint32_t message_length, uint16_t *out_message_id)
+bool MQTTSocketHandlerBase::send_unsubscribe(const char **topics, uint8_t count, uint16_t *out_message_id)
 {
     if (m_pendingSendDataLen > 0)
     {
-        trace("MQTTSocketHandler::send_publish_header: attempting to send another message while previous was not fully sent, disconnecting.");
+        trace("MQTTSocketHandler::send_unsubscribe: attempting to send another message while previous was not fully sent, disconnecting.");
+        return false;
+    }
+
+    // queued publishes go first
+    if ((m_batchUsed > 0) && !flush_publishes())
+    {
         return false;
     }
 
-    trace("MQTTSocketHandler::send_publish_header: topic[%s], message_length[%d] message_id[%d]", safestr(topic), message_length, m_messageId);
-    
     const int MQTT_MESSAGE_ID_SIZE = 2;
     const int MQTT_TOPIC_LENGTH_SIZE = 2;
 
-    uint16_t topic_length = strlen(topic);
+    uint32_t message_size = MQTT_MESSAGE_ID_SIZE;
+    for (uint8_t i=0;i<count;++i)
+    {
+        trace("MQTTSocketHandler::send_unsubscribe: topic[%s]", safestr(topics[i]));
+        message_size += MQTT_TOPIC_LENGTH_SIZE + strlen(topics[i]);
+    }
 
-    uint32_t header_size = MQTT_TOPIC_LENGTH_SIZE + topic_length + MQTT_MESSAGE_ID_SIZE;
-    uint32_t message_size = header_size + message_length;
+    // no properties
+    message_size += (m_protocolVersion >= MQTT_PROTOCOL_V5) ? 1 : 0;
 
-    uint8_t sendBuffer[header_size + MQTT_MAX_HEADER_SIZE] = {0};
-    uint32_t pos = write_header(MQTTPUBLISH|MQTTQOS1|MQTTRETAIN, message_size, sendBuffer, sizeof(sendBuffer), message_length);
+    if ((count == 0) || (message_size + MQTT_MAX_HEADER_SIZE > MQTT_BUFFER_SIZE))
+    {
+        trace("MQTTSocketHandler::send_unsubscribe: attempting to send an unsubscribe with message size larger then local buffer, count[%d] message size[%d], max header[%d]", count, message_size + MQTT_MAX_HEADER_SIZE, MQTT_BUFFER_SIZE);
+        return false;
+    }
 
+    uint8_t sendBuffer[message_size + MQTT_MAX_HEADER_SIZE];
+    uint32_t pos = write_header(MQTTUNSUBSCRIBE|MQTTQOS1, message_size, sendBuffer, sizeof(sendBuffer));
     if (pos == 0)
     {
+        trace("MQTTSocketHandler::send_unsubscribe: failed writing header");
         return false;
     }
-    
-    sendBuffer[pos++] = (topic_length >> 8);
-    sendBuffer[pos++] = (topic_length & 0xFF);
 
-    memcpy(&sendBuffer[pos], topic, topic_length);
-    pos+=topic_length;
+    if (out_message_id != NULL)
+    {
+        *out_message_id = m_messageId;
+    }
 
     sendBuffer[pos++] = m_messageId >> 8;
     sendBuffer[pos++] = m_messageId & 0xFF;
 
-    if (out_message_id != NULL)
+    if (m_protocolVersion >= MQTT_PROTOCOL_V5)
     {
-        *out_message_id = m_messageId;
+        sendBuffer[pos++] = 0;
+    }
+
+    for (uint8_t i=0;i<count;++i)
+    {
+        pos = write_string(topics[i], strlen(topics[i]), sendBuffer, pos);
+    }
+    
+    m_messageId = (m_messageId == 0xFFFF) ? 1 : (m_messageId + 1);
+    
+    m_lastKeepaliveUs = to_us_since_boot(get_absolute_time());
+    
+    return send_downstream(sendBuffer, pos);
+}
+
+bool MQTTSocketHandlerBase::send_publish_header(const char *topic, uint32_t message_length, uint16_t *out_message_id)
+{
+    if (m_pendingSendDataLen > 0)
+    {
+        trace("MQTTSocketHandler::send_publish_header: attempting to send another message while previous was not fully sent, disconnecting.");
+        return false;
+    }
+
+    // queued publishes go first
+    if ((m_batchUsed > 0) && !flush_publishes())
+    {
+        return false;
+    }
+
+    trace("MQTTSocketHandler::send_publish_header: topic[%s], message_length[%d] message_id[%d]", safestr(topic), message_length, m_messageId);
+
+    if (!can_publish(message_length))
+    {
+        trace("MQTTSocketHandler::send_publish_header: in-flight window full, inflight[%d] used[%d], wait for on_pub_ack.", m_inflightCount, m_inflightUsed);
+        return false;
+    }
+    
+    uint16_t topic_length = strlen(topic);
+
+    bool alias_known = false;
+    uint16_t alias = find_alias(topic, topic_length, alias_known);
+
+    uint8_t sendBuffer[publish_header_size(topic_length, 1, 1, false) + MQTT_MAX_HEADER_SIZE] = {0};
+    uint32_t pos = write_publish_header(MQTTPUBLISH|MQTTQOS1|MQTTRETAIN, topic, topic_length, m_messageId, alias, alias_known, message_length, sendBuffer, sizeof(sendBuffer));
+
+    if (pos == 0)
+    {
+        return false;
+    }
+
+    if (out_message_id != NULL)
+    {
+        *out_message_id = m_messageId;
+    }
+
+    // retransmits go out on a new connection where aliases are gone, keep those with the full topic
+    uint8_t fullBuffer[sizeof(sendBuffer)];
+    uint8_t *header = sendBuffer;
+    uint32_t header_size = pos;
+    if (alias > 0)
+    {
+        header = fullBuffer;
+        header_size = write_publish_header(MQTTPUBLISH|MQTTQOS1|MQTTRETAIN, topic, topic_length, m_messageId, 0, false, message_length, fullBuffer, sizeof(fullBuffer));
+    }
+
+    if ((header_size == 0) || !track_publish(m_messageId, header, header_size, message_length))
+    {
+        return false;
+    }
+
+    if ((alias > 0) && !alias_known)
+    {
+        assign_alias(alias, topic, topic_length);
     }
     
     m_pendingSendDataLen = message_length;
@@ -596,10 +1453,10 @@ bool MQTTSocketHandler::send_publish_header(const char *topic, uint32_t message_
     m_messageId = (m_messageId == 0xFFFF) ? 1 : (m_messageId + 1);
     m_lastKeepaliveUs = to_us_since_boot(get_absolute_time());
     
-    return m_downstream->send(sendBuffer, pos);
+    return send_downstream(sendBuffer, pos);
 }
 
-bool MQTTSocketHandler::send_publish_data(uint8_t *data, size_t len)
+bool MQTTSocketHandlerBase::send_publish_data(uint8_t *data, size_t len)
 {
     if (m_pendingSendDataLen < len)
     {
@@ -608,9 +1465,11 @@ bool MQTTSocketHandler::send_publish_data(uint8_t *data, size_t len)
     }
 
     trace("MQTTSocketHandler::send_publish_data: len[%d]", len);
+
+    track_publish_data(data, len);
     
     m_pendingSendDataLen -= len;
-    if (!m_downstream->send(data, len))
+    if (!send_downstream(data, len))
     {
         return false;
     }
@@ -623,7 +1482,7 @@ bool MQTTSocketHandler::send_publish_data(uint8_t *data, size_t len)
     return true;
 }
 
-bool MQTTSocketHandler::send_ping()
+bool MQTTSocketHandlerBase::send_ping()
 {
     if (m_pendingSendDataLen > 0)
     {
@@ -632,6 +1491,11 @@ bool MQTTSocketHandler::send_ping()
     }
     
     m_pendingPing = false;
+
+    if ((m_batchUsed > 0) && !flush_publishes())
+    {
+        return false;
+    }
     
     uint32_t message_size = 0;
     uint8_t sendBuffer[MQTT_MAX_HEADER_SIZE] = {0};
@@ -639,11 +1503,555 @@ bool MQTTSocketHandler::send_ping()
     uint32_t pos = write_header(MQTTPINGREQ, message_size, sendBuffer, MQTT_BUFFER_SIZE);
 
     m_lastKeepaliveUs = to_us_since_boot(get_absolute_time());
-    return m_downstream->send(sendBuffer, pos);
+    return send_downstream(sendBuffer, pos);
+}
+
+
+bool MQTTSocketHandlerBase::send_disconnect()
+{
+    if ((m_batchUsed > 0) && !flush_publishes())
+    {
+        return false;
+    }
+
+    // broker drops the will message on a clean DISCONNECT
+    uint8_t sendBuffer[2] = { MQTTDISCONNECT, 0 };
+    return send_downstream(sendBuffer, sizeof(sendBuffer));
+}
+
+bool MQTTSocketHandlerBase::send_conn_ack(bool session_present, conn_ack_code_t code)
+{
+    trace("MQTTSocketHandler::send_conn_ack: session_present[%d] code[%d]", session_present, code);
+
+    uint8_t sendBuffer[4] = { MQTTCONNACK, 2, (uint8_t)(session_present ? 1 : 0), (uint8_t)code };
+    return send_downstream(sendBuffer, sizeof(sendBuffer));
+}
+
+bool MQTTSocketHandlerBase::queue_publish(const char *topic, const uint8_t *data, uint32_t len, uint8_t qos, bool retain, uint16_t *out_message_id)
+{
+    if (m_pendingSendDataLen > 0)
+    {
+        trace("MQTTSocketHandler::queue_publish: attempting to send another message while previous was not fully sent, disconnecting.");
+        return false;
+    }
+
+    uint16_t topic_length = strlen(topic);
+
+    // sized with the full topic and an alias, the alias is only picked once the publish is certain to be queued
+    uint32_t message_size = publish_header_size(topic_length, qos, 1, false) + len;
+
+    if (message_size + MQTT_MAX_HEADER_SIZE > MQTT_BATCH_BUFFER_SIZE)
+    {
+        trace("MQTTSocketHandler::queue_publish: topic[%s] message size[%d] larger then batch buffer[%d], use send_publish_header.", safestr(topic), message_size + MQTT_MAX_HEADER_SIZE, MQTT_BATCH_BUFFER_SIZE);
+        return false;
+    }
+
+    if ((qos > 0) && !can_publish(len))
+    {
+        trace("MQTTSocketHandler::queue_publish: in-flight window full, inflight[%d] used[%d], wait for on_pub_ack.", m_inflightCount, m_inflightUsed);
+        return false;
+    }
+
+    if ((m_batchUsed + message_size + MQTT_MAX_HEADER_SIZE > MQTT_BATCH_BUFFER_SIZE) && !flush_publishes())
+    {
+        return false;
+    }
+
+    bool alias_known = false;
+    uint16_t alias = find_alias(topic, topic_length, alias_known);
+
+    uint8_t *packet = &m_batchBuffer[m_batchUsed];
+    uint8_t type = MQTTPUBLISH | ((qos > 0) ? MQTTQOS1 : MQTTQOS0) | (retain ? MQTTRETAIN : 0);
+    uint32_t pos = write_publish_header(type, topic, topic_length, (qos > 0) ? m_messageId : 0, alias, alias_known, len, packet, MQTT_BATCH_BUFFER_SIZE - m_batchUsed);
+    if (pos == 0)
+    {
+        return false;
+    }
+
+    memcpy(&packet[pos], data, len);
+
+    if (qos > 0)
+    {
+        if (out_message_id != NULL)
+        {
+            *out_message_id = m_messageId;
+        }
+
+        // kept for retransmission as a header followed by its data, with the full topic when the batch uses an alias
+        uint8_t fullBuffer[publish_header_size(topic_length, qos, 0, false) + MQTT_MAX_HEADER_SIZE];
+        const uint8_t *header = packet;
+        uint32_t header_size = pos;
+        if (alias > 0)
+        {
+            header = fullBuffer;
+            header_size = write_publish_header(type, topic, topic_length, m_messageId, 0, false, len, fullBuffer, sizeof(fullBuffer));
+        }
+
+        if ((header_size == 0) || !track_publish(m_messageId, header, header_size, len))
+        {
+            return false;
+        }
+        track_publish_data(data, len);
+
+        m_messageId = (m_messageId == 0xFFFF) ? 1 : (m_messageId + 1);
+    }
+
+    if ((alias > 0) && !alias_known)
+    {
+        assign_alias(alias, topic, topic_length);
+    }
+
+    pos += len;
+
+    if (m_batchUsed == 0)
+    {
+        m_batchStartUs = to_us_since_boot(get_absolute_time());
+    }
+
+    m_batchUsed += pos;
+    m_batchStats.publishes++;
+    return true;
+}
+
+bool MQTTSocketHandlerBase::flush_publishes()
+{
+    if (m_batchUsed == 0)
+    {
+        return true;
+    }
+
+    if (m_debug)
+    {
+        trace("MQTTSocketHandler::flush_publishes: this=%p, bytes[%d]", this, m_batchUsed);
+    }
+
+    uint16_t len = m_batchUsed;
+    m_batchUsed = 0;
+
+    m_batchStats.writes++;
+    m_batchStats.bytes += len;
+
+    m_lastKeepaliveUs = to_us_since_boot(get_absolute_time());
+    return send_downstream(m_batchBuffer, len);
+}
+
+bool MQTTSocketHandlerBase::send_downstream(const uint8_t *data, size_t len)
+{
+    // ISessionSender returns an lwip error code, 0 is ERR_OK
+    return m_downstream->send(data, len) == 0;
+}
+
+bool MQTTSocketHandlerBase::finish_publish()
+{
+    uint8_t qos = m_receiveQos;
+    bool duplicate = m_receiveDuplicate;
+
+    m_receiveQos = 0;
+    m_receiveDuplicate = false;
+
+    if (qos == 1)
+    {
+        return queue_ack(MQTTPUBACK, m_receiveMessageId);
+    }
+
+    if (qos == 2)
+    {
+        // id is only remembered once the message was delivered, a partial delivery is redelivered in full
+        if (!duplicate)
+        {
+            m_qos2Ids[m_qos2Count++] = m_receiveMessageId;
+        }
+        return queue_ack(MQTTPUBREC, m_receiveMessageId);
+    }
+
+    return true;
+}
+
+int MQTTSocketHandlerBase::find_qos2(uint16_t message_id)
+{
+    for (uint8_t i=0;i<m_qos2Count;++i)
+    {
+        if (m_qos2Ids[i] == message_id)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+bool MQTTSocketHandlerBase::queue_ack(uint8_t message_type, uint16_t message_id)
+{
+    if ((m_ackBufferIdx + MQTT_ACK_SIZE > sizeof(m_ackBuffer)) && !flush_acks())
+    {
+        return false;
+    }
+
+    m_ackBuffer[m_ackBufferIdx++] = message_type;
+    m_ackBuffer[m_ackBufferIdx++] = 2;
+    m_ackBuffer[m_ackBufferIdx++] = message_id >> 8;
+    m_ackBuffer[m_ackBufferIdx++] = message_id & 0xFF;
+    return true;
+}
+
+bool MQTTSocketHandlerBase::flush_acks()
+{
+    if (m_ackBufferIdx == 0)
+    {
+        return true;
+    }
+
+    if (m_debug)
+    {
+        trace("MQTTSocketHandler::flush_acks: this=%p, acks[%d]", this, m_ackBufferIdx / MQTT_ACK_SIZE);
+    }
+
+    uint16_t len = m_ackBufferIdx;
+    m_ackBufferIdx = 0;
+    return send_downstream(m_ackBuffer, len);
+}
+
+bool MQTTSocketHandlerBase::can_publish(uint32_t message_length)
+{
+    if (m_inflightCount >= m_inflightWindow)
+    {
+        return false;
+    }
+
+    // messages that never fit are sent without a copy, others wait for room in the buffer
+    uint32_t packet_size = MQTT_MAX_HEADER_SIZE + MQTT_BUFFER_SIZE + message_length;
+    return (packet_size > MQTT_INFLIGHT_BUFFER_SIZE) || (m_inflightUsed + packet_size <= MQTT_INFLIGHT_BUFFER_SIZE);
+}
+
+bool MQTTSocketHandlerBase::track_publish(uint16_t message_id, const uint8_t *header, uint32_t header_size, uint32_t message_length)
+{
+    if (m_inflightCount >= MQTT_INFLIGHT_WINDOW)
+    {
+        return false;
+    }
+
+    InflightPublish& entry = m_inflight[m_inflightCount++];
+    entry.message_id = message_id;
+    entry.offset = m_inflightUsed;
+    entry.retained = (m_inflightUsed + header_size + message_length <= MQTT_INFLIGHT_BUFFER_SIZE);
+    entry.length = entry.retained ? (header_size + message_length) : 0;
+
+    if (entry.retained)
+    {
+        memcpy(&m_inflightBuffer[m_inflightUsed], header, header_size);
+        m_inflightUsed += header_size;
+    }
+
+    return true;
+}
+
+void MQTTSocketHandlerBase::track_publish_data(const uint8_t *data, size_t len)
+{
+    // keep a copy for retransmission, the publish being sent is always the newest entry
+    if ((m_inflightCount > 0) && m_inflight[m_inflightCount-1].retained)
+    {
+        memcpy(&m_inflightBuffer[m_inflightUsed], data, len);
+        m_inflightUsed += len;
+    }
+}
+
+void MQTTSocketHandlerBase::release_publish(uint8_t index)
+{
+    InflightPublish entry = m_inflight[index];
+
+    // keep packets packed, entries behind this one move down
+    if (entry.length > 0)
+    {
+        uint16_t end = entry.offset + entry.length;
+        memmove(&m_inflightBuffer[entry.offset], &m_inflightBuffer[end], m_inflightUsed - std::min(end, m_inflightUsed));
+        m_inflightUsed -= std::min(entry.length, m_inflightUsed);
+    }
+
+    if (index + m_inflightHeld >= m_inflightCount)
+    {
+        --m_inflightHeld;
+    }
+
+    for (uint8_t i=index+1;i<m_inflightCount;++i)
+    {
+        m_inflight[i].offset -= entry.length;
+        m_inflight[i-1] = m_inflight[i];
+    }
+    --m_inflightCount;
+}
+
+bool MQTTSocketHandlerBase::ack_publish(uint16_t message_id)
+{
+    for (uint8_t i=0;i<m_inflightCount;++i)
+    {
+        if (m_inflight[i].message_id == message_id)
+        {
+            release_publish(i);
+            return true;
+        }
+    }
+
+    trace("MQTTSocketHandler::ack_publish: PUBACK for unknown message_id[%d].", message_id);
+    return false;
+}
+
+bool MQTTSocketHandlerBase::resend_inflight()
+{
+    if (m_inflightUsed == 0)
+    {
+        return true;
+    }
+
+    for (uint8_t i=0;i<m_inflightCount;++i)
+    {
+        if (m_inflight[i].retained)
+        {
+            m_inflightBuffer[m_inflight[i].offset] |= MQTTDUP;
+        }
+    }
+
+    // a smaller Receive Maximum from the new CONNACK holds back the rest until PUBACKs free up the window
+    uint8_t count = std::min(m_inflightCount, m_inflightWindow);
+    uint16_t used = (count < m_inflightCount) ? m_inflight[count].offset : m_inflightUsed;
+    m_inflightHeld = m_inflightCount - count;
+
+    trace("MQTTSocketHandler::resend_inflight: resending publishes[%d] bytes[%d] held[%d].", count, used, m_inflightHeld);
+
+    // packets are packed back to back, one write for all of them
+    m_lastKeepaliveUs = to_us_since_boot(get_absolute_time());
+    return send_downstream(m_inflightBuffer, used);
 }
 
+bool MQTTSocketHandlerBase::resend_held()
+{
+    if ((m_inflightHeld == 0) || (m_inflightCount - m_inflightHeld >= m_inflightWindow))
+    {
+        return true;
+    }
+
+    InflightPublish& entry = m_inflight[m_inflightCount - m_inflightHeld];
+    --m_inflightHeld;
+
+    m_lastKeepaliveUs = to_us_since_boot(get_absolute_time());
+    return send_downstream(&m_inflightBuffer[entry.offset], entry.length);
+}
+
+uint16_t MQTTSocketHandlerBase::find_alias(const char *topic, uint16_t topic_length, bool& known)
+{
+    known = false;
+
+    // only allowed once a MQTT 5.0 broker sent Topic Alias Maximum
+    if ((m_outAliasMax == 0) || (topic_length == 0) || (topic_length > MQTT_TOPIC_ALIAS_SIZE))
+    {
+        return 0;
+    }
+
+    for (uint8_t i=0;i<m_outAliasCount;++i)
+    {
+        if ((m_outAliases[i].length == topic_length) && (memcmp(m_outAliases[i].topic, topic, topic_length) == 0))
+        {
+            known = true;
+            return i + 1;
+        }
+    }
+
+    // new topics take a free alias, once all are used the oldest assignment is replaced
+    return ((m_outAliasCount < m_outAliasMax) ? m_outAliasCount : m_outAliasNext) + 1;
+}
+
+void MQTTSocketHandlerBase::assign_alias(uint16_t alias, const char *topic, uint16_t topic_length)
+{
+    TopicAlias& entry = m_outAliases[alias - 1];
+    memcpy(entry.topic, topic, topic_length);
+    entry.length = topic_length;
+
+    if (m_outAliasCount < m_outAliasMax)
+    {
+        ++m_outAliasCount;
+    }
+    else
+    {
+        m_outAliasNext = (m_outAliasNext + 1) % m_outAliasMax;
+    }
+}
+
+uint32_t MQTTSocketHandlerBase::publish_header_size(uint16_t topic_length, uint8_t qos, uint16_t alias, bool alias_known)
+{
+    const int MQTT_MESSAGE_ID_SIZE = 2;
+    const int MQTT_TOPIC_LENGTH_SIZE = 2;
+    const int MQTT_TOPIC_ALIAS_PROPERTY_SIZE = 3;
+
+    uint32_t size = MQTT_TOPIC_LENGTH_SIZE + (alias_known ? 0 : topic_length) + ((qos > 0) ? MQTT_MESSAGE_ID_SIZE : 0);
+
+    // properties length, then the topic alias
+    if (m_protocolVersion >= MQTT_PROTOCOL_V5)
+    {
+        size += 1 + ((alias > 0) ? MQTT_TOPIC_ALIAS_PROPERTY_SIZE : 0);
+    }
+    return size;
+}
+
+uint32_t MQTTSocketHandlerBase::write_publish_header(uint8_t type, const char *topic, uint16_t topic_length, uint16_t message_id, uint16_t alias, bool alias_known, uint32_t message_length, uint8_t *buffer, size_t buffer_size)
+{
+    uint8_t qos = (type & (MQTTQOS1 | MQTTQOS2)) >> 1;
+    uint32_t header_size = publish_header_size(topic_length, qos, alias, alias_known);
+
+    uint32_t pos = write_header(type, header_size + message_length, buffer, buffer_size, message_length);
+    if (pos == 0)
+    {
+        return 0;
+    }
+
+    // an alias the broker already knows stands in for the topic
+    pos = write_string(topic, alias_known ? 0 : topic_length, buffer, pos);
+
+    if (qos > 0)
+    {
+        buffer[pos++] = message_id >> 8;
+        buffer[pos++] = message_id & 0xFF;
+    }
+
+    if (m_protocolVersion >= MQTT_PROTOCOL_V5)
+    {
+        if (alias > 0)
+        {
+            buffer[pos++] = 3;
+            buffer[pos++] = MQTT_PROP_TOPIC_ALIAS;
+            buffer[pos++] = alias >> 8;
+            buffer[pos++] = alias & 0xFF;
+        }
+        else
+        {
+            buffer[pos++] = 0;
+        }
+    }
+
+    return pos;
+}
+
+bool MQTTSocketHandlerBase::decode_properties(const uint8_t *buffer, uint32_t pos, uint32_t end, ReceivedProperties& properties)
+{
+    while (pos < end)
+    {
+        uint8_t id = buffer[pos++];
+        uint32_t size = 0;
+
+        switch (id)
+        {
+            // byte
+            case 0x01: case 0x17: case 0x19: case 0x24: case 0x25: case 0x28: case 0x29: case 0x2A: size = 1; break;
+            // two byte integer
+            case 0x13: case 0x21: case 0x22: case 0x23: size = 2; break;
+            // four byte integer
+            case 0x02: case 0x11: case 0x18: case 0x27: size = 4; break;
+            // variable byte integer
+            case 0x0B:
+            {
+                uint32_t value = 0;
+                if (!read_varint(buffer, end, pos, value))
+                {
+                    return false;
+                }
+                continue;
+            }
+            // string or binary data
+            case 0x03: case 0x08: case 0x09: case 0x12: case 0x15: case 0x16: case 0x1A: case 0x1C: case 0x1F:
+            {
+                if (pos + 2 > end)
+                {
+                    return false;
+                }
+                size = 2 + (buffer[pos] << 8) + buffer[pos+1];
+                break;
+            }
+            // user property, string pair
+            case 0x26:
+            {
+                if (pos + 2 > end)
+                {
+                    return false;
+                }
+                uint32_t second = pos + 2 + (buffer[pos] << 8) + buffer[pos+1];
+                if (second + 2 > end)
+                {
+                    return false;
+                }
+                size = second + 2 + (buffer[second] << 8) + buffer[second+1] - pos;
+                break;
+            }
+            default:
+            {
+                trace("MQTTSocketHandler::decode_properties: unknown property[0x%x].", id);
+                return false;
+            }
+        }
+
+        if (pos + size > end)
+        {
+            return false;
+        }
+
+        uint32_t value = 0;
+        if (size == 2)
+        {
+            value = (buffer[pos] << 8) + buffer[pos+1];
+        }
+
+        switch (id)
+        {
+            case MQTT_PROP_RECEIVE_MAXIMUM: properties.receive_maximum = value; break;
+            case MQTT_PROP_TOPIC_ALIAS_MAXIMUM: properties.topic_alias_maximum = value; break;
+            case MQTT_PROP_TOPIC_ALIAS: properties.topic_alias = value; break;
+            case MQTT_PROP_SERVER_KEEP_ALIVE: properties.server_keep_alive = value; break;
+            default: break;
+        }
+
+        pos += size;
+    }
+
+    return true;
+}
+
+bool MQTTSocketHandlerBase::read_varint(const uint8_t *buffer, uint32_t end, uint32_t& pos, uint32_t& value)
+{
+    uint32_t result = 0;
+    for (uint32_t i=0;i<4;++i)
+    {
+        if (pos + i >= end)
+        {
+            return false;
+        }
+
+        result |= ((uint32_t)(buffer[pos + i] & 0x7F)) << (7 * i);
+        if ((buffer[pos + i] & 0x80) == 0)
+        {
+            pos += i + 1;
+            value = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool MQTTSocketHandlerBase::read_string(const uint8_t *buffer, uint32_t end, uint32_t& pos, const uint8_t*& value, uint16_t& length)
+{
+    if (pos + 2 > end)
+    {
+        return false;
+    }
+
+    uint16_t string_length = (buffer[pos] << 8) + buffer[pos+1];
+    if (pos + 2 + string_length > end)
+    {
+        return false;
+    }
+
+    value = &buffer[pos + 2];
+    length = string_length;
+    pos += 2 + string_length;
+    return true;
+}
 
-uint16_t MQTTSocketHandler::write_string(const char* msg, uint16_t len, uint8_t* buffer, uint16_t pos)
+uint16_t MQTTSocketHandlerBase::write_string(const char* msg, uint16_t len, uint8_t* buffer, uint16_t pos)
 {    
     buffer[pos++] = len >> 8;
     buffer[pos++] = len & 0xff;
@@ -653,7 +2061,7 @@ uint16_t MQTTSocketHandler::write_string(const char* msg, uint16_t len, uint8_t*
     return pos;
 }
 
-uint32_t MQTTSocketHandler::write_header(uint8_t message_type, uint32_t message_size, uint8_t *buffer, size_t buffer_size, size_t laterBytes)
+uint32_t MQTTSocketHandlerBase::write_header(uint8_t message_type, uint32_t message_size, uint8_t *buffer, size_t buffer_size, size_t laterBytes)
 {
     if (message_size - laterBytes + 5 > buffer_size)
     {
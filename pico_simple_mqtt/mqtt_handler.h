@@ -36,13 +36,73 @@ SOFTWARE.
 #define MQTTQOS2 0x04
 #define MQTTRETAIN 0x01
 
+#define MQTTDUP 0x08
+
+#define MQTT_PROTOCOL_V311 4
+#define MQTT_PROTOCOL_V5 5
+
 #define MQTT_MAX_HEADER_SIZE 5
+
+// Receive buffer of MQTTSocketHandler, use MQTTSocketHandlerT for other sizes. Outgoing CONNECT/SUBSCRIBE packets are limited to it as well.
 #define MQTT_BUFFER_SIZE 256
 
+// Unacknowledged QoS 1 publishes allowed at once, send_publish_header is refused beyond that.
+#ifndef MQTT_INFLIGHT_WINDOW
+#define MQTT_INFLIGHT_WINDOW 8
+#endif
+
+// Copies of in-flight publishes kept for retransmission, larger messages are sent once and not retransmitted.
+#ifndef MQTT_INFLIGHT_BUFFER_SIZE
+#define MQTT_INFLIGHT_BUFFER_SIZE 1024
+#endif
+
+// QoS 2 packet ids received and not yet released by PUBREL, further QoS 2 publishes are refused beyond that.
+#ifndef MQTT_QOS2_RECEIVE_MAX
+#define MQTT_QOS2_RECEIVE_MAX 16
+#endif
+
+// PUBACK/PUBREC/PUBCOMP packets collected while decoding received data, sent in one write.
+#ifndef MQTT_ACK_BATCH
+#define MQTT_ACK_BATCH 16
+#endif
+
+#define MQTT_ACK_SIZE 4
+
+// Complete PUBLISH packets queued by queue_publish are encoded back to back here and sent in one write.
+#ifndef MQTT_BATCH_BUFFER_SIZE
+#define MQTT_BATCH_BUFFER_SIZE 512
+#endif
+
+// Longest a queued publish waits in the batch before update() sends it.
+#ifndef MQTT_BATCH_DELAY_MS
+#define MQTT_BATCH_DELAY_MS 20
+#endif
+
+// MQTT 5.0 topic aliases kept per direction, publishes to longer topics always carry the topic.
+#ifndef MQTT_TOPIC_ALIASES
+#define MQTT_TOPIC_ALIASES 8
+#endif
+
+#ifndef MQTT_TOPIC_ALIAS_SIZE
+#define MQTT_TOPIC_ALIAS_SIZE 64
+#endif
+
+// MQTT 5.0 session expiry requested when connecting without clean session, 3.1.1 sessions never expire.
+#ifndef MQTT_SESSION_EXPIRY_SECONDS
+#define MQTT_SESSION_EXPIRY_SECONDS 3600
+#endif
+
+// Topics send_connect_subscribe can subscribe to, one SUBSCRIBE (and SUBACK) each.
+#ifndef MQTT_STARTUP_TOPICS
+#define MQTT_STARTUP_TOPICS 8
+#endif
+
 enum class SocketState
 {
     WAIT_PACKET,
     WAIT_DATA,
+    WAIT_TOPIC,
+    SKIP_DATA,
 };
 
 enum conn_ack_code_t
@@ -55,6 +115,44 @@ enum conn_ack_code_t
     NOT_AUTHORIZED = 0x05,
 };
 
+// MQTT 5.0 reason codes, failures are 0x80 and above.
+enum mqtt_reason_code_t
+{
+    MQTT_RC_SUCCESS = 0x00,
+    MQTT_RC_NO_MATCHING_SUBSCRIBERS = 0x10,
+    MQTT_RC_NO_SUBSCRIPTION_EXISTED = 0x11,
+    MQTT_RC_UNSPECIFIED_ERROR = 0x80,
+    MQTT_RC_MALFORMED_PACKET = 0x81,
+    MQTT_RC_PROTOCOL_ERROR = 0x82,
+    MQTT_RC_IMPLEMENTATION_SPECIFIC_ERROR = 0x83,
+    MQTT_RC_NOT_AUTHORIZED = 0x87,
+    MQTT_RC_SERVER_BUSY = 0x89,
+    MQTT_RC_SERVER_SHUTTING_DOWN = 0x8B,
+    MQTT_RC_KEEP_ALIVE_TIMEOUT = 0x8D,
+    MQTT_RC_SESSION_TAKEN_OVER = 0x8E,
+    MQTT_RC_TOPIC_FILTER_INVALID = 0x8F,
+    MQTT_RC_TOPIC_NAME_INVALID = 0x90,
+    MQTT_RC_PACKET_ID_IN_USE = 0x91,
+    MQTT_RC_PACKET_ID_NOT_FOUND = 0x92,
+    MQTT_RC_RECEIVE_MAXIMUM_EXCEEDED = 0x93,
+    MQTT_RC_TOPIC_ALIAS_INVALID = 0x94,
+    MQTT_RC_PACKET_TOO_LARGE = 0x95,
+    MQTT_RC_QUOTA_EXCEEDED = 0x97,
+    MQTT_RC_PAYLOAD_FORMAT_INVALID = 0x99,
+    MQTT_RC_QOS_NOT_SUPPORTED = 0x9B,
+    MQTT_RC_USE_ANOTHER_SERVER = 0x9C,
+    MQTT_RC_SERVER_MOVED = 0x9D,
+};
+
+enum mqtt_property_t
+{
+    MQTT_PROP_SESSION_EXPIRY_INTERVAL = 0x11,
+    MQTT_PROP_SERVER_KEEP_ALIVE = 0x13,
+    MQTT_PROP_RECEIVE_MAXIMUM = 0x21,
+    MQTT_PROP_TOPIC_ALIAS_MAXIMUM = 0x22,
+    MQTT_PROP_TOPIC_ALIAS = 0x23,
+};
+
 enum mqtt_message_type_t
 {
     MQTTCONNECT = 0x10,
@@ -74,17 +172,62 @@ enum mqtt_message_type_t
     MQTTRESERVED = 0xF0,
 };
 
+// CONNECT flags
+#define MQTT_CONNECT_CLEAN_SESSION 0x02
+#define MQTT_CONNECT_WILL 0x04
+#define MQTT_CONNECT_WILL_RETAIN 0x20
+#define MQTT_CONNECT_PASS 0x40
+#define MQTT_CONNECT_USER 0x80
+
+#define MQTT_CONNECT_WILL_QOS(flags) (((flags) >> 3) & 0x03)
+
+// CONNECT received in server mode, strings point into the receive buffer and are not NUL terminated.
+// Only the protocol level and flags are decoded for protocol levels other then MQTT_PROTOCOL_V311.
+struct MQTTConnectInfo
+{
+    uint8_t protocol_level;
+    uint8_t flags;
+    uint16_t keepalive_seconds;
+    const uint8_t *client_id;
+    uint16_t client_id_length;
+    const uint8_t *will_topic;
+    uint16_t will_topic_length;
+    const uint8_t *will_message;
+    uint16_t will_message_length;
+    const uint8_t *user;
+    uint16_t user_length;
+    const uint8_t *pass;
+    uint16_t pass_length;
+};
+
 class MQTTSocketInterface
 {
 public:
     // Return true if handling successful, return false if you want processing to fail and lead to disconnect.
     virtual bool on_pub_ack(uint16_t message_id) { return true; }
     virtual bool on_sub_ack(uint16_t message_id) { return true; }
+    virtual bool on_unsub_ack(uint16_t message_id) { return true; }
+    // MQTT 5.0 brokers refuse connections with reason codes (0x80 and above) instead of conn_ack_code_t values.
     virtual bool on_conn_ack(conn_ack_code_t code, uint8_t flags) { return true; }
+
+    // Failure reason codes of PUBACK, SUBACK (per filter, 3.1.1 reports 0x80) and UNSUBACK, and the reason the peer sends DISCONNECT.
+    virtual bool on_reason_code(uint8_t message_type, uint16_t message_id, mqtt_reason_code_t reason_code) { return true; }
+
+    // Server mode only. Answer on_connect with send_conn_ack.
+    virtual bool on_connect(const MQTTConnectInfo& info) { return true; }
+    // Server mode only, called per filter. Returns the granted QoS or 0x80, SUBACK is sent once all filters were seen
+    // and followed by on_subscribed, a good time to send retained messages.
+    virtual uint8_t on_subscribe(uint16_t message_id, const uint8_t *filter, uint16_t filter_length, uint8_t qos) { return MQTT_RC_UNSPECIFIED_ERROR; }
+    virtual bool on_subscribed(uint16_t message_id) { return true; }
+    // Server mode only, called per filter before UNSUBACK.
+    virtual bool on_unsubscribe(uint16_t message_id, const uint8_t *filter, uint16_t filter_length) { return true; }
     
     virtual bool on_ping_req() { return true; }
     virtual bool on_ping_resp() { return true; }
 
+    // Topics that do not fit the receive buffer arrive in pieces through on_publish_topic, on_publish_header then has topic NULL.
+    // Returning false from any of them stops decoding and closes the connection.
+    virtual bool on_publish_topic(const uint8_t *data, uint16_t len, uint16_t offset, uint16_t topic_length) { return true; }
     virtual bool on_publish_header(uint8_t *topic, uint16_t topic_length, uint16_t message_id, uint32_t message_length) { return true; }
     virtual bool on_publish_data(uint8_t *data, uint32_t len, bool last_chunk) { return true; }
 
@@ -93,20 +236,121 @@ public:
     virtual void on_connected() {};
 };
 
-class MQTTSocketHandler
+struct MQTTBatchStats
+{
+    uint32_t publishes;
+    uint32_t writes;
+    uint32_t bytes;
+};
+
+struct MQTTStartupStats
+{
+    // times are relative to send_connect/send_connect_subscribe, 0 until reached
+    uint64_t start_us;
+    uint64_t conn_ack_us;
+    uint64_t subscribed_us;
+    uint64_t first_publish_us;
+    bool first_publish;
+
+    uint8_t subscriptions;
+    uint8_t granted;
+    uint8_t refused;
+    uint8_t writes;
+};
+
+///
+/// MQTT client protocol handling (or the broker side, see set_server_mode), the receive buffer is provided by MQTTSocketHandlerT.
+///
+/// Publishes are never buffered whole: topics longer then the receive buffer are handed upstream in pieces
+/// and message data is handed through as it arrives. Other packets larger then the buffer are decoded
+/// from the part that fits (ids and leading reason codes) and the rest is skipped.
+///
+class MQTTSocketHandlerBase
     : public ISessionCallback
 {
 public:
-    MQTTSocketHandler() {};
+    MQTTSocketHandlerBase(uint8_t *recv_buffer, uint16_t recv_buffer_size) : m_recvBufferSize(recv_buffer_size), m_recvBuffer(recv_buffer) {};
+
+    ///
+    /// MQTT_PROTOCOL_V311 (default) or MQTT_PROTOCOL_V5, set before send_connect.
+    /// With MQTT 5.0 publishes use topic aliases once the broker allows them in CONNACK (Topic Alias Maximum),
+    /// repeated publishes to a topic then carry 2 topic bytes plus the alias.
+    /// The broker Receive Maximum narrows the in-flight window.
+    ///
+    void set_protocol_version(uint8_t version) { m_protocolVersion = version; }
+    uint8_t get_protocol_version() { return m_protocolVersion; }
+
+    ///
+    /// Server role for a broker, MQTT 3.1.1 only. CONNECT, SUBSCRIBE and UNSUBSCRIBE are decoded and reported upstream,
+    /// SUBACK, UNSUBACK and PINGRESP are sent by the handler and update() sends no PINGREQ.
+    ///
+    void set_server_mode(bool server) { m_serverMode = server; }
+    bool is_server_mode() { return m_serverMode; }
+    bool send_conn_ack(bool session_present, conn_ack_code_t code);
+
+    ///
+    /// Fixed header flags (QoS and RETAIN) of the publish being received, valid from on_publish_header until its last on_publish_data.
+    ///
+    uint8_t get_publish_flags() { return m_receiveFlags; }
+
+    ///
+    /// Time of the last on_recv, for keepalive checks of the peer.
+    ///
+    uint64_t get_last_recv_us() { return m_lastRecvUs; }
 
     bool send_connect(bool clean_session, uint8_t keepalive_seconds, const char *id = NULL, const char *will_topic = NULL, const char *will_message = NULL, const char *user = NULL, const char *pass = NULL);
     bool send_subscribe(const char *topic);
+
+    ///
+    /// CONNECT followed by a SUBSCRIBE per topic in a single write (more only if they do not fit MQTT_BATCH_BUFFER_SIZE),
+    /// instead of waiting for CONNACK and each SUBACK in turn. MQTT lets clients send packets right behind CONNECT,
+    /// the broker handles them once the connection is accepted.
+    ///
+    /// SUBACKs are matched as they arrive, on_sub_ack/on_reason_code still go upstream. Progress and startup latency
+    /// (CONNACK, last startup SUBACK, first publish) are in get_startup_stats.
+    ///
+    bool send_connect_subscribe(const char **topics, uint8_t count, uint8_t qos, bool clean_session, uint8_t keepalive_seconds, const char *id, const char *will_topic = NULL, const char *will_message = NULL, const char *user = NULL, const char *pass = NULL);
+    const MQTTStartupStats& get_startup_stats() { return m_startup; }
+    bool is_subscribed() { return (m_startup.subscriptions > 0) && (m_startupPending == 0) && (m_startup.refused == 0); }
+
+    ///
+    /// Subscribe/unsubscribe several filters in one packet, acknowledged with a single on_sub_ack/on_unsub_ack for out_message_id.
+    ///
+    bool send_subscribe(const char **topics, uint8_t count, uint8_t qos = 1, uint16_t *out_message_id = NULL);
+    bool send_unsubscribe(const char **topics, uint8_t count, uint16_t *out_message_id = NULL);
     bool send_publish_header(const char *topic, uint32_t message_length, uint16_t *out_message_id = NULL);
     bool send_publish_data(uint8_t *data, size_t len);
     bool send_ping();
+    bool send_disconnect();
+
+    ///
+    /// Queue a complete publish for the next batched write, for many small messages (sensor readings and alike).
+    /// The batch is sent when the next publish does not fit, once the oldest publish waited the batch delay (from update),
+    /// or before any other packet so order is kept. QoS 1 publishes take part in the in-flight window like send_publish_header.
+    ///
+    /// @returns - false if message does not fit MQTT_BATCH_BUFFER_SIZE (use send_publish_header), or window is full.
+    ///
+    bool queue_publish(const char *topic, const uint8_t *data, uint32_t len, uint8_t qos = 1, bool retain = false, uint16_t *out_message_id = NULL);
+    bool flush_publishes();
+    void set_batch_delay(uint32_t delay_ms) { m_batchDelayUs = (uint64_t)delay_ms * 1000; }
+    const MQTTBatchStats& get_batch_stats() { return m_batchStats; }
+
+    ///
+    /// Backpressure for QoS 1 publishes, false while the in-flight window (or its retransmit buffer) is full.
+    /// Room is made by PUBACKs, reported through on_pub_ack.
+    ///
+    bool can_publish(uint32_t message_length);
+    uint8_t get_inflight_count() { return m_inflightCount; }
+    uint8_t get_inflight_window() { return m_inflightWindow; }
 
     bool update(uint64_t now_us);
     void reset();
+
+    ///
+    /// reset() keeps unacknowledged publishes, the message id and QoS 2 ids to resume the session on the next connection.
+    /// This drops them as well, for a connection that starts a new session (clean session, or a reused broker slot).
+    ///
+    void clear_session();
     
     void set_upstream(MQTTSocketInterface *upstream) { m_upstream = upstream; }
     void set_downstream(ISessionSender *downstream) { m_downstream = downstream; }
@@ -127,24 +371,146 @@ private:
     bool decode_conn_ack(uint8_t*& data, size_t& len, uint32_t msg_size, uint32_t pos, uint32_t startPosition);
     bool decode_pubsub_ack(uint8_t*& data, size_t& len, uint32_t msg_size, uint32_t pos, uint32_t startPosition, uint8_t message_type);
     bool decode_ping(uint8_t*& data, size_t& len, uint32_t msg_size, uint32_t pos, uint32_t startPosition, uint8_t message_type);
+    bool stream_topic(uint8_t* data, uint32_t len);
+    bool decode_disconnect(uint8_t*& data, size_t& len, uint32_t msg_size, uint32_t pos, uint32_t startPosition);
+    bool decode_connect(uint8_t*& data, size_t& len, uint32_t msg_size, uint32_t pos, uint32_t startPosition);
+    bool decode_subscribe(uint8_t*& data, size_t& len, uint32_t msg_size, uint32_t pos, uint32_t startPosition, uint8_t message_type);
     bool decode_unhandled(uint8_t*& data, size_t& len, uint32_t msg_size, uint32_t pos, uint32_t startPosition, uint8_t message_type);
 
+    struct ReceivedProperties
+    {
+        uint32_t receive_maximum;
+        uint32_t topic_alias_maximum;
+        uint32_t topic_alias;
+        uint32_t server_keep_alive;
+    };
+
+    static bool decode_properties(const uint8_t *buffer, uint32_t pos, uint32_t end, ReceivedProperties& properties);
+    static bool read_varint(const uint8_t *buffer, uint32_t end, uint32_t& pos, uint32_t& value);
+    static bool read_string(const uint8_t *buffer, uint32_t end, uint32_t& pos, const uint8_t*& value, uint16_t& length);
+
+    uint16_t find_alias(const char *topic, uint16_t topic_length, bool& known);
+    void assign_alias(uint16_t alias, const char *topic, uint16_t topic_length);
+    uint32_t publish_header_size(uint16_t topic_length, uint8_t qos, uint16_t alias, bool alias_known);
+    uint32_t write_publish_header(uint8_t type, const char *topic, uint16_t topic_length, uint16_t message_id, uint16_t alias, bool alias_known, uint32_t message_length, uint8_t *buffer, size_t buffer_size);
+
+    uint32_t write_connect(bool clean_session, uint8_t keepalive_seconds, const char *id, const char *will_topic, const char *will_message, const char *user, const char *pass, uint8_t *buffer, size_t buffer_size);
+    uint32_t write_subscribe(const char **topics, uint8_t count, uint8_t qos, uint8_t *buffer, size_t buffer_size, uint16_t *out_message_id);
+    void track_startup_sub_ack(uint16_t message_id, bool refused);
+
+    bool send_downstream(const uint8_t *data, size_t len);
+
+    bool queue_ack(uint8_t message_type, uint16_t message_id);
+    bool flush_acks();
+    bool finish_publish();
+    int find_qos2(uint16_t message_id);
+
+    bool track_publish(uint16_t message_id, const uint8_t *header, uint32_t header_size, uint32_t message_length);
+    void track_publish_data(const uint8_t *data, size_t len);
+    void release_publish(uint8_t index);
+    bool ack_publish(uint16_t message_id);
+    bool resend_inflight();
+    bool resend_held();
+
     static uint16_t write_string(const char* msg, uint16_t len, uint8_t* buffer, uint16_t pos);
     static uint32_t write_header(uint8_t message_type, uint32_t message_size, uint8_t *buffer, size_t buffer_size, size_t laterBytes=0);
 
     bool m_debug = false;
+    uint8_t m_protocolVersion = MQTT_PROTOCOL_V311;
+    bool m_serverMode = false;
+    uint64_t m_lastRecvUs = 0;
     bool m_pendingPing = false;
     uint8_t m_keepaliveSeconds = 0;
     uint16_t m_messageId = 1;
     uint16_t m_recvBufferIdx = 0;
-    uint8_t m_recvBuffer[MQTT_BUFFER_SIZE];
+    uint16_t m_recvBufferSize;
+    uint8_t *m_recvBuffer;
+
+    // publish with a topic longer then the receive buffer, rest of its header is decoded once the topic passed
+    uint8_t m_streamFlags = 0;
+    uint16_t m_streamTopicLength = 0;
+    uint16_t m_streamTopicOffset = 0;
+    uint32_t m_streamRemaining = 0;
+
+    // tail of a control packet larger then the receive buffer
+    uint32_t m_skipDataLen = 0;
 
     SocketState m_state = SocketState::WAIT_PACKET;
     uint64_t m_lastKeepaliveUs = 0;
     uint32_t m_pendingDataLen = 0;
     uint32_t m_pendingSendDataLen = 0;
 
+    struct InflightPublish
+    {
+        uint16_t message_id;
+        uint16_t offset;
+        uint16_t length;
+        bool retained;
+    };
+
+    // retained packets are kept in send order and packed at the start of m_inflightBuffer
+    uint8_t m_inflightWindow = MQTT_INFLIGHT_WINDOW;
+    uint8_t m_inflightCount = 0;
+    uint16_t m_inflightUsed = 0;
+
+    // newest entries not resent yet, waiting for the broker's Receive Maximum
+    uint8_t m_inflightHeld = 0;
+    InflightPublish m_inflight[MQTT_INFLIGHT_WINDOW];
+    uint8_t m_inflightBuffer[MQTT_INFLIGHT_BUFFER_SIZE];
+
+    uint16_t m_batchUsed = 0;
+    uint64_t m_batchStartUs = 0;
+    uint64_t m_batchDelayUs = (uint64_t)MQTT_BATCH_DELAY_MS * 1000;
+    MQTTBatchStats m_batchStats = {0, 0, 0};
+
+    // SUBSCRIBEs of send_connect_subscribe still waiting for SUBACK
+    MQTTStartupStats m_startup = {};
+    uint8_t m_startupPending = 0;
+    uint16_t m_startupIds[MQTT_STARTUP_TOPICS];
+    uint8_t m_batchBuffer[MQTT_BATCH_BUFFER_SIZE];
+
+    // publish being received, acknowledged once all data was delivered
+    uint8_t m_receiveFlags = 0;
+    uint8_t m_receiveQos = 0;
+    uint16_t m_receiveMessageId = 0;
+    bool m_receiveDuplicate = false;
+
+    uint8_t m_qos2Count = 0;
+    uint16_t m_qos2Ids[MQTT_QOS2_RECEIVE_MAX];
+
+    struct TopicAlias
+    {
+        uint8_t length = 0;
+        char topic[MQTT_TOPIC_ALIAS_SIZE];
+    };
+
+    // alias n is entry n-1, both tables are only valid for the current connection
+    uint8_t m_outAliasMax = 0;
+    uint8_t m_outAliasCount = 0;
+    uint8_t m_outAliasNext = 0;
+    TopicAlias m_outAliases[MQTT_TOPIC_ALIASES];
+    TopicAlias m_inAliases[MQTT_TOPIC_ALIASES];
+
+    uint16_t m_ackBufferIdx = 0;
+    uint8_t m_ackBuffer[MQTT_ACK_BATCH * MQTT_ACK_SIZE];
+
     MQTTSocketInterface *m_upstream = NULL;
     ISessionSender *m_downstream = NULL;
 };
 
+///
+/// MQTTSocketHandlerBase with a receive buffer of RecvBufferSize bytes, memory use is fixed by it regardless of topic or message sizes.
+///
+template<uint16_t RecvBufferSize>
+class MQTTSocketHandlerT
+    : public MQTTSocketHandlerBase
+{
+public:
+    MQTTSocketHandlerT() : MQTTSocketHandlerBase(m_recvStorage, RecvBufferSize) {};
+
+private:
+    static_assert(RecvBufferSize >= 16, "MQTT receive buffer must hold at least a packet header, packet id and reason codes");
+    uint8_t m_recvStorage[RecvBufferSize];
+};
+
+typedef MQTTSocketHandlerT<MQTT_BUFFER_SIZE> MQTTSocketHandler;
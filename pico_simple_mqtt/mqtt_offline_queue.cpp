@@ -0,0 +1,516 @@
+/* MIT License
+
+Copyright (c) 2024 Adrian Cruceru - https://github.com/AdrianCX/pico_https
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include <algorithm>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include "stdlib.h"
+#include <cstdint>
+
+#define FLASH_SECTOR_SIZE 4096
+#define FLASH_PAGE_SIZE 256
+#else
+#include "pico/stdlib.h"
+#include "pico/flash.h"
+#include "hardware/flash.h"
+#endif
+
+#include "mqtt_offline_queue.h"
+
+extern "C" void trace(const char *parameters, ...);
+extern "C" const char *safestr(const char *value);
+
+#if defined(__x86_64__) || defined(_M_X64)
+
+// Host builds keep the region in RAM, programming only clears bits the same as NOR flash.
+static struct HostFlash
+{
+    HostFlash() { memset(data, 0xFF, sizeof(data)); }
+    uint8_t data[MQTT_OFFLINE_SECTORS * FLASH_SECTOR_SIZE];
+} s_hostFlash;
+
+static const uint8_t *flash_contents(uint32_t offset)
+{
+    return &s_hostFlash.data[offset];
+}
+
+static bool flash_erase_sector(uint32_t offset)
+{
+    memset(&s_hostFlash.data[offset], 0xFF, FLASH_SECTOR_SIZE);
+    return true;
+}
+
+static bool flash_program_page(uint32_t offset, const uint8_t *page)
+{
+    for (uint32_t i=0;i<FLASH_PAGE_SIZE;++i)
+    {
+        s_hostFlash.data[offset + i] &= page[i];
+    }
+    return true;
+}
+
+#else
+
+struct FlashOperation
+{
+    uint32_t offset;
+    const uint8_t *data;
+};
+
+static void erase_sector_unsafe(void *param)
+{
+    FlashOperation *operation = (FlashOperation *)param;
+    flash_range_erase(operation->offset, FLASH_SECTOR_SIZE);
+}
+
+static void program_page_unsafe(void *param)
+{
+    FlashOperation *operation = (FlashOperation *)param;
+    flash_range_program(operation->offset, operation->data, FLASH_PAGE_SIZE);
+}
+
+static const uint8_t *flash_contents(uint32_t offset)
+{
+    return (const uint8_t *)(XIP_BASE + MQTT_OFFLINE_FLASH_OFFSET + offset);
+}
+
+static bool flash_erase_sector(uint32_t offset)
+{
+    FlashOperation operation = { MQTT_OFFLINE_FLASH_OFFSET + offset, NULL };
+    int rc = flash_safe_execute(erase_sector_unsafe, &operation, UINT32_MAX);
+    if (rc != PICO_OK)
+    {
+        trace("MQTTOfflineQueue: failed erasing sector at offset[0x%x] rc[%d].", operation.offset, rc);
+        return false;
+    }
+    return true;
+}
+
+static bool flash_program_page(uint32_t offset, const uint8_t *page)
+{
+    FlashOperation operation = { MQTT_OFFLINE_FLASH_OFFSET + offset, page };
+    int rc = flash_safe_execute(program_page_unsafe, &operation, UINT32_MAX);
+    if (rc != PICO_OK)
+    {
+        trace("MQTTOfflineQueue: failed programming page at offset[0x%x] rc[%d].", operation.offset, rc);
+        return false;
+    }
+    return true;
+}
+
+#endif
+
+///
+/// Program bytes at any offset, each page touched is programmed with 0xFF around the new bytes so nothing else changes.
+///
+static bool flash_program(uint32_t offset, const uint8_t *data, uint32_t len)
+{
+    uint8_t page[FLASH_PAGE_SIZE];
+
+    while (len > 0)
+    {
+        uint32_t page_offset = offset % FLASH_PAGE_SIZE;
+        uint32_t count = std::min(len, (uint32_t)(FLASH_PAGE_SIZE - page_offset));
+
+        memset(page, 0xFF, sizeof(page));
+        memcpy(&page[page_offset], data, count);
+
+        if (!flash_program_page(offset - page_offset, page))
+        {
+            return false;
+        }
+
+        offset += count;
+        data += count;
+        len -= count;
+    }
+
+    return true;
+}
+
+uint16_t MQTTOfflineQueue::crc(const uint8_t *data, uint32_t len, uint16_t crc)
+{
+    // CRC-16/CCITT
+    for (uint32_t i=0;i<len;++i)
+    {
+        crc ^= (uint16_t)data[i] << 8;
+        for (int bit=0;bit<8;++bit)
+        {
+            crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1);
+        }
+    }
+    return crc;
+}
+
+uint16_t MQTTOfflineQueue::record_crc(const RecordHeader *record)
+{
+    // flags and lengths, then topic and data following the header
+    uint16_t value = crc(((const uint8_t *)record) + 1, 5, 0xFFFF);
+    return crc((const uint8_t *)(record + 1), record->topic_length + record->data_length, value);
+}
+
+const MQTTOfflineQueue::SectorHeader *MQTTOfflineQueue::sector_header(uint16_t sector)
+{
+    return (const SectorHeader *)flash_contents(sector * FLASH_SECTOR_SIZE);
+}
+
+const MQTTOfflineQueue::RecordHeader *MQTTOfflineQueue::record_at(uint16_t sector, uint32_t offset)
+{
+    return (const RecordHeader *)flash_contents(sector * FLASH_SECTOR_SIZE + offset);
+}
+
+bool MQTTOfflineQueue::open_sector(uint16_t sector)
+{
+    if (!flash_erase_sector(sector * FLASH_SECTOR_SIZE))
+    {
+        return false;
+    }
+    m_stats.erases++;
+
+    SectorHeader header = { MQTT_OFFLINE_MAGIC, ++m_sequence };
+    if (!flash_program(sector * FLASH_SECTOR_SIZE, (const uint8_t *)&header, sizeof(header)))
+    {
+        return false;
+    }
+
+    m_headSector = sector;
+    m_headOffset = sizeof(SectorHeader);
+
+    // the drain sector only gets erased once all of it is retired, continue with what is still undelivered
+    if (m_drainSector == sector)
+    {
+        m_drainSector = oldest_live_sector();
+        m_drainOffset = sizeof(SectorHeader);
+    }
+    return true;
+}
+
+uint16_t MQTTOfflineQueue::oldest_live_sector()
+{
+    // the ring is written in order, so the first live sector after the head is the oldest
+    for (uint16_t i=1;i<MQTT_OFFLINE_SECTORS;++i)
+    {
+        uint16_t sector = (m_headSector + i) % MQTT_OFFLINE_SECTORS;
+        if (sector_live(sector))
+        {
+            return sector;
+        }
+    }
+    return m_headSector;
+}
+
+bool MQTTOfflineQueue::format()
+{
+    trace("MQTTOfflineQueue::format: this=%p", this);
+
+    for (uint16_t sector=0;sector<MQTT_OFFLINE_SECTORS;++sector)
+    {
+        if (!flash_erase_sector(sector * FLASH_SECTOR_SIZE))
+        {
+            return false;
+        }
+    }
+
+    m_sequence = 0;
+    m_pendingCount = 0;
+    m_drainSector = 0;
+    m_drainOffset = sizeof(SectorHeader);
+    return open_sector(0);
+}
+
+bool MQTTOfflineQueue::open()
+{
+    bool found = false;
+    for (uint16_t sector=0;sector<MQTT_OFFLINE_SECTORS;++sector)
+    {
+        const SectorHeader *header = sector_header(sector);
+        if ((header->magic == MQTT_OFFLINE_MAGIC) && (!found || (header->sequence > m_sequence)))
+        {
+            found = true;
+            m_sequence = header->sequence;
+            m_headSector = sector;
+        }
+    }
+
+    if (!found)
+    {
+        return format();
+    }
+
+    // append position, after the last record written in the newest sector
+    m_headOffset = sizeof(SectorHeader);
+    while (m_headOffset + sizeof(RecordHeader) <= FLASH_SECTOR_SIZE)
+    {
+        const RecordHeader *record = record_at(m_headSector, m_headOffset);
+        if (record->state == RECORD_FREE)
+        {
+            // a header cut short by power loss, nothing after it can be trusted, continue in the next sector
+            if ((record->flags != 0xFF) || (record->topic_length != 0xFFFF) || (record->data_length != 0xFFFF) || (record->crc != 0xFFFF))
+            {
+                m_headOffset = FLASH_SECTOR_SIZE;
+            }
+            break;
+        }
+
+        if (m_headOffset + record_size(record) > FLASH_SECTOR_SIZE)
+        {
+            m_headOffset = FLASH_SECTOR_SIZE;
+            break;
+        }
+        m_headOffset += record_size(record);
+    }
+
+    // drain from the oldest sector with undelivered records, fully retired ones would be erased under the cursor
+    m_drainSector = oldest_live_sector();
+    m_drainOffset = sizeof(SectorHeader);
+    m_pendingCount = 0;
+
+    trace("MQTTOfflineQueue::open: this=%p sequence[%d] head sector[%d] offset[%d] drain sector[%d]", this, m_sequence, m_headSector, m_headOffset, m_drainSector);
+    return true;
+}
+
+const MQTTOfflineQueue::RecordHeader *MQTTOfflineQueue::cursor_record(uint16_t& sector, uint32_t& offset)
+{
+    while (true)
+    {
+        if ((sector == m_headSector) && (offset >= m_headOffset))
+        {
+            return NULL;
+        }
+
+        if (offset + sizeof(RecordHeader) <= FLASH_SECTOR_SIZE)
+        {
+            const RecordHeader *record = record_at(sector, offset);
+            if ((record->state != RECORD_FREE) && (offset + record_size(record) <= FLASH_SECTOR_SIZE))
+            {
+                return record;
+            }
+        }
+
+        if (sector == m_headSector)
+        {
+            return NULL;
+        }
+
+        // rest of this sector is unused, continue in the next one
+        sector = (sector + 1) % MQTT_OFFLINE_SECTORS;
+        offset = sizeof(SectorHeader);
+    }
+}
+
+bool MQTTOfflineQueue::sector_live(uint16_t sector)
+{
+    if (sector_header(sector)->magic != MQTT_OFFLINE_MAGIC)
+    {
+        return false;
+    }
+
+    uint32_t offset = sizeof(SectorHeader);
+    while (offset + sizeof(RecordHeader) <= FLASH_SECTOR_SIZE)
+    {
+        const RecordHeader *record = record_at(sector, offset);
+        if (record->state == RECORD_FREE)
+        {
+            break;
+        }
+
+        if (record->state != RECORD_RETIRED)
+        {
+            return true;
+        }
+        offset += record_size(record);
+    }
+    return false;
+}
+
+bool MQTTOfflineQueue::retire(uint16_t sector, uint32_t offset)
+{
+    uint8_t state = RECORD_RETIRED;
+    m_stats.retired++;
+    return flash_program(sector * FLASH_SECTOR_SIZE + offset, &state, 1);
+}
+
+bool MQTTOfflineQueue::is_pending(uint16_t sector, uint32_t offset)
+{
+    for (uint8_t i=0;i<m_pendingCount;++i)
+    {
+        if ((m_pending[i].sector == sector) && (m_pending[i].offset == offset))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool MQTTOfflineQueue::store(const char *topic, const uint8_t *data, uint16_t len, uint8_t qos, bool retain)
+{
+    if (topic == NULL)
+    {
+        return false;
+    }
+
+    // stored with its terminator so it can be published straight from flash
+    uint16_t topic_length = strlen(topic) + 1;
+
+    // drained through MQTTSocketHandler::queue_publish, records must fit a batch
+    const int MQTT_PUBLISH_OVERHEAD = MQTT_MAX_HEADER_SIZE + 2 + 2;
+    if (topic_length - 1 + len + MQTT_PUBLISH_OVERHEAD > MQTT_BATCH_BUFFER_SIZE)
+    {
+        trace("MQTTOfflineQueue::store: topic[%s] len[%d] does not fit batch buffer[%d].", safestr(topic), len, MQTT_BATCH_BUFFER_SIZE);
+        return false;
+    }
+
+    uint8_t buffer[sizeof(RecordHeader) + MQTT_BATCH_BUFFER_SIZE + 4];
+    memset(buffer, 0xFF, sizeof(buffer));
+
+    RecordHeader *record = (RecordHeader *)buffer;
+    record->state = RECORD_STORED;
+    record->flags = ((qos > 0) ? MQTTQOS1 : MQTTQOS0) | (retain ? MQTTRETAIN : 0);
+    record->topic_length = topic_length;
+    record->data_length = len;
+    memcpy(&buffer[sizeof(RecordHeader)], topic, topic_length);
+    memcpy(&buffer[sizeof(RecordHeader) + topic_length], data, len);
+    record->crc = record_crc(record);
+
+    uint32_t size = record_size(record);
+    if (m_headOffset + size > FLASH_SECTOR_SIZE)
+    {
+        uint16_t next = (m_headSector + 1) % MQTT_OFFLINE_SECTORS;
+        if (sector_live(next))
+        {
+            trace("MQTTOfflineQueue::store: queue full, oldest sector[%d] still has undelivered publishes.", next);
+            return false;
+        }
+
+        if (!open_sector(next))
+        {
+            return false;
+        }
+    }
+
+    uint32_t offset = m_headSector * FLASH_SECTOR_SIZE + m_headOffset;
+    if (!flash_program(offset, buffer, size))
+    {
+        return false;
+    }
+
+    if (memcmp(flash_contents(offset), buffer, size) != 0)
+    {
+        trace("MQTTOfflineQueue::store: written record does not match buffer, sector[%d] offset[%d].", m_headSector, m_headOffset);
+        m_headOffset = FLASH_SECTOR_SIZE;
+        return false;
+    }
+
+    m_headOffset += size;
+    m_stats.stored++;
+    return true;
+}
+
+bool MQTTOfflineQueue::drain(MQTTSocketHandlerBase &handler)
+{
+    bool queued = false;
+
+    const RecordHeader *record = NULL;
+    while ((record = cursor_record(m_drainSector, m_drainOffset)) != NULL)
+    {
+        if ((record->state != RECORD_RETIRED) && !is_pending(m_drainSector, m_drainOffset))
+        {
+            if (record_crc(record) != record->crc)
+            {
+                trace("MQTTOfflineQueue::drain: corrupt record at sector[%d] offset[%d], skipping.", m_drainSector, m_drainOffset);
+                retire(m_drainSector, m_drainOffset);
+            }
+            else
+            {
+                uint8_t qos = (record->flags & MQTTQOS1) ? 1 : 0;
+
+                // rest waits for PUBACKs to free up the window
+                if ((qos > 0) && ((m_pendingCount >= MQTT_INFLIGHT_WINDOW) || !handler.can_publish(record->data_length)))
+                {
+                    break;
+                }
+
+                const char *topic = (const char *)(record + 1);
+                const uint8_t *data = (const uint8_t *)(topic + record->topic_length);
+
+                uint16_t message_id = 0;
+                if (!handler.queue_publish(topic, data, record->data_length, qos, (record->flags & MQTTRETAIN) != 0, &message_id))
+                {
+                    break;
+                }
+
+                queued = true;
+                m_stats.sent++;
+
+                if (qos > 0)
+                {
+                    m_pending[m_pendingCount++] = { message_id, m_drainSector, (uint16_t)m_drainOffset };
+                }
+                else
+                {
+                    retire(m_drainSector, m_drainOffset);
+                }
+            }
+        }
+
+        m_drainOffset += record_size(record);
+    }
+
+    return !queued || handler.flush_publishes();
+}
+
+bool MQTTOfflineQueue::on_pub_ack(uint16_t message_id)
+{
+    for (uint8_t i=0;i<m_pendingCount;++i)
+    {
+        if (m_pending[i].message_id == message_id)
+        {
+            Pending pending = m_pending[i];
+            m_pending[i] = m_pending[--m_pendingCount];
+            return retire(pending.sector, pending.offset);
+        }
+    }
+    return false;
+}
+
+bool MQTTOfflineQueue::empty()
+{
+    if (m_pendingCount > 0)
+    {
+        return false;
+    }
+
+    uint16_t sector = m_drainSector;
+    uint32_t offset = m_drainOffset;
+
+    const RecordHeader *record = NULL;
+    while ((record = cursor_record(sector, offset)) != NULL)
+    {
+        if (record->state != RECORD_RETIRED)
+        {
+            return false;
+        }
+        offset += record_size(record);
+    }
+    return true;
+}
@@ -0,0 +1,149 @@
+/* MIT License
+
+Copyright (c) 2024 Adrian Cruceru - https://github.com/AdrianCX/pico_https
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#ifdef __TARGET_CPU_CORTEX_M0PLUS
+#include "pico/stdlib.h"
+#else
+#include "stdlib.h"
+#include <cstdint>
+#endif
+
+#include "mqtt_handler.h"
+
+// Flash offset of the queue, should be defined in general config so it does not overlap the program or OTA buffer.
+#ifndef MQTT_OFFLINE_FLASH_OFFSET
+#define MQTT_OFFLINE_FLASH_OFFSET 0xF0000
+#endif
+
+// 4KB sectors used as a ring, written in turn so erases are spread evenly.
+#ifndef MQTT_OFFLINE_SECTORS
+#define MQTT_OFFLINE_SECTORS 16
+#endif
+
+#define MQTT_OFFLINE_MAGIC 0x514F514D
+
+static_assert(MQTT_OFFLINE_SECTORS >= 2, "MQTT offline queue needs at least two sectors to wrap");
+
+struct MQTTOfflineStats
+{
+    uint32_t stored;
+    uint32_t sent;
+    uint32_t retired;
+    uint32_t erases;
+};
+
+///
+/// Persistent publish queue in a reserved flash region, for publishes made while the broker is unreachable.
+///
+/// Records are appended to a ring of sectors, each sector starts with a header carrying a sequence number so the
+/// newest sector is found again after reboot. A record is retired by programming its state byte to 0 (bits only go 1 -> 0,
+/// no erase), QoS 0 records once handed to the MQTTSocketHandler, QoS 1 records once PUBACK arrives.
+/// A sector is only erased when the ring wraps onto it and all its records are retired.
+///
+/// After CONNACK (and after each PUBACK, as the in-flight window frees up) call drain, stored publishes go out in order
+/// through queue_publish and a single flush.
+///
+class MQTTOfflineQueue
+{
+public:
+    MQTTOfflineQueue() {};
+
+    ///
+    /// Find head and tail of the ring in flash, call once at startup.
+    ///
+    bool open();
+
+    ///
+    /// Erase the whole region.
+    ///
+    bool format();
+
+    ///
+    /// @returns - false if the ring is full of unretired records, message is too large to batch, or flash write failed.
+    ///
+    bool store(const char *topic, const uint8_t *data, uint16_t len, uint8_t qos = 1, bool retain = false);
+
+    bool drain(MQTTSocketHandlerBase &handler);
+
+    ///
+    /// Retire the record published with message_id, returns false if it was not one of ours.
+    ///
+    bool on_pub_ack(uint16_t message_id);
+
+    bool empty();
+    const MQTTOfflineStats& get_stats() { return m_stats; }
+
+private:
+    struct SectorHeader
+    {
+        uint32_t magic;
+        uint32_t sequence;
+    };
+
+    struct RecordHeader
+    {
+        uint8_t state;
+        uint8_t flags;
+        uint16_t topic_length;
+        uint16_t data_length;
+        uint16_t crc;
+    };
+
+    struct Pending
+    {
+        uint16_t message_id;
+        uint16_t sector;
+        uint16_t offset;
+    };
+
+    static const uint8_t RECORD_FREE = 0xFF;
+    static const uint8_t RECORD_STORED = 0xFE;
+    static const uint8_t RECORD_RETIRED = 0x00;
+
+    static uint32_t record_size(const RecordHeader *record) { return (sizeof(RecordHeader) + record->topic_length + record->data_length + 3) & ~3u; }
+    static uint16_t crc(const uint8_t *data, uint32_t len, uint16_t crc);
+    static uint16_t record_crc(const RecordHeader *record);
+
+    const SectorHeader *sector_header(uint16_t sector);
+    const RecordHeader *record_at(uint16_t sector, uint32_t offset);
+    const RecordHeader *cursor_record(uint16_t& sector, uint32_t& offset);
+    bool sector_live(uint16_t sector);
+    bool retire(uint16_t sector, uint32_t offset);
+    bool open_sector(uint16_t sector);
+    uint16_t oldest_live_sector();
+    bool is_pending(uint16_t sector, uint32_t offset);
+
+    uint32_t m_sequence = 0;
+    uint16_t m_headSector = 0;
+    uint32_t m_headOffset = 0;
+
+    // next record to hand to the MQTTSocketHandler
+    uint16_t m_drainSector = 0;
+    uint32_t m_drainOffset = 0;
+
+    uint8_t m_pendingCount = 0;
+    Pending m_pending[MQTT_INFLIGHT_WINDOW];
+
+    MQTTOfflineStats m_stats = {0, 0, 0, 0};
+};
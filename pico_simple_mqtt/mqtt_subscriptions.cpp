@@ -0,0 +1,600 @@
+/* MIT License
+
+Copyright (c) 2024 Adrian Cruceru - https://github.com/AdrianCX/pico_https
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include <algorithm>
+#include <string.h>
+
+#include "mqtt_subscriptions.h"
+
+extern "C" void trace(const char *parameters, ...);
+extern "C" const char *safestr(const char *value);
+
+void MQTTSubscriptions::clear()
+{
+    memset(m_nodes, 0, sizeof(m_nodes));
+    for (uint16_t i=0;i<MQTT_SUBSCRIPTION_TABLE_SIZE;++i)
+    {
+        m_table[i] = MQTT_SUBSCRIPTION_NO_NODE;
+    }
+
+    m_freeNode = MQTT_SUBSCRIPTION_NO_NODE;
+    for (uint16_t i=MQTT_SUBSCRIPTION_MAX_NODES-1;i>0;--i)
+    {
+        m_nodes[i].parent = m_freeNode;
+        m_freeNode = i;
+    }
+
+    m_nodes[0].parent = MQTT_SUBSCRIPTION_NO_NODE;
+    m_nodes[0].plus = MQTT_SUBSCRIPTION_NO_NODE;
+    m_nodes[0].multi = MQTT_SUBSCRIPTION_NO_NODE;
+    m_nodeCount = 1;
+
+    m_poolUsed = 0;
+    m_matchCount = 0;
+}
+
+bool MQTTSubscriptions::valid_filter(const char *filter)
+{
+    if ((filter == NULL) || (filter[0] == '\0'))
+    {
+        return false;
+    }
+
+    // no limit on depth, the trie is walked a level at a time
+    for (const char *p = filter; *p != '\0'; ++p)
+    {
+        bool level_start = (p == filter) || (p[-1] == '/');
+        bool level_end = (p[1] == '\0') || (p[1] == '/');
+
+        if ((*p == '+') && !(level_start && level_end))
+        {
+            return false;
+        }
+        else if ((*p == '#') && !(level_start && (p[1] == '\0')))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+uint32_t MQTTSubscriptions::hash_level(const uint8_t *data, uint16_t length)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (uint16_t i=0;i<length;++i)
+    {
+        hash = (hash ^ data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+uint16_t MQTTSubscriptions::lookup(uint16_t parent, const uint8_t *data, uint16_t length, uint32_t hash)
+{
+    for (uint32_t i = slot(parent, hash); m_table[i] != MQTT_SUBSCRIPTION_NO_NODE; i = (i + 1) & (MQTT_SUBSCRIPTION_TABLE_SIZE - 1))
+    {
+        const Node& node = m_nodes[m_table[i]];
+        if ((node.hash == hash) && (node.parent == parent) && (node.length == length) && (memcmp(&m_pool[node.offset], data, length) == 0))
+        {
+            return m_table[i];
+        }
+    }
+    return MQTT_SUBSCRIPTION_NO_NODE;
+}
+
+uint16_t MQTTSubscriptions::insert(uint16_t parent, const uint8_t *data, uint16_t length, uint32_t hash)
+{
+    if (m_poolUsed + length > MQTT_SUBSCRIPTION_POOL_SIZE)
+    {
+        trace("MQTTSubscriptions::insert: level name pool full, used[%d] length[%d] max[%d]", m_poolUsed, length, MQTT_SUBSCRIPTION_POOL_SIZE);
+        return MQTT_SUBSCRIPTION_NO_NODE;
+    }
+
+    uint16_t index = alloc_node(parent);
+    if (index == MQTT_SUBSCRIPTION_NO_NODE)
+    {
+        return MQTT_SUBSCRIPTION_NO_NODE;
+    }
+
+    Node& node = m_nodes[index];
+    node.hash = hash;
+    node.offset = m_poolUsed;
+    node.length = length;
+    memcpy(&m_pool[m_poolUsed], data, length);
+    m_poolUsed += length;
+
+    // table is larger then the node count, there is always a free slot
+    uint32_t i = slot(parent, hash);
+    while (m_table[i] != MQTT_SUBSCRIPTION_NO_NODE)
+    {
+        i = (i + 1) & (MQTT_SUBSCRIPTION_TABLE_SIZE - 1);
+    }
+    m_table[i] = index;
+
+    m_nodes[parent].children++;
+    return index;
+}
+
+uint16_t MQTTSubscriptions::alloc_node(uint16_t parent)
+{
+    if (m_freeNode == MQTT_SUBSCRIPTION_NO_NODE)
+    {
+        trace("MQTTSubscriptions::alloc_node: out of nodes, max[%d]", MQTT_SUBSCRIPTION_MAX_NODES);
+        return MQTT_SUBSCRIPTION_NO_NODE;
+    }
+
+    uint16_t index = m_freeNode;
+    m_freeNode = m_nodes[index].parent;
+
+    Node& node = m_nodes[index];
+    memset(&node, 0, sizeof(node));
+    node.parent = parent;
+    node.plus = MQTT_SUBSCRIPTION_NO_NODE;
+    node.multi = MQTT_SUBSCRIPTION_NO_NODE;
+
+    ++m_nodeCount;
+    return index;
+}
+
+void MQTTSubscriptions::free_node(uint16_t index)
+{
+    Node& node = m_nodes[index];
+
+    // keep the pool packed, names stored after this one move down
+    if (node.length > 0)
+    {
+        uint16_t end = node.offset + node.length;
+        memmove(&m_pool[node.offset], &m_pool[end], m_poolUsed - end);
+        m_poolUsed -= node.length;
+
+        for (uint16_t i=1;i<MQTT_SUBSCRIPTION_MAX_NODES;++i)
+        {
+            if ((m_nodes[i].length > 0) && (m_nodes[i].offset >= end))
+            {
+                m_nodes[i].offset -= node.length;
+            }
+        }
+    }
+
+    memset(&node, 0, sizeof(node));
+    node.parent = m_freeNode;
+    m_freeNode = index;
+    --m_nodeCount;
+}
+
+void MQTTSubscriptions::table_remove(uint16_t index)
+{
+    const uint32_t mask = MQTT_SUBSCRIPTION_TABLE_SIZE - 1;
+
+    uint32_t i = slot(m_nodes[index].parent, m_nodes[index].hash);
+    while (m_table[i] != index)
+    {
+        i = (i + 1) & mask;
+    }
+
+    // backward shift deletion, entries after the hole move up unless it would put them before their home slot
+    uint32_t j = i;
+    while (true)
+    {
+        j = (j + 1) & mask;
+        if (m_table[j] == MQTT_SUBSCRIPTION_NO_NODE)
+        {
+            break;
+        }
+
+        uint32_t home = slot(m_nodes[m_table[j]].parent, m_nodes[m_table[j]].hash);
+        if (((j > i) && ((home <= i) || (home > j))) || ((j < i) && (home <= i) && (home > j)))
+        {
+            m_table[i] = m_table[j];
+            i = j;
+        }
+    }
+    m_table[i] = MQTT_SUBSCRIPTION_NO_NODE;
+}
+
+void MQTTSubscriptions::prune(uint16_t index)
+{
+    while (index != 0)
+    {
+        Node& node = m_nodes[index];
+        if ((node.handler != NULL) || (node.children > 0) || (node.plus != MQTT_SUBSCRIPTION_NO_NODE) || (node.multi != MQTT_SUBSCRIPTION_NO_NODE))
+        {
+            return;
+        }
+
+        uint16_t parent = node.parent;
+        Node& parent_node = m_nodes[parent];
+
+        if (parent_node.plus == index)
+        {
+            parent_node.plus = MQTT_SUBSCRIPTION_NO_NODE;
+        }
+        else if (parent_node.multi == index)
+        {
+            parent_node.multi = MQTT_SUBSCRIPTION_NO_NODE;
+        }
+        else
+        {
+            table_remove(index);
+            parent_node.children--;
+        }
+
+        free_node(index);
+        index = parent;
+    }
+}
+
+bool MQTTSubscriptions::add(const char *filter, MQTTSubscriptionInterface *handler)
+{
+    if (!valid_filter(filter))
+    {
+        trace("MQTTSubscriptions::add: invalid filter[%s]", safestr(filter));
+        return false;
+    }
+
+    uint16_t index = 0;
+    const char *level = filter;
+    while (true)
+    {
+        const char *end = strchr(level, '/');
+        uint16_t length = (end != NULL) ? (end - level) : strlen(level);
+
+        uint16_t child = MQTT_SUBSCRIPTION_NO_NODE;
+        if ((length == 1) && (level[0] == '+'))
+        {
+            child = m_nodes[index].plus;
+            if (child == MQTT_SUBSCRIPTION_NO_NODE)
+            {
+                child = alloc_node(index);
+                m_nodes[index].plus = child;
+            }
+        }
+        else if ((length == 1) && (level[0] == '#'))
+        {
+            child = m_nodes[index].multi;
+            if (child == MQTT_SUBSCRIPTION_NO_NODE)
+            {
+                child = alloc_node(index);
+                m_nodes[index].multi = child;
+            }
+        }
+        else
+        {
+            uint32_t hash = hash_level((const uint8_t*)level, length);
+            child = lookup(index, (const uint8_t*)level, length, hash);
+            if (child == MQTT_SUBSCRIPTION_NO_NODE)
+            {
+                child = insert(index, (const uint8_t*)level, length, hash);
+            }
+        }
+
+        if (child == MQTT_SUBSCRIPTION_NO_NODE)
+        {
+            trace("MQTTSubscriptions::add: out of storage for filter[%s], nodes[%d] pool[%d]", filter, m_nodeCount, m_poolUsed);
+            prune(index);
+            return false;
+        }
+
+        index = child;
+        if (end == NULL)
+        {
+            break;
+        }
+        level = end + 1;
+    }
+
+    if ((m_nodes[index].handler != NULL) && (m_nodes[index].handler != handler))
+    {
+        trace("MQTTSubscriptions::add: replacing handler for filter[%s]", filter);
+    }
+
+    m_nodes[index].handler = handler;
+    return true;
+}
+
+uint16_t MQTTSubscriptions::find(const char *filter)
+{
+    if (!valid_filter(filter))
+    {
+        return MQTT_SUBSCRIPTION_NO_NODE;
+    }
+
+    uint16_t index = 0;
+    const char *level = filter;
+    while (index != MQTT_SUBSCRIPTION_NO_NODE)
+    {
+        const char *end = strchr(level, '/');
+        uint16_t length = (end != NULL) ? (end - level) : strlen(level);
+
+        if ((length == 1) && (level[0] == '+'))
+        {
+            index = m_nodes[index].plus;
+        }
+        else if ((length == 1) && (level[0] == '#'))
+        {
+            index = m_nodes[index].multi;
+        }
+        else
+        {
+            index = lookup(index, (const uint8_t*)level, length, hash_level((const uint8_t*)level, length));
+        }
+
+        if (end == NULL)
+        {
+            break;
+        }
+        level = end + 1;
+    }
+    return index;
+}
+
+bool MQTTSubscriptions::remove(const char *filter)
+{
+    uint16_t index = find(filter);
+    if ((index == MQTT_SUBSCRIPTION_NO_NODE) || (m_nodes[index].handler == NULL))
+    {
+        trace("MQTTSubscriptions::remove: filter[%s] not found", safestr(filter));
+        return false;
+    }
+
+    m_nodes[index].handler = NULL;
+    prune(index);
+    return true;
+}
+
+void MQTTSubscriptions::add_match(MQTTSubscriptionInterface *handler, MQTTSubscriptionInterface **out, uint8_t& found, uint8_t max_out)
+{
+    if (handler == NULL)
+    {
+        return;
+    }
+
+    // overlapping filters with the same handler deliver once
+    for (uint8_t i=0;i<found;++i)
+    {
+        if (out[i] == handler)
+        {
+            return;
+        }
+    }
+
+    if (found < max_out)
+    {
+        out[found++] = handler;
+    }
+}
+
+void MQTTSubscriptions::match_node(uint16_t index, const Level *levels, uint8_t level, uint8_t count, bool system, MQTTSubscriptionInterface **out, uint8_t& found, uint8_t max_out)
+{
+    const Node& node = m_nodes[index];
+
+    // wildcards at the first level do not match topics starting with '$'
+    bool wildcards = !system || (level > 0);
+
+    // '#' also matches the parent level, "a/#" receives "a"
+    if ((node.multi != MQTT_SUBSCRIPTION_NO_NODE) && wildcards)
+    {
+        add_match(m_nodes[node.multi].handler, out, found, max_out);
+    }
+
+    if (level == count)
+    {
+        add_match(node.handler, out, found, max_out);
+        return;
+    }
+
+    if ((node.plus != MQTT_SUBSCRIPTION_NO_NODE) && wildcards)
+    {
+        match_node(node.plus, levels, level + 1, count, system, out, found, max_out);
+    }
+
+    if (node.children > 0)
+    {
+        uint16_t child = lookup(index, levels[level].data, levels[level].length, levels[level].hash);
+        if (child != MQTT_SUBSCRIPTION_NO_NODE)
+        {
+            match_node(child, levels, level + 1, count, system, out, found, max_out);
+        }
+    }
+}
+
+uint8_t MQTTSubscriptions::match(const uint8_t *topic, uint16_t topic_length, MQTTSubscriptionInterface **out, uint8_t max_out)
+{
+    Level levels[MQTT_TOPIC_MAX_LEVELS];
+    uint8_t count = 0;
+
+    uint16_t start = 0;
+    for (uint16_t i=0;i<=topic_length;++i)
+    {
+        if ((i < topic_length) && (topic[i] != '/'))
+        {
+            continue;
+        }
+
+        // deeper topics go through the streamed matcher, it keeps no per level state
+        if (count == MQTT_TOPIC_MAX_LEVELS)
+        {
+            Stream stream;
+            uint8_t found = 0;
+            stream_start(stream, (topic_length > 0) && (topic[0] == '$'));
+            stream_feed(stream, topic, topic_length, out, found, max_out);
+            stream_finish(stream, out, found, max_out);
+            return found;
+        }
+
+        levels[count].data = &topic[start];
+        levels[count].length = i - start;
+        levels[count].hash = hash_level(&topic[start], i - start);
+        ++count;
+        start = i + 1;
+    }
+
+    uint8_t found = 0;
+    match_node(0, levels, 0, count, (topic_length > 0) && (topic[0] == '$'), out, found, max_out);
+    return found;
+}
+
+void MQTTSubscriptions::stream_start(Stream& stream, bool system)
+{
+    stream.system = system;
+    stream.level = 0;
+    stream.states[0] = 0;
+    stream.stateCount = 1;
+    stream.hash = 2166136261u;
+    stream.length = 0;
+}
+
+void MQTTSubscriptions::stream_feed(Stream& stream, const uint8_t *data, uint16_t len, MQTTSubscriptionInterface **out, uint8_t& found, uint8_t max_out)
+{
+    for (uint16_t i=0;i<len;++i)
+    {
+        if (data[i] == '/')
+        {
+            stream_level(stream, out, found, max_out);
+            continue;
+        }
+
+        // FNV-1a, same as hash_level
+        stream.hash = (stream.hash ^ data[i]) * 16777619u;
+        if (stream.length < MQTT_SUBSCRIPTION_STREAM_LEVEL_SIZE)
+        {
+            stream.buffer[stream.length] = data[i];
+        }
+        ++stream.length;
+    }
+}
+
+void MQTTSubscriptions::stream_level(Stream& stream, MQTTSubscriptionInterface **out, uint8_t& found, uint8_t max_out)
+{
+    // same steps as match_node, for every node the topic can be at
+    bool wildcards = !stream.system || (stream.level > 0);
+
+    // a level that was not kept whole can not be confirmed, it only matches wildcards
+    bool exact = (stream.length <= MQTT_SUBSCRIPTION_STREAM_LEVEL_SIZE);
+
+    uint8_t count = 0;
+    uint16_t next[MQTT_SUBSCRIPTION_STREAM_STATES * 2];
+    for (uint8_t i=0;i<stream.stateCount;++i)
+    {
+        const Node& node = m_nodes[stream.states[i]];
+
+        if ((node.multi != MQTT_SUBSCRIPTION_NO_NODE) && wildcards)
+        {
+            add_match(m_nodes[node.multi].handler, out, found, max_out);
+        }
+
+        if ((node.plus != MQTT_SUBSCRIPTION_NO_NODE) && wildcards)
+        {
+            next[count++] = node.plus;
+        }
+
+        if ((node.children > 0) && exact)
+        {
+            uint16_t child = lookup(stream.states[i], stream.buffer, stream.length, stream.hash);
+            if (child != MQTT_SUBSCRIPTION_NO_NODE)
+            {
+                next[count++] = child;
+            }
+        }
+    }
+
+    if (count > MQTT_SUBSCRIPTION_STREAM_STATES)
+    {
+        trace("MQTTSubscriptions::stream_level: topic matches more then %d wildcard branches at level[%d], ignoring the rest", MQTT_SUBSCRIPTION_STREAM_STATES, stream.level);
+        count = MQTT_SUBSCRIPTION_STREAM_STATES;
+    }
+
+    memcpy(stream.states, next, count * sizeof(uint16_t));
+    stream.stateCount = count;
+    ++stream.level;
+
+    stream.hash = 2166136261u;
+    stream.length = 0;
+}
+
+void MQTTSubscriptions::stream_finish(Stream& stream, MQTTSubscriptionInterface **out, uint8_t& found, uint8_t max_out)
+{
+    // last level, then the nodes the whole topic reached
+    stream_level(stream, out, found, max_out);
+    for (uint8_t i=0;i<stream.stateCount;++i)
+    {
+        const Node& node = m_nodes[stream.states[i]];
+        if (node.multi != MQTT_SUBSCRIPTION_NO_NODE)
+        {
+            add_match(m_nodes[node.multi].handler, out, found, max_out);
+        }
+        add_match(node.handler, out, found, max_out);
+    }
+    stream.stateCount = 0;
+}
+
+bool MQTTSubscriptions::on_publish_topic(const uint8_t *data, uint16_t len, uint16_t offset, uint16_t topic_length)
+{
+    if (offset == 0)
+    {
+        m_matchCount = 0;
+        stream_start(m_stream, (len > 0) && (data[0] == '$'));
+    }
+
+    stream_feed(m_stream, data, len, m_matched, m_matchCount, MQTT_SUBSCRIPTION_MAX_MATCHES);
+
+    if (offset + len < topic_length)
+    {
+        return true;
+    }
+
+    stream_finish(m_stream, m_matched, m_matchCount, MQTT_SUBSCRIPTION_MAX_MATCHES);
+    return true;
+}
+
+bool MQTTSubscriptions::on_publish_header(uint8_t *topic, uint16_t topic_length, uint16_t message_id, uint32_t message_length)
+{
+    // streamed topics were matched as they arrived
+    if (topic != NULL)
+    {
+        m_matchCount = match(topic, topic_length, m_matched, MQTT_SUBSCRIPTION_MAX_MATCHES);
+    }
+
+    if (m_matchCount == 0)
+    {
+        trace("MQTTSubscriptions::on_publish_header: no subscription for topic[%.*s]", (topic != NULL) ? topic_length : 0, (topic != NULL) ? (const char*)topic : "");
+        return true;
+    }
+
+    bool result = true;
+    for (uint8_t i=0;i<m_matchCount;++i)
+    {
+        result = m_matched[i]->on_publish_header(topic, topic_length, message_id, message_length) && result;
+    }
+    return result;
+}
+
+bool MQTTSubscriptions::on_publish_data(uint8_t *data, uint32_t len, bool last_chunk)
+{
+    bool result = true;
+    for (uint8_t i=0;i<m_matchCount;++i)
+    {
+        result = m_matched[i]->on_publish_data(data, len, last_chunk) && result;
+    }
+    return result;
+}
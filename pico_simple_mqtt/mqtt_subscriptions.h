@@ -0,0 +1,177 @@
+/* MIT License
+
+Copyright (c) 2024 Adrian Cruceru - https://github.com/AdrianCX/pico_https
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#ifdef __TARGET_CPU_CORTEX_M0PLUS
+#include "pico/stdlib.h"
+#else
+#include "stdlib.h"
+#include <cstdint>
+#endif
+
+// Trie nodes, one per distinct filter level (sharing prefixes), plus the root.
+#ifndef MQTT_SUBSCRIPTION_MAX_NODES
+#define MQTT_SUBSCRIPTION_MAX_NODES 64
+#endif
+
+// Hash table for exact level lookups, power of two larger then MQTT_SUBSCRIPTION_MAX_NODES.
+#ifndef MQTT_SUBSCRIPTION_TABLE_SIZE
+#define MQTT_SUBSCRIPTION_TABLE_SIZE 128
+#endif
+
+// Storage for level names of all filters.
+#ifndef MQTT_SUBSCRIPTION_POOL_SIZE
+#define MQTT_SUBSCRIPTION_POOL_SIZE 512
+#endif
+
+// Handlers a single publish can be dispatched to.
+#ifndef MQTT_SUBSCRIPTION_MAX_MATCHES
+#define MQTT_SUBSCRIPTION_MAX_MATCHES 8
+#endif
+
+// Trie nodes a streamed topic can be at at once, one per '+' branch taken.
+#ifndef MQTT_SUBSCRIPTION_STREAM_STATES
+#define MQTT_SUBSCRIPTION_STREAM_STATES 8
+#endif
+
+// Streamed topic levels up to this length are compared in full, longer ones only match wildcards.
+#ifndef MQTT_SUBSCRIPTION_STREAM_LEVEL_SIZE
+#define MQTT_SUBSCRIPTION_STREAM_LEVEL_SIZE 64
+#endif
+
+#define MQTT_TOPIC_MAX_LEVELS 16
+#define MQTT_SUBSCRIPTION_NO_NODE 0xFFFF
+
+static_assert((MQTT_SUBSCRIPTION_TABLE_SIZE & (MQTT_SUBSCRIPTION_TABLE_SIZE - 1)) == 0, "MQTT_SUBSCRIPTION_TABLE_SIZE must be a power of two");
+static_assert(MQTT_SUBSCRIPTION_TABLE_SIZE > MQTT_SUBSCRIPTION_MAX_NODES, "MQTT_SUBSCRIPTION_TABLE_SIZE must be larger then MQTT_SUBSCRIPTION_MAX_NODES");
+
+class MQTTSubscriptionInterface
+{
+public:
+    // Same contract as MQTTSocketInterface, only called for publishes matching the filter the handler was added with.
+    // topic is NULL for topics streamed through MQTTSubscriptions::on_publish_topic.
+    virtual bool on_publish_header(uint8_t *topic, uint16_t topic_length, uint16_t message_id, uint32_t message_length) { return true; }
+    virtual bool on_publish_data(uint8_t *data, uint32_t len, bool last_chunk) { return true; }
+};
+
+///
+/// Topic filters (with '+' and '#' wildcards) stored as a trie of levels, dispatching publishes to a handler per filter.
+/// Exact levels are found through a hash table keyed on parent node and level hash, so matching costs a lookup per topic level
+/// (plus one branch per wildcard filter that applies), independent of how many filters are stored.
+///
+/// Forward MQTTSocketInterface::on_publish_topic/on_publish_header/on_publish_data here, all matching handlers are called (once each).
+/// Streamed topics are matched a level at a time as pieces arrive, with no limit on topic length or depth.
+///
+class MQTTSubscriptions
+{
+public:
+    MQTTSubscriptions() { clear(); }
+
+    ///
+    /// @returns - false if filter is invalid or storage is exhausted. Replaces the handler of an existing filter.
+    ///
+    bool add(const char *filter, MQTTSubscriptionInterface *handler);
+    bool remove(const char *filter);
+    void clear();
+
+    ///
+    /// Collect handlers of all filters matching topic, returns how many were written to out.
+    ///
+    uint8_t match(const uint8_t *topic, uint16_t topic_length, MQTTSubscriptionInterface **out, uint8_t max_out);
+
+    bool on_publish_topic(const uint8_t *data, uint16_t len, uint16_t offset, uint16_t topic_length);
+    bool on_publish_header(uint8_t *topic, uint16_t topic_length, uint16_t message_id, uint32_t message_length);
+    bool on_publish_data(uint8_t *data, uint32_t len, bool last_chunk);
+
+    uint16_t get_node_count() { return m_nodeCount; }
+    uint16_t get_pool_used() { return m_poolUsed; }
+
+    static bool valid_filter(const char *filter);
+
+private:
+    struct Node
+    {
+        uint32_t hash;
+        uint16_t parent;
+        uint16_t offset;
+        uint16_t length;
+        uint16_t children;
+        uint16_t plus;
+        uint16_t multi;
+        MQTTSubscriptionInterface *handler;
+    };
+
+    struct Level
+    {
+        const uint8_t *data;
+        uint16_t length;
+        uint32_t hash;
+    };
+
+    // streamed topic: nodes reached by the levels seen so far and the level being received
+    struct Stream
+    {
+        bool system;
+        uint8_t level;
+        uint8_t stateCount;
+        uint16_t states[MQTT_SUBSCRIPTION_STREAM_STATES];
+        uint32_t hash;
+        uint16_t length;
+        uint8_t buffer[MQTT_SUBSCRIPTION_STREAM_LEVEL_SIZE];
+    };
+
+    static uint32_t hash_level(const uint8_t *data, uint16_t length);
+    uint32_t slot(uint16_t parent, uint32_t hash) { return (hash ^ (parent * 0x9E3779B1u)) & (MQTT_SUBSCRIPTION_TABLE_SIZE - 1); }
+
+    uint16_t lookup(uint16_t parent, const uint8_t *data, uint16_t length, uint32_t hash);
+    uint16_t insert(uint16_t parent, const uint8_t *data, uint16_t length, uint32_t hash);
+    uint16_t find(const char *filter);
+
+    uint16_t alloc_node(uint16_t parent);
+    void free_node(uint16_t index);
+    void table_remove(uint16_t index);
+    void prune(uint16_t index);
+
+    void match_node(uint16_t index, const Level *levels, uint8_t level, uint8_t count, bool system, MQTTSubscriptionInterface **out, uint8_t& found, uint8_t max_out);
+    void stream_start(Stream& stream, bool system);
+    void stream_feed(Stream& stream, const uint8_t *data, uint16_t len, MQTTSubscriptionInterface **out, uint8_t& found, uint8_t max_out);
+    void stream_level(Stream& stream, MQTTSubscriptionInterface **out, uint8_t& found, uint8_t max_out);
+    void stream_finish(Stream& stream, MQTTSubscriptionInterface **out, uint8_t& found, uint8_t max_out);
+    static void add_match(MQTTSubscriptionInterface *handler, MQTTSubscriptionInterface **out, uint8_t& found, uint8_t max_out);
+
+    // node 0 is the root, free nodes are chained through 'parent'
+    Node m_nodes[MQTT_SUBSCRIPTION_MAX_NODES];
+    uint16_t m_freeNode = MQTT_SUBSCRIPTION_NO_NODE;
+    uint16_t m_nodeCount = 0;
+
+    uint16_t m_table[MQTT_SUBSCRIPTION_TABLE_SIZE];
+
+    uint16_t m_poolUsed = 0;
+    uint8_t m_pool[MQTT_SUBSCRIPTION_POOL_SIZE];
+
+    // topic of the publish being delivered, match() keeps its own state
+    Stream m_stream = {};
+
+    uint8_t m_matchCount = 0;
+    MQTTSubscriptionInterface *m_matched[MQTT_SUBSCRIPTION_MAX_MATCHES];
+};
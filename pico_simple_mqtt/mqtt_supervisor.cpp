@@ -0,0 +1,358 @@
+/* MIT License
+
+Copyright (c) 2024 Adrian Cruceru - https://github.com/AdrianCX/pico_https
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include <algorithm>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include "stdlib.h"
+#include <cstdint>
+#else
+#include "pico/stdlib.h"
+#include "pico/rand.h"
+#include "session.h"
+#endif
+
+#include "mqtt_supervisor.h"
+
+extern "C" void trace(const char *parameters, ...);
+extern "C" const char *safestr(const char *value);
+
+MQTTSupervisor::MQTTSupervisor(const MQTTSupervisorConfig &config, MQTTSocketInterface *upstream, ISessionSender *session, uint32_t seed)
+    : m_config(config)
+    , m_upstream(upstream)
+    , m_session(session)
+    , m_random(seed ? seed : 1)
+{
+    m_handler.set_upstream(this);
+    m_handler.set_downstream(session);
+}
+
+MQTTSupervisor::~MQTTSupervisor()
+{
+    if (m_ownsSession)
+    {
+        delete m_session;
+    }
+}
+
+#if !(defined(__x86_64__) || defined(_M_X64))
+MQTTSupervisor *MQTTSupervisor::create(const MQTTSupervisorConfig &config, MQTTSocketInterface *upstream, bool tls)
+{
+    Session *session = new Session(NULL, tls);
+    MQTTSupervisor *supervisor = new MQTTSupervisor(config, upstream, session, get_rand_32());
+
+    session->set_callback(&supervisor->m_handler);
+    supervisor->m_ownsSession = true;
+    return supervisor;
+}
+#endif
+
+uint32_t MQTTSupervisor::next_random()
+{
+    // xorshift32
+    m_random ^= m_random << 13;
+    m_random ^= m_random >> 17;
+    m_random ^= m_random << 5;
+    return m_random;
+}
+
+void MQTTSupervisor::start(uint64_t now_us)
+{
+    m_nowUs = now_us;
+    m_failures = 0;
+    m_disconnectUs = now_us;
+    connect();
+}
+
+void MQTTSupervisor::stop()
+{
+    trace("MQTTSupervisor::stop: this=%p state[%d]", this, (int)m_state);
+
+    bool connected = (m_state == MQTTSupervisorState::CONNECTED);
+    m_state = MQTTSupervisorState::IDLE;
+
+    if (connected)
+    {
+        m_handler.send_disconnect();
+    }
+    m_session->close();
+}
+
+void MQTTSupervisor::connect()
+{
+    m_state = MQTTSupervisorState::CONNECTING;
+    m_attemptStartUs = m_nowUs;
+    m_stats.connect_attempts++;
+
+    trace("MQTTSupervisor::connect: this=%p host[%s] port[%d] attempt[%d]", this, safestr(m_config.host), m_config.port, m_failures + 1);
+
+    // lwip ERR_INPROGRESS, DNS lookup continues in the background
+    const int8_t CONNECT_IN_PROGRESS = -5;
+
+    int8_t err = m_session->connect(m_config.host, m_config.port);
+
+    // DNS failures are reported here, other failures come through on_closed
+    if ((err != 0) && (err != CONNECT_IN_PROGRESS) && (m_state == MQTTSupervisorState::CONNECTING))
+    {
+        trace("MQTTSupervisor::connect: this=%p failed err[%d]", this, err);
+        schedule_reconnect();
+    }
+}
+
+void MQTTSupervisor::schedule_reconnect()
+{
+    uint32_t delay = MQTT_RECONNECT_MAX_MS;
+    if (m_failures < 16)
+    {
+        delay = std::min((uint32_t)MQTT_RECONNECT_MAX_MS, (uint32_t)MQTT_RECONNECT_MIN_MS << m_failures);
+    }
+
+    // equal jitter, never less then half the delay
+    delay = delay / 2 + next_random() % (delay / 2 + 1);
+
+    if (m_failures < 0xFF)
+    {
+        ++m_failures;
+    }
+
+    m_state = MQTTSupervisorState::WAITING;
+    m_nextAttemptUs = m_nowUs + (uint64_t)delay * 1000;
+    m_stats.last_backoff_ms = delay;
+
+    trace("MQTTSupervisor::schedule_reconnect: this=%p failures[%d] retry in[%d ms]", this, m_failures, delay);
+}
+
+bool MQTTSupervisor::update(uint64_t now_us)
+{
+    m_nowUs = now_us;
+
+    switch (m_state)
+    {
+        case MQTTSupervisorState::WAITING:
+        {
+            if (now_us >= m_nextAttemptUs)
+            {
+                connect();
+            }
+            break;
+        }
+        case MQTTSupervisorState::CONNECTING:
+        {
+            if (now_us - m_attemptStartUs > (uint64_t)MQTT_CONNECT_TIMEOUT_MS * 1000)
+            {
+                trace("MQTTSupervisor::update: this=%p no CONNACK after[%d ms], abandoning attempt.", this, MQTT_CONNECT_TIMEOUT_MS);
+                m_session->close();
+
+                if (m_state == MQTTSupervisorState::CONNECTING)
+                {
+                    schedule_reconnect();
+                }
+            }
+            break;
+        }
+        case MQTTSupervisorState::CONNECTED:
+        {
+            return m_handler.update(now_us);
+        }
+        default:
+        {
+            break;
+        }
+    }
+
+    return true;
+}
+
+bool MQTTSupervisor::publish(const char *topic, const uint8_t *data, uint16_t len, uint8_t qos, bool retain)
+{
+    // keep order, nothing new goes out ahead of stored publishes
+    bool stored_pending = (m_offlineQueue != NULL) && !m_offlineQueue->empty();
+
+    if ((m_state == MQTTSupervisorState::CONNECTED) && !stored_pending && m_handler.queue_publish(topic, data, len, qos, retain))
+    {
+        return true;
+    }
+
+    if (m_offlineQueue == NULL)
+    {
+        return false;
+    }
+
+    if (!m_offlineQueue->store(topic, data, len, qos, retain))
+    {
+        return false;
+    }
+
+    return (m_state != MQTTSupervisorState::CONNECTED) || m_offlineQueue->drain(m_handler);
+}
+
+void MQTTSupervisor::on_connected()
+{
+    bool pipelined = subscribe_with_connect();
+    trace("MQTTSupervisor::on_connected: this=%p, sending CONNECT clean_session[0] subscribe_with_connect[%d]", this, pipelined);
+
+    if (pipelined)
+    {
+        m_stats.resubscribes++;
+    }
+
+    // a failed CONNECT is abandoned by the connect timeout in update
+    bool sent = pipelined ? m_handler.send_connect_subscribe(m_config.topics, m_config.topic_count, m_config.qos, false, m_config.keepalive_seconds, m_config.client_id, m_config.will_topic, m_config.will_message, m_config.user, m_config.pass)
+                          : m_handler.send_connect(false, m_config.keepalive_seconds, m_config.client_id, m_config.will_topic, m_config.will_message, m_config.user, m_config.pass);
+    if (!sent)
+    {
+        trace("MQTTSupervisor::on_connected: this=%p failed sending CONNECT", this);
+    }
+
+    if (m_upstream)
+    {
+        m_upstream->on_connected();
+    }
+}
+
+bool MQTTSupervisor::on_conn_ack(conn_ack_code_t code, uint8_t flags)
+{
+    if (code != CONNECTION_ACCEPTED)
+    {
+        trace("MQTTSupervisor::on_conn_ack: this=%p refused code[%d]", this, code);
+        if (m_upstream)
+        {
+            m_upstream->on_conn_ack(code, flags);
+        }
+
+        // on_closed schedules the next attempt
+        return false;
+    }
+
+    bool session_present = (flags & 0x01) != 0;
+
+    m_state = MQTTSupervisorState::CONNECTED;
+    m_failures = 0;
+
+    m_stats.connections++;
+    m_stats.last_connect_us = m_nowUs - m_attemptStartUs;
+    m_stats.last_reconnect_us = m_nowUs - m_disconnectUs;
+    m_stats.total_reconnect_us += m_stats.last_reconnect_us;
+    m_stats.max_reconnect_us = std::max(m_stats.max_reconnect_us, m_stats.last_reconnect_us);
+
+    trace("MQTTSupervisor::on_conn_ack: this=%p session_present[%d] reconnect[%d ms]", this, session_present, (uint32_t)(m_stats.last_reconnect_us / 1000));
+
+    if (session_present)
+    {
+        m_stats.sessions_resumed++;
+    }
+    else if ((m_config.topic_count > 0) && !subscribe_with_connect())
+    {
+        m_stats.resubscribes++;
+        if (!m_handler.send_subscribe(m_config.topics, m_config.topic_count, m_config.qos))
+        {
+            return false;
+        }
+    }
+
+    if ((m_offlineQueue != NULL) && !m_offlineQueue->drain(m_handler))
+    {
+        return false;
+    }
+
+    return m_upstream ? m_upstream->on_conn_ack(code, flags) : true;
+}
+
+void MQTTSupervisor::on_closed()
+{
+    trace("MQTTSupervisor::on_closed: this=%p state[%d]", this, (int)m_state);
+
+    MQTTSupervisorState state = m_state;
+
+    if (state == MQTTSupervisorState::CONNECTED)
+    {
+        m_stats.disconnects++;
+        m_disconnectUs = m_nowUs;
+    }
+
+    if ((state == MQTTSupervisorState::CONNECTED) || (state == MQTTSupervisorState::CONNECTING))
+    {
+        schedule_reconnect();
+    }
+
+    if (m_upstream)
+    {
+        m_upstream->on_closed();
+    }
+}
+
+bool MQTTSupervisor::on_pub_ack(uint16_t message_id)
+{
+    // a freed in-flight slot lets more stored publishes out
+    if ((m_offlineQueue != NULL) && m_offlineQueue->on_pub_ack(message_id) && !m_offlineQueue->drain(m_handler))
+    {
+        return false;
+    }
+
+    return m_upstream ? m_upstream->on_pub_ack(message_id) : true;
+}
+
+bool MQTTSupervisor::on_sub_ack(uint16_t message_id)
+{
+    return m_upstream ? m_upstream->on_sub_ack(message_id) : true;
+}
+
+bool MQTTSupervisor::on_unsub_ack(uint16_t message_id)
+{
+    return m_upstream ? m_upstream->on_unsub_ack(message_id) : true;
+}
+
+bool MQTTSupervisor::on_reason_code(uint8_t message_type, uint16_t message_id, mqtt_reason_code_t reason_code)
+{
+    return m_upstream ? m_upstream->on_reason_code(message_type, message_id, reason_code) : true;
+}
+
+bool MQTTSupervisor::on_ping_req()
+{
+    return m_upstream ? m_upstream->on_ping_req() : true;
+}
+
+bool MQTTSupervisor::on_ping_resp()
+{
+    return m_upstream ? m_upstream->on_ping_resp() : true;
+}
+
+bool MQTTSupervisor::on_publish_topic(const uint8_t *data, uint16_t len, uint16_t offset, uint16_t topic_length)
+{
+    return m_upstream ? m_upstream->on_publish_topic(data, len, offset, topic_length) : true;
+}
+
+bool MQTTSupervisor::on_publish_header(uint8_t *topic, uint16_t topic_length, uint16_t message_id, uint32_t message_length)
+{
+    return m_upstream ? m_upstream->on_publish_header(topic, topic_length, message_id, message_length) : true;
+}
+
+bool MQTTSupervisor::on_publish_data(uint8_t *data, uint32_t len, bool last_chunk)
+{
+    return m_upstream ? m_upstream->on_publish_data(data, len, last_chunk) : true;
+}
+
+bool MQTTSupervisor::on_sent(uint16_t len)
+{
+    return m_upstream ? m_upstream->on_sent(len) : true;
+}
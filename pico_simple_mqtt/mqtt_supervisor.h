@@ -0,0 +1,179 @@
+/* MIT License
+
+Copyright (c) 2024 Adrian Cruceru - https://github.com/AdrianCX/pico_https
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#ifdef __TARGET_CPU_CORTEX_M0PLUS
+#include "pico/stdlib.h"
+#else
+#include "stdlib.h"
+#include <cstdint>
+#endif
+
+#include "mqtt_handler.h"
+#include "mqtt_offline_queue.h"
+
+// Reconnect delay doubles from MIN to MAX with every failed attempt, the actual delay is picked in [delay/2, delay].
+#ifndef MQTT_RECONNECT_MIN_MS
+#define MQTT_RECONNECT_MIN_MS 1000
+#endif
+
+#ifndef MQTT_RECONNECT_MAX_MS
+#define MQTT_RECONNECT_MAX_MS 60000
+#endif
+
+// An attempt without CONNACK after this long is abandoned and counts as failed.
+#ifndef MQTT_CONNECT_TIMEOUT_MS
+#define MQTT_CONNECT_TIMEOUT_MS 15000
+#endif
+
+struct MQTTSupervisorConfig
+{
+    const char *host;
+    uint16_t port;
+    const char *client_id;
+    const char *user;
+    const char *pass;
+    const char *will_topic;
+    const char *will_message;
+    uint8_t keepalive_seconds;
+
+    // subscribed again only when the broker did not keep the session
+    const char **topics;
+    uint8_t topic_count;
+    uint8_t qos;
+
+    // SUBSCRIBEs go out with CONNECT on every connection, saving a round trip, the broker then resends retained
+    // messages of the topics even when it kept the session
+    bool subscribe_with_connect;
+};
+
+struct MQTTSupervisorStats
+{
+    uint32_t connect_attempts;
+    uint32_t connections;
+    uint32_t disconnects;
+    uint32_t sessions_resumed;
+    uint32_t resubscribes;
+    uint32_t last_backoff_ms;
+
+    // disconnect to accepted CONNACK
+    uint64_t last_reconnect_us;
+    uint64_t max_reconnect_us;
+    uint64_t total_reconnect_us;
+
+    // start of the successful attempt to accepted CONNACK
+    uint64_t last_connect_us;
+};
+
+enum class MQTTSupervisorState
+{
+    IDLE,
+    WAITING,
+    CONNECTING,
+    CONNECTED,
+};
+
+///
+/// Owns the connection of an MQTTSocketHandler and keeps it up.
+///
+/// Connects with clean_session=false so the broker keeps subscriptions and queued messages, on CONNACK the handler resends
+/// unacknowledged publishes and topics are only subscribed again when the broker reports no session present.
+/// Lost connections and failed attempts are retried after a jittered exponential backoff, so a fleet of devices does not
+/// come back in lockstep and a down broker does not cost a TLS handshake per poll.
+///
+/// Time is taken from update(now_us), call it from the main loop.
+///
+class MQTTSupervisor
+    : public MQTTSocketInterface
+{
+public:
+    ///
+    /// @param session - connection to drive, its callback must be get_handler(). Not owned.
+    /// @param seed - for backoff jitter, should differ between devices.
+    ///
+    MQTTSupervisor(const MQTTSupervisorConfig &config, MQTTSocketInterface *upstream, ISessionSender *session, uint32_t seed);
+    virtual ~MQTTSupervisor();
+
+#if !(defined(__x86_64__) || defined(_M_X64))
+    ///
+    /// Supervisor with its own Session, deleted along with it.
+    ///
+    static MQTTSupervisor *create(const MQTTSupervisorConfig &config, MQTTSocketInterface *upstream, bool tls);
+#endif
+
+    void start(uint64_t now_us);
+    void stop();
+    bool update(uint64_t now_us);
+
+    ///
+    /// Publish now when connected, otherwise keep it in the offline queue if one is set.
+    ///
+    bool publish(const char *topic, const uint8_t *data, uint16_t len, uint8_t qos = 1, bool retain = false);
+
+    void set_offline_queue(MQTTOfflineQueue *queue) { m_offlineQueue = queue; }
+
+    MQTTSocketHandler& get_handler() { return m_handler; }
+    MQTTSupervisorState get_state() { return m_state; }
+    uint64_t get_next_attempt_us() { return m_nextAttemptUs; }
+    const MQTTSupervisorStats& get_stats() { return m_stats; }
+
+    virtual bool on_pub_ack(uint16_t message_id) override;
+    virtual bool on_sub_ack(uint16_t message_id) override;
+    virtual bool on_unsub_ack(uint16_t message_id) override;
+    virtual bool on_conn_ack(conn_ack_code_t code, uint8_t flags) override;
+    virtual bool on_reason_code(uint8_t message_type, uint16_t message_id, mqtt_reason_code_t reason_code) override;
+    virtual bool on_ping_req() override;
+    virtual bool on_ping_resp() override;
+    virtual bool on_publish_topic(const uint8_t *data, uint16_t len, uint16_t offset, uint16_t topic_length) override;
+    virtual bool on_publish_header(uint8_t *topic, uint16_t topic_length, uint16_t message_id, uint32_t message_length) override;
+    virtual bool on_publish_data(uint8_t *data, uint32_t len, bool last_chunk) override;
+    virtual bool on_sent(uint16_t len) override;
+    virtual void on_closed() override;
+    virtual void on_connected() override;
+
+private:
+    void connect();
+    void schedule_reconnect();
+    uint32_t next_random();
+
+    // more topics then send_connect_subscribe takes are subscribed after CONNACK
+    bool subscribe_with_connect() { return m_config.subscribe_with_connect && (m_config.topic_count > 0) && (m_config.topic_count <= MQTT_STARTUP_TOPICS); }
+
+    MQTTSupervisorConfig m_config;
+    MQTTSocketInterface *m_upstream = NULL;
+    ISessionSender *m_session = NULL;
+    bool m_ownsSession = false;
+    MQTTSocketHandler m_handler;
+    MQTTOfflineQueue *m_offlineQueue = NULL;
+
+    MQTTSupervisorState m_state = MQTTSupervisorState::IDLE;
+    uint32_t m_random = 1;
+    uint8_t m_failures = 0;
+
+    uint64_t m_nowUs = 0;
+    uint64_t m_nextAttemptUs = 0;
+    uint64_t m_attemptStartUs = 0;
+    uint64_t m_disconnectUs = 0;
+
+    MQTTSupervisorStats m_stats = {};
+};
@@ -0,0 +1,231 @@
+/* MIT License
+
+Copyright (c) 2024 Adrian Cruceru - https://github.com/AdrianCX/pico_https
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include <algorithm>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include "stdlib.h"
+#include <cstdint>
+#else
+#include "pico/stdlib.h"
+#include "pico/time.h"
+#endif
+
+#include "mqtt_value_cache.h"
+
+extern "C" void trace(const char *parameters, ...);
+extern "C" const char *safestr(const char *value);
+
+bool MQTTValueCache::on_publish_header(uint8_t *topic, uint16_t topic_length, uint16_t message_id, uint32_t message_length)
+{
+    m_pending = MQTT_VALUE_CACHE_NO_ENTRY;
+    m_pendingLength = message_length;
+    m_pendingStored = 0;
+
+    // streamed topics are not available here
+    if (topic == NULL)
+    {
+        ++m_stats.dropped;
+        return true;
+    }
+
+    m_pending = lookup(topic, topic_length);
+    if (m_pending == MQTT_VALUE_CACHE_NO_ENTRY)
+    {
+        m_pending = add(topic, topic_length);
+        if (m_pending == MQTT_VALUE_CACHE_NO_ENTRY)
+        {
+            ++m_stats.dropped;
+        }
+    }
+
+    // a cache miss is not an error for the connection
+    return true;
+}
+
+bool MQTTValueCache::on_publish_data(uint8_t *data, uint32_t len, bool last_chunk)
+{
+    if (m_pending == MQTT_VALUE_CACHE_NO_ENTRY)
+    {
+        return true;
+    }
+
+    uint16_t count = std::min(len, (uint32_t)(MQTT_VALUE_CACHE_VALUE_SIZE - m_pendingStored));
+    if (count > 0)
+    {
+        memcpy(&m_pendingValue[m_pendingStored], data, count);
+        m_pendingStored += count;
+    }
+
+    if (last_chunk)
+    {
+        commit();
+        m_pending = MQTT_VALUE_CACHE_NO_ENTRY;
+    }
+    return true;
+}
+
+bool MQTTValueCache::track(const char *topic)
+{
+    if (topic == NULL)
+    {
+        return false;
+    }
+
+    uint16_t topic_length = strlen(topic);
+    return (lookup((const uint8_t *)topic, topic_length) != MQTT_VALUE_CACHE_NO_ENTRY) || (add((const uint8_t *)topic, topic_length) != MQTT_VALUE_CACHE_NO_ENTRY);
+}
+
+int8_t MQTTValueCache::find(const char *topic)
+{
+    return (topic != NULL) ? lookup((const uint8_t *)topic, strlen(topic)) : MQTT_VALUE_CACHE_NO_ENTRY;
+}
+
+bool MQTTValueCache::read(const char *topic, uint8_t *out, uint16_t out_size, MQTTCachedValue& info)
+{
+    return read(find(topic), out, out_size, info);
+}
+
+bool MQTTValueCache::read(int8_t index, uint8_t *out, uint16_t out_size, MQTTCachedValue& info)
+{
+    if ((index < 0) || (index >= get_count()))
+    {
+        return false;
+    }
+
+    Entry &entry = m_entries[index];
+
+    uint32_t sequence;
+    do
+    {
+        sequence = entry.sequence.load(std::memory_order_acquire);
+        if (sequence & 1)
+        {
+            // writer is copying a new value in
+            continue;
+        }
+
+        info = entry.info;
+        memcpy(out, entry.value, std::min(out_size, info.stored));
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+    } while ((sequence & 1) || (entry.sequence.load(std::memory_order_relaxed) != sequence));
+
+    return true;
+}
+
+const char *MQTTValueCache::get_topic(int8_t index)
+{
+    return ((index >= 0) && (index < get_count())) ? m_entries[index].topic : NULL;
+}
+
+int8_t MQTTValueCache::lookup(const uint8_t *topic, uint16_t topic_length)
+{
+    uint8_t count = get_count();
+    for (uint8_t i=0;i<count;++i)
+    {
+        // topics never change once an entry is visible
+        if ((strncmp(m_entries[i].topic, (const char *)topic, topic_length) == 0) && (m_entries[i].topic[topic_length] == '\0'))
+        {
+            return i;
+        }
+    }
+    return MQTT_VALUE_CACHE_NO_ENTRY;
+}
+
+int8_t MQTTValueCache::add(const uint8_t *topic, uint16_t topic_length)
+{
+    uint8_t count = m_count.load(std::memory_order_relaxed);
+    if (count >= MQTT_VALUE_CACHE_ENTRIES)
+    {
+        trace("MQTTValueCache::add: no entry left for topic[%.*s], max[%d]", topic_length, topic, MQTT_VALUE_CACHE_ENTRIES);
+        return MQTT_VALUE_CACHE_NO_ENTRY;
+    }
+
+    if ((topic_length == 0) || (topic_length >= MQTT_VALUE_CACHE_TOPIC_SIZE))
+    {
+        trace("MQTTValueCache::add: topic length[%d] not cached, max[%d]", topic_length, MQTT_VALUE_CACHE_TOPIC_SIZE - 1);
+        return MQTT_VALUE_CACHE_NO_ENTRY;
+    }
+
+    Entry &entry = m_entries[count];
+    memcpy(entry.topic, topic, topic_length);
+    entry.topic[topic_length] = '\0';
+    entry.info = {};
+
+    // entry is filled in before readers can see it
+    m_count.store(count + 1, std::memory_order_release);
+    return count;
+}
+
+void MQTTValueCache::commit()
+{
+    Entry &entry = m_entries[m_pending];
+
+    // the writer is the only one changing entries, no need for the sequence to look at the old value
+    bool changed = (entry.info.updates == 0) || (entry.info.length != m_pendingLength) || (entry.info.stored != m_pendingStored) || (memcmp(entry.value, m_pendingValue, m_pendingStored) != 0);
+
+    MQTTCachedValue info;
+    info.length = m_pendingLength;
+    info.stored = m_pendingStored;
+    info.updated_us = now_us();
+    info.updates = entry.info.updates + 1;
+
+    uint32_t sequence = entry.sequence.load(std::memory_order_relaxed);
+    entry.sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    entry.info = info;
+    memcpy(entry.value, m_pendingValue, m_pendingStored);
+
+    entry.sequence.store(sequence + 2, std::memory_order_release);
+
+    ++m_stats.stored;
+    if (m_pendingStored < m_pendingLength)
+    {
+        ++m_stats.truncated;
+    }
+
+    if (changed)
+    {
+        ++m_stats.changed;
+        if (m_listener != NULL)
+        {
+            m_listener->on_value_changed(m_pending, entry.topic, entry.value, info.stored, info);
+        }
+    }
+}
+
+uint64_t MQTTValueCache::now_us()
+{
+    if (m_clock != NULL)
+    {
+        return m_clock();
+    }
+
+#if defined(__x86_64__) || defined(_M_X64)
+    return 0;
+#else
+    return time_us_64();
+#endif
+}
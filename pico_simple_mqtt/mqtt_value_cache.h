@@ -0,0 +1,154 @@
+/* MIT License
+
+Copyright (c) 2024 Adrian Cruceru - https://github.com/AdrianCX/pico_https
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#ifdef __TARGET_CPU_CORTEX_M0PLUS
+#include "pico/stdlib.h"
+#else
+#include "stdlib.h"
+#include <cstdint>
+#endif
+
+#include <atomic>
+
+#include "mqtt_subscriptions.h"
+
+// Topics the cache holds a value for, entries are taken on the first publish of a topic and kept.
+#ifndef MQTT_VALUE_CACHE_ENTRIES
+#define MQTT_VALUE_CACHE_ENTRIES 8
+#endif
+
+// Longer topics are not cached.
+#ifndef MQTT_VALUE_CACHE_TOPIC_SIZE
+#define MQTT_VALUE_CACHE_TOPIC_SIZE 64
+#endif
+
+// Payload bytes kept per topic, longer messages are stored truncated.
+#ifndef MQTT_VALUE_CACHE_VALUE_SIZE
+#define MQTT_VALUE_CACHE_VALUE_SIZE 128
+#endif
+
+#define MQTT_VALUE_CACHE_NO_ENTRY -1
+
+static_assert(MQTT_VALUE_CACHE_ENTRIES <= 127, "MQTT_VALUE_CACHE_ENTRIES must fit an int8_t index");
+
+struct MQTTCachedValue
+{
+    // length of the message as published, stored is less when it did not fit MQTT_VALUE_CACHE_VALUE_SIZE
+    uint32_t length;
+    uint16_t stored;
+    uint64_t updated_us;
+    uint32_t updates;
+};
+
+struct MQTTValueCacheStats
+{
+    uint32_t stored;
+    uint32_t changed;
+    uint32_t truncated;
+    uint32_t dropped;
+};
+
+class MQTTValueCacheListener
+{
+public:
+    // Called from the thread feeding the cache, after the new value is visible to readers, only if the payload changed.
+    virtual void on_value_changed(int8_t index, const char *topic, const uint8_t *data, uint16_t len, const MQTTCachedValue& info) {}
+};
+
+///
+/// Latest payload of each topic received, for code that needs the current value of a topic outside the MQTT callbacks,
+/// for example an HTTP handler rendering a status page.
+///
+/// Feed it like a subscription handler, either directly from MQTTSocketInterface::on_publish_header/on_publish_data or
+/// through MQTTSubscriptions::add for the filters to cache. Only one thread feeds the cache.
+///
+/// Reads are lock free and can happen from any thread or the other core: each entry is guarded by a sequence counter
+/// that is odd while the writer copies a new value in, readers copy the value out and retry when the counter moved.
+/// A message is assembled in a staging buffer first, so the counter is only odd for the final copy.
+///
+/// Entries are never released, topic and index of an entry stay valid for the lifetime of the cache.
+///
+class MQTTValueCache : public MQTTSubscriptionInterface
+{
+public:
+    MQTTValueCache() {};
+
+    virtual bool on_publish_header(uint8_t *topic, uint16_t topic_length, uint16_t message_id, uint32_t message_length) override;
+    virtual bool on_publish_data(uint8_t *data, uint32_t len, bool last_chunk) override;
+
+    ///
+    /// Reserve an entry before the first publish arrives, readers can then look it up (with updates 0) right away.
+    /// Writer side only. @returns - false when the topic is too long or all entries are taken.
+    ///
+    bool track(const char *topic);
+
+    ///
+    /// @returns - index of topic or MQTT_VALUE_CACHE_NO_ENTRY. Safe from any thread.
+    ///
+    int8_t find(const char *topic);
+
+    ///
+    /// Copy the latest value out, up to out_size bytes. Safe from any thread.
+    /// @returns - false when there is no entry for topic (or index).
+    ///
+    bool read(const char *topic, uint8_t *out, uint16_t out_size, MQTTCachedValue& info);
+    bool read(int8_t index, uint8_t *out, uint16_t out_size, MQTTCachedValue& info);
+
+    const char *get_topic(int8_t index);
+    uint8_t get_count() { return m_count.load(std::memory_order_acquire); }
+
+    void set_listener(MQTTValueCacheListener *listener) { m_listener = listener; }
+
+    // Time source for updated_us, defaults to time since boot.
+    void set_clock(uint64_t (*clock)()) { m_clock = clock; }
+
+    const MQTTValueCacheStats& get_stats() { return m_stats; }
+
+private:
+    struct Entry
+    {
+        std::atomic<uint32_t> sequence{0};
+        char topic[MQTT_VALUE_CACHE_TOPIC_SIZE];
+        MQTTCachedValue info;
+        uint8_t value[MQTT_VALUE_CACHE_VALUE_SIZE];
+    };
+
+    int8_t lookup(const uint8_t *topic, uint16_t topic_length);
+    int8_t add(const uint8_t *topic, uint16_t topic_length);
+    void commit();
+    uint64_t now_us();
+
+    Entry m_entries[MQTT_VALUE_CACHE_ENTRIES];
+    std::atomic<uint8_t> m_count{0};
+
+    // message being received, MQTT_VALUE_CACHE_NO_ENTRY when it is not cached
+    int8_t m_pending = MQTT_VALUE_CACHE_NO_ENTRY;
+    uint32_t m_pendingLength = 0;
+    uint16_t m_pendingStored = 0;
+    uint8_t m_pendingValue[MQTT_VALUE_CACHE_VALUE_SIZE];
+
+    MQTTValueCacheListener *m_listener = NULL;
+    uint64_t (*m_clock)() = NULL;
+    MQTTValueCacheStats m_stats = {};
+};
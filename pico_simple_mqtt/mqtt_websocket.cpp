@@ -0,0 +1,332 @@
+/* MIT License
+
+Copyright (c) 2024 Adrian Cruceru - https://github.com/AdrianCX/pico_https
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include <algorithm>
+#include <string.h>
+#include <stdio.h>
+
+#include "mqtt_websocket.h"
+#include "pico_http/http_header.h"
+
+extern "C" void trace(const char *parameters, ...);
+extern "C" const char *safestr(const char *value);
+
+// mbedtls_wrapper
+extern "C" int base64_encode(const unsigned char *src, size_t slen, unsigned char *dst, size_t dlen);
+
+// lwip error codes, returned through ISessionSender
+static const int8_t MQTT_WEBSOCKET_ERR_CONN = -11;
+static const int8_t MQTT_WEBSOCKET_ERR_ARG = -16;
+
+MQTTWebSocketTransport::MQTTWebSocketTransport(ISessionSender *session, const char *path, WebSocketMaskGenerator random)
+    : m_session(session)
+    , m_random(random)
+{
+    m_host[0] = '\0';
+    m_key[0] = '\0';
+
+    int written = snprintf(m_path, sizeof(m_path), "%s", (path != NULL) ? path : "/mqtt");
+    if ((written < 0) || (written >= (int)sizeof(m_path)))
+    {
+        trace("MQTTWebSocketTransport::MQTTWebSocketTransport: this=%p, path[%s] longer then max[%d], using /mqtt.", this, safestr(path), MQTT_WEBSOCKET_PATH_SIZE - 1);
+        snprintf(m_path, sizeof(m_path), "/mqtt");
+    }
+}
+
+bool MQTTWebSocketTransport::set_host(const char *host, uint16_t port)
+{
+    int written = snprintf(m_host, sizeof(m_host), "%s", safestr(host));
+    if ((host == NULL) || (written < 0) || (written >= (int)sizeof(m_host)))
+    {
+        trace("MQTTWebSocketTransport::set_host: this=%p, host[%s] missing or longer then max[%d].", this, safestr(host), MQTT_WEBSOCKET_HOST_SIZE - 1);
+        return false;
+    }
+
+    m_port = port;
+    m_state = MQTTWebSocketState::CONNECTING;
+    m_replyLen = 0;
+
+    // frame state of a previous connection is gone
+    m_websocket = WebSocketHandler();
+    m_websocket.setClientMode(m_random);
+    return true;
+}
+
+int8_t MQTTWebSocketTransport::connect(const char *host, uint16_t port)
+{
+    if (!set_host(host, port))
+    {
+        return MQTT_WEBSOCKET_ERR_ARG;
+    }
+
+    int8_t err = m_session->connect(host, port);
+    if (err != 0)
+    {
+        m_state = MQTTWebSocketState::CLOSED;
+    }
+    return err;
+}
+
+int8_t MQTTWebSocketTransport::connect(const char *host, const ip_addr_t *ipaddr, uint16_t port)
+{
+    // host is still needed for the Host header
+    if (!set_host(host, port))
+    {
+        return MQTT_WEBSOCKET_ERR_ARG;
+    }
+
+    int8_t err = m_session->connect(host, ipaddr, port);
+    if (err != 0)
+    {
+        m_state = MQTTWebSocketState::CLOSED;
+    }
+    return err;
+}
+
+int8_t MQTTWebSocketTransport::send(const uint8_t *data, size_t len)
+{
+    if (m_state != MQTTWebSocketState::OPEN)
+    {
+        trace("MQTTWebSocketTransport::send: this=%p, websocket not open, state[%d].", this, (int)m_state);
+        return MQTT_WEBSOCKET_ERR_CONN;
+    }
+
+    // one frame per send, MQTT packets do not need to line up with frames
+    m_sendError = 0;
+    if (!m_websocket.encodeData(data, len, this, WebSocketOperation::BINARY_FRAME))
+    {
+        return (m_sendError != 0) ? m_sendError : MQTT_WEBSOCKET_ERR_CONN;
+    }
+    return 0;
+}
+
+int8_t MQTTWebSocketTransport::flush()
+{
+    return m_session->flush();
+}
+
+int8_t MQTTWebSocketTransport::close()
+{
+    if (m_state == MQTTWebSocketState::OPEN)
+    {
+        // best effort, the TCP connection goes regardless
+        m_websocket.sendClose(WebSocketCloseCode::NORMAL_CLOSURE, this);
+    }
+
+    return m_session->close();
+}
+
+uint16_t MQTTWebSocketTransport::send_buffer_size()
+{
+    uint16_t size = m_session->send_buffer_size();
+    return (size > WEBSOCKET_FRAME_HEADROOM) ? (size - WEBSOCKET_FRAME_HEADROOM) : 0;
+}
+
+bool MQTTWebSocketTransport::on_sent(uint16_t len)
+{
+    // acknowledged bytes include frame headers
+    return (m_state != MQTTWebSocketState::OPEN) || m_callback->on_sent(len);
+}
+
+void MQTTWebSocketTransport::on_connected()
+{
+    m_state = MQTTWebSocketState::HANDSHAKE;
+
+    if (!send_upgrade())
+    {
+        m_session->close();
+    }
+}
+
+void MQTTWebSocketTransport::on_closed()
+{
+    trace("MQTTWebSocketTransport::on_closed: this=%p, state[%d]", this, (int)m_state);
+
+    m_state = MQTTWebSocketState::CLOSED;
+    m_callback->on_closed();
+}
+
+bool MQTTWebSocketTransport::on_recv(uint8_t *data, size_t len)
+{
+    switch (m_state)
+    {
+        case MQTTWebSocketState::HANDSHAKE:
+        {
+            bool complete = false;
+            if (!validate_reply(data, len, complete))
+            {
+                m_state = MQTTWebSocketState::CLOSED;
+                return false;
+            }
+
+            if (!complete)
+            {
+                return true;
+            }
+
+            trace("MQTTWebSocketTransport::on_recv: this=%p, websocket established host[%s] path[%s]", this, m_host, m_path);
+
+            // the MQTT handler starts with CONNECT from here
+            m_state = MQTTWebSocketState::OPEN;
+            m_callback->on_connected();
+
+            // server may send frames right behind the reply
+            return (len == 0) || m_websocket.decodeData(data, len, this);
+        }
+        case MQTTWebSocketState::OPEN:
+        {
+            return m_websocket.decodeData(data, len, this);
+        }
+        default:
+        {
+            return false;
+        }
+    }
+}
+
+bool MQTTWebSocketTransport::onWebSocketData(uint8_t *data, size_t len)
+{
+    // frame payload as it is decoded, the handler reassembles MQTT packets
+    return (len == 0) || m_callback->on_recv(data, len);
+}
+
+bool MQTTWebSocketTransport::onWebsocketEncodedData(const uint8_t *data, size_t len)
+{
+    m_sendError = m_session->send(data, len);
+    if (m_sendError != 0)
+    {
+        trace("MQTTWebSocketTransport::onWebsocketEncodedData: this=%p, failed sending websocket data error[%d]", this, m_sendError);
+        return false;
+    }
+    return true;
+}
+
+bool MQTTWebSocketTransport::onWebSocketClose(uint16_t code)
+{
+    trace("MQTTWebSocketTransport::onWebSocketClose: this=%p, code[%d]", this, code);
+
+    // close handshake is done, returning false closes the connection
+    return false;
+}
+
+bool MQTTWebSocketTransport::send_upgrade()
+{
+    // 16 random bytes, base64 encoded
+    uint8_t nonce[16];
+    for (int i=0;i<4;++i)
+    {
+        uint32_t value = m_random();
+        memcpy(&nonce[i*4], &value, sizeof(value));
+    }
+
+    int err = base64_encode(nonce, sizeof(nonce), (uint8_t*)m_key, sizeof(m_key));
+    if (err != 0)
+    {
+        trace("MQTTWebSocketTransport::send_upgrade: this=%p, base64 error[%d]", this, err);
+        return false;
+    }
+
+    char request[MQTT_WEBSOCKET_HOST_SIZE + MQTT_WEBSOCKET_PATH_SIZE + 224];
+    int written = snprintf(request, sizeof(request),
+                           "GET %s HTTP/1.1\r\n"
+                           "Host: %s:%d\r\n"
+                           "Upgrade: websocket\r\n"
+                           "Connection: Upgrade\r\n"
+                           "Sec-WebSocket-Key: %s\r\n"
+                           "Sec-WebSocket-Version: 13\r\n"
+                           "Sec-WebSocket-Protocol: mqtt\r\n"
+                           "\r\n", m_path, m_host, m_port, m_key);
+
+    if ((written <= 0) || (written >= (int)sizeof(request)))
+    {
+        trace("MQTTWebSocketTransport::send_upgrade: this=%p, request does not fit buffer[%d].", this, sizeof(request));
+        return false;
+    }
+
+    return m_session->send((const uint8_t *)request, written) == 0;
+}
+
+bool MQTTWebSocketTransport::validate_reply(uint8_t*& data, size_t& len, bool& complete)
+{
+    // reply may arrive in pieces, frames may follow it in the same segment
+    uint16_t previous = m_replyLen;
+    size_t count = std::min(len, (size_t)(MQTT_WEBSOCKET_REPLY_SIZE - m_replyLen));
+    memcpy(&m_reply[m_replyLen], data, count);
+    m_replyLen += count;
+    m_reply[m_replyLen] = '\0';
+
+    char *end = strstr(m_reply, "\r\n\r\n");
+    if (end == NULL)
+    {
+        if (m_replyLen >= MQTT_WEBSOCKET_REPLY_SIZE)
+        {
+            trace("MQTTWebSocketTransport::validate_reply: this=%p, reply header larger then buffer[%d].", this, MQTT_WEBSOCKET_REPLY_SIZE);
+            return false;
+        }
+
+        data += len;
+        len = 0;
+        return true;
+    }
+
+    uint16_t header_size = (end - m_reply) + 4;
+
+    HTTPHeader header;
+    if (!header.parse(m_reply, header_size) || (header.getResponseCode() != 101))
+    {
+        trace("MQTTWebSocketTransport::validate_reply: this=%p, upgrade refused, code[%d]", this, header.getResponseCode());
+        return false;
+    }
+
+    // brokers must confirm the subprotocol, MQTT can not be spoken otherwise
+    const char *protocol = header.getHeaderValue("Sec-WebSocket-Protocol");
+    if ((protocol == NULL) || (strcmp(protocol, "mqtt") != 0))
+    {
+        trace("MQTTWebSocketTransport::validate_reply: this=%p, server did not accept subprotocol mqtt, got[%s]", this, safestr(protocol));
+        return false;
+    }
+
+    const char *accept = header.getHeaderValue("Sec-WebSocket-Accept");
+    if (accept == NULL)
+    {
+        trace("MQTTWebSocketTransport::validate_reply: this=%p, reply missing header 'Sec-WebSocket-Accept'", this);
+        return false;
+    }
+
+    char buffer[WEBSOCKET_ACCEPT_SIZE];
+    if (!computeWebSocketAccept(m_key, buffer, sizeof(buffer)))
+    {
+        return false;
+    }
+
+    if (strcmp(buffer, accept) != 0)
+    {
+        trace("MQTTWebSocketTransport::validate_reply: this=%p, invalid 'Sec-WebSocket-Accept' got[%s] expected[%s]", this, accept, buffer);
+        return false;
+    }
+
+    // only the part of this segment that belonged to the header is consumed
+    data += header_size - previous;
+    len -= header_size - previous;
+    complete = true;
+    return true;
+}
@@ -0,0 +1,120 @@
+/* MIT License
+
+Copyright (c) 2024 Adrian Cruceru - https://github.com/AdrianCX/pico_https
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#ifdef __TARGET_CPU_CORTEX_M0PLUS
+#include "pico/stdlib.h"
+#else
+#include "stdlib.h"
+#include <cstdint>
+#endif
+
+#include "pico_tls/isession_callback.h"
+#include "pico_http/websocket_handler.h"
+
+// Upgrade reply from the server, kept until the header is complete.
+#ifndef MQTT_WEBSOCKET_REPLY_SIZE
+#define MQTT_WEBSOCKET_REPLY_SIZE 512
+#endif
+
+#ifndef MQTT_WEBSOCKET_HOST_SIZE
+#define MQTT_WEBSOCKET_HOST_SIZE 64
+#endif
+
+#ifndef MQTT_WEBSOCKET_PATH_SIZE
+#define MQTT_WEBSOCKET_PATH_SIZE 64
+#endif
+
+enum class MQTTWebSocketState
+{
+    CLOSED,
+    CONNECTING,
+    HANDSHAKE,
+    OPEN,
+};
+
+///
+/// MQTT over WebSocket (port 443 friendly), an ISessionSender/ISessionCallback pair placed between MQTTSocketHandler and a Session.
+///
+/// connect() opens the TCP/TLS connection and sends the upgrade request with Sec-WebSocket-Protocol "mqtt",
+/// on_connected reaches the handler only once the server accepted it. Every send() goes out as one masked BINARY frame,
+/// masked while it is copied into the frame (WebSocketHandler::encodeData) with no staging buffer for whole packets.
+/// Received frame payloads are handed to the handler as they are decoded, MQTT packets may span frames or share one.
+///
+/// Usage: the Session callback is the transport, the transport callback is the MQTTSocketHandler
+/// and the handler downstream (or MQTTSupervisor session) is the transport.
+///
+class MQTTWebSocketTransport
+    : public ISessionSender
+    , public ISessionCallback
+    , public WebSocketInterface
+{
+public:
+    ///
+    /// @param session - TCP/TLS connection, not owned.
+    /// @param path - request path, "/mqtt" for most brokers.
+    /// @param random - source of masking keys and the handshake nonce, get_rand_32 on the device.
+    ///
+    MQTTWebSocketTransport(ISessionSender *session, const char *path, WebSocketMaskGenerator random);
+
+    void set_callback(ISessionCallback *callback) { m_callback = callback; }
+    MQTTWebSocketState get_state() { return m_state; }
+
+    virtual int8_t connect(const char *host, uint16_t port) override;
+    virtual int8_t connect(const char *host, const ip_addr_t *ipaddr, uint16_t port) override;
+    virtual int8_t send(const uint8_t *data, size_t len) override;
+    virtual int8_t flush() override;
+    virtual int8_t close() override;
+    virtual uint16_t send_buffer_size() override;
+    virtual bool is_connected() override { return (m_state == MQTTWebSocketState::OPEN) && m_session->is_connected(); }
+
+    virtual bool on_sent(uint16_t len) override;
+    virtual bool on_recv(uint8_t *data, size_t len) override;
+    virtual void on_closed() override;
+    virtual void on_connected() override;
+
+    virtual bool onWebSocketData(uint8_t *data, size_t len) override;
+    virtual bool onWebsocketEncodedData(const uint8_t *data, size_t len) override;
+    virtual bool onWebSocketClose(uint16_t code) override;
+
+private:
+    bool set_host(const char *host, uint16_t port);
+    bool send_upgrade();
+    bool validate_reply(uint8_t*& data, size_t& len, bool& complete);
+
+    ISessionSender *m_session = NULL;
+    ISessionCallback *m_callback = NULL;
+    WebSocketMaskGenerator m_random = NULL;
+    WebSocketHandler m_websocket;
+
+    MQTTWebSocketState m_state = MQTTWebSocketState::CLOSED;
+    int8_t m_sendError = 0;
+
+    uint16_t m_port = 0;
+    char m_host[MQTT_WEBSOCKET_HOST_SIZE];
+    char m_path[MQTT_WEBSOCKET_PATH_SIZE];
+    char m_key[32];
+
+    uint16_t m_replyLen = 0;
+    char m_reply[MQTT_WEBSOCKET_REPLY_SIZE + 1];
+};
@@ -23,6 +23,7 @@ SOFTWARE.
 */
 #include <string.h>
 #include <time.h>
+#include "hardware/dma.h"
 #include "hardware/flash.h"
 #include "hardware/sync.h"
 #include "hardware/xip_cache.h"
@@ -132,6 +133,9 @@ UpgradeHelper *UpgradeHelper::create()
 
 UpgradeHelper::UpgradeHelper()
 {
+#if OTA_DMA_SNIFFER_CRC
+    m_dmaChannel = dma_claim_unused_channel(false);
+#endif
     clear();
 }
 
@@ -140,12 +144,68 @@ bool UpgradeHelper::clear()
     trace("UpgradeHelper::clear: this=%p", this);
     memset(&m_regionErased[0], 0, sizeof(m_regionErased));
     m_index = 0;
+    m_sectors[0].region = NO_REGION;
+    m_sectors[1].region = NO_REGION;
+    m_receiving = 0;
+    m_pending = false;
+    m_failed = false;
+    m_stats = {};
+
+    // an abandoned transfer must not leave the window closed
+    releaseHeldBytes();
     return true;
 }
 
+void UpgradeHelper::setSession(Session *session)
+{
+    releaseHeldBytes();
+
+    if (m_session != NULL)
+    {
+        m_session->set_manual_recved(false);
+    }
+
+    m_session = session;
+
+    if (m_session != NULL)
+    {
+        m_session->set_manual_recved(true);
+    }
+}
+
 bool UpgradeHelper::storeData(u8_t *data, size_t len)
 {
     trace("UpgradeHelper::storeData: this=%p data=%p len=%d.\n", this, data, len);
+
+    if (m_failed)
+    {
+        trace("UpgradeHelper::storeData: this=%p programming a sector failed earlier.\n", this);
+        return false;
+    }
+
+    if (m_stats.bytes == 0)
+    {
+        m_stats.start_us = time_us_64();
+    }
+    m_stats.bytes += len;
+
+    // window reopens once the bytes are in flash, or right away while nothing waits for poll
+    if (m_session != NULL)
+    {
+        m_heldBytes += len;
+    }
+
+    // a refused image must not leave the window closed either
+    bool result = storeBlocks(data, len);
+    if (!result || !m_pending)
+    {
+        releaseHeldBytes();
+    }
+    return result;
+}
+
+bool UpgradeHelper::storeBlocks(u8_t *data, size_t len)
+{
     while (len > 0)
     {
         size_t available = (BLOCK_SIZE - m_index);
@@ -203,9 +263,9 @@ bool UpgradeHelper::storeData(u8_t *data, size_t len)
                 return false;
             }
 
-            if ((((uint32_t)(&block->data[0])) % 32) != 0)
+            if ((block->payloadSize > sizeof(block->data)) || ((block->targetAddr % FLASH_SECTOR_SIZE) + block->payloadSize > FLASH_SECTOR_SIZE))
             {
-                trace("UpgradeHelper::storeData: this=%p targetAddr[0x%x] flags[0x%x] payloadSize[%d] blockNo[%d] numBlocks[%d] magicEnd[0x%x] software failure, m_buffer must be 32 byte aligned, address[%p].\n", this, block->targetAddr, block->flags, block->payloadSize, block->blockNo, block->numBlocks, block->magicEnd, &block->data[0]);
+                trace("UpgradeHelper::storeData: this=%p targetAddr[0x%x] flags[0x%x] payloadSize[%d] blockNo[%d] numBlocks[%d] magicEnd[0x%x] payload larger then block or crossing a sector.\n", this, block->targetAddr, block->flags, block->payloadSize, block->blockNo, block->numBlocks, block->magicEnd);
                 return false;
             }
 
@@ -217,22 +277,16 @@ bool UpgradeHelper::storeData(u8_t *data, size_t len)
                 return false;
             }
 
-            int rc = flash_safe_execute(UpgradeHelper::writeToFlash, (void*)this, UINT32_MAX);
-            if (rc != PICO_OK)
+            m_stats.blocks++;
+
+            // flash is only touched once blocks move on to another sector
+            if ((region != m_sectors[m_receiving].region) && (!queueSector() || !loadSector(region)))
             {
                 trace("UpgradeHelper::storeData: this=%p targetAddr[0x%x] flags[0x%x] payloadSize[%d] blockNo[%d] numBlocks[%d] magicEnd[0x%x] failed write to flash.\n", this, block->targetAddr, block->flags, block->payloadSize, block->blockNo, block->numBlocks, block->magicEnd);
                 return false;
             }
-            
-            const volatile uint8_t *flash_target_contents = (const uint8_t *) (XIP_BASE + block->targetAddr);
-            for (uint32_t i=0;i<block->payloadSize;++i)
-            {
-                if (flash_target_contents[i] != block->data[i])
-                {
-                    trace("UpgradeHelper::storeData: this=%p targetAddr[0x%x] flags[0x%x] payloadSize[%d] blockNo[%d] numBlocks[%d] magicEnd[0x%x] written data does not match buffer, byte[0x%x] flash[0x%x] expected[0x%x].\n", this, block->targetAddr, block->flags, block->payloadSize, block->blockNo, block->numBlocks, block->magicEnd, i, flash_target_contents[i], block->data[i]);
-                    return false;
-                }
-            }
+
+            memcpy(&m_sectors[m_receiving].data[block->targetAddr - offset], &block->data[0], block->payloadSize);
         }
         else if (m_index > BLOCK_SIZE)
         {
@@ -244,28 +298,228 @@ bool UpgradeHelper::storeData(u8_t *data, size_t len)
     return true;
 }
 
-void UpgradeHelper::writeToFlash(void *param)
+bool UpgradeHelper::poll()
 {
-    UpgradeHelper *self = (UpgradeHelper *)param;
-    
-    UF2_Block *block = (UF2_Block *)&self->m_buffer[0];
+    cyw43_arch_lwip_begin();
 
-    uint32_t region = (block->targetAddr - OTA_FLASH_BUFFER_OFFSET) / FLASH_SECTOR_SIZE;
-    uint32_t offset = block->targetAddr - (block->targetAddr % FLASH_SECTOR_SIZE);
-    
-    if (!self->getRegionErased(region))
+    bool pending = m_pending;
+    bool result = !m_failed && programPending();
+    m_failed = !result;
+
+    if (result && pending)
+    {
+        m_stats.deferred++;
+    }
+
+    cyw43_arch_lwip_end();
+    return result;
+}
+
+bool UpgradeHelper::flush()
+{
+    // a sector lost earlier (in poll or storeData) must not end up as a partial image over the program
+    if (m_failed)
+    {
+        trace("UpgradeHelper::flush: this=%p programming a sector failed earlier.\n", this);
+        return false;
+    }
+
+    if (!programPending())
+    {
+        return false;
+    }
+
+    return (m_sectors[m_receiving].region == NO_REGION) || writeSector(m_receiving);
+}
+
+uint32_t UpgradeHelper::getThroughputKBps()
+{
+    uint64_t elapsed = time_us_64() - m_stats.start_us;
+    return ((m_stats.bytes > 0) && (elapsed > 0)) ? (uint32_t)(((uint64_t)m_stats.bytes * 1000000) / (elapsed * 1024)) : 0;
+}
+
+bool UpgradeHelper::queueSector()
+{
+    if (m_sectors[m_receiving].region == NO_REGION)
+    {
+        return true;
+    }
+
+    // poll did not get to the previous sector yet, no buffer left to receive into
+    if (m_pending)
+    {
+        m_stats.synchronous++;
+        if (!programPending())
+        {
+            return false;
+        }
+    }
+
+    m_pending = true;
+    m_receiving = 1 - m_receiving;
+    return true;
+}
+
+bool UpgradeHelper::programPending()
+{
+    if (!m_pending)
     {
-        self->setRegionErased(region);
-        flash_range_erase(offset, FLASH_SECTOR_SIZE);
+        return true;
     }
 
-    flash_range_program(block->targetAddr, &block->data[0], block->payloadSize);
+    m_pending = false;
+
+    bool result = writeSector(1 - m_receiving);
+    releaseHeldBytes();
+    return result;
 }
 
+bool UpgradeHelper::writeSector(uint8_t index)
+{
+    m_writing = index;
+
+    uint64_t start = time_us_64();
+    int rc = flash_safe_execute(UpgradeHelper::writeToFlash, (void*)this, UINT32_MAX);
+    uint64_t elapsed = time_us_64() - start;
+
+    m_stats.flash_us += elapsed;
+    m_stats.max_flash_us = (elapsed > m_stats.max_flash_us) ? elapsed : m_stats.max_flash_us;
+
+    // a sector that did not make it leaves its region unmarked and the image unusable until clear()
+    if (rc != PICO_OK)
+    {
+        trace("UpgradeHelper::writeSector: this=%p region[%d] flash_safe_execute failed rc[%d].\n", this, m_sectors[index].region, rc);
+        m_failed = true;
+        return false;
+    }
 
+    m_stats.sectors++;
+
+    if (!verifySector(index))
+    {
+        m_failed = true;
+        return false;
+    }
+
+    setRegionErased(m_sectors[index].region);
+    m_sectors[index].region = NO_REGION;
+    return true;
+}
+
+bool UpgradeHelper::loadSector(uint32_t region)
+{
+    // a sector waiting for poll is read back from flash like any other written sector
+    if (m_pending && (m_sectors[1 - m_receiving].region == region))
+    {
+        m_stats.synchronous++;
+        if (!programPending())
+        {
+            return false;
+        }
+    }
+
+    Sector &sector = m_sectors[m_receiving];
+    sector.region = region;
+
+    if (!getRegionErased(region))
+    {
+        memset(&sector.data[0], 0xFF, FLASH_SECTOR_SIZE);
+        return true;
+    }
+
+    // blocks out of order, keep what was already written to the sector
+    trace("UpgradeHelper::loadSector: this=%p region[%d] written before, reading it back.\n", this, region);
+    m_stats.rewrites++;
+    memcpy(&sector.data[0], (const void *)(XIP_BASE + OTA_FLASH_BUFFER_OFFSET + region * FLASH_SECTOR_SIZE), FLASH_SECTOR_SIZE);
+    return true;
+}
+
+void UpgradeHelper::releaseHeldBytes()
+{
+    // altcp_recved takes at most 64KB at a time
+    while ((m_session != NULL) && (m_heldBytes > 0))
+    {
+        u16_t len = (m_heldBytes > 0xFFFF) ? 0xFFFF : m_heldBytes;
+        m_session->recved(len);
+        m_heldBytes -= len;
+    }
+    m_heldBytes = 0;
+}
+
+bool UpgradeHelper::verifySector(uint8_t index)
+{
+    uint64_t start = time_us_64();
+    Sector &sector = m_sectors[index];
+
+    // no cache allocation, the sector is not read again
+    const uint8_t *flash_target_contents = (const uint8_t *) (XIP_NOCACHE_NOALLOC_BASE + OTA_FLASH_BUFFER_OFFSET + sector.region * FLASH_SECTOR_SIZE);
+
+    // the sniffer is shared by all channels, leave it alone while someone else has it enabled
+    bool match = true;
+    if ((m_dmaChannel >= 0) && ((dma_hw->sniff_ctrl & DMA_SNIFF_CTRL_EN_BITS) == 0))
+    {
+        uint32_t expected = crc32(&sector.data[0], FLASH_SECTOR_SIZE);
+        uint32_t written = crc32(flash_target_contents, FLASH_SECTOR_SIZE);
+        if (written != expected)
+        {
+            trace("UpgradeHelper::verifySector: this=%p region[%d] written data does not match buffer, crc flash[0x%x] expected[0x%x].\n", this, sector.region, written, expected);
+            match = false;
+        }
+    }
+    else if (memcmp(flash_target_contents, &sector.data[0], FLASH_SECTOR_SIZE) != 0)
+    {
+        trace("UpgradeHelper::verifySector: this=%p region[%d] written data does not match buffer.\n", this, sector.region);
+        match = false;
+    }
+
+    m_stats.verify_us += time_us_64() - start;
+    return match;
+}
+
+uint32_t UpgradeHelper::crc32(const uint8_t *data, size_t len)
+{
+    // transfers go nowhere, only the sniffer looks at the data
+    static uint32_t sink;
+
+    dma_channel_config config = dma_channel_get_default_config(m_dmaChannel);
+    channel_config_set_transfer_data_size(&config, DMA_SIZE_32);
+    channel_config_set_read_increment(&config, true);
+    channel_config_set_write_increment(&config, false);
+    channel_config_set_sniff_enable(&config, true);
+
+    dma_sniffer_enable(m_dmaChannel, DMA_SNIFF_CTRL_CALC_VALUE_CRC32, true);
+    dma_sniffer_set_data_accumulator(0xFFFFFFFF);
+
+    dma_channel_configure(m_dmaChannel, &config, &sink, data, len / 4, true);
+    dma_channel_wait_for_finish_blocking(m_dmaChannel);
+
+    uint32_t crc = dma_sniffer_get_data_accumulator();
+    dma_sniffer_disable();
+    return crc;
+}
+
+void UpgradeHelper::writeToFlash(void *param)
+{
+    UpgradeHelper *self = (UpgradeHelper *)param;
+    Sector &sector = self->m_sectors[self->m_writing];
+
+    uint32_t offset = OTA_FLASH_BUFFER_OFFSET + sector.region * FLASH_SECTOR_SIZE;
+
+    flash_range_erase(offset, FLASH_SECTOR_SIZE);
+    flash_range_program(offset, &sector.data[0], FLASH_SECTOR_SIZE);
+}
 
 void UpgradeHelper::upgrade()
 {
+    if (!flush())
+    {
+        trace("UpgradeHelper::upgrade: this=%p failed writing last sector, not upgrading.\n", this);
+        return;
+    }
+
+    trace("UpgradeHelper::upgrade: this=%p bytes[%d] blocks[%d] sectors[%d] deferred[%d] synchronous[%d] rewrites[%d] total[%d ms] throughput[%d KB/s] flash[%d ms] max_stall[%d ms] verify[%d ms].\n", this,
+          m_stats.bytes, m_stats.blocks, m_stats.sectors, m_stats.deferred, m_stats.synchronous, m_stats.rewrites, (uint32_t)((time_us_64() - m_stats.start_us) / 1000), getThroughputKBps(),
+          (uint32_t)(m_stats.flash_us / 1000), (uint32_t)(m_stats.max_flash_us / 1000), (uint32_t)(m_stats.verify_us / 1000));
+
     upgrade_binary((void *)this);
 }
-
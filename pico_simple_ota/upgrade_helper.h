@@ -29,6 +29,7 @@ SOFTWARE.
 #include "pico/stdlib.h"
 #include "pico/cyw43_arch.h"
 #include "http_session.h"
+#include "session.h"
 #include "hardware/flash.h"
 
 // Should be defined in general config
@@ -40,6 +41,62 @@ SOFTWARE.
 #define MAX_BINARY_SIZE (256 * 4096)
 #endif
 
+// Verify written sectors with a CRC32 from the DMA sniffer. There is only one sniffer and the SDK has no claim for it,
+// set to 0 when the application uses it as well. A sniffer found enabled at verify time falls back to memcmp.
+#ifndef OTA_DMA_SNIFFER_CRC
+#define OTA_DMA_SNIFFER_CRC 1
+#endif
+
+struct UpgradeStats
+{
+    uint32_t bytes;
+    uint32_t blocks;
+    uint32_t sectors;
+
+    // sectors programmed successfully from poll, and the ones programmed inside storeData because the previous one was still waiting
+    uint32_t deferred;
+    uint32_t synchronous;
+
+    // sectors that were already written when a block for them came in (blocks out of order), read back and programmed again
+    uint32_t rewrites;
+
+    // first storeData after clear
+    uint64_t start_us;
+
+    // time in flash_safe_execute, receive processing is stalled meanwhile
+    uint64_t flash_us;
+    uint64_t max_flash_us;
+    uint64_t verify_us;
+};
+
+///
+/// Stores an UF2 image in the OTA buffer region of flash, upgrade() copies it over the running program and reboots.
+///
+/// Block payloads are collected into a RAM copy of their 4KB sector, the sector is erased and programmed in one
+/// flash_safe_execute once blocks move on to another sector (or on flush), instead of one flash operation per block.
+/// Each programmed sector is verified by comparing CRC32 of flash and RAM, computed by the DMA sniffer (see OTA_DMA_SNIFFER_CRC).
+///
+/// There are two sector buffers: storeData (in the lwIP receive callback) fills one while the other waits for poll()
+/// from the main loop to program it, so the callback returns and the receive window reopens without waiting on flash.
+/// Only when a second sector completes before poll got to the first is it programmed from storeData.
+///
+/// With setSession the receive window follows flash progress: bytes given to storeData while a sector waits for poll
+/// are acknowledged to the session once it is programmed, so the sender does not run further ahead then one sector.
+/// All other bytes received on that session are the caller's to acknowledge, or the window closes for good:
+///
+///     // once the upgrade request is recognized
+///     helper->setSession(session);
+///
+///     // on every receive while the upgrade is in progress
+///     session->recved(header_len);                        // request line and headers, not given to storeData
+///     if (!helper->storeData(body, body_len)) { ... }     // acknowledged by the helper
+///
+///     // main loop, a sector that failed to program ends the transfer, upgrade() refuses the image
+///     if (!helper->poll()) { ...close the session, helper->setSession(NULL)... }
+///
+///     // transfer finished or aborted, before the session is deleted
+///     helper->setSession(NULL);
+///
 class UpgradeHelper
 {
     UpgradeHelper();
@@ -47,21 +104,76 @@ public:
     static UpgradeHelper *create();
     
     bool clear();
+
+    ///
+    /// Writes the sectors still in RAM, then replaces the program. Returns only if that write fails.
+    ///
     void upgrade();
     bool storeData(u8_t *data, size_t len);
 
+    ///
+    /// Program the sector waiting in RAM, call from the main loop. Takes the lwIP lock.
+    ///
+    bool poll();
+
+    ///
+    /// Write all sectors collected so far, called by upgrade. Fails once any sector failed to program, until clear().
+    ///
+    bool flush();
+
+    ///
+    /// Session the image comes in on, switched to Session::set_manual_recved. Bytes passed to storeData are acknowledged
+    /// by the helper, the caller acknowledges the rest (HTTP headers) with Session::recved. Detach with NULL before the
+    /// session is deleted.
+    ///
+    void setSession(Session *session);
+    uint32_t getThroughputKBps();
+
     static const int NUM_REGIONS = MAX_BINARY_SIZE / FLASH_SECTOR_SIZE;
 
     uint8_t *getRegions() { return &m_regionErased[0]; }
+    const UpgradeStats& getStats() { return m_stats; }
     
 private:
     static void writeToFlash(void *self);
     inline void setRegionErased(uint32_t region) { m_regionErased[region/8] |= (1 << (region % 8)); }
     inline bool getRegionErased(uint32_t region) { return (m_regionErased[region/8] & (1 << (region % 8))) != 0; }
 
+    static const uint32_t NO_REGION = 0xFFFFFFFF;
+
+    struct Sector
+    {
+        alignas(32) uint8_t data[FLASH_SECTOR_SIZE];
+        uint32_t region = NO_REGION;
+    };
+
+    bool storeBlocks(u8_t *data, size_t len);
+    bool queueSector();
+    bool programPending();
+    bool writeSector(uint8_t index);
+    bool loadSector(uint32_t region);
+    bool verifySector(uint8_t index);
+    uint32_t crc32(const uint8_t *data, size_t len);
+    void releaseHeldBytes();
+
     static const int BLOCK_SIZE = 512;
+
+    // m_sectors[m_receiving] collects blocks, the other one waits for poll while m_pending is set
+    Sector m_sectors[2];
+    uint8_t m_receiving = 0;
+    uint8_t m_writing = 0;
+    bool m_pending = false;
+    bool m_failed = false;
+
+    Session *m_session = NULL;
+    uint32_t m_heldBytes = 0;
+
     uint8_t m_buffer[BLOCK_SIZE] = {};
 
     uint8_t m_regionErased[NUM_REGIONS/8] = {};
     uint32_t m_index = 0;
-};
+
+    // DMA channel for the sniffer CRC, -1 (or a sniffer in use elsewhere) falls back to memcmp
+    int m_dmaChannel = -1;
+    UpgradeStats m_stats = {};
+};
\ No newline at end of file
@@ -29,6 +29,7 @@ SOFTWARE.
 #include <time.h>
 
 #include "pico/cyw43_arch.h"
+#include "pico/time.h"
 #include "lwip/pbuf.h"
 #include "lwip/altcp_tcp.h"
 #include "lwip/altcp_tls.h"
@@ -51,8 +52,13 @@ Session::Session(void *arg, bool tls)
     , m_processing(false)
     , m_tls(tls)
     , m_debug(false)
+    , m_manualRecved(false)
     , m_sentBytes(0)
     , m_port(0)
+    , m_smallRecordSize(SESSION_SMALL_RECORD_SIZE)
+    , m_smallRecordBytes(SESSION_SMALL_RECORD_BYTES)
+    , m_recordIdleMs(SESSION_RECORD_IDLE_MS)
+    , m_lastSendUs(0)
     , m_callback(NULL)
     , m_pcb((struct altcp_pcb *)arg)
 {
@@ -130,10 +136,17 @@ err_t Session::send(const u8_t *data, size_t len)
     // prevent partial write notifications back to caller
     m_processing = true;
 
+    uint64_t now = time_us_64();
+    if ((m_lastSendUs == 0) || (now - m_lastSendUs > (uint64_t)m_recordIdleMs * 1000))
+    {
+        restart_record_sizing();
+    }
+    m_lastSendUs = now;
+
     // if len exceeds MBEDTLS_SSL_OUT_CONTENT_LEN then it will quietly fail in "altcp_tls_mbedtls.c" / "altcp_mbedtls_write"
     while (len > 0)
     {
-        int bytesToSend = (len > MBEDTLS_SSL_OUT_CONTENT_LEN) ? MBEDTLS_SSL_OUT_CONTENT_LEN : len;
+        int bytesToSend = next_record_size(len);
         
         if (m_debug)
         {
@@ -148,6 +161,7 @@ err_t Session::send(const u8_t *data, size_t len)
         
         data += bytesToSend;
         len -= bytesToSend;
+        m_stats.burst_bytes += bytesToSend;
     }
 
     err_t err = flush();
@@ -166,6 +180,40 @@ err_t Session::send(const u8_t *data, size_t len)
     return ERR_OK;
 }
 
+void Session::set_record_sizing(u16_t small_record_size, u32_t small_record_bytes, u32_t idle_ms)
+{
+    m_smallRecordSize = (small_record_size > MBEDTLS_SSL_OUT_CONTENT_LEN) ? MBEDTLS_SSL_OUT_CONTENT_LEN : small_record_size;
+    m_smallRecordBytes = small_record_bytes;
+    m_recordIdleMs = idle_ms;
+}
+
+void Session::restart_record_sizing()
+{
+    m_stats.burst_bytes = 0;
+    m_stats.burst_acked_bytes = 0;
+    m_stats.burst_start_us = time_us_64();
+    m_stats.burst_first_ack_us = 0;
+    m_stats.burst_last_ack_us = 0;
+}
+
+u16_t Session::next_record_size(size_t len)
+{
+    // plain TCP has no record overhead, segmentation is left to lwip
+    bool small = m_tls && (m_smallRecordSize > 0) && (m_stats.burst_bytes < m_smallRecordBytes);
+    u16_t recordSize = small ? m_smallRecordSize : MBEDTLS_SSL_OUT_CONTENT_LEN;
+
+    if (small)
+    {
+        ++m_stats.records_small;
+    }
+    else
+    {
+        ++m_stats.records_full;
+    }
+
+    return (len < recordSize) ? len : recordSize;
+}
+
 err_t Session::check_send_failure(err_t err)
 {
     if (err != ERR_OK)
@@ -216,6 +264,16 @@ err_t Session::lwip_sent(void *arg, struct altcp_pcb *pcb, u16_t len)
     {
         trace("Session::lwip_sent: this=%p, m_pcb=%p, len=%d\n", arg, pcb, len);
     }
+
+    if (len > 0)
+    {
+        self->m_stats.burst_last_ack_us = time_us_64();
+        if (self->m_stats.burst_first_ack_us == 0)
+        {
+            self->m_stats.burst_first_ack_us = self->m_stats.burst_last_ack_us;
+        }
+        self->m_stats.burst_acked_bytes += len;
+    }
     
     if (self->m_processing)
     {
@@ -300,11 +358,22 @@ err_t Session::lwip_recv(void *arg, struct altcp_pcb *pcb, struct pbuf *p, err_t
         self->m_processing = false;
     }
 
-    altcp_recved(pcb, p->tot_len);
+    if (!self->m_manualRecved)
+    {
+        altcp_recved(pcb, p->tot_len);
+    }
     pbuf_free(p);
     return ERR_OK;
 }
 
+void Session::recved(u16_t len)
+{
+    if (m_pcb != NULL)
+    {
+        altcp_recved(m_pcb, len);
+    }
+}
+
 void Session::lwip_err(void *arg, err_t err)
 {
     trace("Session::lwip_err: this=%p, err=%d, err_str=%s\n", arg, err, lwip_strerr(err));
@@ -376,6 +445,7 @@ err_t Session::connect(const char *host, u16_t port)
     m_closing = false;
     m_connected = false;
     m_sentBytes = 0;
+    m_lastSendUs = 0;
     
     m_port = port;
     
@@ -47,8 +47,37 @@ SOFTWARE.
 //  ENOTCONN,      /* ERR_CLSD       -15     Connection closed.       */
 //  EIO            /* ERR_ARG        -16     Illegal argument.        */
 
+// Adaptive TLS record sizing, can be overridden in general config.
+//
+// The first SESSION_SMALL_RECORD_BYTES of a burst go out in records that fit a single TCP segment so the peer can
+// decrypt as soon as each segment arrives, after that records grow to MBEDTLS_SSL_OUT_CONTENT_LEN to save MAC/header overhead.
+// A new burst starts after SESSION_RECORD_IDLE_MS without sends or when restart_record_sizing() is called.
+#ifndef SESSION_SMALL_RECORD_SIZE
+#define SESSION_SMALL_RECORD_SIZE (TCP_MSS - 100)
+#endif
+
+#ifndef SESSION_SMALL_RECORD_BYTES
+#define SESSION_SMALL_RECORD_BYTES (16 * 1024)
+#endif
+
+#ifndef SESSION_RECORD_IDLE_MS
+#define SESSION_RECORD_IDLE_MS 1000
+#endif
+
 extern altcp_allocator_t tcp_allocator;
 
+// Send statistics for the current burst, TTFB ~ (burst_first_ack_us - burst_start_us), throughput ~ burst_acked_bytes / (burst_last_ack_us - burst_start_us).
+struct SessionSendStats
+{
+    uint32_t records_small = 0;
+    uint32_t records_full = 0;
+    uint32_t burst_bytes = 0;
+    uint32_t burst_acked_bytes = 0;
+    uint64_t burst_start_us = 0;
+    uint64_t burst_first_ack_us = 0;
+    uint64_t burst_last_ack_us = 0;
+};
+
 typedef void (session_factory_t)(void *arg, bool tls);
 
 
@@ -64,6 +93,16 @@ public:
 
     void set_tls(bool tls) { m_tls = tls; }
     void set_debug(bool debug) { m_debug = debug; }
+
+    // Receive window is only reopened through recved(len) for data handed to on_recv, for callbacks that finish
+    // with the data later (flash writes) so the peer is held back instead of overrunning them.
+    void set_manual_recved(bool manual) { m_manualRecved = manual; }
+    void recved(u16_t len);
+
+    // Configure adaptive record sizing, small_record_size of 0 disables it and always uses full records.
+    void set_record_sizing(u16_t small_record_size, u32_t small_record_bytes, u32_t idle_ms);
+    void restart_record_sizing();
+    const SessionSendStats& get_send_stats() { return m_stats; }
     
     // ISender
     virtual err_t connect(const char *host, u16_t port) override;
@@ -90,14 +129,22 @@ private:
 
     void init_pcb();
     err_t check_send_failure(err_t err);
+    u16_t next_record_size(size_t len);
 
     bool m_connected;
     bool m_closing;
     bool m_processing;
     bool m_tls;
     bool m_debug;
+    bool m_manualRecved;
     u16_t m_sentBytes;
     u16_t m_port;
+
+    u16_t m_smallRecordSize;
+    u32_t m_smallRecordBytes;
+    u32_t m_recordIdleMs;
+    uint64_t m_lastSendUs;
+    SessionSendStats m_stats;
     
     ISessionCallback *m_callback;
     struct altcp_pcb *m_pcb;
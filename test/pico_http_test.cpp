@@ -202,3 +202,26 @@ TEST(HTTPHeader, SimplePostRequest) {
     
     delete[] buffer;
 }
+
+TEST(HTTPHeader, WebSocketUpgradeReply) {
+
+    HTTPHeader header;
+    
+    const char *reply = "HTTP/1.1 101 Switching Protocols\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n"
+        "\r\n";
+    int buffer_size=strlen(reply)+1;
+    char *buffer = new char[buffer_size];
+
+    memcpy(buffer, reply, buffer_size);
+
+    EXPECT_EQ(true, header.parse(buffer, buffer_size));
+
+    EXPECT_EQ(true, header.isResponse());
+    EXPECT_EQ(101, header.getResponseCode());
+    EXPECT_STREQ("s3pPLMBiTxaQ9kYGzzhZRbK+xOo=", header.getHeaderValue("Sec-WebSocket-Accept"));
+    
+    delete[] buffer;
+}
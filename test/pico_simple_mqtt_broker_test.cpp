@@ -0,0 +1,399 @@
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "pico_simple_mqtt/mqtt_broker.h"
+#include "test_support.h"
+
+struct BrokerMessage
+{
+    std::string topic;
+    std::string data;
+    uint8_t flags;
+};
+
+class BrokerClientRecorder : public MQTTSocketInterface, public MQTTSubscriptionInterface
+{
+public:
+    virtual bool on_conn_ack(conn_ack_code_t code, uint8_t flags) override { conn_acks.push_back(code); return true; }
+    virtual bool on_sub_ack(uint16_t message_id) override { ++sub_acks; return true; }
+    virtual bool on_reason_code(uint8_t message_type, uint16_t message_id, mqtt_reason_code_t reason_code) override { ++failures; return true; }
+    virtual bool on_publish_header(uint8_t *topic, uint16_t topic_length, uint16_t message_id, uint32_t message_length) override
+    {
+        messages.push_back({std::string((const char *)topic, topic_length), "", (uint8_t)(handler ? handler->get_publish_flags() : 0)});
+        return true;
+    }
+    virtual bool on_publish_data(uint8_t *data, uint32_t len, bool last_chunk) override
+    {
+        messages.back().data.append((const char *)data, len);
+        return true;
+    }
+
+    MQTTSocketHandler *handler = NULL;
+    std::vector<conn_ack_code_t> conn_acks;
+    std::vector<BrokerMessage> messages;
+    int sub_acks = 0;
+    int failures = 0;
+};
+
+// MQTTSocketHandler client wired back to back with a broker connection
+struct BrokerTestClient
+{
+    BrokerTestClient(MQTTBroker& broker)
+    {
+        client.set_upstream(&recorder);
+        client.set_downstream(&to_broker);
+        recorder.handler = &client;
+
+        server = broker.accept(&to_client);
+        to_client.callback = server;
+        to_broker.callback = &client;
+    }
+
+    void pump()
+    {
+        while (!to_broker.stream.empty() || !to_client.stream.empty())
+        {
+            std::vector<uint8_t> data;
+            data.swap(to_broker.stream);
+            if (!data.empty() && to_client.connected && !server->on_recv(data.data(), data.size()))
+            {
+                to_client.close();
+            }
+
+            data.clear();
+            data.swap(to_client.stream);
+            if (!data.empty())
+            {
+                EXPECT_TRUE(client.on_recv(data.data(), data.size()));
+            }
+        }
+    }
+
+    bool connect(const char *id, uint8_t keepalive = 60, const char *will_topic = NULL, const char *will_message = NULL)
+    {
+        bool ok = client.send_connect(true, keepalive, id, will_topic, will_message);
+        pump();
+        return ok && (recorder.conn_acks.size() == 1) && (recorder.conn_acks[0] == CONNECTION_ACCEPTED);
+    }
+
+    void subscribe(const char *filter, uint8_t qos)
+    {
+        EXPECT_TRUE(client.send_subscribe(&filter, 1, qos));
+        pump();
+    }
+
+    void publish(const char *topic, const char *data, uint8_t qos, bool retain = false)
+    {
+        EXPECT_TRUE(client.queue_publish(topic, (const uint8_t *)data, strlen(data), qos, retain));
+        EXPECT_TRUE(client.flush_publishes());
+        pump();
+    }
+
+    // one per direction, bytes wait in stream until pumped to the other side
+    FakeSessionSender to_broker;
+    FakeSessionSender to_client;
+    MQTTSocketHandler client;
+    BrokerClientRecorder recorder;
+    ISessionCallback *server = NULL;
+};
+
+TEST(MQTTBroker, TopicMatches) {
+    EXPECT_TRUE(MQTTBroker::topic_matches("a/+/c", "a/b/c", 5));
+    EXPECT_TRUE(MQTTBroker::topic_matches("a/#", "a", 1));
+    EXPECT_TRUE(MQTTBroker::topic_matches("a/#", "a/b/c", 5));
+    EXPECT_TRUE(MQTTBroker::topic_matches("+/+", "a/", 2));
+    EXPECT_TRUE(MQTTBroker::topic_matches("#", "a/b", 3));
+    EXPECT_FALSE(MQTTBroker::topic_matches("a/+", "a/b/c", 5));
+    EXPECT_FALSE(MQTTBroker::topic_matches("a/#", "ab", 2));
+    EXPECT_FALSE(MQTTBroker::topic_matches("#", "$SYS/uptime", 11));
+    EXPECT_TRUE(MQTTBroker::topic_matches("$SYS/#", "$SYS/uptime", 11));
+}
+
+TEST(MQTTBroker, FanOutToSubscribersAndLocalHandlers) {
+    MQTTBroker broker;
+    BrokerClientRecorder local;
+    EXPECT_TRUE(broker.subscribe("sensors/kitchen/temp", &local));
+
+    BrokerTestClient display(broker);
+    BrokerTestClient logger(broker);
+    BrokerTestClient sensor(broker);
+
+    EXPECT_TRUE(display.connect("display"));
+    EXPECT_TRUE(logger.connect("logger"));
+    EXPECT_TRUE(sensor.connect("sensor"));
+    EXPECT_EQ(3, broker.get_client_count());
+
+    display.subscribe("sensors/+/temp", 1);
+    logger.subscribe("sensors/#", 0);
+    EXPECT_EQ(1, display.recorder.sub_acks);
+    EXPECT_EQ(1, logger.recorder.sub_acks);
+
+    // QoS 1 publish is acknowledged by the broker right away, fan-out goes out with the next update
+    sensor.publish("sensors/kitchen/temp", "21.5", 1);
+    EXPECT_EQ(0, sensor.client.get_inflight_count());
+    EXPECT_EQ(1, local.messages.size());
+    EXPECT_EQ("21.5", local.messages[0].data);
+    EXPECT_EQ(0, display.recorder.messages.size());
+
+    sensor.publish("sensors/kitchen/humidity", "40", 0);
+    sensor.publish("sensors/hall/temp", "19.0", 0);
+
+    broker.update(1000000);
+    display.pump();
+    logger.pump();
+
+    // display gets both temperatures in one write, at the lower of publish and granted QoS
+    ASSERT_EQ(2, display.recorder.messages.size());
+    EXPECT_EQ("sensors/kitchen/temp", display.recorder.messages[0].topic);
+    EXPECT_EQ(MQTTQOS1, display.recorder.messages[0].flags & (MQTTQOS1 | MQTTQOS2));
+    EXPECT_EQ("sensors/hall/temp", display.recorder.messages[1].topic);
+    EXPECT_EQ(MQTTQOS0, display.recorder.messages[1].flags & (MQTTQOS1 | MQTTQOS2));
+
+    ASSERT_EQ(3, logger.recorder.messages.size());
+    EXPECT_EQ("40", logger.recorder.messages[1].data);
+    EXPECT_EQ(MQTTQOS0, logger.recorder.messages[0].flags & (MQTTQOS1 | MQTTQOS2));
+
+    EXPECT_EQ(1, local.messages.size());
+    EXPECT_EQ(0, sensor.recorder.messages.size());
+    EXPECT_EQ(3, broker.get_stats().publishes_received);
+    EXPECT_EQ(5, broker.get_stats().publishes_sent);
+
+    // local publishes reach clients as well
+    EXPECT_TRUE(broker.publish("sensors/pico/temp", (const uint8_t *)"30", 2, 1));
+    EXPECT_FALSE(broker.publish("sensors/+/temp", (const uint8_t *)"30", 2, 1));
+    broker.update(2000000);
+    display.pump();
+    ASSERT_EQ(3, display.recorder.messages.size());
+    EXPECT_EQ("30", display.recorder.messages[2].data);
+
+    // unsubscribed filters no longer deliver
+    const char *filter = "sensors/+/temp";
+    EXPECT_TRUE(display.client.send_unsubscribe(&filter, 1));
+    display.pump();
+    sensor.publish("sensors/hall/temp", "19.5", 0);
+    broker.update(3000000);
+    display.pump();
+    EXPECT_EQ(3, display.recorder.messages.size());
+}
+
+TEST(MQTTBroker, RetainedMessagesOnSubscribe) {
+    MQTTBroker broker;
+    BrokerTestClient lamp(broker);
+    EXPECT_TRUE(lamp.connect("lamp"));
+
+    lamp.publish("home/lamp", "on", 1, true);
+    lamp.publish("home/door", "closed", 0, true);
+    lamp.publish("home/lamp", "off", 1, true);
+    EXPECT_EQ(2, broker.get_retained_count());
+
+    // an empty retained message clears the topic
+    lamp.publish("home/door", "", 0, true);
+    EXPECT_EQ(1, broker.get_retained_count());
+
+    BrokerTestClient phone(broker);
+    EXPECT_TRUE(phone.connect("phone"));
+    phone.subscribe("home/+", 1);
+    broker.update(1000000);
+    phone.pump();
+
+    ASSERT_EQ(1, phone.recorder.messages.size());
+    EXPECT_EQ("home/lamp", phone.recorder.messages[0].topic);
+    EXPECT_EQ("off", phone.recorder.messages[0].data);
+    EXPECT_EQ(MQTTRETAIN | MQTTQOS1, phone.recorder.messages[0].flags);
+
+    // live publishes are not flagged retained
+    lamp.publish("home/lamp", "on", 0, true);
+    broker.update(2000000);
+    phone.pump();
+    ASSERT_EQ(2, phone.recorder.messages.size());
+    EXPECT_EQ(0, phone.recorder.messages[1].flags & MQTTRETAIN);
+
+    BrokerClientRecorder local;
+    EXPECT_TRUE(broker.subscribe("home/#", &local));
+    ASSERT_EQ(1, local.messages.size());
+    EXPECT_EQ("on", local.messages[0].data);
+}
+
+TEST(MQTTBroker, WillPublishedOnlyWhenConnectionIsLost) {
+    MQTTBroker broker;
+    BrokerTestClient monitor(broker);
+    EXPECT_TRUE(monitor.connect("monitor"));
+    monitor.subscribe("status/#", 1);
+
+    BrokerTestClient sensor(broker);
+    EXPECT_TRUE(sensor.connect("sensor", 60, "status/sensor", "offline"));
+    sensor.to_client.close();
+    EXPECT_EQ(1, broker.get_client_count());
+
+    broker.update(1000000);
+    monitor.pump();
+    ASSERT_EQ(1, monitor.recorder.messages.size());
+    EXPECT_EQ("status/sensor", monitor.recorder.messages[0].topic);
+    EXPECT_EQ("offline", monitor.recorder.messages[0].data);
+
+    // will is retained as requested by send_connect
+    EXPECT_EQ(1, broker.get_retained_count());
+
+    BrokerTestClient polite(broker);
+    EXPECT_TRUE(polite.connect("polite", 60, "status/polite", "offline"));
+    EXPECT_TRUE(polite.client.send_disconnect());
+    polite.pump();
+    EXPECT_FALSE(polite.to_client.connected);
+
+    broker.update(2000000);
+    monitor.pump();
+    EXPECT_EQ(1, monitor.recorder.messages.size());
+    EXPECT_EQ(1, broker.get_stats().wills_sent);
+}
+
+TEST(MQTTBroker, KeepaliveTimeoutAndClientLimit) {
+    MQTTBroker broker;
+    BrokerTestClient quiet(broker);
+    EXPECT_TRUE(quiet.connect("quiet", 10));
+
+    BrokerTestClient silent(broker);
+    BrokerTestClient other(broker);
+    EXPECT_TRUE(other.connect("other", 0));
+    BrokerTestClient fourth(broker);
+    EXPECT_TRUE(fourth.connect("fourth", 0));
+
+    FakeSessionSender refused;
+    EXPECT_EQ(NULL, broker.accept(&refused));
+    EXPECT_EQ(1, broker.get_stats().refused);
+
+    // PINGREQ is answered by the broker
+    EXPECT_TRUE(quiet.client.send_ping());
+    quiet.pump();
+    EXPECT_EQ(2u, quiet.to_client.sent.size());
+
+    broker.update(14000000);
+    EXPECT_TRUE(quiet.to_client.connected);
+    EXPECT_FALSE(silent.to_client.connected);
+
+    broker.update(16000000);
+    EXPECT_FALSE(quiet.to_client.connected);
+    EXPECT_EQ(1, broker.get_stats().keepalive_timeouts);
+    EXPECT_EQ(2, broker.get_client_count());
+
+    // same client id takes over the connection
+    BrokerTestClient again(broker);
+    EXPECT_TRUE(again.connect("other", 0));
+    EXPECT_FALSE(other.to_client.connected);
+    EXPECT_EQ(2, broker.get_client_count());
+}
+
+// QoS 0 PUBLISH written straight to the broker, bypassing the client handler
+static std::vector<uint8_t> raw_publish(const char *topic, const char *data)
+{
+    std::vector<uint8_t> packet = {0x30, (uint8_t)(2 + strlen(topic) + strlen(data)), 0x00, (uint8_t)strlen(topic)};
+    packet.insert(packet.end(), topic, topic + strlen(topic));
+    packet.insert(packet.end(), data, data + strlen(data));
+    return packet;
+}
+
+TEST(MQTTBroker, RefusedPublishesAreNotRouted) {
+    MQTTBroker broker;
+    BrokerTestClient display(broker);
+    EXPECT_TRUE(display.connect("display"));
+    display.subscribe("#", 0);
+
+    // never sent CONNECT
+    BrokerTestClient rogue(broker);
+    std::vector<uint8_t> injected = raw_publish("a/b", "injected");
+    EXPECT_FALSE(rogue.server->on_recv(injected.data(), injected.size()));
+
+    // wildcard in a topic name, right behind a valid publish in the same write
+    BrokerTestClient sensor(broker);
+    EXPECT_TRUE(sensor.connect("sensor"));
+    std::vector<uint8_t> packets = raw_publish("a/b", "one");
+    std::vector<uint8_t> invalid = raw_publish("a/+", "two");
+    packets.insert(packets.end(), invalid.begin(), invalid.end());
+    EXPECT_FALSE(sensor.server->on_recv(packets.data(), packets.size()));
+
+    broker.update(1000000);
+    display.pump();
+    ASSERT_EQ(1, display.recorder.messages.size());
+    EXPECT_EQ("a/b", display.recorder.messages[0].topic);
+    EXPECT_EQ("one", display.recorder.messages[0].data);
+    EXPECT_EQ(1, broker.get_stats().publishes_received);
+}
+
+TEST(MQTTBroker, ReusedSlotStartsCleanSession) {
+    MQTTBroker broker;
+    BrokerTestClient display(broker);
+    EXPECT_TRUE(display.connect("display"));
+    display.subscribe("q", 0);
+
+    BrokerTestClient old(broker);
+    EXPECT_TRUE(old.connect("old"));
+    old.subscribe("t", 1);
+
+    BrokerTestClient sensor(broker);
+    EXPECT_TRUE(sensor.connect("sensor"));
+
+    // deliveries to the old client are never acknowledged, its window fills up
+    for (int i=0;i<MQTT_INFLIGHT_WINDOW;++i)
+    {
+        sensor.publish("t", "old", 1);
+        broker.update(1000000 * (i + 1));
+    }
+    old.to_client.stream.clear();
+
+    // QoS 2 publish left without PUBREL
+    std::vector<uint8_t> qos2 = {0x34, 0x07, 0x00, 0x01, 'q', 0x00, 0x01, 'o', 'n'};
+    EXPECT_TRUE(old.server->on_recv(qos2.data(), qos2.size()));
+    old.to_client.close();
+
+    broker.update(20000000);
+    display.pump();
+    ASSERT_EQ(1, display.recorder.messages.size());
+
+    // takes the slot of the old client, with nothing of its session
+    BrokerTestClient fresh(broker);
+    EXPECT_TRUE(fresh.connect("fresh"));
+    fresh.subscribe("t", 1);
+
+    sensor.publish("t", "new", 1);
+    broker.update(21000000);
+    fresh.pump();
+    ASSERT_EQ(1, fresh.recorder.messages.size());
+    EXPECT_EQ("new", fresh.recorder.messages[0].data);
+
+    // same QoS 2 id as the old client used is a new message
+    EXPECT_TRUE(fresh.server->on_recv(qos2.data(), qos2.size()));
+    broker.update(22000000);
+    display.pump();
+    EXPECT_EQ(2, display.recorder.messages.size());
+}
+
+TEST(MQTTBroker, ManyOverlappingFiltersDeliver) {
+    MQTTBroker broker;
+    BrokerTestClient wide(broker);
+    EXPECT_TRUE(wide.connect("wide"));
+
+    const char *filters[] = {"#", "+/#", "a/#", "a/b/#", "+/b/c", "a/+/c", "a/b/+", "+/+/+", "+/+/c"};
+    for (const char *filter : filters)
+    {
+        wide.subscribe(filter, 0);
+    }
+
+    BrokerTestClient exact(broker);
+    EXPECT_TRUE(exact.connect("exact"));
+    exact.subscribe("a/b/c", 0);
+
+    BrokerTestClient sensor(broker);
+    EXPECT_TRUE(sensor.connect("sensor"));
+    sensor.publish("a/b/c", "1", 0);
+
+    broker.update(1000000);
+    wide.pump();
+    exact.pump();
+
+    // overlapping filters deliver once
+    EXPECT_EQ(1, wide.recorder.messages.size());
+    ASSERT_EQ(1, exact.recorder.messages.size());
+    EXPECT_EQ("a/b/c", exact.recorder.messages[0].topic);
+}
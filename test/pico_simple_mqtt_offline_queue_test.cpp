@@ -0,0 +1,260 @@
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "pico_simple_mqtt/mqtt_offline_queue.h"
+#include "test_support.h"
+
+// decodes what was sent back into publishes
+class OfflineQueueReceiver : public MQTTSocketInterface
+{
+public:
+    virtual bool on_publish_header(uint8_t *topic, uint16_t topic_length, uint16_t message_id, uint32_t message_length) override
+    {
+        topics.push_back(std::string((char*)topic, topic_length));
+        ids.push_back(message_id);
+        payloads.push_back("");
+        return true;
+    }
+
+    virtual bool on_publish_data(uint8_t *data, uint32_t len, bool last_chunk) override
+    {
+        payloads.back().append((char*)data, len);
+        return true;
+    }
+
+    void decode(const std::vector<std::vector<uint8_t>>& writes)
+    {
+        // QoS 1 publishes are acknowledged through it
+        FakeSessionSender acks;
+        MQTTSocketHandler decoder;
+        decoder.set_upstream(this);
+        decoder.set_downstream(&acks);
+        for (std::vector<uint8_t> write : writes)
+        {
+            EXPECT_TRUE(decoder.on_recv(write.data(), write.size()));
+        }
+    }
+
+    std::vector<std::string> topics;
+    std::vector<uint16_t> ids;
+    std::vector<std::string> payloads;
+};
+
+static void store(MQTTOfflineQueue &queue, int reading, uint8_t qos = 1)
+{
+    std::string value = "reading " + std::to_string(reading);
+    ASSERT_TRUE(queue.store("garden/temp", (const uint8_t*)value.data(), value.size(), qos));
+}
+
+TEST(MQTTOfflineQueue, DrainInOrderAfterConnAck) {
+    MQTTOfflineQueue queue;
+    ASSERT_TRUE(queue.format());
+
+    for (int i=0;i<5;++i)
+    {
+        store(queue, i);
+    }
+    EXPECT_FALSE(queue.empty());
+
+    FakeSessionSender sender;
+    MQTTSocketHandler handler;
+    handler.set_downstream(&sender);
+
+    EXPECT_TRUE(queue.drain(handler));
+    ASSERT_EQ(sender.sent.size(), 1);
+
+    OfflineQueueReceiver receiver;
+    receiver.decode(sender.sent);
+    ASSERT_EQ(receiver.payloads.size(), 5);
+    for (int i=0;i<5;++i)
+    {
+        EXPECT_EQ(receiver.topics[i], "garden/temp");
+        EXPECT_EQ(receiver.payloads[i], "reading " + std::to_string(i));
+    }
+
+    // records are only retired by PUBACK
+    EXPECT_FALSE(queue.empty());
+    for (uint16_t id : receiver.ids)
+    {
+        EXPECT_TRUE(queue.on_pub_ack(id));
+    }
+    EXPECT_FALSE(queue.on_pub_ack(receiver.ids[0]));
+    EXPECT_TRUE(queue.empty());
+    EXPECT_EQ(queue.get_stats().retired, 5);
+}
+
+TEST(MQTTOfflineQueue, WindowLimitsDrain) {
+    MQTTOfflineQueue queue;
+    ASSERT_TRUE(queue.format());
+
+    const int count = MQTT_INFLIGHT_WINDOW + 4;
+    for (int i=0;i<count;++i)
+    {
+        store(queue, i);
+    }
+
+    FakeSessionSender sender;
+    MQTTSocketInterface upstream;
+    MQTTSocketHandler handler;
+    handler.set_upstream(&upstream);
+    handler.set_downstream(&sender);
+
+    EXPECT_TRUE(queue.drain(handler));
+    EXPECT_EQ(handler.get_inflight_count(), MQTT_INFLIGHT_WINDOW);
+
+    OfflineQueueReceiver receiver;
+    receiver.decode(sender.sent);
+    ASSERT_EQ(receiver.ids.size(), MQTT_INFLIGHT_WINDOW);
+
+    // PUBACKs free the window and the rest follows
+    for (uint16_t id : receiver.ids)
+    {
+        uint8_t pub_ack[] = {0x40, 0x02, (uint8_t)(id >> 8), (uint8_t)(id & 0xFF)};
+        handler.on_recv(pub_ack, sizeof(pub_ack));
+        EXPECT_TRUE(queue.on_pub_ack(id));
+    }
+
+    sender.sent.clear();
+    EXPECT_TRUE(queue.drain(handler));
+
+    OfflineQueueReceiver rest;
+    rest.decode(sender.sent);
+    ASSERT_EQ(rest.payloads.size(), count - MQTT_INFLIGHT_WINDOW);
+    EXPECT_EQ(rest.payloads[0], "reading " + std::to_string(MQTT_INFLIGHT_WINDOW));
+}
+
+TEST(MQTTOfflineQueue, UnacknowledgedRecordsSurviveReboot) {
+    {
+        MQTTOfflineQueue queue;
+        ASSERT_TRUE(queue.format());
+        for (int i=0;i<3;++i)
+        {
+            store(queue, i);
+        }
+
+        FakeSessionSender sender;
+        MQTTSocketHandler handler;
+        handler.set_downstream(&sender);
+        EXPECT_TRUE(queue.drain(handler));
+
+        OfflineQueueReceiver receiver;
+        receiver.decode(sender.sent);
+        ASSERT_EQ(receiver.ids.size(), 3);
+        EXPECT_TRUE(queue.on_pub_ack(receiver.ids[0]));
+    }
+
+    // a new instance over the same flash, as after a reset
+    MQTTOfflineQueue queue;
+    ASSERT_TRUE(queue.open());
+    EXPECT_FALSE(queue.empty());
+
+    store(queue, 3);
+
+    FakeSessionSender sender;
+    MQTTSocketHandler handler;
+    handler.set_downstream(&sender);
+    EXPECT_TRUE(queue.drain(handler));
+
+    OfflineQueueReceiver receiver;
+    receiver.decode(sender.sent);
+    std::vector<std::string> expected = {"reading 1", "reading 2", "reading 3"};
+    EXPECT_EQ(receiver.payloads, expected);
+}
+
+TEST(MQTTOfflineQueue, RingWrapsAndSpreadsErases) {
+    MQTTOfflineQueue queue;
+    ASSERT_TRUE(queue.format());
+
+    FakeSessionSender sender;
+    MQTTSocketHandler handler;
+    handler.set_downstream(&sender);
+
+    // fill the ring while offline
+    int stored = 0;
+    std::string value(200, 'x');
+    while (queue.store("t", (const uint8_t*)value.data(), value.size(), 0))
+    {
+        ++stored;
+    }
+    EXPECT_GT(stored, (MQTT_OFFLINE_SECTORS - 1) * (4096 / 220));
+    EXPECT_EQ(queue.get_stats().erases, MQTT_OFFLINE_SECTORS);
+
+    // QoS 0 records are retired once handed over, the ring takes new records again
+    EXPECT_TRUE(queue.drain(handler));
+    EXPECT_TRUE(queue.empty());
+    EXPECT_EQ(queue.get_stats().retired, stored);
+
+    for (int i=0;i<stored;++i)
+    {
+        ASSERT_TRUE(queue.store("t", (const uint8_t*)value.data(), value.size(), 0));
+    }
+    EXPECT_TRUE(queue.drain(handler));
+    EXPECT_TRUE(queue.empty());
+
+    // one erase per sector for each pass over the ring
+    EXPECT_LE(queue.get_stats().erases, MQTT_OFFLINE_SECTORS * 2 + 1);
+
+    std::string large(MQTT_BATCH_BUFFER_SIZE, 'x');
+    EXPECT_FALSE(queue.store("t", (const uint8_t*)large.data(), large.size()));
+}
+
+static int drain_count(MQTTOfflineQueue &queue)
+{
+    FakeSessionSender sender;
+    MQTTSocketHandler handler;
+    handler.set_downstream(&sender);
+    EXPECT_TRUE(queue.drain(handler));
+
+    OfflineQueueReceiver receiver;
+    receiver.decode(sender.sent);
+    return receiver.topics.size();
+}
+
+TEST(MQTTOfflineQueue, RetiredOldestSectorKeepsBacklogAfterReboot) {
+    MQTTOfflineQueue queue;
+    ASSERT_TRUE(queue.format());
+
+    // one full sector, delivered and retired
+    std::string value(200, 'x');
+    for (int i=0;i<19;++i)
+    {
+        ASSERT_TRUE(queue.store("t", (const uint8_t*)value.data(), value.size(), 0));
+    }
+    EXPECT_EQ(drain_count(queue), 19);
+
+    // backlog in the sectors after it
+    for (int i=0;i<15*19;++i)
+    {
+        ASSERT_TRUE(queue.store("t", (const uint8_t*)value.data(), value.size(), 0));
+    }
+
+    // the fully retired sector is reused while the backlog stays queued
+    MQTTOfflineQueue reopened;
+    ASSERT_TRUE(reopened.open());
+    ASSERT_TRUE(reopened.store("t", (const uint8_t*)value.data(), value.size(), 0));
+    EXPECT_EQ(drain_count(reopened), 15*19 + 1);
+    EXPECT_TRUE(reopened.empty());
+}
+
+TEST(MQTTOfflineQueue, ErasedDrainSectorKeepsBacklog) {
+    MQTTOfflineQueue queue;
+    ASSERT_TRUE(queue.format());
+
+    std::string value(200, 'x');
+    for (int i=0;i<19;++i)
+    {
+        ASSERT_TRUE(queue.store("t", (const uint8_t*)value.data(), value.size(), 0));
+    }
+    EXPECT_EQ(drain_count(queue), 19);
+
+    // wrapping onto the drained sector moves the cursor to the backlog, not past it
+    for (int i=0;i<15*19+1;++i)
+    {
+        ASSERT_TRUE(queue.store("t", (const uint8_t*)value.data(), value.size(), 0));
+    }
+    EXPECT_EQ(drain_count(queue), 15*19 + 1);
+    EXPECT_TRUE(queue.empty());
+}
@@ -0,0 +1,303 @@
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "pico_simple_mqtt/mqtt_subscriptions.h"
+#include "pico_simple_mqtt/mqtt_handler.h"
+#include "test_support.h"
+
+class RecordingSubscription : public MQTTSubscriptionInterface
+{
+public:
+    virtual bool on_publish_header(uint8_t *topic, uint16_t topic_length, uint16_t message_id, uint32_t message_length) override
+    {
+        topics.push_back((topic != NULL) ? std::string((char*)topic, topic_length) : std::string());
+        return true;
+    }
+
+    virtual bool on_publish_data(uint8_t *data, uint32_t len, bool last_chunk) override
+    {
+        payload.append((char*)data, len);
+        return true;
+    }
+
+    std::vector<std::string> topics;
+    std::string payload;
+};
+
+static uint8_t matches(MQTTSubscriptions &subscriptions, const char *topic, MQTTSubscriptionInterface **out = NULL)
+{
+    MQTTSubscriptionInterface *matched[MQTT_SUBSCRIPTION_MAX_MATCHES];
+    return subscriptions.match((const uint8_t*)topic, strlen(topic), out ? out : matched, MQTT_SUBSCRIPTION_MAX_MATCHES);
+}
+
+TEST(MQTTSubscriptions, ValidFilter) {
+    EXPECT_TRUE(MQTTSubscriptions::valid_filter("a/b/c"));
+    EXPECT_TRUE(MQTTSubscriptions::valid_filter("a/+/c"));
+    EXPECT_TRUE(MQTTSubscriptions::valid_filter("#"));
+    EXPECT_TRUE(MQTTSubscriptions::valid_filter("+/+/#"));
+    EXPECT_TRUE(MQTTSubscriptions::valid_filter("/a//b"));
+
+    EXPECT_FALSE(MQTTSubscriptions::valid_filter(""));
+    EXPECT_FALSE(MQTTSubscriptions::valid_filter(NULL));
+    EXPECT_FALSE(MQTTSubscriptions::valid_filter("a/b+"));
+    EXPECT_FALSE(MQTTSubscriptions::valid_filter("a/#/b"));
+    EXPECT_FALSE(MQTTSubscriptions::valid_filter("a#"));
+}
+
+TEST(MQTTSubscriptions, WildcardMatching) {
+    MQTTSubscriptions subscriptions;
+    RecordingSubscription exact, plus, multi, root;
+
+    EXPECT_TRUE(subscriptions.add("home/kitchen/temp", &exact));
+    EXPECT_TRUE(subscriptions.add("home/+/temp", &plus));
+    EXPECT_TRUE(subscriptions.add("home/#", &multi));
+    EXPECT_TRUE(subscriptions.add("#", &root));
+
+    MQTTSubscriptionInterface *out[MQTT_SUBSCRIPTION_MAX_MATCHES];
+    EXPECT_EQ(matches(subscriptions, "home/kitchen/temp", out), 4);
+    EXPECT_EQ(matches(subscriptions, "home/garage/temp"), 3);
+    EXPECT_EQ(matches(subscriptions, "home/garage/humidity"), 2);
+    EXPECT_EQ(matches(subscriptions, "home"), 2);
+    EXPECT_EQ(matches(subscriptions, "office/temp"), 1);
+
+    // wildcards at the first level skip system topics
+    EXPECT_EQ(matches(subscriptions, "$SYS/broker/load"), 0);
+
+    // '+' needs a level, it does not match across or past levels
+    EXPECT_EQ(matches(subscriptions, "home/temp", out), 2);
+    EXPECT_EQ(matches(subscriptions, "home/a/b/temp", out), 2);
+}
+
+TEST(MQTTSubscriptions, DispatchAndRemove) {
+    MQTTSubscriptions subscriptions;
+    RecordingSubscription lights, sensors;
+
+    EXPECT_TRUE(subscriptions.add("lights/+/set", &lights));
+    EXPECT_TRUE(subscriptions.add("sensors/#", &sensors));
+    uint16_t nodes = subscriptions.get_node_count();
+    uint16_t pool = subscriptions.get_pool_used();
+
+    uint8_t topic[] = "lights/porch/set";
+    uint8_t data[] = "on";
+    EXPECT_TRUE(subscriptions.on_publish_header(topic, sizeof(topic) - 1, 0, 2));
+    EXPECT_TRUE(subscriptions.on_publish_data(data, 2, true));
+
+    ASSERT_EQ(lights.topics.size(), 1);
+    EXPECT_EQ(lights.topics[0], "lights/porch/set");
+    EXPECT_EQ(lights.payload, "on");
+    EXPECT_TRUE(sensors.topics.empty());
+
+    // storage is given back as filters are removed
+    EXPECT_TRUE(subscriptions.add("lights/+/state", &lights));
+    EXPECT_GT(subscriptions.get_node_count(), nodes);
+    EXPECT_TRUE(subscriptions.remove("lights/+/state"));
+    EXPECT_EQ(subscriptions.get_node_count(), nodes);
+    EXPECT_EQ(subscriptions.get_pool_used(), pool);
+
+    EXPECT_FALSE(subscriptions.remove("lights/+/state"));
+    EXPECT_TRUE(subscriptions.remove("lights/+/set"));
+    EXPECT_EQ(matches(subscriptions, "lights/porch/set"), 0);
+    EXPECT_EQ(matches(subscriptions, "sensors/a"), 1);
+
+    EXPECT_TRUE(subscriptions.remove("sensors/#"));
+    EXPECT_EQ(subscriptions.get_node_count(), 1);
+    EXPECT_EQ(subscriptions.get_pool_used(), 0);
+}
+
+TEST(MQTTSubscriptions, RemoveKeepsSiblingsReachable) {
+    MQTTSubscriptions subscriptions;
+    std::vector<RecordingSubscription> handlers(40);
+
+    // many siblings under one parent share probe sequences in the level table
+    for (int i=0;i<40;++i)
+    {
+        EXPECT_TRUE(subscriptions.add(("dev/" + std::to_string(i)).c_str(), &handlers[i]));
+    }
+
+    for (int i=0;i<40;i+=3)
+    {
+        EXPECT_TRUE(subscriptions.remove(("dev/" + std::to_string(i)).c_str()));
+    }
+
+    for (int i=0;i<40;++i)
+    {
+        MQTTSubscriptionInterface *out[MQTT_SUBSCRIPTION_MAX_MATCHES];
+        std::string topic = "dev/" + std::to_string(i);
+        uint8_t found = matches(subscriptions, topic.c_str(), out);
+        EXPECT_EQ(found, (i % 3 == 0) ? 0 : 1) << topic;
+        if (found == 1)
+        {
+            EXPECT_EQ(out[0], &handlers[i]);
+        }
+    }
+}
+
+TEST(MQTTSubscriptions, MultipleFiltersInOnePacket) {
+    FakeSessionSender sender;
+
+    MQTTSocketHandler handler;
+    handler.set_downstream(&sender);
+
+    const char *topics[] = { "a/+", "b/#" };
+    uint16_t message_id = 0;
+    EXPECT_TRUE(handler.send_subscribe(topics, 2, 1, &message_id));
+    EXPECT_TRUE(handler.send_unsubscribe(topics, 2));
+
+    ASSERT_EQ(sender.sent.size(), 2);
+    std::vector<uint8_t> subscribe = {0x82, 0x0e, (uint8_t)(message_id >> 8), (uint8_t)message_id, 0x00, 0x03, 'a', '/', '+', 0x01, 0x00, 0x03, 'b', '/', '#', 0x01};
+    EXPECT_EQ(sender.sent[0], subscribe);
+
+    uint16_t next_id = message_id + 1;
+    std::vector<uint8_t> unsubscribe = {0xa2, 0x0c, (uint8_t)(next_id >> 8), (uint8_t)next_id, 0x00, 0x03, 'a', '/', '+', 0x00, 0x03, 'b', '/', '#'};
+    EXPECT_EQ(sender.sent[1], unsubscribe);
+}
+
+TEST(MQTTSubscriptions, StreamedTopicMatchesLikeWhole) {
+    MQTTSubscriptions subscriptions;
+    std::string long_level(MQTT_SUBSCRIPTION_STREAM_LEVEL_SIZE, 'l');
+    std::string deep;
+    for (int i=0;i<40;++i)
+    {
+        deep += (i ? "/" : "") + std::string("d") + std::to_string(i);
+    }
+
+    const char *filters[] = { "home/kitchen/temp", "home/+/temp", "home/#", "#", "+/+", "$SYS/#", "a/+/+/b" };
+    std::vector<RecordingSubscription> handlers(9);
+    for (int i=0;i<7;++i)
+    {
+        EXPECT_TRUE(subscriptions.add(filters[i], &handlers[i]));
+    }
+    EXPECT_TRUE(subscriptions.add(("long/" + long_level + "/x").c_str(), &handlers[7]));
+    EXPECT_TRUE(subscriptions.add((deep + "/#").c_str(), &handlers[8]));
+
+    std::vector<std::string> topics = { "home/kitchen/temp", "home/garage/temp", "home", "office/temp", "$SYS/broker/load",
+                                        "a/x/y/b", "a/x/b", "long/" + long_level + "/x", "long/" + long_level + "m/x", deep, deep + "/more", "/" };
+
+    // deeper then MQTT_TOPIC_MAX_LEVELS, whole topics are matched the streamed way
+    EXPECT_EQ(matches(subscriptions, deep.c_str()), 2);
+    EXPECT_EQ(matches(subscriptions, "home/kitchen/temp"), 4);
+
+    for (const std::string &topic : topics)
+    {
+        for (size_t piece : {(size_t)1, (size_t)5, topic.size()})
+        {
+            for (RecordingSubscription &handler : handlers)
+            {
+                handler.topics.clear();
+            }
+
+            for (size_t offset=0;offset<topic.size();offset+=piece)
+            {
+                size_t len = std::min(piece, topic.size() - offset);
+                EXPECT_TRUE(subscriptions.on_publish_topic((const uint8_t*)&topic[offset], len, offset, topic.size()));
+            }
+            EXPECT_TRUE(subscriptions.on_publish_header(NULL, topic.size(), 0, 0));
+
+            int streamed = 0;
+            for (RecordingSubscription &handler : handlers)
+            {
+                streamed += handler.topics.size();
+            }
+
+            EXPECT_EQ(streamed, matches(subscriptions, topic.c_str())) << topic << " piece " << piece;
+        }
+    }
+}
+
+static void streamTopic(MQTTSubscriptions &subscriptions, const std::string &topic, size_t piece)
+{
+    for (size_t offset=0;offset<topic.size();offset+=piece)
+    {
+        size_t len = std::min(piece, topic.size() - offset);
+        EXPECT_TRUE(subscriptions.on_publish_topic((const uint8_t*)&topic[offset], len, offset, topic.size()));
+    }
+}
+
+TEST(MQTTSubscriptions, StreamedLongLevelOnlyMatchesWildcards) {
+    MQTTSubscriptions subscriptions;
+    RecordingSubscription exact, plus;
+
+    // a level longer then the stream buffer can not be compared, a hash match alone is not trusted
+    std::string long_level(MQTT_SUBSCRIPTION_STREAM_LEVEL_SIZE + 1, 'l');
+    EXPECT_TRUE(subscriptions.add(("long/" + long_level).c_str(), &exact));
+    EXPECT_TRUE(subscriptions.add("long/+", &plus));
+
+    std::string topic = "long/" + long_level;
+    EXPECT_EQ(matches(subscriptions, topic.c_str()), 2);
+
+    streamTopic(subscriptions, topic, 7);
+    EXPECT_TRUE(subscriptions.on_publish_header(NULL, topic.size(), 0, 0));
+    EXPECT_EQ(exact.topics.size(), 0);
+    EXPECT_EQ(plus.topics.size(), 1);
+}
+
+TEST(MQTTSubscriptions, DeepMatchKeepsStreamState) {
+    MQTTSubscriptions subscriptions;
+    RecordingSubscription kitchen, deep;
+
+    std::string deep_topic;
+    for (int i=0;i<MQTT_TOPIC_MAX_LEVELS + 4;++i)
+    {
+        deep_topic += (i ? "/" : "") + std::string("d") + std::to_string(i);
+    }
+    EXPECT_TRUE(subscriptions.add("home/kitchen/temp", &kitchen));
+    EXPECT_TRUE(subscriptions.add("d0/#", &deep));
+
+    // matching a deep topic in between pieces of a streamed one leaves the streamed match alone
+    std::string topic = "home/kitchen/temp";
+    EXPECT_TRUE(subscriptions.on_publish_topic((const uint8_t*)topic.data(), 5, 0, topic.size()));
+    EXPECT_EQ(matches(subscriptions, deep_topic.c_str()), 1);
+    EXPECT_TRUE(subscriptions.on_publish_topic((const uint8_t*)topic.data() + 5, topic.size() - 5, 5, topic.size()));
+
+    EXPECT_TRUE(subscriptions.on_publish_header(NULL, topic.size(), 0, 0));
+    EXPECT_EQ(kitchen.topics.size(), 1);
+    EXPECT_EQ(deep.topics.size(), 0);
+}
+
+TEST(MQTTSubscriptions, MatchBenchmark) {
+    MQTTSubscriptions subscriptions;
+    RecordingSubscription handler;
+
+    const int rooms = 100;
+    for (int i=0;i<rooms;++i)
+    {
+        std::string room = "building/floor" + std::to_string(i % 10) + "/room" + std::to_string(i);
+        ASSERT_TRUE(subscriptions.add((room + "/temperature").c_str(), &handler));
+        ASSERT_TRUE(subscriptions.add((room + "/+/state").c_str(), &handler));
+        ASSERT_TRUE(subscriptions.add((room + "/alarm/#").c_str(), &handler));
+    }
+    ASSERT_TRUE(subscriptions.add("building/+/+/humidity", &handler));
+
+    std::vector<std::string> topics;
+    for (int i=0;i<rooms;++i)
+    {
+        std::string room = "building/floor" + std::to_string(i % 10) + "/room" + std::to_string(i);
+        topics.push_back(room + "/temperature");
+        topics.push_back(room + "/light/state");
+        topics.push_back(room + "/alarm/smoke/level");
+        topics.push_back(room + "/humidity");
+        topics.push_back(room + "/unknown");
+    }
+
+    const int iterations = 200;
+    uint64_t matched = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int iteration=0;iteration<iterations;++iteration)
+    {
+        for (const std::string& topic : topics)
+        {
+            matched += matches(subscriptions, topic.c_str());
+        }
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    EXPECT_EQ(matched, (uint64_t)iterations * rooms * 4);
+    if (benchmarkReportEnabled())
+    {
+        printf("MQTTSubscriptions: filters[%d] nodes[%d] %.2f M matches/s\n", rooms * 3 + 1, subscriptions.get_node_count(), (double)(topics.size() * iterations) / elapsed / 1e6);
+    }
+}
@@ -0,0 +1,188 @@
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "pico_simple_mqtt/mqtt_supervisor.h"
+#include "test_support.h"
+
+// stands in for Session, reports connection events to the handler the same way
+// starts out connecting, the supervisor's first connect() is in flight
+class SupervisedSession : public FakeSessionSender
+{
+public:
+    SupervisedSession() { connected = false; connecting = true; }
+};
+
+static const char *TOPICS[] = { "home/+/set", "ota/#" };
+
+static MQTTSupervisorConfig config()
+{
+    MQTTSupervisorConfig config = {};
+    config.host = "broker";
+    config.port = 8883;
+    config.client_id = "device";
+    config.keepalive_seconds = 60;
+    config.topics = TOPICS;
+    config.topic_count = 2;
+    config.qos = 1;
+    return config;
+}
+
+static const std::vector<uint8_t> CONNACK_NO_SESSION = {0x20, 0x02, 0x00, 0x00};
+static const std::vector<uint8_t> CONNACK_SESSION_PRESENT = {0x20, 0x02, 0x01, 0x00};
+
+TEST(MQTTSupervisor, JitteredExponentialBackoff) {
+    SupervisedSession session;
+    MQTTSupervisor supervisor(config(), NULL, &session, 12345);
+    session.callback = &supervisor.get_handler();
+
+    uint64_t now = 0;
+    supervisor.start(now);
+    EXPECT_EQ(session.connects, 1);
+
+    uint32_t delay = MQTT_RECONNECT_MIN_MS;
+    for (int attempt=0;attempt<10;++attempt)
+    {
+        session.connecting = true;
+        session.close();
+
+        ASSERT_EQ(supervisor.get_state(), MQTTSupervisorState::WAITING);
+        uint32_t backoff = supervisor.get_stats().last_backoff_ms;
+        EXPECT_GE(backoff, delay / 2);
+        EXPECT_LE(backoff, delay);
+        EXPECT_EQ(supervisor.get_next_attempt_us(), now + backoff * 1000ull);
+
+        // nothing happens before the delay expires
+        EXPECT_TRUE(supervisor.update(supervisor.get_next_attempt_us() - 1));
+        EXPECT_EQ(session.connects, attempt + 1);
+
+        now = supervisor.get_next_attempt_us();
+        EXPECT_TRUE(supervisor.update(now));
+        EXPECT_EQ(session.connects, attempt + 2);
+
+        delay = std::min(delay * 2, (uint32_t)MQTT_RECONNECT_MAX_MS);
+    }
+
+    // devices with different seeds do not retry in lockstep
+    SupervisedSession other_session;
+    MQTTSupervisor other(config(), NULL, &other_session, 54321);
+    other_session.callback = &other.get_handler();
+    other.start(0);
+    other_session.close();
+
+    SupervisedSession first_session;
+    MQTTSupervisor first(config(), NULL, &first_session, 12345);
+    first_session.callback = &first.get_handler();
+    first.start(0);
+    first_session.close();
+
+    EXPECT_NE(other.get_next_attempt_us(), first.get_next_attempt_us());
+}
+
+TEST(MQTTSupervisor, ResumesSessionWithoutResubscribing) {
+    SupervisedSession session;
+    MQTTSupervisor supervisor(config(), NULL, &session, 1);
+    session.callback = &supervisor.get_handler();
+
+    supervisor.start(0);
+    session.establish();
+
+    // CONNECT with clean_session cleared, flags follow the protocol name and level
+    ASSERT_EQ(session.sent.size(), 1);
+    EXPECT_EQ(session.sent[0][0], MQTTCONNECT);
+    EXPECT_EQ(session.sent[0][9] & 0x02, 0);
+
+    // first connection has no session yet, filters are subscribed
+    supervisor.update(200000);
+    session.receive(CONNACK_NO_SESSION);
+    ASSERT_EQ(session.sent.size(), 2);
+    EXPECT_EQ(session.sent[1][0], MQTTSUBSCRIBE|MQTTQOS1);
+    EXPECT_EQ(supervisor.get_state(), MQTTSupervisorState::CONNECTED);
+    EXPECT_EQ(supervisor.get_stats().last_connect_us, 200000);
+
+    // publish in flight when the connection drops
+    const char value[] = "21.5";
+    EXPECT_TRUE(supervisor.publish("home/temp", (const uint8_t*)value, 4));
+    EXPECT_TRUE(supervisor.get_handler().flush_publishes());
+    std::vector<uint8_t> published = session.sent.back();
+
+    supervisor.update(1000000);
+    session.close();
+    EXPECT_EQ(supervisor.get_stats().disconnects, 1);
+
+    supervisor.update(supervisor.get_next_attempt_us());
+    session.establish();
+    session.sent.clear();
+
+    uint64_t connack_us = supervisor.get_next_attempt_us() + 300000;
+    supervisor.update(connack_us);
+    session.receive(CONNACK_SESSION_PRESENT);
+
+    // broker kept the subscriptions, only the unacknowledged publish is replayed with DUP
+    ASSERT_EQ(session.sent.size(), 1);
+    published[0] |= MQTTDUP;
+    EXPECT_EQ(session.sent[0], published);
+
+    EXPECT_EQ(supervisor.get_stats().sessions_resumed, 1);
+    EXPECT_EQ(supervisor.get_stats().resubscribes, 1);
+    EXPECT_EQ(supervisor.get_stats().connections, 2);
+    EXPECT_EQ(supervisor.get_stats().last_reconnect_us, connack_us - 1000000);
+    EXPECT_EQ(supervisor.get_stats().max_reconnect_us, connack_us - 1000000);
+}
+
+TEST(MQTTSupervisor, AbandonsAttemptWithoutConnAck) {
+    SupervisedSession session;
+    MQTTSupervisor supervisor(config(), NULL, &session, 7);
+    session.callback = &supervisor.get_handler();
+
+    supervisor.start(0);
+    session.establish();
+
+    EXPECT_TRUE(supervisor.update((uint64_t)MQTT_CONNECT_TIMEOUT_MS * 1000));
+    EXPECT_EQ(supervisor.get_state(), MQTTSupervisorState::CONNECTING);
+
+    EXPECT_TRUE(supervisor.update((uint64_t)MQTT_CONNECT_TIMEOUT_MS * 1000 + 1));
+    EXPECT_EQ(supervisor.get_state(), MQTTSupervisorState::WAITING);
+    EXPECT_FALSE(session.connected);
+
+    // refused CONNACK fails the attempt the same way
+    supervisor.update(supervisor.get_next_attempt_us());
+    session.establish();
+
+    std::vector<uint8_t> refused = {0x20, 0x02, 0x00, NOT_AUTHORIZED};
+    EXPECT_FALSE(session.callback->on_recv(refused.data(), refused.size()));
+    session.close();
+    EXPECT_EQ(supervisor.get_state(), MQTTSupervisorState::WAITING);
+    EXPECT_EQ(supervisor.get_stats().connections, 0);
+    EXPECT_EQ(supervisor.get_stats().connect_attempts, 2);
+}
+
+TEST(MQTTSupervisor, SubscribesWithConnect) {
+    MQTTSupervisorConfig pipelined = config();
+    pipelined.subscribe_with_connect = true;
+
+    SupervisedSession session;
+    MQTTSupervisor supervisor(pipelined, NULL, &session, 1);
+    session.callback = &supervisor.get_handler();
+
+    supervisor.start(0);
+    session.establish();
+
+    // CONNECT directly followed by a SUBSCRIBE per filter
+    ASSERT_EQ(session.sent.size(), 1);
+    EXPECT_EQ(session.sent[0][0], MQTTCONNECT);
+    size_t subscribe = 2 + session.sent[0][1];
+    ASSERT_LT(subscribe, session.sent[0].size());
+    EXPECT_EQ(session.sent[0][subscribe], MQTTSUBSCRIBE|MQTTQOS1);
+
+    // nothing more to send after CONNACK, SUBACKs complete the startup
+    session.receive(CONNACK_NO_SESSION);
+    EXPECT_EQ(session.sent.size(), 1);
+    EXPECT_EQ(supervisor.get_state(), MQTTSupervisorState::CONNECTED);
+    EXPECT_EQ(supervisor.get_stats().resubscribes, 1);
+
+    session.receive({0x90, 0x03, 0x00, 0x01, 0x01, 0x90, 0x03, 0x00, 0x02, 0x00});
+    EXPECT_TRUE(supervisor.get_handler().is_subscribed());
+}
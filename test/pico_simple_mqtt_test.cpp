@@ -1,8 +1,11 @@
 #include <gtest/gtest.h>
 #include <gmock/gmock.h>
 #include <stdarg.h>
+#include <string>
+#include <vector>
 
 #include "pico_simple_mqtt/mqtt_handler.h"
+#include "test_support.h"
 
 using ::testing::_;
 
@@ -12,6 +15,7 @@ public:
     MOCK_METHOD(bool, on_pub_ack, (uint16_t message_id), (override));
     MOCK_METHOD(bool, on_sub_ack, (uint16_t message_id), (override));
     MOCK_METHOD(bool, on_conn_ack, (conn_ack_code_t code, uint8_t flags), (override));
+    MOCK_METHOD(bool, on_reason_code, (uint8_t message_type, uint16_t message_id, mqtt_reason_code_t reason_code), (override));
     
     MOCK_METHOD(bool, on_ping_req, (), (override));
     MOCK_METHOD(bool, on_ping_resp, (), (override));
@@ -236,3 +240,640 @@ TEST(MQTTSocketHandler, fragmentedChunkTest) {
     delete[] test_buffer;
     delete[] buffer;
 }
+
+static void publish(MQTTSocketHandler &handler, const char *topic, const char *message, uint16_t *message_id = NULL)
+{
+    ASSERT_TRUE(handler.send_publish_header(topic, strlen(message), message_id));
+    ASSERT_TRUE(handler.send_publish_data((uint8_t*)message, strlen(message)));
+}
+
+TEST(MQTTSocketHandler, InflightWindowBackpressure) {
+    MockMQTTSocketInterface mockListener;
+    FakeSessionSender sender;
+    MQTTSocketHandler handler;
+    handler.set_upstream(&mockListener);
+    handler.set_downstream(&sender);
+
+    uint16_t first_id = 0;
+    for (int i=0;i<MQTT_INFLIGHT_WINDOW;++i)
+    {
+        uint16_t message_id = 0;
+        publish(handler, "a/b", "data", &message_id);
+        if (i == 0)
+        {
+            first_id = message_id;
+        }
+    }
+
+    EXPECT_EQ(handler.get_inflight_count(), MQTT_INFLIGHT_WINDOW);
+    EXPECT_FALSE(handler.can_publish(4));
+    EXPECT_FALSE(handler.send_publish_header("a/b", 4));
+
+    EXPECT_CALL(mockListener, on_pub_ack(first_id)).WillOnce(testing::Return(true));
+
+    uint8_t pub_ack[] = {0x40, 0x02, (uint8_t)(first_id >> 8), (uint8_t)(first_id & 0xFF)};
+    EXPECT_TRUE(handler.on_recv(pub_ack, sizeof(pub_ack)));
+
+    EXPECT_EQ(handler.get_inflight_count(), MQTT_INFLIGHT_WINDOW - 1);
+    EXPECT_TRUE(handler.can_publish(4));
+}
+
+TEST(MQTTSocketHandler, InflightResentWithDupAfterConnAck) {
+    MockMQTTSocketInterface mockListener;
+    FakeSessionSender sender;
+    MQTTSocketHandler handler;
+    handler.set_upstream(&mockListener);
+    handler.set_downstream(&sender);
+
+    uint16_t first_id = 0, second_id = 0, third_id = 0;
+    publish(handler, "a/b", "one", &first_id);
+    publish(handler, "a/b", "two", &second_id);
+    publish(handler, "a/b", "three", &third_id);
+
+    // second publish acknowledged, first and third are outstanding when the connection drops
+    EXPECT_CALL(mockListener, on_pub_ack(second_id)).WillOnce(testing::Return(true));
+    uint8_t pub_ack[] = {0x40, 0x02, (uint8_t)(second_id >> 8), (uint8_t)(second_id & 0xFF)};
+    EXPECT_TRUE(handler.on_recv(pub_ack, sizeof(pub_ack)));
+
+    std::vector<uint8_t> first_packet = sender.sent[0];
+    first_packet.insert(first_packet.end(), sender.sent[1].begin(), sender.sent[1].end());
+    std::vector<uint8_t> third_packet = sender.sent[4];
+    third_packet.insert(third_packet.end(), sender.sent[5].begin(), sender.sent[5].end());
+
+    handler.reset();
+    sender.sent.clear();
+
+    // message ids keep counting while publishes are pending
+    EXPECT_TRUE(handler.send_connect(false, 60, "client"));
+    EXPECT_CALL(mockListener, on_conn_ack(_,_)).WillOnce(testing::Return(true));
+
+    uint8_t conn_ack[] = {0x20, 0x2, 0x0, 0x0};
+    EXPECT_TRUE(handler.on_recv(conn_ack, sizeof(conn_ack)));
+
+    ASSERT_EQ(sender.sent.size(), 2);
+
+    first_packet[0] |= MQTTDUP;
+    third_packet[0] |= MQTTDUP;
+    std::vector<uint8_t> expected = first_packet;
+    expected.insert(expected.end(), third_packet.begin(), third_packet.end());
+    EXPECT_EQ(sender.sent[1], expected);
+
+    uint16_t next_id = 0;
+    publish(handler, "a/b", "four", &next_id);
+    EXPECT_EQ(next_id, third_id + 1);
+    EXPECT_EQ(handler.get_inflight_count(), 3);
+}
+
+TEST(MQTTSocketHandler, InflightLargeMessageNotRetained) {
+    MockMQTTSocketInterface mockListener;
+    FakeSessionSender sender;
+    MQTTSocketHandler handler;
+    handler.set_upstream(&mockListener);
+    handler.set_downstream(&sender);
+
+    std::string large(MQTT_INFLIGHT_BUFFER_SIZE, 'x');
+    EXPECT_TRUE(handler.can_publish(large.size()));
+    publish(handler, "a/b", large.c_str());
+    EXPECT_EQ(handler.get_inflight_count(), 1);
+
+    // can not be resent, dropped on disconnect
+    handler.reset();
+    EXPECT_EQ(handler.get_inflight_count(), 0);
+}
+
+TEST(MQTTSocketHandler, InboundQos1AcksBatched) {
+    MockMQTTSocketInterface mockListener;
+    FakeSessionSender sender;
+    MQTTSocketHandler handler;
+    handler.set_upstream(&mockListener);
+    handler.set_downstream(&sender);
+
+    // two QoS 1 publishes to "t" with ids 5 and 6 in one read
+    uint8_t bytes[] = {0x32, 0x06, 0x00, 0x01, 't', 0x00, 0x05, 'a',
+                       0x32, 0x06, 0x00, 0x01, 't', 0x00, 0x06, 'b'};
+
+    EXPECT_CALL(mockListener, on_publish_header(_,_,_,_)).Times(2).WillRepeatedly(testing::Return(true));
+    EXPECT_CALL(mockListener, on_publish_data(_,_,true)).Times(2).WillRepeatedly(testing::Return(true));
+
+    EXPECT_TRUE(handler.on_recv(bytes, sizeof(bytes)));
+
+    ASSERT_EQ(sender.sent.size(), 1);
+    std::vector<uint8_t> expected = {0x40, 0x02, 0x00, 0x05, 0x40, 0x02, 0x00, 0x06};
+    EXPECT_EQ(sender.sent[0], expected);
+}
+
+TEST(MQTTSocketHandler, InboundQos2ExactlyOnce) {
+    MockMQTTSocketInterface mockListener;
+    FakeSessionSender sender;
+    MQTTSocketHandler handler;
+    handler.set_upstream(&mockListener);
+    handler.set_downstream(&sender);
+
+    uint8_t publish[] = {0x34, 0x06, 0x00, 0x01, 't', 0x00, 0x07, 'a'};
+    uint8_t publish_dup[] = {0x3c, 0x06, 0x00, 0x01, 't', 0x00, 0x07, 'a'};
+    uint8_t pub_rel[] = {0x62, 0x02, 0x00, 0x07};
+
+    EXPECT_CALL(mockListener, on_publish_header(_,_,7,1)).Times(2).WillRepeatedly(testing::Return(true));
+    EXPECT_CALL(mockListener, on_publish_data(_,1,true)).Times(2).WillRepeatedly(testing::Return(true));
+
+    EXPECT_TRUE(handler.on_recv(publish, sizeof(publish)));
+
+    // redelivery before PUBREL is acknowledged but not handed upstream again
+    EXPECT_TRUE(handler.on_recv(publish_dup, sizeof(publish_dup)));
+
+    ASSERT_EQ(sender.sent.size(), 2);
+    std::vector<uint8_t> pub_rec = {0x50, 0x02, 0x00, 0x07};
+    EXPECT_EQ(sender.sent[0], pub_rec);
+    EXPECT_EQ(sender.sent[1], pub_rec);
+
+    EXPECT_TRUE(handler.on_recv(pub_rel, sizeof(pub_rel)));
+    ASSERT_EQ(sender.sent.size(), 3);
+    std::vector<uint8_t> pub_comp = {0x70, 0x02, 0x00, 0x07};
+    EXPECT_EQ(sender.sent[2], pub_comp);
+
+    // after release the id is free to carry a new message
+    EXPECT_TRUE(handler.on_recv(publish, sizeof(publish)));
+}
+
+TEST(MQTTSocketHandler, BatchedPublishesSingleWrite) {
+    MockMQTTSocketInterface mockListener;
+    FakeSessionSender sender;
+    MQTTSocketHandler handler;
+    handler.set_upstream(&mockListener);
+    handler.set_downstream(&sender);
+
+    // 20 small readings, QoS 0 so the in-flight window is not involved
+    const int readings = 20;
+    for (int i=0;i<readings;++i)
+    {
+        std::string value = std::to_string(20 + i);
+        EXPECT_TRUE(handler.queue_publish("garden/temp", (const uint8_t*)value.data(), value.size(), 0));
+    }
+    EXPECT_TRUE(sender.sent.empty());
+
+    EXPECT_TRUE(handler.flush_publishes());
+    ASSERT_EQ(sender.sent.size(), 1);
+    EXPECT_EQ(handler.get_batch_stats().publishes, readings);
+    EXPECT_EQ(handler.get_batch_stats().writes, 1);
+
+    // the receiving side decodes the same publishes out of the single write
+    MockMQTTSocketInterface receiver;
+    MQTTSocketHandler decoder;
+    decoder.set_upstream(&receiver);
+
+    EXPECT_CALL(receiver, on_publish_header(_,11,0,2)).Times(readings).WillRepeatedly(testing::Return(true));
+    EXPECT_CALL(receiver, on_publish_data(_,2,true)).Times(readings).WillRepeatedly(testing::Return(true));
+    EXPECT_TRUE(decoder.on_recv(sender.sent[0].data(), sender.sent[0].size()));
+
+    if (benchmarkReportEnabled())
+    {
+        printf("MQTTSocketHandler batching: publishes[%d] writes[%d] (unbatched %d) bytes[%d]\n", readings, handler.get_batch_stats().writes, readings * 2, handler.get_batch_stats().bytes);
+    }
+}
+
+TEST(MQTTSocketHandler, BatchFlushOnSizeTimeAndOrder) {
+    MockMQTTSocketInterface mockListener;
+    FakeSessionSender sender;
+    MQTTSocketHandler handler;
+    handler.set_upstream(&mockListener);
+    handler.set_downstream(&sender);
+    handler.set_batch_delay(10);
+
+    std::string value(100, 'v');
+    uint16_t message_id = 0;
+    EXPECT_TRUE(handler.queue_publish("t", (const uint8_t*)value.data(), value.size(), 1, false, &message_id));
+    EXPECT_EQ(handler.get_inflight_count(), 1);
+
+    // not yet due
+    EXPECT_TRUE(handler.update(5000));
+    EXPECT_TRUE(sender.sent.empty());
+
+    EXPECT_TRUE(handler.update(10000));
+    ASSERT_EQ(sender.sent.size(), 1);
+
+    // buffer fills up, earlier publishes are sent to make room
+    int queued = 0;
+    while (sender.sent.size() == 1)
+    {
+        EXPECT_TRUE(handler.queue_publish("t", (const uint8_t*)value.data(), value.size(), 0));
+        ++queued;
+    }
+    EXPECT_EQ(sender.sent[1].size(), (queued - 1) * (2 + 3 + value.size()));
+
+    // other packets never overtake queued publishes
+    EXPECT_TRUE(handler.send_subscribe("t"));
+    ASSERT_EQ(sender.sent.size(), 4);
+    EXPECT_EQ(sender.sent[2].size(), 2 + 3 + value.size());
+    EXPECT_EQ(sender.sent[3][0], MQTTSUBSCRIBE|MQTTQOS1);
+
+    std::string large(MQTT_BATCH_BUFFER_SIZE, 'x');
+    EXPECT_FALSE(handler.queue_publish("t", (const uint8_t*)large.data(), large.size(), 0));
+}
+
+// CONNACK with Receive Maximum and Topic Alias Maximum properties
+static void connect_v5(MQTTSocketHandler &handler, MockMQTTSocketInterface &listener, uint16_t receive_maximum, uint16_t topic_alias_maximum)
+{
+    EXPECT_CALL(listener, on_conn_ack(CONNECTION_ACCEPTED, 0)).WillOnce(testing::Return(true));
+
+    uint8_t conn_ack[] = {0x20, 0x09, 0x00, 0x00, 0x06,
+                          MQTT_PROP_RECEIVE_MAXIMUM, (uint8_t)(receive_maximum >> 8), (uint8_t)(receive_maximum & 0xFF),
+                          MQTT_PROP_TOPIC_ALIAS_MAXIMUM, (uint8_t)(topic_alias_maximum >> 8), (uint8_t)(topic_alias_maximum & 0xFF)};
+    ASSERT_TRUE(handler.on_recv(conn_ack, sizeof(conn_ack)));
+}
+
+TEST(MQTTSocketHandler, Mqtt5ConnectProperties) {
+    MockMQTTSocketInterface mockListener;
+    FakeSessionSender sender;
+    MQTTSocketHandler handler;
+    handler.set_upstream(&mockListener);
+    handler.set_downstream(&sender);
+    handler.set_protocol_version(MQTT_PROTOCOL_V5);
+
+    EXPECT_TRUE(handler.send_connect(false, 60, "c"));
+    ASSERT_EQ(sender.sent.size(), 1);
+
+    std::vector<uint8_t> expected = {0x10, 25, 0x00, 0x04, 'M', 'Q', 'T', 'T', 5, 0x00, 0x00, 60,
+                                     11,
+                                     MQTT_PROP_SESSION_EXPIRY_INTERVAL, 0x00, 0x00, (MQTT_SESSION_EXPIRY_SECONDS >> 8) & 0xFF, MQTT_SESSION_EXPIRY_SECONDS & 0xFF,
+                                     MQTT_PROP_RECEIVE_MAXIMUM, 0x00, MQTT_QOS2_RECEIVE_MAX,
+                                     MQTT_PROP_TOPIC_ALIAS_MAXIMUM, 0x00, MQTT_TOPIC_ALIASES,
+                                     0x00, 0x01, 'c'};
+    EXPECT_EQ(sender.sent[0], expected);
+}
+
+TEST(MQTTSocketHandler, Mqtt5TopicAliasSteadyState) {
+    MockMQTTSocketInterface mockListener;
+    FakeSessionSender sender;
+    MQTTSocketHandler handler;
+    handler.set_upstream(&mockListener);
+    handler.set_downstream(&sender);
+    handler.set_protocol_version(MQTT_PROTOCOL_V5);
+    connect_v5(handler, mockListener, 100, 10);
+
+    const char *topic = "garden/sensors/temperature";
+    const int readings = 10;
+    for (int i=0;i<readings;++i)
+    {
+        EXPECT_TRUE(handler.queue_publish(topic, (const uint8_t*)"21", 2, 0));
+    }
+    EXPECT_TRUE(handler.flush_publishes());
+    ASSERT_EQ(sender.sent.size(), 1);
+
+    // first publish sets alias 1 along with the topic, the rest carry an empty topic and the alias
+    uint32_t first_size = 2 + 2 + strlen(topic) + 1 + 3 + 2;
+    uint32_t steady_size = 2 + 2 + 1 + 3 + 2;
+    ASSERT_EQ(sender.sent[0].size(), first_size + (readings - 1) * steady_size);
+
+    std::vector<uint8_t> steady(sender.sent[0].begin() + first_size, sender.sent[0].begin() + first_size + steady_size);
+    std::vector<uint8_t> expected = {0x30, 0x08, 0x00, 0x00, 0x03, MQTT_PROP_TOPIC_ALIAS, 0x00, 0x01, '2', '1'};
+    EXPECT_EQ(steady, expected);
+
+    // a receiving MQTT 5.0 handler resolves the alias back to the topic
+    MockMQTTSocketInterface receiver;
+    MQTTSocketHandler decoder;
+    decoder.set_upstream(&receiver);
+    decoder.set_protocol_version(MQTT_PROTOCOL_V5);
+
+    EXPECT_CALL(receiver, on_publish_header(_,strlen(topic),0,2)).Times(readings).WillRepeatedly(testing::WithArgs<0>([topic](uint8_t *received) {
+        EXPECT_EQ(memcmp(received, topic, strlen(topic)), 0);
+        return true;
+    }));
+    EXPECT_CALL(receiver, on_publish_data(_,2,true)).Times(readings).WillRepeatedly(testing::Return(true));
+    EXPECT_TRUE(decoder.on_recv(sender.sent[0].data(), sender.sent[0].size()));
+
+    // an alias that was never set is a protocol error
+    uint8_t unknown[] = {0x30, 0x08, 0x00, 0x00, 0x03, MQTT_PROP_TOPIC_ALIAS, 0x00, 0x02, '2', '1'};
+    EXPECT_FALSE(decoder.on_recv(unknown, sizeof(unknown)));
+
+    if (benchmarkReportEnabled())
+    {
+        printf("MQTTSocketHandler topic alias: first publish[%d] bytes, steady state[%d] bytes, 3.1.1[%d] bytes\n", first_size, steady_size, (uint32_t)(2 + 2 + strlen(topic) + 2));
+    }
+}
+
+TEST(MQTTSocketHandler, Mqtt5ReceiveMaximumAndRetransmit) {
+    MockMQTTSocketInterface mockListener;
+    FakeSessionSender sender;
+    MQTTSocketHandler handler;
+    handler.set_upstream(&mockListener);
+    handler.set_downstream(&sender);
+    handler.set_protocol_version(MQTT_PROTOCOL_V5);
+    connect_v5(handler, mockListener, 2, 4);
+
+    EXPECT_EQ(handler.get_inflight_window(), 2);
+
+    uint16_t first_id = 0, second_id = 0;
+    publish(handler, "a/b", "one", &first_id);
+    publish(handler, "a/b", "two", &second_id);
+    EXPECT_FALSE(handler.can_publish(3));
+
+    // second publish went out with the alias only
+    ASSERT_EQ(sender.sent.size(), 4);
+    std::vector<uint8_t> second_header = {0x33, 0x0b, 0x00, 0x00, (uint8_t)(second_id >> 8), (uint8_t)(second_id & 0xFF), 0x03, MQTT_PROP_TOPIC_ALIAS, 0x00, 0x01};
+    EXPECT_EQ(sender.sent[2], second_header);
+
+    // broker quota reached, reported and the publish is done with
+    EXPECT_CALL(mockListener, on_reason_code(MQTTPUBACK, first_id, MQTT_RC_QUOTA_EXCEEDED)).WillOnce(testing::Return(true));
+    EXPECT_CALL(mockListener, on_pub_ack(first_id)).WillOnce(testing::Return(true));
+    uint8_t pub_ack[] = {0x40, 0x04, (uint8_t)(first_id >> 8), (uint8_t)(first_id & 0xFF), MQTT_RC_QUOTA_EXCEEDED, 0x00};
+    EXPECT_TRUE(handler.on_recv(pub_ack, sizeof(pub_ack)));
+    EXPECT_TRUE(handler.can_publish(3));
+
+    // aliases are gone on a new connection, the retransmit carries the topic
+    handler.reset();
+    sender.sent.clear();
+    connect_v5(handler, mockListener, 2, 0);
+
+    ASSERT_EQ(sender.sent.size(), 1);
+    std::vector<uint8_t> resent = {0x3b, 0x0b, 0x00, 0x03, 'a', '/', 'b', (uint8_t)(second_id >> 8), (uint8_t)(second_id & 0xFF), 0x00, 't', 'w', 'o'};
+    EXPECT_EQ(sender.sent[0], resent);
+}
+
+TEST(MQTTSocketHandler, Mqtt5ResendHonoursNewReceiveMaximum) {
+    MockMQTTSocketInterface mockListener;
+    FakeSessionSender sender;
+    MQTTSocketHandler handler;
+    handler.set_upstream(&mockListener);
+    handler.set_downstream(&sender);
+    handler.set_protocol_version(MQTT_PROTOCOL_V5);
+    connect_v5(handler, mockListener, 4, 0);
+
+    uint16_t ids[3] = {0, 0, 0};
+    publish(handler, "a/b", "one", &ids[0]);
+    publish(handler, "a/b", "two", &ids[1]);
+    publish(handler, "a/b", "six", &ids[2]);
+
+    // the broker only takes one publish at a time after reconnecting
+    handler.reset();
+    sender.sent.clear();
+    connect_v5(handler, mockListener, 1, 0);
+
+    std::vector<uint8_t> resent = {0x3b, 0x0b, 0x00, 0x03, 'a', '/', 'b', (uint8_t)(ids[0] >> 8), (uint8_t)(ids[0] & 0xFF), 0x00, 'o', 'n', 'e'};
+    ASSERT_EQ(sender.sent.size(), 1);
+    EXPECT_EQ(sender.sent[0], resent);
+    EXPECT_FALSE(handler.can_publish(3));
+
+    // each PUBACK lets the next held publish go out
+    for (int i=0;i<2;++i)
+    {
+        EXPECT_CALL(mockListener, on_pub_ack(ids[i])).WillOnce(testing::Return(true));
+        uint8_t pub_ack[] = {0x40, 0x02, (uint8_t)(ids[i] >> 8), (uint8_t)(ids[i] & 0xFF)};
+        EXPECT_TRUE(handler.on_recv(pub_ack, sizeof(pub_ack)));
+
+        ASSERT_EQ(sender.sent.size(), i + 2);
+        EXPECT_EQ(sender.sent[i + 1][0], 0x3b);
+        EXPECT_EQ(sender.sent[i + 1][7], ids[i + 1] >> 8);
+        EXPECT_EQ(sender.sent[i + 1][8], ids[i + 1] & 0xFF);
+        EXPECT_FALSE(handler.can_publish(3));
+    }
+
+    EXPECT_CALL(mockListener, on_pub_ack(ids[2])).WillOnce(testing::Return(true));
+    uint8_t pub_ack[] = {0x40, 0x02, (uint8_t)(ids[2] >> 8), (uint8_t)(ids[2] & 0xFF)};
+    EXPECT_TRUE(handler.on_recv(pub_ack, sizeof(pub_ack)));
+    EXPECT_EQ(sender.sent.size(), 3);
+    EXPECT_TRUE(handler.can_publish(3));
+}
+
+TEST(MQTTSocketHandler, Mqtt5LongTopicAliasDropped) {
+    MockMQTTSocketInterface receiver;
+    MQTTSocketHandler decoder;
+    decoder.set_upstream(&receiver);
+    decoder.set_protocol_version(MQTT_PROTOCOL_V5);
+
+    // the publish is delivered with its topic, the alias is not kept
+    std::string topic(MQTT_TOPIC_ALIAS_SIZE + 1, 't');
+    std::vector<uint8_t> publish = {0x30, 0x00, 0x00, (uint8_t)topic.size()};
+    publish.insert(publish.end(), topic.begin(), topic.end());
+    publish.insert(publish.end(), {0x03, MQTT_PROP_TOPIC_ALIAS, 0x00, 0x01, '2', '1'});
+    publish[1] = publish.size() - 2;
+
+    EXPECT_CALL(receiver, on_publish_header(_,topic.size(),0,2)).WillOnce(testing::Return(true));
+    EXPECT_CALL(receiver, on_publish_data(_,2,true)).WillOnce(testing::Return(true));
+    EXPECT_TRUE(decoder.on_recv(publish.data(), publish.size()));
+
+    uint8_t aliased[] = {0x30, 0x08, 0x00, 0x00, 0x03, MQTT_PROP_TOPIC_ALIAS, 0x00, 0x01, '2', '1'};
+    EXPECT_FALSE(decoder.on_recv(aliased, sizeof(aliased)));
+}
+
+TEST(MQTTSocketHandler, Mqtt5ReasonCodes) {
+    MockMQTTSocketInterface mockListener;
+    FakeSessionSender sender;
+    MQTTSocketHandler handler;
+    handler.set_upstream(&mockListener);
+    handler.set_downstream(&sender);
+    handler.set_protocol_version(MQTT_PROTOCOL_V5);
+
+    const char *topics[] = {"a/#", "b/+"};
+    uint16_t message_id = 0;
+    EXPECT_TRUE(handler.send_subscribe(topics, 2, 1, &message_id));
+    std::vector<uint8_t> subscribe = {0x82, 0x0e, (uint8_t)(message_id >> 8), (uint8_t)(message_id & 0xFF), 0x00, 0x00, 0x03, 'a', '/', '#', 0x01, 0x00, 0x03, 'b', '/', '+', 0x01};
+    subscribe[1] = subscribe.size() - 2;
+    EXPECT_EQ(sender.sent[0], subscribe);
+
+    // first filter granted, second refused
+    EXPECT_CALL(mockListener, on_reason_code(MQTTSUBACK, message_id, MQTT_RC_NOT_AUTHORIZED)).WillOnce(testing::Return(true));
+    EXPECT_CALL(mockListener, on_sub_ack(message_id)).WillOnce(testing::Return(true));
+    uint8_t sub_ack[] = {0x90, 0x05, (uint8_t)(message_id >> 8), (uint8_t)(message_id & 0xFF), 0x00, 0x01, MQTT_RC_NOT_AUTHORIZED};
+    EXPECT_TRUE(handler.on_recv(sub_ack, sizeof(sub_ack)));
+
+    // broker closing the connection tells why
+    EXPECT_CALL(mockListener, on_reason_code(MQTTDISCONNECT, 0, MQTT_RC_SESSION_TAKEN_OVER)).WillOnce(testing::Return(true));
+    uint8_t disconnect[] = {0xe0, 0x02, MQTT_RC_SESSION_TAKEN_OVER, 0x00};
+    EXPECT_FALSE(handler.on_recv(disconnect, sizeof(disconnect)));
+}
+
+class TopicStreamRecorder : public MQTTSocketInterface
+{
+public:
+    virtual bool on_publish_topic(const uint8_t *data, uint16_t len, uint16_t offset, uint16_t topic_length) override
+    {
+        EXPECT_EQ(offset, topic.size());
+        topic.append((const char*)data, len);
+        total_length = topic_length;
+        return true;
+    }
+
+    virtual bool on_publish_header(uint8_t *topic, uint16_t topic_length, uint16_t message_id, uint32_t message_length) override
+    {
+        headers.push_back(topic != NULL ? std::string((char*)topic, topic_length) : std::string("(streamed ") + std::to_string(topic_length) + ")");
+        ids.push_back(message_id);
+        return true;
+    }
+
+    virtual bool on_publish_data(uint8_t *data, uint32_t len, bool last_chunk) override
+    {
+        payload.append((char*)data, len);
+        return true;
+    }
+
+    virtual bool on_sub_ack(uint16_t message_id) override { sub_acks.push_back(message_id); return true; }
+    virtual bool on_reason_code(uint8_t message_type, uint16_t message_id, mqtt_reason_code_t reason_code) override { reason_codes.push_back(reason_code); return true; }
+    virtual bool on_ping_resp() override { ++ping_resps; return true; }
+
+    std::string topic;
+    uint16_t total_length = 0;
+    std::vector<std::string> headers;
+    std::vector<uint16_t> ids;
+    std::string payload;
+    std::vector<uint16_t> sub_acks;
+    std::vector<uint8_t> reason_codes;
+    int ping_resps = 0;
+};
+
+TEST(MQTTSocketHandler, StreamedTopicLongerThenBuffer) {
+    TopicStreamRecorder recorder;
+    FakeSessionSender sender;
+    MQTTSocketHandlerT<32> handler;
+    handler.set_upstream(&recorder);
+    handler.set_downstream(&sender);
+
+    std::string topic;
+    for (int i=0;i<60;++i)
+    {
+        topic += "level" + std::to_string(i) + "/";
+    }
+    topic += "end";
+
+    // QoS 1 publish with the long topic, then a short one
+    std::string message = "payload";
+    uint32_t remaining = 2 + topic.size() + 2 + message.size();
+    std::vector<uint8_t> bytes = {0x32, (uint8_t)((remaining & 0x7F) | 0x80), (uint8_t)(remaining >> 7), (uint8_t)(topic.size() >> 8), (uint8_t)(topic.size() & 0xFF)};
+    bytes.insert(bytes.end(), topic.begin(), topic.end());
+    bytes.insert(bytes.end(), {0x00, 0x09});
+    bytes.insert(bytes.end(), message.begin(), message.end());
+    std::vector<uint8_t> short_publish = {0x30, 0x04, 0x00, 0x01, 't', 'x'};
+    bytes.insert(bytes.end(), short_publish.begin(), short_publish.end());
+
+    for (size_t piece : {(size_t)7, (size_t)1, bytes.size()})
+    {
+        recorder = TopicStreamRecorder();
+        sender.sent.clear();
+
+        for (size_t offset=0;offset<bytes.size();offset+=piece)
+        {
+            ASSERT_TRUE(handler.on_recv(&bytes[offset], std::min(piece, bytes.size() - offset)));
+        }
+
+        EXPECT_EQ(recorder.topic, topic);
+        EXPECT_EQ(recorder.total_length, topic.size());
+        std::vector<std::string> headers = {"(streamed " + std::to_string(topic.size()) + ")", "t"};
+        EXPECT_EQ(recorder.headers, headers);
+        std::vector<uint16_t> ids = {9, 0};
+        EXPECT_EQ(recorder.ids, ids);
+        EXPECT_EQ(recorder.payload, message + "x");
+
+        std::vector<uint8_t> pub_ack = {0x40, 0x02, 0x00, 0x09};
+        std::vector<uint8_t> acks;
+        for (const std::vector<uint8_t> &sent : sender.sent)
+        {
+            acks.insert(acks.end(), sent.begin(), sent.end());
+        }
+        EXPECT_EQ(acks, pub_ack) << "piece " << piece;
+    }
+
+    if (benchmarkReportEnabled())
+    {
+        printf("MQTTSocketHandler receive buffer: MQTTSocketHandlerT<32>[%d] bytes, MQTTSocketHandler[%d] bytes, topic[%d] bytes\n", (int)sizeof(MQTTSocketHandlerT<32>), (int)sizeof(MQTTSocketHandler), (int)topic.size());
+    }
+}
+
+TEST(MQTTSocketHandler, OversizedControlPacketSkipped) {
+    TopicStreamRecorder recorder;
+    FakeSessionSender sender;
+    MQTTSocketHandlerT<16> handler;
+    handler.set_upstream(&recorder);
+    handler.set_downstream(&sender);
+
+    // SUBACK for 40 filters, the third refused, then a PINGRESP
+    std::vector<uint8_t> bytes = {0x90, 42, 0x00, 0x05};
+    for (int i=0;i<40;++i)
+    {
+        bytes.push_back((i == 2) ? 0x80 : 0x01);
+    }
+    bytes.insert(bytes.end(), {0xd0, 0x00});
+
+    for (size_t i=0;i<bytes.size();i+=5)
+    {
+        ASSERT_TRUE(handler.on_recv(&bytes[i], std::min((size_t)5, bytes.size() - i)));
+    }
+
+    std::vector<uint16_t> sub_acks = {5};
+    EXPECT_EQ(recorder.sub_acks, sub_acks);
+    std::vector<uint8_t> reason_codes = {0x80};
+    EXPECT_EQ(recorder.reason_codes, reason_codes);
+    EXPECT_EQ(recorder.ping_resps, 1);
+}
+
+TEST(MQTTSocketHandler, PipelinedConnectAndSubscribe) {
+    MockMQTTSocketInterface mockListener;
+    FakeSessionSender sender;
+    MQTTSocketHandler handler;
+    handler.set_upstream(&mockListener);
+    handler.set_downstream(&sender);
+
+    const char *topics[] = { "home/+/set", "ota/#", "config" };
+    EXPECT_TRUE(handler.send_connect_subscribe(topics, 3, 1, true, 60, "pico"));
+
+    // CONNECT and a SUBSCRIBE per topic in one write, same bytes as sending them one by one
+    ASSERT_EQ(sender.sent.size(), 1);
+    EXPECT_EQ(handler.get_startup_stats().writes, 1);
+
+    FakeSessionSender sequentialSender;
+    MQTTSocketHandler sequential;
+    sequential.set_upstream(&mockListener);
+    sequential.set_downstream(&sequentialSender);
+    EXPECT_TRUE(sequential.send_connect(true, 60, "pico"));
+    std::vector<uint8_t> expected = sequentialSender.sent[0];
+    for (int i=0;i<3;++i)
+    {
+        uint16_t message_id = 0;
+        EXPECT_TRUE(sequential.send_subscribe(&topics[i], 1, 1, &message_id));
+        EXPECT_EQ(message_id, i + 1);
+        expected.insert(expected.end(), sequentialSender.sent.back().begin(), sequentialSender.sent.back().end());
+    }
+    EXPECT_EQ(sender.sent[0], expected);
+
+    // CONNACK and SUBACKs (out of order, one refused) arrive together
+    EXPECT_CALL(mockListener, on_conn_ack(CONNECTION_ACCEPTED, 0)).WillOnce(testing::Return(true));
+    EXPECT_CALL(mockListener, on_sub_ack(_)).Times(3).WillRepeatedly(testing::Return(true));
+    EXPECT_CALL(mockListener, on_reason_code(MQTTSUBACK, 3, MQTT_RC_UNSPECIFIED_ERROR)).WillOnce(testing::Return(true));
+
+    uint8_t replies[] = {0x20, 0x02, 0x00, 0x00,
+                         0x90, 0x03, 0x00, 0x02, 0x01,
+                         0x90, 0x03, 0x00, 0x01, 0x01};
+    EXPECT_TRUE(handler.on_recv(replies, sizeof(replies)));
+    EXPECT_EQ(handler.get_startup_stats().granted, 2);
+    EXPECT_FALSE(handler.is_subscribed());
+    EXPECT_FALSE(handler.get_startup_stats().first_publish);
+
+    uint8_t refused[] = {0x90, 0x03, 0x00, 0x03, 0x80};
+    EXPECT_TRUE(handler.on_recv(refused, sizeof(refused)));
+    EXPECT_EQ(handler.get_startup_stats().refused, 1);
+    EXPECT_FALSE(handler.is_subscribed());
+
+    EXPECT_CALL(mockListener, on_publish_header(_, 6, 0, 2)).WillOnce(testing::Return(true));
+    EXPECT_CALL(mockListener, on_publish_data(_, 2, true)).WillOnce(testing::Return(true));
+    uint8_t publish[] = {0x30, 0x0A, 0x00, 0x06, 'c', 'o', 'n', 'f', 'i', 'g', 'o', 'n'};
+    EXPECT_TRUE(handler.on_recv(publish, sizeof(publish)));
+    EXPECT_TRUE(handler.get_startup_stats().first_publish);
+
+    // more then fits the batch buffer goes out in as few writes as possible
+    std::string long_topic(200, 't');
+    const char *many[] = { long_topic.c_str(), long_topic.c_str(), long_topic.c_str() };
+    sender.sent.clear();
+    EXPECT_TRUE(handler.send_connect_subscribe(many, 3, 0, true, 60, "pico"));
+    EXPECT_EQ(sender.sent.size(), 2);
+    EXPECT_EQ(handler.get_startup_stats().writes, 2);
+    EXPECT_EQ(handler.get_startup_stats().subscriptions, 3);
+
+    EXPECT_CALL(mockListener, on_sub_ack(_)).Times(3).WillRepeatedly(testing::Return(true));
+    for (uint16_t message_id=1;message_id<=3;++message_id)
+    {
+        uint8_t sub_ack[] = {0x90, 0x03, 0x00, (uint8_t)message_id, 0x00};
+        EXPECT_TRUE(handler.on_recv(sub_ack, sizeof(sub_ack)));
+    }
+    EXPECT_TRUE(handler.is_subscribed());
+
+    const char *too_many[MQTT_STARTUP_TOPICS + 1] = {};
+    EXPECT_FALSE(handler.send_connect_subscribe(too_many, MQTT_STARTUP_TOPICS + 1, 1, true, 60, "pico"));
+}
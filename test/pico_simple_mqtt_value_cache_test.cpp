@@ -0,0 +1,185 @@
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+#include <string.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "pico_simple_mqtt/mqtt_value_cache.h"
+#include "pico_simple_mqtt/mqtt_subscriptions.h"
+
+class ValueChangeRecorder : public MQTTValueCacheListener
+{
+public:
+    virtual void on_value_changed(int8_t index, const char *topic, const uint8_t *data, uint16_t len, const MQTTCachedValue& info) override
+    {
+        changes.push_back(std::string(topic) + "=" + std::string((const char *)data, len));
+    }
+
+    std::vector<std::string> changes;
+};
+
+static uint64_t cacheClock = 0;
+static uint64_t cacheNow() { return cacheClock; }
+
+template <typename Target>
+static void publish(Target &target, const char *topic, const std::string& message, size_t chunk = 1000)
+{
+    target.on_publish_header((uint8_t *)topic, strlen(topic), 0, message.size());
+    if (message.empty())
+    {
+        target.on_publish_data(NULL, 0, true);
+        return;
+    }
+
+    for (size_t i=0;i<message.size();i+=chunk)
+    {
+        size_t len = std::min(chunk, message.size() - i);
+        target.on_publish_data((uint8_t *)&message[i], len, i + len == message.size());
+    }
+}
+
+static std::string read_value(MQTTValueCache &cache, const char *topic, MQTTCachedValue &info)
+{
+    uint8_t buffer[MQTT_VALUE_CACHE_VALUE_SIZE];
+    if (!cache.read(topic, buffer, sizeof(buffer), info))
+    {
+        return "<none>";
+    }
+    return std::string((const char *)buffer, info.stored);
+}
+
+TEST(MQTTValueCache, LatestValuePerTopic) {
+    MQTTValueCache cache;
+    ValueChangeRecorder recorder;
+    MQTTCachedValue info;
+
+    cache.set_clock(cacheNow);
+    cache.set_listener(&recorder);
+
+    EXPECT_TRUE(cache.track("home/door"));
+    EXPECT_EQ(0, cache.find("home/door"));
+    EXPECT_EQ("", read_value(cache, "home/door", info));
+    EXPECT_EQ(0, info.updates);
+
+    cacheClock = 1000;
+    publish(cache, "home/temp", "21.5", 2);
+    cacheClock = 2000;
+    publish(cache, "home/door", "open");
+
+    EXPECT_EQ(2, cache.get_count());
+    EXPECT_EQ("21.5", read_value(cache, "home/temp", info));
+    EXPECT_EQ(1000, info.updated_us);
+    EXPECT_EQ(1, info.updates);
+    EXPECT_EQ("open", read_value(cache, "home/door", info));
+    EXPECT_EQ(2000, info.updated_us);
+    EXPECT_EQ("<none>", read_value(cache, "home/missing", info));
+
+    // same payload again only refreshes the timestamp
+    cacheClock = 3000;
+    publish(cache, "home/temp", "21.5");
+    EXPECT_EQ("21.5", read_value(cache, "home/temp", info));
+    EXPECT_EQ(3000, info.updated_us);
+    EXPECT_EQ(2, info.updates);
+
+    publish(cache, "home/temp", "22");
+    publish(cache, "home/door", "");
+    EXPECT_EQ("22", read_value(cache, "home/temp", info));
+    EXPECT_EQ("", read_value(cache, "home/door", info));
+    EXPECT_EQ(0, info.length);
+
+    EXPECT_THAT(recorder.changes, ::testing::ElementsAre("home/temp=21.5", "home/door=open", "home/temp=22", "home/door="));
+    EXPECT_EQ(5, cache.get_stats().stored);
+    EXPECT_EQ(4, cache.get_stats().changed);
+
+    // long payloads are kept truncated, full length is reported
+    std::string big(MQTT_VALUE_CACHE_VALUE_SIZE + 50, 'x');
+    publish(cache, "home/log", big, 40);
+    EXPECT_EQ(big.substr(0, MQTT_VALUE_CACHE_VALUE_SIZE), read_value(cache, "home/log", info));
+    EXPECT_EQ(big.size(), info.length);
+    EXPECT_EQ(1, cache.get_stats().truncated);
+
+    // caller buffer smaller then the value
+    uint8_t small[2];
+    EXPECT_TRUE(cache.read(cache.find("home/temp"), small, sizeof(small), info));
+    EXPECT_EQ(0, memcmp(small, "22", 2));
+    EXPECT_STREQ("home/log", cache.get_topic(cache.find("home/log")));
+}
+
+TEST(MQTTValueCache, LimitsAndSubscriptionFilters) {
+    MQTTValueCache cache;
+    MQTTSubscriptions subscriptions;
+    MQTTCachedValue info;
+
+    EXPECT_TRUE(subscriptions.add("sensors/+/value", &cache));
+
+    for (int i=0;i<MQTT_VALUE_CACHE_ENTRIES+2;++i)
+    {
+        std::string topic = "sensors/" + std::to_string(i) + "/value";
+        publish(subscriptions, topic.c_str(), std::to_string(i * 10));
+    }
+    publish(subscriptions, "other/topic", "ignored");
+
+    EXPECT_EQ(MQTT_VALUE_CACHE_ENTRIES, cache.get_count());
+    EXPECT_EQ("70", read_value(cache, "sensors/7/value", info));
+    EXPECT_EQ("<none>", read_value(cache, "sensors/9/value", info));
+    EXPECT_EQ("<none>", read_value(cache, "other/topic", info));
+    EXPECT_EQ(2, cache.get_stats().dropped);
+
+    // existing entries still update when the cache is full
+    publish(subscriptions, "sensors/0/value", "5");
+    EXPECT_EQ("5", read_value(cache, "sensors/0/value", info));
+
+    EXPECT_FALSE(cache.track("sensors/new"));
+    EXPECT_TRUE(cache.track("sensors/1/value"));
+
+    MQTTValueCache other;
+    EXPECT_FALSE(other.track(std::string(MQTT_VALUE_CACHE_TOPIC_SIZE, 't').c_str()));
+    EXPECT_EQ(MQTT_VALUE_CACHE_NO_ENTRY, other.find("anything"));
+}
+
+TEST(MQTTValueCache, ConcurrentReadersSeeWholeValues) {
+    MQTTValueCache cache;
+    EXPECT_TRUE(cache.track("fast"));
+
+    std::atomic<bool> done{false};
+    std::atomic<int> torn{0};
+    std::atomic<int> reads{0};
+
+    std::thread reader([&]() {
+        uint8_t buffer[MQTT_VALUE_CACHE_VALUE_SIZE];
+        MQTTCachedValue info;
+        while (!done.load())
+        {
+            ASSERT_TRUE(cache.read(cache.find("fast"), buffer, sizeof(buffer), info));
+            for (uint16_t i=1;i<info.stored;++i)
+            {
+                if (buffer[i] != buffer[0])
+                {
+                    ++torn;
+                    break;
+                }
+            }
+            if ((info.stored > 0) && (info.stored != (buffer[0] - 'a') + 1))
+            {
+                ++torn;
+            }
+            ++reads;
+        }
+    });
+
+    // every value is a run of one letter, its length tied to the letter
+    for (int i=0;i<200000;++i)
+    {
+        char letter = 'a' + (i % 26);
+        publish(cache, "fast", std::string(letter - 'a' + 1, letter));
+    }
+
+    done = true;
+    reader.join();
+
+    EXPECT_EQ(0, torn.load());
+    EXPECT_GT(reads.load(), 0);
+    EXPECT_EQ(200000, cache.get_stats().stored);
+}
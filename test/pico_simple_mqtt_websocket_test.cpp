@@ -0,0 +1,282 @@
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "pico_simple_mqtt/mqtt_websocket.h"
+#include "pico_simple_mqtt/mqtt_handler.h"
+#include "test_support.h"
+
+// mbedtls_wrapper is not part of the host build, reference implementations for the handshake
+extern "C" int sha1(const unsigned char *input, size_t ilen, unsigned char output[20])
+{
+    uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+
+    std::vector<uint8_t> msg(input, input + ilen);
+    msg.push_back(0x80);
+    while (msg.size() % 64 != 56)
+    {
+        msg.push_back(0);
+    }
+
+    uint64_t bits = (uint64_t)ilen * 8;
+    for (int i=7;i>=0;--i)
+    {
+        msg.push_back((uint8_t)(bits >> (i * 8)));
+    }
+
+    for (size_t chunk=0;chunk<msg.size();chunk+=64)
+    {
+        uint32_t w[80];
+        for (int i=0;i<16;++i)
+        {
+            w[i] = ((uint32_t)msg[chunk+4*i] << 24) | ((uint32_t)msg[chunk+4*i+1] << 16) | ((uint32_t)msg[chunk+4*i+2] << 8) | msg[chunk+4*i+3];
+        }
+        for (int i=16;i<80;++i)
+        {
+            uint32_t v = w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16];
+            w[i] = (v << 1) | (v >> 31);
+        }
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i=0;i<80;++i)
+        {
+            uint32_t f = (i < 20) ? ((b & c) | (~b & d)) : ((i < 40) || (i >= 60)) ? (b ^ c ^ d) : ((b & c) | (b & d) | (c & d));
+            uint32_t k = (i < 20) ? 0x5A827999 : (i < 40) ? 0x6ED9EBA1 : (i < 60) ? 0x8F1BBCDC : 0xCA62C1D6;
+            uint32_t temp = ((a << 5) | (a >> 27)) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = (b << 30) | (b >> 2);
+            b = a;
+            a = temp;
+        }
+
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+    }
+
+    for (int i=0;i<5;++i)
+    {
+        output[i*4] = h[i] >> 24;
+        output[i*4+1] = h[i] >> 16;
+        output[i*4+2] = h[i] >> 8;
+        output[i*4+3] = h[i];
+    }
+    return 0;
+}
+
+extern "C" int base64_encode(const unsigned char *src, size_t slen, unsigned char *dst, size_t dlen)
+{
+    static const char *TABLE = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    if (((slen + 2) / 3) * 4 + 1 > dlen)
+    {
+        return -1;
+    }
+
+    size_t pos = 0;
+    for (size_t i=0;i<slen;i+=3)
+    {
+        uint32_t v = (src[i] << 16) | ((i+1 < slen) ? (src[i+1] << 8) : 0) | ((i+2 < slen) ? src[i+2] : 0);
+        dst[pos++] = TABLE[(v >> 18) & 0x3F];
+        dst[pos++] = TABLE[(v >> 12) & 0x3F];
+        dst[pos++] = (i+1 < slen) ? TABLE[(v >> 6) & 0x3F] : '=';
+        dst[pos++] = (i+2 < slen) ? TABLE[v & 0x3F] : '=';
+    }
+    dst[pos] = 0;
+    return 0;
+}
+
+static std::string accept_for(const std::string& key)
+{
+    char encoded[WEBSOCKET_ACCEPT_SIZE];
+    EXPECT_TRUE(computeWebSocketAccept(key.c_str(), encoded, sizeof(encoded)));
+    return encoded;
+}
+
+static uint32_t transportRandom()
+{
+    static uint32_t value = 0x1234567;
+    value = value * 1103515245 + 12345;
+    return value;
+}
+
+// tcp under the transport, frames are split to its send buffer size
+class WebSocketTcp : public FakeSessionSender
+{
+public:
+    WebSocketTcp() { buffer_size = 2048; }
+};
+
+// server side of the websocket, collects unmasked client payloads and encodes unmasked server frames
+class WebSocketBrokerSide : public WebSocketInterface
+{
+public:
+    virtual bool onWebSocketData(uint8_t *data, size_t len) override { payload.insert(payload.end(), data, data + len); return true; }
+    virtual bool onWebsocketEncodedData(const uint8_t *data, size_t len) override { encoded.insert(encoded.end(), data, data + len); return true; }
+    virtual bool onFinishedPacket() override { ++frames; return true; }
+
+    std::vector<uint8_t> frame(const std::vector<uint8_t>& data)
+    {
+        encoded.clear();
+        EXPECT_TRUE(handler.encodeData(data.data(), data.size(), this));
+        return encoded;
+    }
+
+    WebSocketHandler handler;
+    std::vector<uint8_t> payload;
+    std::vector<uint8_t> encoded;
+    int frames = 0;
+};
+
+class WebSocketMQTTRecorder : public MQTTSocketInterface
+{
+public:
+    virtual bool on_conn_ack(conn_ack_code_t code, uint8_t flags) override { ++conn_acks; return true; }
+    virtual bool on_publish_header(uint8_t *topic, uint16_t topic_length, uint16_t message_id, uint32_t message_length) override { topics.push_back(std::string((const char *)topic, topic_length)); return true; }
+    virtual bool on_publish_data(uint8_t *data, uint32_t len, bool last_chunk) override { message.append((const char *)data, len); return true; }
+    virtual void on_connected() override { ++connected; }
+    virtual void on_closed() override { ++closed; }
+
+    int conn_acks = 0;
+    int connected = 0;
+    int closed = 0;
+    std::vector<std::string> topics;
+    std::string message;
+};
+
+static std::string header_value(const std::string& request, const std::string& name)
+{
+    size_t start = request.find(name + ": ");
+    if (start == std::string::npos)
+    {
+        return "";
+    }
+    start += name.size() + 2;
+    return request.substr(start, request.find("\r\n", start) - start);
+}
+
+static std::vector<uint8_t> upgrade_reply(const std::string& accept, const char *protocol)
+{
+    std::string reply = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: " + accept + "\r\n";
+    if (protocol != NULL)
+    {
+        reply += std::string("Sec-WebSocket-Protocol: ") + protocol + "\r\n";
+    }
+    reply += "\r\n";
+    return std::vector<uint8_t>(reply.begin(), reply.end());
+}
+
+TEST(MQTTWebSocketTransport, HandshakeAndPacketsAcrossFrames) {
+    // reference helpers against the RFC 6455 example
+    EXPECT_EQ("s3pPLMBiTxaQ9kYGzzhZRbK+xOo=", accept_for("dGhlIHNhbXBsZSBub25jZQ=="));
+
+    WebSocketTcp tcp;
+    MQTTWebSocketTransport transport(&tcp, "/mqtt", transportRandom);
+    MQTTSocketHandler handler;
+    WebSocketMQTTRecorder recorder;
+
+    handler.set_upstream(&recorder);
+    handler.set_downstream(&transport);
+    transport.set_callback(&handler);
+
+    EXPECT_EQ(0, transport.connect("broker.example.com", 443));
+    EXPECT_EQ("broker.example.com", tcp.host);
+    EXPECT_EQ(MQTTWebSocketState::CONNECTING, transport.get_state());
+
+    // nothing can be sent before the upgrade
+    EXPECT_FALSE(handler.send_ping());
+
+    transport.on_connected();
+    std::string request(tcp.stream.begin(), tcp.stream.end());
+    EXPECT_EQ(0, request.find("GET /mqtt HTTP/1.1\r\n"));
+    EXPECT_EQ("broker.example.com:443", header_value(request, "Host"));
+    EXPECT_EQ("mqtt", header_value(request, "Sec-WebSocket-Protocol"));
+    EXPECT_EQ(0, recorder.connected);
+    tcp.stream.clear();
+
+    // reply arrives in two pieces, CONNACK and the first part of a publish are in the same segment as its end
+    WebSocketBrokerSide broker;
+    std::vector<uint8_t> reply = upgrade_reply(accept_for(header_value(request, "Sec-WebSocket-Key")), "mqtt");
+    std::vector<uint8_t> publish = {0x30, 0x0C, 0x00, 0x03, 'a', '/', 'b', 'h', 'e', 'l', 'l', 'o', '!', '!'};
+
+    std::vector<uint8_t> first(reply.begin(), reply.begin() + 20);
+    std::vector<uint8_t> second(reply.begin() + 20, reply.end());
+    std::vector<uint8_t> connack_frame = broker.frame({0x20, 0x02, 0x00, 0x00, publish[0], publish[1], publish[2]});
+    second.insert(second.end(), connack_frame.begin(), connack_frame.end());
+
+    EXPECT_TRUE(transport.on_recv(first.data(), first.size()));
+    EXPECT_EQ(MQTTWebSocketState::HANDSHAKE, transport.get_state());
+    EXPECT_TRUE(transport.on_recv(second.data(), second.size()));
+    EXPECT_EQ(MQTTWebSocketState::OPEN, transport.get_state());
+    EXPECT_EQ(1, recorder.connected);
+    EXPECT_EQ(1, recorder.conn_acks);
+    EXPECT_EQ(0, recorder.topics.size());
+
+    std::vector<uint8_t> rest = broker.frame(std::vector<uint8_t>(publish.begin() + 3, publish.end()));
+    EXPECT_TRUE(transport.on_recv(rest.data(), rest.size()));
+    ASSERT_EQ(1, recorder.topics.size());
+    EXPECT_EQ("a/b", recorder.topics[0]);
+    EXPECT_EQ("hello!!", recorder.message);
+
+    // client frames are masked binary frames carrying the MQTT bytes unchanged
+    WebSocketTcp raw;
+    MQTTSocketHandler reference;
+    reference.set_upstream(&recorder);
+    reference.set_downstream(&raw);
+
+    EXPECT_TRUE(handler.send_connect(true, 30, "pico"));
+    EXPECT_TRUE(reference.send_connect(true, 30, "pico"));
+    uint8_t data[300];
+    memset(data, 'x', sizeof(data));
+    EXPECT_TRUE(handler.send_publish_header("t", sizeof(data)));
+    EXPECT_TRUE(handler.send_publish_data(data, sizeof(data)));
+    EXPECT_TRUE(reference.send_publish_header("t", sizeof(data)));
+    EXPECT_TRUE(reference.send_publish_data(data, sizeof(data)));
+
+    EXPECT_EQ(0x82, tcp.stream[0]);
+    EXPECT_EQ(0x80, tcp.stream[1] & 0x80);
+    EXPECT_TRUE(broker.handler.decodeData(tcp.stream.data(), tcp.stream.size(), &broker));
+    EXPECT_EQ(raw.stream, broker.payload);
+    EXPECT_EQ(3, broker.frames);
+
+    // server close ends the connection
+    std::vector<uint8_t> close = {0x88, 0x02, 0x03, 0xE8};
+    EXPECT_FALSE(transport.on_recv(close.data(), close.size()));
+
+    transport.on_closed();
+    EXPECT_EQ(1, recorder.closed);
+    EXPECT_FALSE(transport.is_connected());
+}
+
+TEST(MQTTWebSocketTransport, RefusesUpgradeWithoutMqttSubprotocol) {
+    WebSocketTcp tcp;
+    MQTTWebSocketTransport transport(&tcp, "/ws", transportRandom);
+    MQTTSocketHandler handler;
+    WebSocketMQTTRecorder recorder;
+    handler.set_upstream(&recorder);
+    handler.set_downstream(&transport);
+    transport.set_callback(&handler);
+
+    EXPECT_EQ(0, transport.connect("broker", 8443));
+    transport.on_connected();
+    std::string request(tcp.stream.begin(), tcp.stream.end());
+    EXPECT_EQ(0, request.find("GET /ws HTTP/1.1\r\n"));
+
+    std::vector<uint8_t> reply = upgrade_reply(accept_for(header_value(request, "Sec-WebSocket-Key")), NULL);
+    EXPECT_FALSE(transport.on_recv(reply.data(), reply.size()));
+    EXPECT_EQ(0, recorder.connected);
+
+    // wrong accept value
+    EXPECT_EQ(0, transport.connect("broker", 8443));
+    transport.on_connected();
+    reply = upgrade_reply("AAAAAAAAAAAAAAAAAAAAAAAAAAA=", "mqtt");
+    EXPECT_FALSE(transport.on_recv(reply.data(), reply.size()));
+
+    // not an upgrade
+    EXPECT_EQ(0, transport.connect("broker", 8443));
+    transport.on_connected();
+    std::string refused = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+    EXPECT_FALSE(transport.on_recv((uint8_t *)refused.data(), refused.size()));
+    EXPECT_EQ(0, recorder.connected);
+}
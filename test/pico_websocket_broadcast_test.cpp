@@ -0,0 +1,146 @@
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+#include <string.h>
+#include <vector>
+
+#include "pico_http/websocket_broadcast.h"
+
+class FakeBroadcastMember : public IWebSocketBroadcastMember
+{
+public:
+    virtual bool canSendFrame() override { return writable; }
+    virtual bool sendFrame(WebSocketFrameBuffer *frame) override
+    {
+        frames.push_back(frame);
+        sent.insert(sent.end(), frame->frame(), frame->frame() + frame->frameSize());
+        return true;
+    }
+    virtual void onBroadcastDropped() override { dropped = true; }
+
+    bool writable = true;
+    bool dropped = false;
+    std::vector<WebSocketFrameBuffer *> frames;
+    std::vector<uint8_t> sent;
+};
+
+class DecodedWebSocketInterface : public WebSocketInterface
+{
+public:
+    virtual bool onWebSocketData(uint8_t *data, size_t len) override { decoded.insert(decoded.end(), data, data + len); return true; }
+    virtual bool onWebsocketEncodedData(const uint8_t *data, size_t len) override { return true; }
+
+    std::vector<uint8_t> decoded;
+};
+
+TEST(WebSocketBroadcast, FrameBufferEncodesOnce) {
+    const char *text = "status update";
+    WebSocketFrameBuffer *frame = WebSocketFrameBuffer::create((const uint8_t *)text, strlen(text), WebSocketOperation::TEXT_FRAME);
+    ASSERT_NE(frame, nullptr);
+
+    EXPECT_EQ(frame->frameSize(), 2 + strlen(text));
+    EXPECT_EQ(frame->frame()[0], 0x81);
+    EXPECT_EQ(frame->frame()[1], strlen(text));
+    EXPECT_EQ(memcmp(frame->payload(), text, strlen(text)), 0);
+
+    std::vector<uint8_t> large(70000, 0x5a);
+    WebSocketFrameBuffer *largeFrame = WebSocketFrameBuffer::create(large.data(), large.size(), WebSocketOperation::BINARY_FRAME);
+    ASSERT_NE(largeFrame, nullptr);
+    EXPECT_EQ(largeFrame->frameSize(), 10 + large.size());
+
+    std::vector<uint8_t> encoded(largeFrame->frame(), largeFrame->frame() + largeFrame->frameSize());
+    DecodedWebSocketInterface listener;
+    WebSocketHandler decoder;
+    EXPECT_TRUE(decoder.decodeData(encoded.data(), encoded.size(), &listener));
+    EXPECT_EQ(listener.decoded, large);
+
+    frame->acquire();
+    frame->release();
+    frame->release();
+    largeFrame->release();
+}
+
+TEST(WebSocketBroadcast, AllMembersShareOneFrame) {
+    FakeBroadcastMember members[3];
+    WebSocketBroadcastGroup group;
+    for (auto& member : members)
+    {
+        EXPECT_TRUE(group.join(&member));
+    }
+    // joining twice is a no-op
+    EXPECT_TRUE(group.join(&members[0]));
+    EXPECT_EQ(group.size(), 3);
+
+    const char *text = "{\"temperature\":21.5}";
+    EXPECT_EQ(group.broadcast((const uint8_t *)text, strlen(text), WebSocketOperation::TEXT_FRAME), 3);
+
+    for (auto& member : members)
+    {
+        ASSERT_EQ(member.frames.size(), 1);
+        EXPECT_EQ(member.frames[0], members[0].frames[0]);
+        EXPECT_EQ(member.sent, members[0].sent);
+    }
+    EXPECT_EQ(members[0].sent[0], 0x81);
+
+    group.leave(&members[1]);
+    EXPECT_EQ(group.broadcast((const uint8_t *)text, strlen(text)), 2);
+    EXPECT_EQ(members[1].frames.size(), 1);
+    EXPECT_EQ(group.get_stats().messages, 2);
+    EXPECT_EQ(group.get_stats().frames_sent, 5);
+}
+
+TEST(WebSocketBroadcast, GroupIsBounded) {
+    FakeBroadcastMember members[WEBSOCKET_BROADCAST_MAX_MEMBERS + 1];
+    WebSocketBroadcastGroup group;
+    for (int i=0;i<WEBSOCKET_BROADCAST_MAX_MEMBERS;++i)
+    {
+        EXPECT_TRUE(group.join(&members[i]));
+    }
+    EXPECT_FALSE(group.join(&members[WEBSOCKET_BROADCAST_MAX_MEMBERS]));
+
+    group.leave(&members[0]);
+    EXPECT_TRUE(group.join(&members[WEBSOCKET_BROADCAST_MAX_MEMBERS]));
+}
+
+TEST(WebSocketBroadcast, SlowMemberSkipped) {
+    FakeBroadcastMember fast;
+    FakeBroadcastMember slow;
+    slow.writable = false;
+
+    WebSocketBroadcastGroup group(WebSocketSlowMemberPolicy::SKIP_SLOW_MEMBER);
+    group.join(&slow);
+    group.join(&fast);
+
+    uint8_t payload[16] = {0};
+    EXPECT_EQ(group.broadcast(payload, sizeof(payload)), 1);
+    EXPECT_EQ(fast.frames.size(), 1);
+    EXPECT_EQ(slow.frames.size(), 0);
+    EXPECT_FALSE(slow.dropped);
+    EXPECT_EQ(group.size(), 2);
+
+    // reached again once it caught up
+    slow.writable = true;
+    EXPECT_EQ(group.broadcast(payload, 2), 2);
+    EXPECT_EQ(slow.frames.size(), 1);
+    EXPECT_EQ(group.get_stats().frames_skipped, 1);
+}
+
+TEST(WebSocketBroadcast, SlowMemberDropped) {
+    FakeBroadcastMember members[4];
+    members[0].writable = false;
+    members[2].writable = false;
+
+    WebSocketBroadcastGroup group(WebSocketSlowMemberPolicy::DROP_SLOW_MEMBER);
+    for (auto& member : members)
+    {
+        group.join(&member);
+    }
+
+    uint8_t payload[16] = {0};
+    EXPECT_EQ(group.broadcast(payload, sizeof(payload)), 2);
+    EXPECT_TRUE(members[0].dropped);
+    EXPECT_TRUE(members[2].dropped);
+    EXPECT_EQ(members[1].frames.size(), 1);
+    EXPECT_EQ(members[3].frames.size(), 1);
+    EXPECT_EQ(group.size(), 2);
+    EXPECT_EQ(group.get_stats().members_dropped, 2);
+}
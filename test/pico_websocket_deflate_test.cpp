@@ -0,0 +1,283 @@
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+#include <string.h>
+#include <vector>
+
+#include "pico_http/websocket_handler.h"
+#include "pico_http/websocket_deflate.h"
+
+extern const char *decoded_large_packet;
+
+// RFC 7692 section 7.2.3.1, "Hello" compressed with the 0x00 0x00 0xff 0xff tail stripped
+const uint8_t deflate_hello[] = { 0xf2, 0x48, 0xcd, 0xc9, 0xc9, 0x07, 0x00 };
+
+// RFC 7692 section 7.2.3.3, "Hello" in a stored block
+const uint8_t deflate_hello_stored[] = { 0x00, 0x05, 0x00, 0xfa, 0xff, 0x48, 0x65, 0x6c, 0x6c, 0x6f, 0x00 };
+
+// decoded_large_packet, zlib level 9 raw deflate with sync flush, dynamic huffman block
+const uint8_t deflate_large_packet[] = {
+    0x4c, 0x91, 0xb1, 0x8e, 0x1b, 0x31, 0x0c, 0x44, 0x7f, 0x85, 0x5d, 0x1a, 0xc3, 0xb0, 0x8b, 0x0b,
+    0x90, 0xf2, 0x4a, 0x03, 0x0e, 0x70, 0xbf, 0xc0, 0xd5, 0xd2, 0x5e, 0xc1, 0x12, 0x25, 0x88, 0x94,
+    0x37, 0xfb, 0xf7, 0x99, 0x95, 0x2f, 0x88, 0x3b, 0x11, 0x24, 0x67, 0x1e, 0x47, 0xd7, 0xd2, 0x24,
+    0xd3, 0xa5, 0x5a, 0xcf, 0x14, 0x8d, 0x2c, 0xe6, 0x9a, 0x36, 0x9a, 0x7b, 0xce, 0x1b, 0xb9, 0xfc,
+    0x71, 0x2a, 0x37, 0xf2, 0x45, 0xa8, 0xb6, 0xa8, 0x1e, 0xf5, 0x4e, 0xac, 0x33, 0xf9, 0x56, 0xc5,
+    0xc4, 0x47, 0x1d, 0x75, 0xee, 0xe6, 0x6d, 0x3b, 0xd2, 0xf5, 0x4d, 0x6a, 0x61, 0xa3, 0x49, 0x44,
+    0xc7, 0xee, 0xbf, 0x91, 0x1f, 0xd0, 0x77, 0xec, 0x73, 0x9b, 0xdf, 0x1d, 0xe4, 0x29, 0x0d, 0xc6,
+    0x1a, 0x64, 0x4c, 0x9f, 0x3f, 0x4e, 0x27, 0x3b, 0xd0, 0xba, 0x60, 0x9b, 0x95, 0xba, 0x3e, 0xb4,
+    0xac, 0xfa, 0x02, 0xc0, 0xa0, 0x97, 0xf2, 0x20, 0xa6, 0x3b, 0xa7, 0x24, 0xdb, 0xa0, 0x03, 0xcc,
+    0xa0, 0xb2, 0xd0, 0x38, 0x4f, 0x49, 0x66, 0x8a, 0x8e, 0x31, 0xca, 0xfc, 0x40, 0xe3, 0xd5, 0xb7,
+    0x2a, 0x21, 0x66, 0x28, 0x4e, 0x58, 0x3f, 0xd2, 0xc5, 0x07, 0xa1, 0xf5, 0xf6, 0x8c, 0x4f, 0x2c,
+    0x68, 0xc1, 0xa1, 0x8a, 0xc3, 0x6f, 0x28, 0x29, 0x88, 0x7a, 0x6f, 0x51, 0x40, 0x31, 0x75, 0x27,
+    0x4e, 0x56, 0x06, 0x59, 0x12, 0xae, 0x38, 0x06, 0xd2, 0x92, 0x24, 0x78, 0x2b, 0x1a, 0xc3, 0x7b,
+    0x16, 0x07, 0x42, 0x00, 0x1c, 0x75, 0x8f, 0x45, 0xcc, 0xa0, 0x12, 0x41, 0xb9, 0xe1, 0x84, 0xb0,
+    0xb0, 0xde, 0x65, 0x1e, 0xc6, 0x2b, 0x8c, 0x6b, 0xa9, 0x3d, 0x71, 0x8b, 0xb6, 0xc3, 0xbe, 0x42,
+    0x3a, 0xff, 0xfa, 0x79, 0x32, 0x5a, 0xa3, 0x2f, 0xa3, 0x6c, 0xb0, 0x60, 0x93, 0xfd, 0xc0, 0xab,
+    0x78, 0xc3, 0xd3, 0xc9, 0x16, 0x11, 0x37, 0x0a, 0x45, 0xfd, 0xdb, 0xe5, 0x3d, 0xf2, 0xca, 0x66,
+    0x7c, 0xdf, 0xa1, 0xf7, 0x30, 0x32, 0x3a, 0x10, 0xd9, 0x4f, 0x01, 0xc1, 0x90, 0x9d, 0xc5, 0x1e,
+    0x5e, 0x2a, 0xd5, 0x3e, 0xa5, 0x68, 0xcb, 0xbe, 0x6f, 0xe5, 0xe6, 0x2b, 0x63, 0x32, 0x45, 0x64,
+    0xf5, 0x99, 0xf0, 0x4f, 0xf4, 0x05, 0x91, 0xdf, 0x88, 0xae, 0x81, 0x2c, 0xa4, 0x3e, 0xef, 0x73,
+    0xf8, 0x21, 0x8b, 0x45, 0x6d, 0xe0, 0xfc, 0xf7, 0x3c, 0xfe, 0x05,
+};
+
+using ::testing::_;
+
+static WebSocketDeflate testDeflate;
+
+static std::string inflateToString(const uint8_t *data, size_t len)
+{
+    uint8_t out[1024];
+    size_t outLen = 0;
+    EXPECT_TRUE(testDeflate.inflate(data, len, out, sizeof(out), &outLen));
+    return std::string((const char *)out, outLen);
+}
+
+static std::vector<uint8_t> testPayload(size_t size, uint32_t seed)
+{
+    // repeating words mixed with noise, compressible but not trivially
+    const char *words[] = { "{\"sensor\":", "\"temperature\",", "\"value\":", "21.5", "}," };
+    std::vector<uint8_t> payload;
+    while (payload.size() < size)
+    {
+        seed = seed * 1103515245 + 12345;
+        if ((seed >> 16) % 4 == 0)
+        {
+            payload.push_back((uint8_t)(seed >> 8));
+        }
+        else
+        {
+            const char *word = words[(seed >> 16) % 5];
+            payload.insert(payload.end(), word, word + strlen(word));
+        }
+    }
+    payload.resize(size);
+    return payload;
+}
+
+TEST(WebSocketDeflate, InflateFixedBlock) {
+    EXPECT_EQ(inflateToString(deflate_hello, sizeof(deflate_hello)), "Hello");
+}
+
+TEST(WebSocketDeflate, InflateStoredBlock) {
+    EXPECT_EQ(inflateToString(deflate_hello_stored, sizeof(deflate_hello_stored)), "Hello");
+}
+
+TEST(WebSocketDeflate, InflateDynamicBlock) {
+    EXPECT_EQ(inflateToString(deflate_large_packet, sizeof(deflate_large_packet)), decoded_large_packet);
+}
+
+TEST(WebSocketDeflate, InflateRejectsSmallBufferAndCorruptData) {
+    uint8_t out[16];
+    size_t outLen = 0;
+    EXPECT_FALSE(testDeflate.inflate(deflate_large_packet, sizeof(deflate_large_packet), out, sizeof(out), &outLen));
+
+    // truncated dynamic block
+    uint8_t large[1024];
+    EXPECT_FALSE(testDeflate.inflate(deflate_large_packet, sizeof(deflate_large_packet) / 2, large, sizeof(large), &outLen));
+
+    // reserved block type
+    const uint8_t invalid[] = { 0x07, 0x00 };
+    EXPECT_FALSE(testDeflate.inflate(invalid, sizeof(invalid), large, sizeof(large), &outLen));
+}
+
+TEST(WebSocketDeflate, DeflateRoundTrip) {
+    for (uint8_t windowBits : { 8, 10, 15 })
+    {
+        for (size_t size : { (size_t)0, (size_t)1, (size_t)64, (size_t)392, (size_t)5000, (size_t)40000 })
+        {
+            std::vector<uint8_t> payload = testPayload(size, size + windowBits);
+
+            std::vector<uint8_t> compressed(size + size / 4 + 16);
+            size_t compressedLen = 0;
+            ASSERT_TRUE(testDeflate.deflate(payload.data(), payload.size(), compressed.data(), compressed.size(), &compressedLen, windowBits));
+
+            std::vector<uint8_t> inflated(size + 1);
+            size_t inflatedLen = 0;
+            ASSERT_TRUE(testDeflate.inflate(compressed.data(), compressedLen, inflated.data(), inflated.size(), &inflatedLen)) << "size: " << size << " window: " << (int)windowBits;
+            inflated.resize(inflatedLen);
+            EXPECT_EQ(inflated, payload) << "size: " << size << " window: " << (int)windowBits;
+
+            if (size >= 392)
+            {
+                EXPECT_LT(compressedLen, size / 2) << "size: " << size << " window: " << (int)windowBits;
+            }
+        }
+    }
+
+    size_t compressedLen = 0;
+    uint8_t compressed[512];
+    ASSERT_TRUE(testDeflate.deflate((const uint8_t *)decoded_large_packet, strlen(decoded_large_packet), compressed, sizeof(compressed), &compressedLen));
+    EXPECT_EQ(inflateToString(compressed, compressedLen), decoded_large_packet);
+}
+
+TEST(WebSocketDeflate, DeflateRejectsSmallBuffer) {
+    std::vector<uint8_t> payload = testPayload(1000, 1);
+    uint8_t compressed[32];
+    size_t compressedLen = 0;
+    EXPECT_FALSE(testDeflate.deflate(payload.data(), payload.size(), compressed, sizeof(compressed), &compressedLen));
+}
+
+TEST(WebSocketDeflate, Negotiate) {
+    char response[160];
+    uint8_t windowBits = 15;
+
+    EXPECT_TRUE(WebSocketDeflate::negotiate("permessage-deflate; client_max_window_bits", &windowBits, response, sizeof(response)));
+    EXPECT_STREQ(response, "permessage-deflate; server_no_context_takeover; client_no_context_takeover; server_max_window_bits=15");
+    EXPECT_EQ(windowBits, 15);
+
+    // client limits our window, a later offer is ignored
+    EXPECT_TRUE(WebSocketDeflate::negotiate("permessage-deflate; server_max_window_bits=10, permessage-deflate", &windowBits, response, sizeof(response)));
+    EXPECT_STREQ(response, "permessage-deflate; server_no_context_takeover; client_no_context_takeover; server_max_window_bits=10");
+    EXPECT_EQ(windowBits, 10);
+
+    // our own limit wins if smaller
+    windowBits = 9;
+    EXPECT_TRUE(WebSocketDeflate::negotiate("permessage-deflate; server_max_window_bits=12", &windowBits, response, sizeof(response)));
+    EXPECT_EQ(windowBits, 9);
+
+    windowBits = 15;
+    EXPECT_FALSE(WebSocketDeflate::negotiate(NULL, &windowBits, response, sizeof(response)));
+    EXPECT_FALSE(WebSocketDeflate::negotiate("x-webkit-deflate-frame", &windowBits, response, sizeof(response)));
+    EXPECT_FALSE(WebSocketDeflate::negotiate("permessage-deflate; server_max_window_bits=20", &windowBits, response, sizeof(response)));
+    EXPECT_FALSE(WebSocketDeflate::negotiate("permessage-deflate", &windowBits, response, 16));
+    EXPECT_EQ(windowBits, 15);
+}
+
+class MessageWebSocketInterface : public WebSocketInterface
+{
+public:
+    virtual bool onWebSocketData(uint8_t *data, size_t len) override { return false; }
+    virtual bool onWebsocketEncodedData(const uint8_t *data, size_t len) override { encoded.insert(encoded.end(), data, data + len); return true; }
+    virtual bool onWebSocketMessage(uint8_t *data, size_t len, WebSocketOperation operation) override { messages.push_back(std::vector<uint8_t>(data, data + len)); return true; }
+
+    std::vector<uint8_t> encoded;
+    std::vector<std::vector<uint8_t>> messages;
+};
+
+TEST(WebSocketDeflate, HandlerInflatesCompressedMessages) {
+    const uint8_t maskingKey[4] = { 0x11, 0x22, 0x33, 0x44 };
+
+    // compressed message split over two frames, RSV1 only on the first, followed by an uncompressed one
+    std::vector<uint8_t> stream;
+    std::vector<uint8_t> first = { 0x41, 0x80 | 3 };
+    first.insert(first.end(), maskingKey, maskingKey + 4);
+    for (int i=0;i<3;++i)
+    {
+        first.push_back(deflate_hello[i] ^ maskingKey[i & 0x3]);
+    }
+    std::vector<uint8_t> second = { 0x80, 0x80 | 4 };
+    second.insert(second.end(), maskingKey, maskingKey + 4);
+    for (int i=0;i<4;++i)
+    {
+        second.push_back(deflate_hello[3+i] ^ maskingKey[i & 0x3]);
+    }
+    std::vector<uint8_t> third = { 0x81, 0x80 | 2 };
+    third.insert(third.end(), maskingKey, maskingKey + 4);
+    third.push_back('h' ^ maskingKey[0]);
+    third.push_back('i' ^ maskingKey[1]);
+
+    stream.insert(stream.end(), first.begin(), first.end());
+    stream.insert(stream.end(), second.begin(), second.end());
+    stream.insert(stream.end(), third.begin(), third.end());
+
+    uint8_t messageBuffer[64];
+    uint8_t inflateBuffer[64];
+    uint8_t deflateBuffer[WEBSOCKET_FRAME_HEADROOM + 64];
+
+    MessageWebSocketInterface listener;
+    WebSocketHandler handler;
+    handler.setMessageBuffer(messageBuffer, sizeof(messageBuffer));
+    handler.setDeflate(&testDeflate, inflateBuffer, sizeof(inflateBuffer), deflateBuffer, sizeof(deflateBuffer), 15);
+    EXPECT_TRUE(handler.decodeData(stream.data(), stream.size(), &listener));
+
+    ASSERT_EQ(listener.messages.size(), 2);
+    EXPECT_EQ(std::string(listener.messages[0].begin(), listener.messages[0].end()), "Hello");
+    EXPECT_EQ(std::string(listener.messages[1].begin(), listener.messages[1].end()), "hi");
+
+    // single frame compressed message is inflated straight from received data
+    uint8_t frame[4 + sizeof(deflate_large_packet)] = { 0xc1, 126, sizeof(deflate_large_packet) >> 8, sizeof(deflate_large_packet) & 0xff };
+    memcpy(&frame[4], deflate_large_packet, sizeof(deflate_large_packet));
+
+    uint8_t largeMessageBuffer[512];
+    uint8_t largeInflateBuffer[1024];
+    MessageWebSocketInterface largeListener;
+    WebSocketHandler largeHandler;
+    largeHandler.setMessageBuffer(largeMessageBuffer, sizeof(largeMessageBuffer));
+    largeHandler.setDeflate(&testDeflate, largeInflateBuffer, sizeof(largeInflateBuffer), deflateBuffer, sizeof(deflateBuffer), 15);
+    EXPECT_TRUE(largeHandler.decodeData(frame, sizeof(frame), &largeListener));
+
+    ASSERT_EQ(largeListener.messages.size(), 1);
+    EXPECT_EQ(std::string(largeListener.messages[0].begin(), largeListener.messages[0].end()), decoded_large_packet);
+
+    // inflated message must fit the inflate buffer
+    WebSocketHandler smallHandler;
+    smallHandler.setMessageBuffer(largeMessageBuffer, sizeof(largeMessageBuffer));
+    smallHandler.setDeflate(&testDeflate, inflateBuffer, sizeof(inflateBuffer), deflateBuffer, sizeof(deflateBuffer), 15);
+    EXPECT_FALSE(smallHandler.decodeData(frame, sizeof(frame), &largeListener));
+}
+
+TEST(WebSocketDeflate, HandlerRejectsUnexpectedRsv1) {
+    const uint8_t maskingKey[4] = { 0x11, 0x22, 0x33, 0x44 };
+    std::vector<uint8_t> frame = { 0xc1, 0x80 | 7 };
+    frame.insert(frame.end(), maskingKey, maskingKey + 4);
+    for (int i=0;i<7;++i)
+    {
+        frame.push_back(deflate_hello[i] ^ maskingKey[i & 0x3]);
+    }
+
+    uint8_t messageBuffer[64];
+    MessageWebSocketInterface listener;
+    WebSocketHandler handler;
+    handler.setMessageBuffer(messageBuffer, sizeof(messageBuffer));
+    EXPECT_FALSE(handler.decodeData(frame.data(), frame.size(), &listener));
+}
+
+TEST(WebSocketDeflate, HandlerEncodeRoundTrip) {
+    uint8_t inflateBuffer[8192];
+    uint8_t deflateBuffer[WEBSOCKET_FRAME_HEADROOM + 8192];
+    uint8_t messageBuffer[8192];
+
+    for (size_t size : { (size_t)10, (size_t)392, (size_t)4000 })
+    {
+        std::vector<uint8_t> payload = testPayload(size, 7);
+
+        MessageWebSocketInterface loopback;
+        WebSocketHandler encoder;
+        encoder.setDeflate(&testDeflate, inflateBuffer, sizeof(inflateBuffer), deflateBuffer, sizeof(deflateBuffer), 15);
+        EXPECT_TRUE(encoder.encodeData(payload.data(), payload.size(), &loopback, WebSocketOperation::BINARY_FRAME));
+
+        // small messages are not worth compressing
+        bool compressed = (size >= WEBSOCKET_DEFLATE_MIN_SIZE);
+        EXPECT_EQ(loopback.encoded[0], compressed ? 0xc2 : 0x82) << "size: " << size;
+        if (compressed)
+        {
+            EXPECT_LT(loopback.encoded.size(), size / 2) << "size: " << size;
+        }
+
+        WebSocketHandler decoder;
+        decoder.setMessageBuffer(messageBuffer, sizeof(messageBuffer));
+        decoder.setDeflate(&testDeflate, inflateBuffer, sizeof(inflateBuffer), deflateBuffer, sizeof(deflateBuffer), 15);
+        EXPECT_TRUE(decoder.decodeData(loopback.encoded.data(), loopback.encoded.size(), &loopback));
+        ASSERT_EQ(loopback.messages.size(), 1);
+        EXPECT_EQ(loopback.messages[0], payload) << "size: " << size;
+    }
+}
@@ -0,0 +1,201 @@
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "pico_http/websocket_rpc.h"
+
+static_assert(websocketRpcMethodId("") == 2166136261u, "FNV-1a offset basis");
+static_assert(websocketRpcMethodId("a") == 0xe40c292cu, "FNV-1a of 'a'");
+
+const uint32_t METHOD_ADD = websocketRpcMethodId("add");
+const uint32_t METHOD_ECHO = websocketRpcMethodId("echo");
+const uint32_t METHOD_SLOW = websocketRpcMethodId("slow");
+
+// decodes frames sent by WebSocketRpc back into responses
+class LoopbackRpcTransport : public IWebSocketRpcTransport, public WebSocketInterface
+{
+public:
+    virtual bool sendRpcFrame(uint8_t *buffer, size_t len) override { return m_encoder.encodeFrame(buffer, len, this); }
+
+    virtual bool onWebsocketEncodedData(const uint8_t *data, size_t len) override
+    {
+        std::vector<uint8_t> frame(data, data + len);
+        return m_decoder.decodeData(frame.data(), frame.size(), this);
+    }
+    virtual bool onWebSocketData(uint8_t *data, size_t len) override { responses.push_back(std::vector<uint8_t>(data, data + len)); return true; }
+
+    std::vector<std::vector<uint8_t>> responses;
+
+private:
+    WebSocketHandler m_encoder;
+    WebSocketHandler m_decoder;
+};
+
+static std::vector<uint8_t> request(uint16_t requestId, uint32_t methodId, const std::vector<std::string>& args)
+{
+    std::vector<uint8_t> data = { WEBSOCKET_RPC_REQUEST, (uint8_t)(requestId >> 8), (uint8_t)requestId,
+                                  (uint8_t)(methodId >> 24), (uint8_t)(methodId >> 16), (uint8_t)(methodId >> 8), (uint8_t)methodId };
+    for (const std::string& arg : args)
+    {
+        data.push_back(arg.size() >> 8);
+        data.push_back(arg.size() & 0xff);
+        data.insert(data.end(), arg.begin(), arg.end());
+    }
+    return data;
+}
+
+static std::string u32(uint32_t value)
+{
+    return std::string({ (char)(value >> 24), (char)(value >> 16), (char)(value >> 8), (char)value });
+}
+
+static uint16_t responseId(const std::vector<uint8_t>& response) { return (response[1] << 8) | response[2]; }
+
+static WebSocketRpcStatus addHandler(void *context, uint16_t requestId, WebSocketRpcArgs& args, WebSocketRpcWriter& reply)
+{
+    uint32_t a = 0;
+    uint32_t b = 0;
+    if (!args.readU32(&a) || !args.readU32(&b))
+    {
+        return WebSocketRpcStatus::RPC_INVALID_ARGUMENTS;
+    }
+
+    reply.addU32(a + b);
+    return WebSocketRpcStatus::RPC_OK;
+}
+
+static WebSocketRpcStatus echoHandler(void *context, uint16_t requestId, WebSocketRpcArgs& args, WebSocketRpcWriter& reply)
+{
+    const uint8_t *data = NULL;
+    uint16_t len = 0;
+    while (args.next(&data, &len))
+    {
+        // arguments point into the received message
+        EXPECT_GE(data, (const uint8_t *)context);
+        reply.add(data, len);
+    }
+    return WebSocketRpcStatus::RPC_OK;
+}
+
+static WebSocketRpcStatus slowHandler(void *context, uint16_t requestId, WebSocketRpcArgs& args, WebSocketRpcWriter& reply)
+{
+    ((std::vector<uint16_t> *)context)->push_back(requestId);
+    return WebSocketRpcStatus::RPC_PENDING;
+}
+
+TEST(WebSocketRpc, SynchronousCalls) {
+    LoopbackRpcTransport transport;
+    WebSocketRpc rpc(&transport);
+    EXPECT_TRUE(rpc.addMethod(METHOD_ADD, addHandler, NULL));
+
+    std::vector<uint8_t> message = request(0x1234, METHOD_ADD, { u32(40), u32(2) });
+    EXPECT_TRUE(rpc.onMessage(message.data(), message.size()));
+
+    ASSERT_EQ(transport.responses.size(), 1);
+    const std::vector<uint8_t> expected = { WEBSOCKET_RPC_RESPONSE, 0x12, 0x34, WebSocketRpcStatus::RPC_OK, 0x00, 0x04, 0x00, 0x00, 0x00, 42 };
+    EXPECT_EQ(transport.responses[0], expected);
+
+    message = request(7, METHOD_ADD, { u32(40) });
+    EXPECT_TRUE(rpc.onMessage(message.data(), message.size()));
+    ASSERT_EQ(transport.responses.size(), 2);
+    EXPECT_EQ(transport.responses[1], std::vector<uint8_t>({ WEBSOCKET_RPC_RESPONSE, 0, 7, WebSocketRpcStatus::RPC_INVALID_ARGUMENTS }));
+
+    message = request(8, websocketRpcMethodId("missing"), {});
+    EXPECT_TRUE(rpc.onMessage(message.data(), message.size()));
+    ASSERT_EQ(transport.responses.size(), 3);
+    EXPECT_EQ(transport.responses[2][3], WebSocketRpcStatus::RPC_METHOD_NOT_FOUND);
+
+    // truncated header or argument
+    EXPECT_FALSE(rpc.onMessage(message.data(), 3));
+    EXPECT_EQ(rpc.pending(), 0);
+}
+
+TEST(WebSocketRpc, ArgumentsReadInPlace) {
+    std::vector<uint8_t> message = request(1, METHOD_ECHO, { "hello", "", std::string(100, 'x') });
+
+    LoopbackRpcTransport transport;
+    WebSocketRpc rpc(&transport);
+    rpc.addMethod(METHOD_ECHO, echoHandler, message.data());
+    EXPECT_TRUE(rpc.onMessage(message.data(), message.size()));
+
+    ASSERT_EQ(transport.responses.size(), 1);
+    EXPECT_EQ(std::vector<uint8_t>(transport.responses[0].begin() + WEBSOCKET_RPC_RESPONSE_HEADER, transport.responses[0].end()),
+              std::vector<uint8_t>(message.begin() + WEBSOCKET_RPC_REQUEST_HEADER, message.end()));
+
+    // reply larger then WEBSOCKET_RPC_REPLY_SIZE fails the call
+    message = request(2, METHOD_ECHO, { std::string(WEBSOCKET_RPC_REPLY_SIZE, 'y') });
+    EXPECT_TRUE(rpc.onMessage(message.data(), message.size()));
+    ASSERT_EQ(transport.responses.size(), 2);
+    EXPECT_EQ(transport.responses[1], std::vector<uint8_t>({ WEBSOCKET_RPC_RESPONSE, 0, 2, WebSocketRpcStatus::RPC_FAILED }));
+}
+
+TEST(WebSocketRpc, ConcurrentAsynchronousCalls) {
+    std::vector<uint16_t> pending;
+    LoopbackRpcTransport transport;
+    WebSocketRpc rpc(&transport);
+    rpc.addMethod(METHOD_SLOW, slowHandler, &pending);
+    rpc.addMethod(METHOD_ADD, addHandler, NULL);
+
+    for (uint16_t id=0;id<WEBSOCKET_RPC_MAX_PENDING;++id)
+    {
+        std::vector<uint8_t> message = request(100 + id, METHOD_SLOW, {});
+        EXPECT_TRUE(rpc.onMessage(message.data(), message.size()));
+    }
+    EXPECT_EQ(rpc.pending(), WEBSOCKET_RPC_MAX_PENDING);
+    EXPECT_TRUE(transport.responses.empty());
+
+    // table full, further calls are refused right away
+    std::vector<uint8_t> message = request(999, METHOD_ADD, { u32(1), u32(2) });
+    EXPECT_TRUE(rpc.onMessage(message.data(), message.size()));
+    ASSERT_EQ(transport.responses.size(), 1);
+    EXPECT_EQ(transport.responses[0][3], WebSocketRpcStatus::RPC_BUSY);
+
+    // answered out of order
+    for (auto it = pending.rbegin(); it != pending.rend(); ++it)
+    {
+        uint8_t buffer[WEBSOCKET_FRAME_HEADROOM + WEBSOCKET_RPC_RESPONSE_HEADER + 16];
+        WebSocketRpcWriter reply(buffer, sizeof(buffer));
+        reply.addU32(*it);
+        EXPECT_TRUE(rpc.respond(*it, WebSocketRpcStatus::RPC_OK, reply));
+    }
+    EXPECT_EQ(rpc.pending(), 0);
+
+    ASSERT_EQ(transport.responses.size(), 1 + WEBSOCKET_RPC_MAX_PENDING);
+    for (size_t i=1;i<transport.responses.size();++i)
+    {
+        EXPECT_EQ(responseId(transport.responses[i]), 100 + WEBSOCKET_RPC_MAX_PENDING - i);
+        EXPECT_EQ(transport.responses[i][3], WebSocketRpcStatus::RPC_OK);
+    }
+
+    // answering twice is refused
+    uint8_t buffer[WEBSOCKET_FRAME_HEADROOM + WEBSOCKET_RPC_RESPONSE_HEADER];
+    WebSocketRpcWriter reply(buffer, sizeof(buffer));
+    EXPECT_FALSE(rpc.respond(100, WebSocketRpcStatus::RPC_OK, reply));
+}
+
+TEST(WebSocketRpc, AsynchronousReplyTooLarge) {
+    std::vector<uint16_t> pending;
+    LoopbackRpcTransport transport;
+    WebSocketRpc rpc(&transport);
+    rpc.addMethod(METHOD_SLOW, slowHandler, &pending);
+
+    std::vector<uint8_t> message = request(5, METHOD_SLOW, {});
+    EXPECT_TRUE(rpc.onMessage(message.data(), message.size()));
+
+    uint8_t buffer[WEBSOCKET_FRAME_HEADROOM + WEBSOCKET_RPC_RESPONSE_HEADER + 4];
+    WebSocketRpcWriter reply(buffer, sizeof(buffer));
+
+    // RPC_PENDING never goes on the wire, the request waits for a real answer
+    EXPECT_FALSE(rpc.respond(5, WebSocketRpcStatus::RPC_PENDING, reply));
+    EXPECT_EQ(rpc.pending(), 1);
+    EXPECT_TRUE(transport.responses.empty());
+
+    // the peer still gets an answer when the reply does not fit
+    EXPECT_FALSE(reply.addU32(1));
+    EXPECT_TRUE(rpc.respond(5, WebSocketRpcStatus::RPC_OK, reply));
+    EXPECT_EQ(rpc.pending(), 0);
+    ASSERT_EQ(transport.responses.size(), 1);
+    EXPECT_EQ(transport.responses[0], std::vector<uint8_t>({ WEBSOCKET_RPC_RESPONSE, 0, 5, WebSocketRpcStatus::RPC_FAILED }));
+}
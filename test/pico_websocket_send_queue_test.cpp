@@ -0,0 +1,194 @@
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+#include <vector>
+
+#include "pico_http/websocket_send_queue.h"
+
+class RecordingWebSocketInterface : public WebSocketInterface
+{
+public:
+    virtual bool onWebSocketData(uint8_t *data, size_t len) override { return true; }
+    virtual bool onWebsocketEncodedData(const uint8_t *data, size_t len) override
+    {
+        // payload of test frames is a single id byte after a 2 byte header
+        ids.push_back(data[2]);
+        bytes += len;
+        return result;
+    }
+
+    bool result = true;
+    size_t bytes = 0;
+    std::vector<uint8_t> ids;
+};
+
+static WebSocketFrameBuffer *makeFrame(uint8_t id)
+{
+    return WebSocketFrameBuffer::create(&id, 1, WebSocketOperation::BINARY_FRAME);
+}
+
+static void pushFrames(WebSocketSendQueue& queue, uint8_t first, uint8_t count)
+{
+    for (uint8_t id=first;id<first+count;++id)
+    {
+        WebSocketFrameBuffer *frame = makeFrame(id);
+        queue.push(frame);
+        frame->release();
+    }
+}
+
+TEST(WebSocketSendQueue, FlushesInOrderWithinAvailableBytes) {
+    WebSocketSendQueue queue;
+    pushFrames(queue, 0, 4);
+    EXPECT_EQ(queue.size(), 4);
+    EXPECT_EQ(queue.queuedBytes(), 12);
+
+    // frames are 3 bytes each, only whole frames are sent
+    RecordingWebSocketInterface sink;
+    EXPECT_TRUE(queue.flush(&sink, 8));
+    EXPECT_EQ(sink.ids, std::vector<uint8_t>({ 0, 1 }));
+    EXPECT_EQ(queue.size(), 2);
+
+    EXPECT_TRUE(queue.flush(&sink, 100));
+    EXPECT_EQ(sink.ids, std::vector<uint8_t>({ 0, 1, 2, 3 }));
+    EXPECT_TRUE(queue.empty());
+    EXPECT_EQ(queue.queuedBytes(), 0);
+    EXPECT_EQ(queue.get_stats().sent, 4);
+}
+
+TEST(WebSocketSendQueue, DropOldest) {
+    WebSocketSendQueue queue(WebSocketQueuePolicy::DROP_OLDEST);
+    pushFrames(queue, 0, WEBSOCKET_SEND_QUEUE_SIZE + 2);
+    EXPECT_TRUE(queue.full());
+
+    RecordingWebSocketInterface sink;
+    EXPECT_TRUE(queue.flush(&sink, 1000));
+    ASSERT_EQ(sink.ids.size(), WEBSOCKET_SEND_QUEUE_SIZE);
+    EXPECT_EQ(sink.ids.front(), 2);
+    EXPECT_EQ(sink.ids.back(), WEBSOCKET_SEND_QUEUE_SIZE + 1);
+    EXPECT_EQ(queue.get_stats().dropped, 2);
+    EXPECT_EQ(queue.get_stats().high_water, WEBSOCKET_SEND_QUEUE_SIZE);
+}
+
+TEST(WebSocketSendQueue, DropNewest) {
+    WebSocketSendQueue queue(WebSocketQueuePolicy::DROP_NEWEST);
+    pushFrames(queue, 0, WEBSOCKET_SEND_QUEUE_SIZE);
+
+    WebSocketFrameBuffer *frame = makeFrame(100);
+    EXPECT_FALSE(queue.push(frame));
+    frame->release();
+
+    RecordingWebSocketInterface sink;
+    EXPECT_TRUE(queue.flush(&sink, 1000));
+    ASSERT_EQ(sink.ids.size(), WEBSOCKET_SEND_QUEUE_SIZE);
+    EXPECT_EQ(sink.ids.back(), WEBSOCKET_SEND_QUEUE_SIZE - 1);
+    EXPECT_EQ(queue.get_stats().dropped, 1);
+}
+
+TEST(WebSocketSendQueue, CoalesceLatest) {
+    WebSocketSendQueue queue(WebSocketQueuePolicy::COALESCE_LATEST);
+    pushFrames(queue, 0, WEBSOCKET_SEND_QUEUE_SIZE + 3);
+    EXPECT_EQ(queue.size(), WEBSOCKET_SEND_QUEUE_SIZE);
+
+    RecordingWebSocketInterface sink;
+    EXPECT_TRUE(queue.flush(&sink, 1000));
+    ASSERT_EQ(sink.ids.size(), WEBSOCKET_SEND_QUEUE_SIZE);
+
+    // everything before the last slot is kept in order, the last slot holds the latest frame
+    EXPECT_EQ(sink.ids[WEBSOCKET_SEND_QUEUE_SIZE - 2], WEBSOCKET_SEND_QUEUE_SIZE - 2);
+    EXPECT_EQ(sink.ids.back(), WEBSOCKET_SEND_QUEUE_SIZE + 2);
+    EXPECT_EQ(queue.get_stats().coalesced, 3);
+}
+
+TEST(WebSocketSendQueue, SharesFramesWithBroadcast) {
+    WebSocketSendQueue first;
+    WebSocketSendQueue second;
+
+    WebSocketFrameBuffer *frame = makeFrame(7);
+    first.push(frame);
+    second.push(frame);
+    frame->release();
+
+    RecordingWebSocketInterface sink;
+    EXPECT_TRUE(first.flush(&sink, 100));
+    EXPECT_TRUE(second.flush(&sink, 100));
+    EXPECT_EQ(sink.ids, std::vector<uint8_t>({ 7, 7 }));
+
+    // failing sends report the error, frame is not retried
+    pushFrames(first, 1, 2);
+    sink.result = false;
+    EXPECT_FALSE(first.flush(&sink, 100));
+    EXPECT_EQ(first.size(), 1);
+}
+
+class ReassemblingWebSocketInterface : public WebSocketInterface
+{
+public:
+    virtual bool onWebSocketData(uint8_t *data, size_t len) override { return true; }
+    virtual bool onWebSocketMessage(uint8_t *data, size_t len, WebSocketOperation operation) override
+    {
+        messages.push_back(std::vector<uint8_t>(data, data + len));
+        return true;
+    }
+    virtual bool onWebsocketEncodedData(const uint8_t *data, size_t len) override
+    {
+        encoded.insert(encoded.end(), data, data + len);
+        writes.push_back(len);
+        return true;
+    }
+
+    std::vector<uint8_t> encoded;
+    std::vector<size_t> writes;
+    std::vector<std::vector<uint8_t>> messages;
+};
+
+TEST(WebSocketSendQueue, FragmentsFrameLargerThanSendBuffer) {
+    const size_t SEND_BUFFER = 1000;
+
+    std::vector<uint8_t> large(3000);
+    for (size_t i=0;i<large.size();++i)
+    {
+        large[i] = (uint8_t)(i * 7);
+    }
+
+    WebSocketSendQueue queue(WebSocketQueuePolicy::DROP_OLDEST);
+    WebSocketFrameBuffer *frame = WebSocketFrameBuffer::create(large.data(), large.size(), WebSocketOperation::BINARY_FRAME);
+    queue.push(frame);
+    frame->release();
+    pushFrames(queue, 1, 1);
+
+    // waits while acknowledgements can still free up space
+    ReassemblingWebSocketInterface sink;
+    EXPECT_TRUE(queue.flush(&sink, SEND_BUFFER));
+    EXPECT_TRUE(sink.encoded.empty());
+
+    // drained send buffer, the frame would never fit so it goes out in fragments
+    EXPECT_TRUE(queue.flush(&sink, SEND_BUFFER, true));
+    EXPECT_EQ(queue.size(), 2);
+    for (size_t write : sink.writes)
+    {
+        EXPECT_LE(write, SEND_BUFFER);
+    }
+
+    // a started frame is never dropped, the frame after it goes instead
+    pushFrames(queue, 10, WEBSOCKET_SEND_QUEUE_SIZE - 1);
+    EXPECT_EQ(queue.get_stats().dropped, 1);
+
+    // once started the frame continues even while acknowledgements are pending
+    for (int i=0;(i<10) && !queue.empty();++i)
+    {
+        EXPECT_TRUE(queue.flush(&sink, SEND_BUFFER));
+    }
+    EXPECT_TRUE(queue.empty());
+    EXPECT_EQ(queue.get_stats().sent, WEBSOCKET_SEND_QUEUE_SIZE);
+    EXPECT_GE(queue.get_stats().fragments, 4);
+
+    // peer sees the large message whole, followed by the small ones in order
+    uint8_t messageBuffer[4096];
+    WebSocketHandler decoder;
+    decoder.setMessageBuffer(messageBuffer, sizeof(messageBuffer));
+    EXPECT_TRUE(decoder.decodeData(sink.encoded.data(), sink.encoded.size(), &sink));
+    ASSERT_EQ(sink.messages.size(), WEBSOCKET_SEND_QUEUE_SIZE);
+    EXPECT_EQ(sink.messages[0], large);
+    EXPECT_EQ(sink.messages[1], std::vector<uint8_t>({ 10 }));
+    EXPECT_EQ(sink.messages.back(), std::vector<uint8_t>({ (uint8_t)(10 + WEBSOCKET_SEND_QUEUE_SIZE - 2) }));
+}
@@ -1,8 +1,12 @@
 #include <gtest/gtest.h>
 #include <gmock/gmock.h>
 #include <stdarg.h>
+#include <chrono>
+#include <string>
+#include <vector>
 
 #include "pico_http/websocket_handler.h"
+#include "test_support.h"
 
 const unsigned char websocket_packet[] = { 0x81, 0x94, 0x32, 0x60, 0x3e, 0x3e, 0x5a, 0x05, 0x52, 0x52, 0x5d, 0x40, 0x58, 0x4c, 0x5d, 0x0d, 0x1e, 0x49, 0x57, 0x02, 0x4d, 0x51, 0x51, 0x0b, 0x5b, 0x4a };
 const uint32_t websocket_packet_size = sizeof(websocket_packet);
@@ -58,8 +62,12 @@ class MockWebSocketInterface : public WebSocketInterface
 public:
     MOCK_METHOD(bool, onWebSocketData, (uint8_t *data, size_t len), (override));
     MOCK_METHOD(bool, onWebsocketEncodedData, (const uint8_t *data, size_t len), (override));
+    MOCK_METHOD(bool, onWebSocketMessage, (uint8_t *data, size_t len, WebSocketOperation operation), (override));
 };
 
+static std::vector<uint8_t> buildMaskedFrame(const std::vector<uint8_t>& payload, const uint8_t maskingKey[4], uint8_t firstByte = 0x82);
+static std::vector<uint8_t> toBytes(const char *text) { return std::vector<uint8_t>(text, text + strlen(text)); }
+
 TEST(WebSocketHandler, BasicWebSocketDecode) {
 
     MockWebSocketInterface mockListener;
@@ -201,3 +209,510 @@ TEST(WebSocketHandler, LargeMessage) {
 
     delete[] buffer;
 }
+
+static std::vector<uint8_t> buildMaskedFrame(const std::vector<uint8_t>& payload, const uint8_t maskingKey[4], uint8_t firstByte)
+{
+    std::vector<uint8_t> frame;
+    frame.push_back(firstByte);
+
+    if (payload.size() < 126)
+    {
+        frame.push_back(0x80 | payload.size());
+    }
+    else if (payload.size() <= 0xffff)
+    {
+        frame.push_back(0x80 | 126);
+        frame.push_back((payload.size() >> 8) & 0xff);
+        frame.push_back(payload.size() & 0xff);
+    }
+    else
+    {
+        frame.push_back(0x80 | 127);
+        for (int i=7;i>=0;--i)
+        {
+            frame.push_back((((uint64_t)payload.size()) >> (i*8)) & 0xff);
+        }
+    }
+
+    frame.insert(frame.end(), maskingKey, maskingKey + 4);
+    for (size_t i=0;i<payload.size();++i)
+    {
+        frame.push_back(payload[i] ^ maskingKey[i & 0x3]);
+    }
+    return frame;
+}
+
+TEST(WebSocketHandler, ApplyMaskMatchesBytewise) {
+
+    const uint8_t maskingKey[4] = { 0x37, 0xfa, 0x21, 0x3d };
+    uint8_t storage[256+16];
+
+    for (uint32_t offset=0;offset<16;++offset)
+    {
+        for (uint32_t phase=0;phase<4;++phase)
+        {
+            for (uint32_t len=0;len<=256;len+=13)
+            {
+                uint8_t *data = &storage[offset];
+                for (uint32_t i=0;i<len;++i)
+                {
+                    data[i] = (uint8_t)(i * 7 + offset);
+                }
+
+                WebSocketHandler::applyMask(data, len, maskingKey, phase);
+
+                for (uint32_t i=0;i<len;++i)
+                {
+                    ASSERT_EQ((uint8_t)((i * 7 + offset) ^ maskingKey[(phase + i) & 0x3]), data[i]) << "offset: " << offset << " phase: " << phase << " len: " << len << " byte: " << i;
+                }
+            }
+        }
+    }
+}
+
+class CountingWebSocketInterface : public WebSocketInterface
+{
+public:
+    virtual bool onWebSocketData(uint8_t *data, size_t len) override
+    {
+        if ((expected != NULL) && (memcmp(data, &expected[received % expectedSize], len) != 0))
+        {
+            matches = false;
+        }
+        received += len;
+        return true;
+    }
+    virtual bool onWebsocketEncodedData(const uint8_t *data, size_t len) override { return true; }
+
+    const uint8_t *expected = NULL;
+    size_t expectedSize = 0;
+    size_t received = 0;
+    bool matches = true;
+};
+
+TEST(WebSocketHandler, UnmaskBenchmark) {
+
+    const uint8_t maskingKey[4] = { 0x12, 0x34, 0x56, 0x78 };
+    const size_t frameSizes[] = { 20, 125, 1400, 16384, 262144 };
+    const size_t chunkSizes[] = { 64, 536, 1460, SIZE_MAX };
+    const size_t BYTES_PER_RUN = 8*1024*1024;
+
+    const bool report = benchmarkReportEnabled();
+
+    for (size_t frameSize : frameSizes)
+    {
+        std::vector<uint8_t> payload(frameSize);
+        for (size_t i=0;i<frameSize;++i)
+        {
+            payload[i] = (uint8_t)(i * 31 + 5);
+        }
+        std::vector<uint8_t> frame = buildMaskedFrame(payload, maskingKey);
+        std::vector<uint8_t> work(frame.size());
+        size_t iterations = std::max((size_t)1, BYTES_PER_RUN / frame.size());
+
+        for (size_t chunkSize : chunkSizes)
+        {
+            if ((chunkSize != SIZE_MAX) && (chunkSize >= frame.size()))
+            {
+                continue;
+            }
+
+            CountingWebSocketInterface listener;
+            listener.expected = payload.data();
+            listener.expectedSize = frameSize;
+
+            WebSocketHandler handler;
+            auto start = std::chrono::steady_clock::now();
+            for (size_t it=0;it<iterations;++it)
+            {
+                memcpy(work.data(), frame.data(), frame.size());
+                for (size_t pos=0;pos<work.size();pos+=chunkSize)
+                {
+                    size_t len = std::min(chunkSize, work.size() - pos);
+                    ASSERT_TRUE(handler.decodeData(&work[pos], len, &listener));
+                }
+            }
+            double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            EXPECT_TRUE(listener.matches) << "frame: " << frameSize << " chunk: " << chunkSize;
+            EXPECT_EQ(listener.received, frameSize * iterations);
+
+            if (!report)
+            {
+                continue;
+            }
+
+            // reference: the previous byte at a time unmasking loop over the same payload bytes
+            start = std::chrono::steady_clock::now();
+            for (size_t it=0;it<iterations;++it)
+            {
+                memcpy(work.data(), frame.data(), frame.size());
+                uint8_t *data = &work[frame.size() - frameSize];
+                for (uint64_t i=0;i<frameSize;++i)
+                {
+                    data[i] ^= maskingKey[i&0x3];
+                }
+                asm volatile("" : : "r"(data) : "memory");
+            }
+            double reference = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            printf("WebSocketHandler unmask: frame[%zu] chunk[%zu] decode %.1f MB/s, bytewise unmask %.1f MB/s\n", frameSize, std::min(chunkSize, frame.size()), (double)(frameSize * iterations) / elapsed / 1e6, (double)(frameSize * iterations) / reference / 1e6);
+        }
+    }
+}
+
+TEST(WebSocketHandler, ReassemblyZeroCopy) {
+
+    const uint8_t maskingKey[4] = { 0x01, 0x02, 0x03, 0x04 };
+    std::vector<uint8_t> frame = buildMaskedFrame(toBytes("hello from websocket"), maskingKey, 0x81);
+
+    uint8_t messageBuffer[64];
+    MockWebSocketInterface mockListener;
+    EXPECT_CALL(mockListener, onWebSocketData(_,_)).Times(0);
+    EXPECT_CALL(mockListener, onWebSocketMessage(_,_,_))
+        .WillOnce(testing::WithArgs<0, 1, 2>([&frame](uint8_t *data, size_t len, WebSocketOperation operation) {
+            EXPECT_EQ(std::string((const char *)data, len), "hello from websocket");
+            EXPECT_EQ(operation, WebSocketOperation::TEXT_FRAME);
+            // handed through in place
+            EXPECT_EQ(data, &frame[6]);
+            return true;
+        }));
+
+    WebSocketHandler handler;
+    handler.setMessageBuffer(messageBuffer, sizeof(messageBuffer));
+    EXPECT_TRUE(handler.decodeData(frame.data(), frame.size(), &mockListener));
+}
+
+TEST(WebSocketHandler, ReassemblyFragmentedMessage) {
+
+    const uint8_t maskingKey[4] = { 0xa1, 0xb2, 0xc3, 0xd4 };
+    std::vector<uint8_t> stream = buildMaskedFrame(toBytes("hello "), maskingKey, 0x02);
+    std::vector<uint8_t> cont1 = buildMaskedFrame(toBytes("from "), maskingKey, 0x00);
+    std::vector<uint8_t> cont2 = buildMaskedFrame(toBytes("websocket"), maskingKey, 0x80);
+    stream.insert(stream.end(), cont1.begin(), cont1.end());
+    stream.insert(stream.end(), cont2.begin(), cont2.end());
+
+    uint8_t messageBuffer[64];
+
+    // whole stream at once, then split at every possible position
+    for (size_t split=0;split<=stream.size();++split)
+    {
+        std::vector<uint8_t> work = stream;
+        
+        MockWebSocketInterface mockListener;
+        EXPECT_CALL(mockListener, onWebSocketMessage(_,_,_))
+            .WillOnce(testing::WithArgs<0, 1, 2>([&messageBuffer](uint8_t *data, size_t len, WebSocketOperation operation) {
+                EXPECT_EQ(std::string((const char *)data, len), "hello from websocket");
+                EXPECT_EQ(operation, WebSocketOperation::BINARY_FRAME);
+                EXPECT_EQ(data, &messageBuffer[0]);
+                return true;
+            }));
+
+        WebSocketHandler handler;
+        handler.setMessageBuffer(messageBuffer, sizeof(messageBuffer));
+        EXPECT_TRUE(handler.decodeData(work.data(), split, &mockListener)) << "split: " << split;
+        EXPECT_TRUE(handler.decodeData(work.data() + split, work.size() - split, &mockListener)) << "split: " << split;
+    }
+}
+
+TEST(WebSocketHandler, ReassemblyRejectsLargeMessage) {
+
+    const uint8_t maskingKey[4] = { 0x01, 0x02, 0x03, 0x04 };
+    std::vector<uint8_t> stream = buildMaskedFrame(toBytes("0123456789"), maskingKey, 0x02);
+    std::vector<uint8_t> cont = buildMaskedFrame(toBytes("0123456789"), maskingKey, 0x80);
+    stream.insert(stream.end(), cont.begin(), cont.end());
+
+    uint8_t messageBuffer[16];
+    MockWebSocketInterface mockListener;
+    EXPECT_CALL(mockListener, onWebSocketMessage(_,_,_)).Times(0);
+
+    WebSocketHandler handler;
+    handler.setMessageBuffer(messageBuffer, sizeof(messageBuffer));
+    EXPECT_FALSE(handler.decodeData(stream.data(), stream.size(), &mockListener));
+}
+
+TEST(WebSocketHandler, ReassemblyRejectsUnexpectedContinuation) {
+
+    const uint8_t maskingKey[4] = { 0x01, 0x02, 0x03, 0x04 };
+    std::vector<uint8_t> frame = buildMaskedFrame(toBytes("orphan"), maskingKey, 0x80);
+
+    uint8_t messageBuffer[16];
+    MockWebSocketInterface mockListener;
+    EXPECT_CALL(mockListener, onWebSocketMessage(_,_,_)).Times(0);
+
+    WebSocketHandler handler;
+    handler.setMessageBuffer(messageBuffer, sizeof(messageBuffer));
+    EXPECT_FALSE(handler.decodeData(frame.data(), frame.size(), &mockListener));
+}
+
+class MockControlWebSocketInterface : public MockWebSocketInterface
+{
+public:
+    MOCK_METHOD(bool, onWebSocketPong, (const uint8_t *data, size_t len), (override));
+    MOCK_METHOD(bool, onWebSocketClose, (uint16_t code), (override));
+};
+
+TEST(WebSocketHandler, PingIsAnsweredWithPong) {
+
+    const uint8_t maskingKey[4] = { 0x11, 0x22, 0x33, 0x44 };
+    std::vector<uint8_t> frame = buildMaskedFrame(toBytes("ping!"), maskingKey, 0x89);
+
+    MockControlWebSocketInterface mockListener;
+    EXPECT_CALL(mockListener, onWebsocketEncodedData(_,_))
+        .WillOnce(testing::WithArgs<0, 1>([](const uint8_t *data, size_t len) {
+            EXPECT_EQ(len, 7);
+            EXPECT_EQ(data[0], 0x8A);
+            EXPECT_EQ(data[1], 5);
+            EXPECT_EQ(std::string((const char *)&data[2], 5), "ping!");
+            return true;
+        }));
+
+    WebSocketHandler handler;
+    EXPECT_TRUE(handler.decodeData(frame.data(), frame.size(), &mockListener));
+}
+
+TEST(WebSocketHandler, ControlFrameBetweenFragments) {
+
+    const uint8_t maskingKey[4] = { 0x11, 0x22, 0x33, 0x44 };
+    std::vector<uint8_t> stream = buildMaskedFrame(toBytes("hello "), maskingKey, 0x01);
+    std::vector<uint8_t> ping = buildMaskedFrame(toBytes("p"), maskingKey, 0x89);
+    std::vector<uint8_t> pong = buildMaskedFrame(toBytes("rtt"), maskingKey, 0x8A);
+    std::vector<uint8_t> cont = buildMaskedFrame(toBytes("world"), maskingKey, 0x80);
+    stream.insert(stream.end(), ping.begin(), ping.end());
+    stream.insert(stream.end(), pong.begin(), pong.end());
+    stream.insert(stream.end(), cont.begin(), cont.end());
+
+    for (size_t chunk=1;chunk<=stream.size();++chunk)
+    {
+        std::vector<uint8_t> work = stream;
+        uint8_t messageBuffer[32];
+
+        MockControlWebSocketInterface mockListener;
+        EXPECT_CALL(mockListener, onWebsocketEncodedData(_,_))
+            .WillOnce(testing::WithArgs<0, 1>([](const uint8_t *data, size_t len) {
+                EXPECT_EQ(len, 3);
+                EXPECT_EQ(data[0], 0x8A);
+                EXPECT_EQ(data[2], 'p');
+                return true;
+            }));
+        EXPECT_CALL(mockListener, onWebSocketPong(_,_))
+            .WillOnce(testing::WithArgs<0, 1>([](const uint8_t *data, size_t len) {
+                EXPECT_EQ(std::string((const char *)data, len), "rtt");
+                return true;
+            }));
+        EXPECT_CALL(mockListener, onWebSocketMessage(_,_,_))
+            .WillOnce(testing::WithArgs<0, 1, 2>([](uint8_t *data, size_t len, WebSocketOperation operation) {
+                EXPECT_EQ(std::string((const char *)data, len), "hello world");
+                EXPECT_EQ(operation, WebSocketOperation::TEXT_FRAME);
+                return true;
+            }));
+
+        WebSocketHandler handler;
+        handler.setMessageBuffer(messageBuffer, sizeof(messageBuffer));
+        for (size_t pos=0;pos<work.size();pos+=chunk)
+        {
+            EXPECT_TRUE(handler.decodeData(&work[pos], std::min(chunk, work.size()-pos), &mockListener)) << "chunk: " << chunk;
+        }
+    }
+}
+
+TEST(WebSocketHandler, CloseHandshake) {
+
+    const uint8_t maskingKey[4] = { 0x11, 0x22, 0x33, 0x44 };
+    std::vector<uint8_t> frame = buildMaskedFrame({ 0x03, 0xe9, 'b', 'y', 'e' }, maskingKey, 0x88);
+    std::vector<uint8_t> after = buildMaskedFrame(toBytes("ignored"), maskingKey, 0x82);
+    frame.insert(frame.end(), after.begin(), after.end());
+
+    MockControlWebSocketInterface mockListener;
+    EXPECT_CALL(mockListener, onWebsocketEncodedData(_,_))
+        .WillOnce(testing::WithArgs<0, 1>([](const uint8_t *data, size_t len) {
+            EXPECT_EQ(len, 4);
+            EXPECT_EQ(data[0], 0x88);
+            EXPECT_EQ(data[1], 2);
+            EXPECT_EQ((data[2] << 8) | data[3], 1001);
+            return true;
+        }));
+    EXPECT_CALL(mockListener, onWebSocketClose(1001)).WillOnce(testing::Return(true));
+    EXPECT_CALL(mockListener, onWebSocketData(_,_)).Times(0);
+
+    WebSocketHandler handler;
+    EXPECT_TRUE(handler.decodeData(frame.data(), frame.size(), &mockListener));
+    EXPECT_TRUE(handler.isClosed());
+}
+
+TEST(WebSocketHandler, ServerInitiatedClose) {
+
+    const uint8_t maskingKey[4] = { 0x11, 0x22, 0x33, 0x44 };
+    std::vector<uint8_t> reply = buildMaskedFrame({ 0x03, 0xe8 }, maskingKey, 0x88);
+
+    MockControlWebSocketInterface mockListener;
+    EXPECT_CALL(mockListener, onWebsocketEncodedData(_,_))
+        .WillOnce(testing::WithArgs<0, 1>([](const uint8_t *data, size_t len) {
+            EXPECT_EQ(len, 4);
+            EXPECT_EQ(data[0], 0x88);
+            EXPECT_EQ((data[2] << 8) | data[3], 1000);
+            return true;
+        }));
+    EXPECT_CALL(mockListener, onWebSocketClose(1000)).WillOnce(testing::Return(true));
+
+    WebSocketHandler handler;
+    EXPECT_TRUE(handler.sendClose(WebSocketCloseCode::NORMAL_CLOSURE, &mockListener));
+    EXPECT_TRUE(handler.decodeData(reply.data(), reply.size(), &mockListener));
+    EXPECT_TRUE(handler.isClosed());
+}
+
+TEST(WebSocketHandler, RejectsFragmentedControlFrame) {
+
+    const uint8_t maskingKey[4] = { 0x11, 0x22, 0x33, 0x44 };
+    std::vector<uint8_t> frame = buildMaskedFrame(toBytes("ping"), maskingKey, 0x09);
+
+    MockControlWebSocketInterface mockListener;
+    EXPECT_CALL(mockListener, onWebsocketEncodedData(_,_)).Times(0);
+
+    WebSocketHandler handler;
+    EXPECT_FALSE(handler.decodeData(frame.data(), frame.size(), &mockListener));
+}
+
+TEST(WebSocketHandler, EncodeSmallFrameSingleWrite) {
+
+    MockWebSocketInterface mockListener;
+    EXPECT_CALL(mockListener, onWebsocketEncodedData(_,_))
+        .WillOnce(testing::WithArgs<0, 1>([](const uint8_t *data, size_t len) {
+            EXPECT_EQ(len, 2 + 20);
+            EXPECT_EQ(data[0], 0x81);
+            EXPECT_EQ(data[1], 20);
+            EXPECT_EQ(std::string((const char *)&data[2], 20), "hello from websocket");
+            return true;
+        }));
+
+    WebSocketHandler handler;
+    EXPECT_TRUE(handler.encodeData((const uint8_t *)websocket_payload, strlen(websocket_payload), &mockListener, WebSocketOperation::TEXT_FRAME));
+}
+
+TEST(WebSocketHandler, EncodeLargeFrameFromCallerMemory) {
+
+    std::vector<uint8_t> payload(70000, 0x5a);
+
+    MockWebSocketInterface mockListener;
+    testing::InSequence sequence;
+    EXPECT_CALL(mockListener, onWebsocketEncodedData(_,_))
+        .WillOnce(testing::WithArgs<0, 1>([](const uint8_t *data, size_t len) {
+            EXPECT_EQ(len, 10);
+            EXPECT_EQ(data[0], 0x82);
+            EXPECT_EQ(data[1], 127);
+            EXPECT_EQ((data[7] << 16) | (data[8] << 8) | data[9], 70000);
+            return true;
+        }));
+    EXPECT_CALL(mockListener, onWebsocketEncodedData(payload.data(), payload.size())).WillOnce(testing::Return(true));
+
+    WebSocketHandler handler;
+    EXPECT_TRUE(handler.encodeData(payload.data(), payload.size(), &mockListener));
+}
+
+class LoopbackWebSocketInterface : public WebSocketInterface
+{
+public:
+    virtual bool onWebSocketData(uint8_t *data, size_t len) override { decoded.insert(decoded.end(), data, data + len); return true; }
+    virtual bool onWebsocketEncodedData(const uint8_t *data, size_t len) override { ++writes; encoded.insert(encoded.end(), data, data + len); return true; }
+
+    int writes = 0;
+    std::vector<uint8_t> encoded;
+    std::vector<uint8_t> decoded;
+};
+
+TEST(WebSocketHandler, EncodeMaskedRoundTrip) {
+
+    const uint8_t maskingKey[4] = { 0x9c, 0x01, 0x7e, 0x33 };
+
+    for (size_t size : { (size_t)0, (size_t)5, (size_t)125, (size_t)126, (size_t)1000, (size_t)70000 })
+    {
+        std::vector<uint8_t> payload(size);
+        for (size_t i=0;i<size;++i)
+        {
+            payload[i] = (uint8_t)(i * 13);
+        }
+
+        LoopbackWebSocketInterface loopback;
+        WebSocketHandler encoder;
+        EXPECT_TRUE(encoder.encodeData(payload.data(), payload.size(), &loopback, WebSocketOperation::BINARY_FRAME, maskingKey));
+        EXPECT_EQ(loopback.encoded[1] & 0x80, 0x80);
+
+        WebSocketHandler decoder;
+        EXPECT_TRUE(decoder.decodeData(loopback.encoded.data(), loopback.encoded.size(), &loopback));
+        EXPECT_EQ(loopback.decoded, payload) << "size: " << size;
+    }
+}
+
+TEST(WebSocketHandler, EncodeFrameInPlace) {
+
+    const uint8_t maskingKey[4] = { 0x9c, 0x01, 0x7e, 0x33 };
+
+    for (size_t size : { (size_t)3, (size_t)300, (size_t)70000 })
+    {
+        std::vector<uint8_t> buffer(WEBSOCKET_FRAME_HEADROOM + size);
+        for (size_t i=0;i<size;++i)
+        {
+            buffer[WEBSOCKET_FRAME_HEADROOM + i] = (uint8_t)(i * 7);
+        }
+        std::vector<uint8_t> payload(buffer.begin() + WEBSOCKET_FRAME_HEADROOM, buffer.end());
+
+        LoopbackWebSocketInterface loopback;
+        WebSocketHandler encoder;
+        EXPECT_TRUE(encoder.encodeFrame(buffer.data(), size, &loopback, WebSocketOperation::BINARY_FRAME, maskingKey));
+        EXPECT_EQ(loopback.writes, 1);
+
+        WebSocketHandler decoder;
+        EXPECT_TRUE(decoder.decodeData(loopback.encoded.data(), loopback.encoded.size(), &loopback));
+        EXPECT_EQ(loopback.decoded, payload) << "size: " << size;
+    }
+}
+
+static uint32_t testMaskGenerator()
+{
+    static uint32_t value = 0x12345678;
+    value = value * 1664525 + 1013904223;
+    return value;
+}
+
+TEST(WebSocketHandler, ClientModeMasksEveryFrame) {
+
+    LoopbackWebSocketInterface loopback;
+    WebSocketHandler client;
+    client.setClientMode(testMaskGenerator);
+
+    std::vector<uint8_t> payload = toBytes("hello from client");
+    EXPECT_TRUE(client.encodeData(payload.data(), payload.size(), &loopback, WebSocketOperation::TEXT_FRAME));
+    EXPECT_EQ(loopback.encoded[1], 0x80 | payload.size());
+    EXPECT_NE(std::vector<uint8_t>(loopback.encoded.begin() + 6, loopback.encoded.end()), payload);
+
+    WebSocketHandler server;
+    EXPECT_TRUE(server.decodeData(loopback.encoded.data(), loopback.encoded.size(), &loopback));
+    EXPECT_EQ(loopback.decoded, payload);
+
+    // PING reply and CLOSE are masked too
+    const uint8_t ping[] = { 0x89, 0x02, 'h', 'i' };
+    std::vector<uint8_t> pingFrame(ping, ping + sizeof(ping));
+    loopback.encoded.clear();
+    EXPECT_TRUE(client.decodeData(pingFrame.data(), pingFrame.size(), &loopback));
+    ASSERT_EQ(loopback.encoded.size(), 8);
+    EXPECT_EQ(loopback.encoded[0], 0x8A);
+    EXPECT_EQ(loopback.encoded[1], 0x82);
+    EXPECT_EQ(loopback.encoded[6] ^ loopback.encoded[2], 'h');
+    EXPECT_EQ(loopback.encoded[7] ^ loopback.encoded[3], 'i');
+
+    loopback.encoded.clear();
+    EXPECT_TRUE(client.sendClose(WebSocketCloseCode::GOING_AWAY, &loopback));
+    ASSERT_EQ(loopback.encoded.size(), 8);
+    EXPECT_EQ(loopback.encoded[1], 0x82);
+    EXPECT_EQ(((loopback.encoded[6] ^ loopback.encoded[2]) << 8) | (loopback.encoded[7] ^ loopback.encoded[3]), WebSocketCloseCode::GOING_AWAY);
+}
+
+TEST(WebSocketHandler, ComputeAccept) {
+    // RFC 6455 section 1.3
+    char accept[WEBSOCKET_ACCEPT_SIZE];
+    EXPECT_TRUE(computeWebSocketAccept("dGhlIHNhbXBsZSBub25jZQ==", accept, sizeof(accept)));
+    EXPECT_STREQ(accept, "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=");
+
+    std::string longKey(128, 'k');
+    EXPECT_FALSE(computeWebSocketAccept(longKey.c_str(), accept, sizeof(accept)));
+}
@@ -0,0 +1,167 @@
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "pico_http/websocket_handler.h"
+#include "pico_http/websocket_utf8.h"
+#include "test_support.h"
+
+static bool isValid(const std::string& text)
+{
+    return WebSocketUtf8Validator::validate((const uint8_t *)text.data(), text.size());
+}
+
+TEST(WebSocketUtf8, ValidSequences) {
+    EXPECT_TRUE(isValid(""));
+    EXPECT_TRUE(isValid("plain ascii text that is longer then a couple of words"));
+    EXPECT_TRUE(isValid("\xc2\x80"));                       // U+0080
+    EXPECT_TRUE(isValid("\xdf\xbf"));                       // U+07FF
+    EXPECT_TRUE(isValid("\xe0\xa0\x80"));                   // U+0800
+    EXPECT_TRUE(isValid("\xed\x9f\xbf"));                   // U+D7FF
+    EXPECT_TRUE(isValid("\xee\x80\x80"));                   // U+E000
+    EXPECT_TRUE(isValid("\xef\xbf\xbf"));                   // U+FFFF
+    EXPECT_TRUE(isValid("\xf0\x90\x80\x80"));               // U+10000
+    EXPECT_TRUE(isValid("\xf4\x8f\xbf\xbf"));               // U+10FFFF
+    EXPECT_TRUE(isValid("temperature \xc2\xb0" "C, \xce\xba\xe1\xbd\xb9\xcf\x83\xce\xbc\xce\xb5 \xf0\x9f\x98\x80"));
+}
+
+TEST(WebSocketUtf8, InvalidSequences) {
+    EXPECT_FALSE(isValid("\x80"));                          // lone continuation
+    EXPECT_FALSE(isValid("\xc0\xaf"));                      // overlong '/'
+    EXPECT_FALSE(isValid("\xc1\xbf"));                      // overlong
+    EXPECT_FALSE(isValid("\xe0\x9f\xbf"));                  // overlong 3 byte
+    EXPECT_FALSE(isValid("\xed\xa0\x80"));                  // surrogate U+D800
+    EXPECT_FALSE(isValid("\xf0\x8f\xbf\xbf"));              // overlong 4 byte
+    EXPECT_FALSE(isValid("\xf4\x90\x80\x80"));              // above U+10FFFF
+    EXPECT_FALSE(isValid("\xf5\x80\x80\x80"));
+    EXPECT_FALSE(isValid("\xff"));
+    EXPECT_FALSE(isValid("\xc2"));                          // truncated
+    EXPECT_FALSE(isValid("\xe2\x82"));
+    EXPECT_FALSE(isValid("\xc2\x41"));                      // missing continuation
+    EXPECT_FALSE(isValid(std::string(37, 'a') + "\xe2\x28\xa1" + std::string(40, 'b')));
+}
+
+TEST(WebSocketUtf8, SplitAtEveryPosition) {
+    std::string text = "abc \xce\xba\xe1\xbd\xb9\xcf\x83\xce\xbc\xce\xb5 0123456789 \xf0\x9f\x98\x80 end of text";
+    std::string invalid = text + "\xed\xa0\x80";
+
+    for (size_t split=0;split<=text.size();++split)
+    {
+        WebSocketUtf8Validator validator;
+        EXPECT_TRUE(validator.feed((const uint8_t *)text.data(), split));
+        EXPECT_TRUE(validator.feed((const uint8_t *)text.data() + split, text.size() - split));
+        EXPECT_TRUE(validator.complete());
+    }
+
+    for (size_t split=0;split<=invalid.size();++split)
+    {
+        WebSocketUtf8Validator validator;
+        bool valid = validator.feed((const uint8_t *)invalid.data(), split) && validator.feed((const uint8_t *)invalid.data() + split, invalid.size() - split);
+        EXPECT_FALSE(valid) << "split: " << split;
+    }
+}
+
+class TextWebSocketInterface : public WebSocketInterface
+{
+public:
+    virtual bool onWebSocketData(uint8_t *data, size_t len) override { decoded.insert(decoded.end(), data, data + len); return true; }
+    virtual bool onWebsocketEncodedData(const uint8_t *data, size_t len) override { encoded.insert(encoded.end(), data, data + len); return true; }
+    virtual bool onWebSocketClose(uint16_t code) override { closeCode = code; return true; }
+
+    uint16_t closeCode = 0;
+    std::string decoded;
+    std::vector<uint8_t> encoded;
+};
+
+static std::vector<uint8_t> textFrame(const std::string& text, uint8_t firstByte)
+{
+    std::vector<uint8_t> frame = { firstByte, (uint8_t)text.size() };
+    frame.insert(frame.end(), text.begin(), text.end());
+    return frame;
+}
+
+TEST(WebSocketUtf8, HandlerValidatesAcrossFragments) {
+    // multi-byte sequence split across two fragments and fed a byte at a time
+    std::vector<uint8_t> stream = textFrame("snow \xe2\x98", 0x01);
+    std::vector<uint8_t> second = textFrame("\x83 man", 0x80);
+    stream.insert(stream.end(), second.begin(), second.end());
+
+    TextWebSocketInterface listener;
+    WebSocketHandler handler;
+    for (size_t i=0;i<stream.size();++i)
+    {
+        EXPECT_TRUE(handler.decodeData(&stream[i], 1, &listener));
+    }
+    EXPECT_EQ(listener.decoded, "snow \xe2\x98\x83 man");
+    EXPECT_TRUE(listener.encoded.empty());
+
+    // binary frames are not checked
+    std::vector<uint8_t> binary = textFrame("\xff\xfe", 0x82);
+    EXPECT_TRUE(handler.decodeData(binary.data(), binary.size(), &listener));
+}
+
+TEST(WebSocketUtf8, HandlerClosesOnInvalidText) {
+    for (const char *text : { "bad \xc0\xaf", "unfinished \xe2\x98" })
+    {
+        std::vector<uint8_t> frame = textFrame(text, 0x81);
+
+        TextWebSocketInterface listener;
+        WebSocketHandler handler;
+        EXPECT_TRUE(handler.decodeData(frame.data(), frame.size(), &listener));
+        EXPECT_TRUE(handler.isClosed());
+        EXPECT_EQ(listener.closeCode, WebSocketCloseCode::INVALID_PAYLOAD);
+
+        // the owner closes once the CLOSE frame is out, anything after it is ignored
+        const std::vector<uint8_t> close = { 0x88, 0x02, (uint8_t)(WebSocketCloseCode::INVALID_PAYLOAD >> 8), (uint8_t)(WebSocketCloseCode::INVALID_PAYLOAD & 0xff) };
+        EXPECT_EQ(listener.encoded, close);
+
+        std::vector<uint8_t> more = textFrame("more", 0x81);
+        EXPECT_TRUE(handler.decodeData(more.data(), more.size(), &listener));
+        EXPECT_EQ(listener.encoded, close);
+    }
+
+    // validation can be turned off
+    std::vector<uint8_t> frame = textFrame("bad \xc0\xaf", 0x81);
+    TextWebSocketInterface listener;
+    WebSocketHandler handler;
+    handler.setUtf8Validation(false);
+    EXPECT_TRUE(handler.decodeData(frame.data(), frame.size(), &listener));
+}
+
+TEST(WebSocketUtf8, ValidatorBenchmark) {
+    std::string ascii;
+    while (ascii.size() < 65536)
+    {
+        ascii += "{\"sensor\":\"temperature\",\"value\":21.5,\"unit\":\"C\"},";
+    }
+    std::string mixed;
+    while (mixed.size() < 65536)
+    {
+        mixed += "{\"sensor\":\"temp\xc3\xa9rature\",\"value\":21.5,\"unit\":\"\xc2\xb0" "C\",\"note\":\"\xe2\x98\x83\xf0\x9f\x98\x80\"},";
+    }
+
+    for (const std::string *text : { &ascii, &mixed })
+    {
+        const uint8_t *data = (const uint8_t *)text->data();
+        size_t size = text->size();
+        const int iterations = 200;
+
+        auto start = std::chrono::steady_clock::now();
+        bool valid = true;
+        for (int iteration=0;iteration<iterations;++iteration)
+        {
+            valid &= WebSocketUtf8Validator::validate(data, size);
+            asm volatile("" : : "r"(data) : "memory");
+        }
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        EXPECT_TRUE(valid);
+
+        if (benchmarkReportEnabled())
+        {
+            printf("WebSocketUtf8Validator: %s input[%zu] %.1f MB/s\n", (text == &ascii) ? "ascii" : "mixed", size, (double)(size * iterations) / elapsed / 1e6);
+        }
+    }
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <gtest/gtest.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include "pico_tls/isession_callback.h"
+
+// benchmarks run with the tests but only report numbers on request, e.g. PICO_TEST_BENCHMARK=1 ctest -V
+inline bool benchmarkReportEnabled()
+{
+    return getenv("PICO_TEST_BENCHMARK") != NULL;
+}
+
+// in-memory session for the tests: records every send, reports close to callback (when set) once while connected or connecting
+class FakeSessionSender : public ISessionSender
+{
+public:
+    virtual int8_t connect(const char *host, uint16_t port) override { ++connects; this->host = host; this->port = port; return 0; }
+    virtual int8_t connect(const char *host, const ip_addr_t *ipaddr, uint16_t port) override { return connect(host, port); }
+    virtual int8_t send(const uint8_t *data, size_t len) override
+    {
+        sent.push_back(std::vector<uint8_t>(data, data + len));
+        stream.insert(stream.end(), data, data + len);
+        return 0;
+    }
+    virtual int8_t flush() override { return 0; }
+    virtual int8_t close() override
+    {
+        closed = true;
+        if (connected || connecting)
+        {
+            connected = connecting = false;
+            if (callback != NULL)
+            {
+                callback->on_closed();
+            }
+        }
+        return 0;
+    }
+    virtual uint16_t send_buffer_size() override { return buffer_size; }
+    virtual bool is_connected() override { return connected; }
+
+    void establish() { connected = true; callback->on_connected(); }
+    void receive(std::vector<uint8_t> data) { EXPECT_TRUE(callback->on_recv(data.data(), data.size())); }
+
+    ISessionCallback *callback = NULL;
+    bool connected = true;
+    bool connecting = false;
+    bool closed = false;
+    int connects = 0;
+    std::string host;
+    uint16_t port = 0;
+    uint16_t buffer_size = 0xFFFF;
+
+    // one entry per send() and the same bytes back to back
+    std::vector<std::vector<uint8_t>> sent;
+    std::vector<uint8_t> stream;
+};